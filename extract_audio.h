@@ -0,0 +1,124 @@
+#ifndef EXTRACT_AUDIO_H
+#define EXTRACT_AUDIO_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Audio extraction from MP4, as a library. Each function returns 0 or
+   an error code, see ea_strerror, and prints nothing but a requested
+   dump. Calls on different contexts may run concurrently. */
+
+enum { /* error codes callers may act on, the others only have text */
+  EA_ERR_ARG = 1, /* invalid options */
+  EA_ERR_BUF_SIZE = 38, /* see ea_write_buffer */
+  EA_ERR_NO_SAMPLE /* see ea_sample_at */
+};
+
+enum { /* I/O backends */
+  EA_IO_STDIO = 1,
+  EA_IO_PREAD,
+  EA_IO_MMAP,
+  EA_IO_MEMORY
+};
+
+enum { /* playlist of segmented output */
+  EA_PLAYLIST_HLS = 1,
+  EA_PLAYLIST_DASH
+};
+
+enum { /* ea_parse flags */
+  EA_DUMP = 1, /* print the boxes to stdout */
+  EA_ALL_TRACKS = 2, /* read the sample descriptions of all tracks */
+  EA_ONE_THREAD = 4 /* no threads of its own, for callers with a pool */
+};
+
+/* How to write the sound track, all 0 for MP4 (m4a) */
+struct ea_options {
+  unsigned char raw; /* ADTS */
+  unsigned int frag_ms; /* fragmented MP4 of fragments of about frag_ms */
+  unsigned char playlist; /* segments of about segment_ms and a playlist */
+  unsigned int segment_ms;
+  unsigned char splice; /* boxes and a splice plan instead of the output */
+};
+
+struct ea_context;
+
+/* Open the input fname, "-" for stdin */
+int ea_open(struct ea_context ** ret, const char * fname, unsigned char io);
+
+/* Open size bytes as the input, which stay the caller's and must live
+   until ea_close */
+int ea_open_memory(struct ea_context ** ret, const void * bytes,
+                   size_t size);
+
+/* Read the boxes and sample tables of the input. If it or
+   ea_select_audio fails, ea_close is the only call left to make. */
+int ea_parse(struct ea_context * ctx, unsigned int flags);
+
+/* Memory for parsed boxes, reused by context after context */
+struct ea_arena;
+
+int ea_arena_new(struct ea_arena ** ret);
+
+/* Parse into arena instead of memory of the context's own, before
+   ea_parse. ea_close resets it for the next context; it serves one
+   at a time. */
+int ea_use_arena(struct ea_context * ctx, struct ea_arena * arena);
+
+void ea_arena_free(struct ea_arena * arena);
+
+/* Keep the first sound track only */
+int ea_select_audio(struct ea_context * ctx);
+
+/* Write the selected track to fname, "-" for stdout */
+int ea_write(struct ea_context * ctx, const char * fname,
+             const struct ea_options * options);
+
+/* Write the selected track to memory allocated with malloc, for the
+   caller to free. Segments and splice plans aren't written to memory. */
+int ea_write_memory(struct ea_context * ctx, void ** ret, size_t * ret_size,
+                    const struct ea_options * options);
+
+/* Write the selected track to buf of capa bytes. If it doesn't fit,
+   the error is EA_ERR_BUF_SIZE and * ret_size the size it needs. */
+int ea_write_buffer(struct ea_context * ctx, void * buf, size_t capa,
+                    size_t * ret_size, const struct ea_options * options);
+
+/* A sample of the selected track, times in timescale units */
+struct ea_sample {
+  long dts;
+  long pts; /* dts and the composition offset */
+  unsigned int duration;
+  unsigned int timescale;
+  unsigned int size;
+  const unsigned char * data; /* into the input if it is mapped or in
+                                 memory, else valid during the call */
+};
+
+/* Called for each sample in decoding order; a return other than 0 stops
+   the walk, which returns it */
+typedef int (* ea_sample_func)(void * arg, const struct ea_sample * sample);
+
+/* Pass the samples of the selected track to func without copying them
+   out of a mapped or in-memory input */
+int ea_walk_samples(struct ea_context * ctx, ea_sample_func func,
+                    void * arg);
+
+/* The sample at index of the selected track, in time logarithmic in
+   the runs of its tables; data is NULL unless the input is mapped or
+   in memory. Past the last sample the error is EA_ERR_NO_SAMPLE. */
+int ea_sample_at(struct ea_context * ctx, unsigned int index,
+                 struct ea_sample * sample);
+
+void ea_close(struct ea_context * ctx);
+
+const char * ea_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,7 +1,47 @@
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_POSIX
+#endif
+
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range */
+#define HAVE_LINUX
+#endif
+
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_LINUX
+#include <sys/sendfile.h>
+#endif
+
+/* Byte swapping of sample tables, 32-bit words in little-endian lanes */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HAVE_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#elif defined(__ARM_NEON) && defined(__ORDER_LITTLE_ENDIAN__) && \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+#include "extract_audio.h"
+
 enum {
   ERR_ARG = 1,
   ERR_MEM,
@@ -35,9 +75,25 @@ enum {
   ERR_NO_SOUN,
   ERR_NO_SOUN_CONF,
   ERR_CHANNEL,
+  ERR_STREAM_ORDER,
+  ERR_STREAM_FRAG,
+  ERR_TRACK_ID,
+  ERR_JOB,
+  ERR_CALL,
+  ERR_BUF_SIZE,
+  ERR_NO_SAMPLE,
+  ERR_ADTS_SIZE,
+  ERR_TFDT,
   ERR_LEN
 };
 
+/* the codes of extract_audio.h */
+typedef char check_err_arg[(int) ERR_ARG == (int) EA_ERR_ARG ? 1 : -1];
+typedef char check_err_buf_size[(int) ERR_BUF_SIZE == (int) EA_ERR_BUF_SIZE ?
+                                1 : -1];
+typedef char check_err_no_sample[(int) ERR_NO_SAMPLE ==
+                                 (int) EA_ERR_NO_SAMPLE ? 1 : -1];
+
 enum {
   NAL_SPS = 0x7,
   NAL_PPS
@@ -64,6 +120,39 @@ enum {
   CODEC_AAC = 1
 };
 
+enum { /* I/O backends */
+  IO_STDIO = EA_IO_STDIO,
+  IO_PREAD = EA_IO_PREAD,
+  IO_MMAP = EA_IO_MMAP,
+  IO_MEMORY = EA_IO_MEMORY
+};
+
+enum { /* playlist of segmented output */
+  PLAYLIST_HLS = EA_PLAYLIST_HLS,
+  PLAYLIST_DASH = EA_PLAYLIST_DASH
+};
+
+enum { /* kernel side copy, tried in decreasing order */
+  COPY_NONE,
+  COPY_SENDFILE,
+  COPY_FILE_RANGE
+};
+
+enum {
+  STREAM_BUF_SIZE = 1 << 16,
+  U32_BLOCK = 1 << 10, /* table words converted at once */
+  SUM_THREAD_SAMPLES = 1 << 20, /* samples per thread summing chunks */
+  SUM_THREADS = 8,
+  ARENA_CHUNK_SIZE = 1 << 16, /* the first, each next one doubles */
+  COPY_BUF_SIZE = 1 << 20,
+  ADTS_BATCH = 1 << 8, /* frames per gather write */
+#ifdef IOV_MAX
+  VEC_MAX = IOV_MAX < 1024 ? IOV_MAX : 1024 /* a batch or more per writev */
+#else
+  VEC_MAX = 16 /* _XOPEN_IOV_MAX */
+#endif
+};
+
 enum {
   BOX_QTY_0_OR_1 = 1,
   BOX_QTY_0_TO_N = 1 << 1,
@@ -105,6 +194,7 @@ enum {
   BOX_CTTS = MKBOX('c', 't', 't', 's'),
   BOX_STSC = MKBOX('s', 't', 's', 'c'),
   BOX_STCO = MKBOX('s', 't', 'c', 'o'),
+  BOX_CO64 = MKBOX('c', 'o', '6', '4'),
   BOX_STSZ = MKBOX('s', 't', 's', 'z'),
   BOX_STSS = MKBOX('s', 't', 's', 's'),
   BOX_SGPD = MKBOX('s', 'g', 'p', 'd'),
@@ -113,7 +203,45 @@ enum {
   BOX_VMHD = MKBOX('v', 'm', 'h', 'd'),
   BOX_SMHD = MKBOX('s', 'm', 'h', 'd'),
   BOX_MDAT = MKBOX('m', 'd', 'a', 't'),
-  BOX_FREE = MKBOX('f', 'r', 'e', 'e')
+  BOX_FREE = MKBOX('f', 'r', 'e', 'e'),
+  BOX_MVEX = MKBOX('m', 'v', 'e', 'x'),
+  BOX_MEHD = MKBOX('m', 'e', 'h', 'd'),
+  BOX_TREX = MKBOX('t', 'r', 'e', 'x'),
+  BOX_MOOF = MKBOX('m', 'o', 'o', 'f'),
+  BOX_MFHD = MKBOX('m', 'f', 'h', 'd'),
+  BOX_TRAF = MKBOX('t', 'r', 'a', 'f'),
+  BOX_TFHD = MKBOX('t', 'f', 'h', 'd'),
+  BOX_TFDT = MKBOX('t', 'f', 'd', 't'),
+  BOX_TRUN = MKBOX('t', 'r', 'u', 'n'),
+  BOX_SDTP = MKBOX('s', 'd', 't', 'p'),
+  BOX_SAIZ = MKBOX('s', 'a', 'i', 'z'),
+  BOX_SAIO = MKBOX('s', 'a', 'i', 'o'),
+  BOX_STYP = MKBOX('s', 't', 'y', 'p'),
+  BOX_SIDX = MKBOX('s', 'i', 'd', 'x'),
+  BOX_MFRA = MKBOX('m', 'f', 'r', 'a'),
+  BOX_EMSG = MKBOX('e', 'm', 's', 'g'),
+  BOX_PRFT = MKBOX('p', 'r', 'f', 't'),
+  BOX_ISO6 = MKBOX('i', 's', 'o', '6'),
+  BOX_CMFC = MKBOX('c', 'm', 'f', 'c'),
+  BOX_MP41 = MKBOX('m', 'p', '4', '1')
+};
+
+enum { /* tfhd flags */
+  TFHD_BASE_DATA_OFFSET = 0x1,
+  TFHD_SAMPLE_DESC_INDEX = 0x2,
+  TFHD_SAMPLE_DURATION = 0x8,
+  TFHD_SAMPLE_SIZE = 0x10,
+  TFHD_SAMPLE_FLAGS = 0x20,
+  TFHD_BASE_IS_MOOF = 0x20000
+};
+
+enum { /* trun flags */
+  TRUN_DATA_OFFSET = 0x1,
+  TRUN_FIRST_SAMPLE_FLAGS = 0x4,
+  TRUN_SAMPLE_DURATION = 0x100,
+  TRUN_SAMPLE_SIZE = 0x200,
+  TRUN_SAMPLE_FLAGS = 0x400,
+  TRUN_SAMPLE_CTS_OFFSET = 0x800
 };
 
 union box {
@@ -132,6 +260,9 @@ union box {
   struct box_soun * soun;
   struct box_vmhd * vmhd;
   struct box_smhd * smhd;
+  struct box_moof * moof;
+  struct box_traf * traf;
+  struct fragment * fragment;
 };
 
 typedef union box box_t;
@@ -392,9 +523,15 @@ struct stts_entry {
   unsigned int sample_delta;
 };
 
+/* The run-length tables stay as runs. start, of each run's first
+   sample, and time, of its decoding time, find the run of a sample by
+   binary search; see fill_runs. */
 struct box_stts {
   unsigned int entry_count;
   struct stts_entry * entry;
+  unsigned int capa; /* grown by fragments */
+  unsigned long * start;
+  unsigned long * time;
 };
 
 struct ctts_entry {
@@ -405,6 +542,8 @@ struct ctts_entry {
 struct box_ctts {
   unsigned int entry_count;
   struct ctts_entry * entry;
+  unsigned int capa;
+  unsigned long * start;
 };
 
 struct stsc_entry {
@@ -416,37 +555,32 @@ struct stsc_entry {
 struct box_stsc {
   unsigned int entry_count;
   struct stsc_entry * entry;
+  unsigned int capa;
+  unsigned long * start;
 };
 
-struct stco_entry {
-  unsigned int chunk_offset;
-  unsigned int samples_per_chunk; /* created from stsc_entry */
-};
-
+/* Per chunk and per sample tables are arrays of one field each, so a
+   scan of one field reads nothing else */
 struct box_stco {
   unsigned int entry_count;
-  long pos;
-  struct stco_entry * entry;
-};
-
-struct stsz_entry {
-  unsigned int pos;
-  unsigned int entry_size;
+  unsigned long * chunk_offset; /* set for the output */
+  unsigned int * samples_per_chunk; /* created from stsc_entry */
+  long * pos; /* offset in the input */
+  long * size; /* bytes of the chunk's samples, see fill_sizes */
+  unsigned int capa;
+  unsigned char large; /* written as co64 */
 };
 
 struct box_stsz {
   unsigned int sample_size;
   unsigned int sample_count;
-  struct stsz_entry * entry;
-};
-
-struct stss_entry {
-  unsigned int sample_number;
+  unsigned int * entry_size; /* NULL if sample_size is constant */
+  unsigned int capa;
 };
 
 struct box_stss {
   unsigned int entry_count;
-  struct stss_entry * entry;
+  unsigned int * sample_number;
 };
 
 struct box_stbl {
@@ -496,10 +630,20 @@ struct box_mdia {
   struct box_minf minf;
 };
 
+struct box_trex { /* sample defaults of the track's fragments */
+  unsigned int sample_desc_index;
+  unsigned int sample_duration;
+  unsigned int sample_size;
+  unsigned int sample_flags;
+};
+
 struct box_trak {
   struct box_tkhd tkhd;
   struct box_edts edts;
   struct box_mdia mdia;
+  struct box_trex trex;
+  unsigned long decode_time; /* of its next fragment's first sample */
+  unsigned char timed; /* decode_time is on the timeline of a tfdt */
 };
 
 struct box_moov {
@@ -507,10 +651,90 @@ struct box_moov {
   struct box_iods * iods;
   struct box_trak * trak;
   unsigned int trak_len;
+  unsigned char fragmented; /* has mvex, samples follow in moofs */
+};
+
+struct io;
+
+struct io_vec {
+  const void * ptr;
+  size_t len;
+};
+
+struct io_ops {
+  int (* read_at)(struct io * io, void * ptr, size_t len, long pos);
+  int (* read_some)(struct io * io, void * ptr, size_t len, long pos,
+                    size_t * ret); /* up to len bytes, 0 at the end */
+  int (* write_at)(struct io * io, const void * ptr, size_t len, long pos);
+  int (* write_vec_at)(struct io * io, const struct io_vec * vec, size_t len,
+                       long pos); /* optional */
+  int (* copy_at)(struct io * io, struct io * src, long pos, long src_pos,
+                  size_t len, size_t * ret); /* optional */
+  int (* size)(struct io * io, long * ret);
+  void (* close)(struct io * io);
+};
+
+struct io {
+  const struct io_ops * ops;
+  const unsigned char * map; /* whole content if addressable, else NULL */
+  unsigned char seq; /* pipe: reads only forward, writes only append */
+};
+
+struct box_sizes { /* box sizes in write_box order */
+  unsigned long * size;
+  unsigned int len;
+  unsigned int capa;
+  unsigned int i; /* next size to write */
+  unsigned char again; /* a box header or stco grew, measure again */
+};
+
+struct stream {
+  struct io * io; /* NULL if only measuring */
+  const unsigned char * map; /* io->map of an input */
+  unsigned char * buf; /* read window, or writes not yet flushed */
+  long buf_pos; /* offset of buf[0] */
+  size_t buf_len;
+  long size; /* input size */
+  long pos;
+  unsigned char out; /* opened for writing */
+  struct box_sizes * sizes; /* recorded when measuring, else written */
+  struct splice * splice; /* if not NULL, the source isn't copied */
+};
+
+/* Splice plan of an output: the source bytes it would copy are recorded
+   as ranges instead, the rest is stored, and the plan lists both in
+   output order, one "h|s <offset> <length>" line each, h for stored
+   bytes, s for the source's */
+struct splice {
+  struct stream plan;
+  long mark; /* stored bytes before it are in the plan */
+  long src_pos; /* pending range of the source */
+  long src_len;
+  long src_total; /* bytes of the source in the plan so far */
+};
+
+/* A run of kept samples of a fragmented pipe, from src in the input to
+   dst in the copy of the runs */
+struct frag_run {
+  long src;
+  long len;
+  long dst;
 };
 
+/* A pipe can't come back for the samples of its fragments: the kept
+   runs are copied out of each mdat as it passes, into bytes, and their
+   chunks point there. file is then buf, reading bytes. */
 struct box_mdat {
-  FILE * file;
+  struct stream * file;
+  unsigned char fragments; /* a moof was read */
+  unsigned char copied; /* kept runs go to bytes */
+  unsigned char * bytes;
+  size_t capa;
+  long len; /* taken by runs so far */
+  struct frag_run * run; /* runs whose mdat is still ahead */
+  unsigned int run_len;
+  unsigned int run_capa;
+  struct stream buf;
 };
 
 struct box_top {
@@ -519,15 +743,36 @@ struct box_top {
   struct box_mdat mdat;
 };
 
+struct box_moof {
+  struct box_top * top;
+  long pos; /* default base of the first traf */
+  long data_end; /* end of the previous traf's data, the next one's base */
+};
+
+/* A track fragment's runs are appended to the track's sample tables as
+   one chunk each, so the rest sees a progressive file. */
+struct box_traf {
+  struct box_moof * moof;
+  struct box_trak * trak; /* NULL if its samples aren't kept */
+  unsigned int track_id;
+  struct box_trex trex; /* tfhd overriding the trex defaults */
+  long base;
+  long data_end; /* end of the previous trun's data */
+};
+
 struct box_info {
+  struct arena * arena; /* of everything the boxes keep */
   unsigned int dump;
   unsigned int depth;
-  unsigned int size;
+  unsigned long size;
   unsigned int type;
   long pos;
+  unsigned char audio_only; /* skip minf of tracks that aren't sound */
+  unsigned char last; /* set by the box: stop at it, skip its siblings */
 };
 
-typedef int (* box_func_t)(FILE * file, struct box_info * info, box_t p_box);
+typedef int (* box_func_t)(struct stream * file, struct box_info * info,
+                           box_t p_box);
 
 struct box_func {
   unsigned int name;
@@ -580,7 +825,16 @@ err_to_str(int i) {
     "Illegal quantity of box",
     "No sound track",
     "No sound configuration",
-    "Illegal number of channels"
+    "Illegal number of channels",
+    "Stream isn't in playback order (moov after mdat?)",
+    "Fragmented stream can't be read forward only (try --io=memory)",
+    "No track with the fragment's track ID",
+    "A batch job failed",
+    "Call out of order",
+    "Output buffer too small",
+    "No such sample",
+    "Sample too big for an ADTS frame",
+    "Fragment's decode time is before the end of the previous one"
   };
   if (i < 0 || i >= ERR_LEN)
     return NULL;
@@ -645,6 +899,13 @@ print_u(const char * name, unsigned int x, struct box_info * info) {
 
 #define PRINT_U(name, info) print_u(#name, (name), (info))
 
+static void
+print_lu(const char * name, unsigned long x, struct box_info * info) {
+  print_name(name, info); printf("%lu\n", x);
+}
+
+#define PRINT_LU(name, info) print_lu(#name, (name), (info))
+
 static void
 print_s(const char * name, int s, struct box_info * info) {
   print_name(name, info); printf("%d\n", s);
@@ -721,4653 +982,8659 @@ mem_free(void * ptr) {
   free(ptr);
 }
 
+/* The parsed boxes are bumped into chunks and released at once */
+union arena_align {
+  long l;
+  double d;
+  void * p;
+};
+
+struct arena_chunk {
+  struct arena_chunk * prev;
+  size_t size; /* header included */
+};
+
+struct arena {
+  struct arena_chunk * chunk; /* the newest */
+  size_t used; /* of chunk */
+  size_t last; /* offset of the last allocation, to grow it in place */
+};
+
+static size_t
+arena_round(size_t size) {
+  size_t align;
+
+  align = sizeof(union arena_align);
+  return (size + align - 1) / align * align;
+}
+
+static void
+init_arena(struct arena * arena) {
+  arena->chunk = NULL;
+  arena->used = 0;
+  arena->last = 0;
+}
+
 static int
-skip(FILE * file, long offset) {
-  if (fseek(file, offset, SEEK_CUR))
-    return ERR_IO;
+arena_alloc(struct arena * arena, void * ret, size_t size) {
+  struct arena_chunk * chunk;
+  size_t head;
+  size_t n;
+  void ** ret_p;
+  int err;
+
+  if (size > (size_t) -1 / 4)
+    return ERR_MEM;
+  size = arena_round(size ? size : 1); /* apart, to grow in place */
+  head = arena_round(sizeof(* chunk));
+
+  chunk = arena->chunk;
+  if (chunk == NULL || size > chunk->size - arena->used) {
+    n = chunk ? chunk->size * 2 : ARENA_CHUNK_SIZE;
+    while (n < head + size)
+      n *= 2;
+    if ((err = mem_alloc(&chunk, n)) != 0)
+      return err;
+    chunk->prev = arena->chunk;
+    chunk->size = n;
+    arena->chunk = chunk;
+    arena->used = head;
+  }
+
+  ret_p = ret;
+  * ret_p = (unsigned char *) chunk + arena->used;
+  arena->last = arena->used;
+  arena->used += size;
   return 0;
 }
 
+/* Resize * ret of old bytes, in place if it is the last allocation.
+   Without an arena it is on the heap. */
 static int
-get_pos(long * ret, FILE * file) {
-  long pos;
+arena_realloc(struct arena * arena, void * ret, size_t old, size_t size) {
+  unsigned char ** ret_p;
+  void * p;
+  int err;
 
-  pos = ftell(file);
-  if (pos == -1)
-    return ERR_IO;
+  if (arena == NULL)
+    return mem_realloc(ret, size);
+
+  ret_p = ret;
+  if (* ret_p != NULL && arena->chunk != NULL &&
+      * ret_p == (unsigned char *) arena->chunk + arena->last &&
+      size <= arena->chunk->size - arena->last) {
+    arena->used = arena->last + arena_round(size);
+    return 0;
+  }
 
-  * ret = pos;
+  if ((err = arena_alloc(arena, &p, size)) != 0)
+    return err;
+  if (* ret_p != NULL)
+    memcpy(p, * ret_p, old < size ? old : size);
+  * ret_p = p;
   return 0;
 }
 
+/* Keep the newest and biggest chunk for the next file */
+static void
+reset_arena(struct arena * arena) {
+  struct arena_chunk * chunk;
+  struct arena_chunk * prev;
+
+  if (arena->chunk == NULL)
+    return;
+  for (chunk = arena->chunk->prev; chunk != NULL; chunk = prev) {
+    prev = chunk->prev;
+    mem_free(chunk);
+  }
+  arena->chunk->prev = NULL;
+  arena->used = arena_round(sizeof(* arena->chunk));
+  arena->last = 0;
+}
+
+static void
+free_arena(struct arena * arena) {
+  struct arena_chunk * chunk;
+  struct arena_chunk * prev;
+
+  for (chunk = arena->chunk; chunk != NULL; chunk = prev) {
+    prev = chunk->prev;
+    mem_free(chunk);
+  }
+  init_arena(arena);
+}
+
+struct io_stdio {
+  struct io io;
+  FILE * file;
+  long end; /* end of the last read or write */
+};
+
+/* Move to pos, dropping the bytes in between if the file is a pipe */
 static int
-set_pos(long pos, FILE * file) {
-  if (fseek(file, pos, SEEK_SET) == -1)
+stdio_seek(struct io_stdio * sio, long pos) {
+  unsigned char tmp[4096];
+  size_t n;
+
+  if (sio->io.seq == 0)
+    return fseek(sio->file, pos, SEEK_SET) == -1 ? ERR_IO : 0;
+
+  if (pos < sio->end)
     return ERR_IO;
+  for (; sio->end < pos; sio->end += (long) n) {
+    n = pos - sio->end < (long) sizeof(tmp) ?
+        (size_t) (pos - sio->end) : sizeof(tmp);
+    if (fread(tmp, 1, n, sio->file) != n)
+      return ERR_IO;
+  }
   return 0;
 }
 
 static int
-read_ary(void * ptr, size_t size, size_t len, FILE * file) {
-  if (fread(ptr, size, len, file) != len)
+stdio_read_at(struct io * io, void * ptr, size_t len, long pos) {
+  struct io_stdio * sio;
+  int err;
+
+  sio = (struct io_stdio *) io;
+  if ((err = stdio_seek(sio, pos)) != 0)
+    return err;
+
+  if (fread(ptr, 1, len, sio->file) != len)
     return ERR_IO;
+  sio->end = pos + (long) len;
   return 0;
 }
 
 static int
-read_s16(short * ret, FILE * file) {
-  unsigned char b16[2];
+stdio_read_some(struct io * io, void * ptr, size_t len, long pos,
+                size_t * ret) {
+  struct io_stdio * sio;
+  int err;
 
-  if (fread(b16, sizeof(b16), 1, file) != 1)
-    return ERR_IO;
+  sio = (struct io_stdio *) io;
+  if ((err = stdio_seek(sio, pos)) != 0)
+    return err;
 
-  * ret = (short) ((b16[0] << 8) | b16[1]);
+  * ret = fread(ptr, 1, len, sio->file);
+  if (* ret == 0 && ferror(sio->file))
+    return ERR_IO;
+  sio->end = pos + (long) * ret;
   return 0;
 }
 
 static int
-read_s32(int * ret, FILE * file) {
-  unsigned char b32[4];
-
-  if (fread(b32, sizeof(b32), 1, file) != 1)
+stdio_write_at(struct io * io, const void * ptr, size_t len, long pos) {
+  struct io_stdio * sio;
+
+  sio = (struct io_stdio *) io;
+  if (io->seq) {
+    if (pos != sio->end)
+      return ERR_IO;
+  } else if (fseek(sio->file, pos, SEEK_SET) == -1) {
     return ERR_IO;
+  }
 
-  * ret = (int) ((b32[0] << 24) | (b32[1] << 16) |
-                 (b32[2] << 8)  | b32[3]);
+  if (fwrite(ptr, 1, len, sio->file) != len)
+    return ERR_IO;
+  sio->end = pos + (long) len;
   return 0;
 }
 
 static int
-read_u8(unsigned char * ret, FILE * file) {
-  int b8;
+stdio_size(struct io * io, long * ret) {
+  FILE * file;
+  long size;
+
+  if (io->seq) { /* known at the end only */
+    * ret = LONG_MAX;
+    return 0;
+  }
 
-  b8 = fgetc(file);
-  if (b8 == EOF)
+  file = ((struct io_stdio *) io)->file;
+  if (fseek(file, 0, SEEK_END) == -1 ||
+      (size = ftell(file)) == -1)
     return ERR_IO;
 
-  * ret = (unsigned char) (b8 & 0xff);
+  * ret = size;
   return 0;
 }
 
+static void
+stdio_close(struct io * io) {
+  fclose(((struct io_stdio *) io)->file);
+  mem_free(io);
+}
+
+static const struct io_ops stdio_ops = {
+  stdio_read_at, stdio_read_some, stdio_write_at, NULL, NULL, stdio_size,
+  stdio_close
+};
+
 static int
-read_u16(unsigned short * ret, FILE * file) {
-  unsigned char b16[2];
+open_stdio(struct io ** ret, const char * fname, const char * mode) {
+  struct io_stdio * io;
+  int err;
+
+  if ((err = mem_alloc(&io, sizeof(* io))) != 0)
+    return err;
 
-  if (fread(b16, sizeof(b16), 1, file) != 1)
+  io->file = fopen(fname, mode);
+  if (io->file == NULL) {
+    mem_free(io);
     return ERR_IO;
+  }
 
-  * ret = (unsigned short) ((b16[0] << 8) | b16[1]);
+  io->end = 0;
+  io->io.ops = &stdio_ops;
+  io->io.map = NULL;
+  io->io.seq = 0;
+  * ret = &io->io;
   return 0;
 }
 
+struct io_memory {
+  struct io io;
+  unsigned char * bytes;
+  size_t size;
+  size_t capa;
+  unsigned char owned; /* bytes are freed on close */
+  unsigned char fixed; /* a caller's buffer, writes past capa are only
+                          counted in size */
+};
+
 static int
-read_u32(unsigned int * ret, FILE * file) {
-  unsigned char b32[4];
+memory_read_at(struct io * io, void * ptr, size_t len, long pos) {
+  struct io_memory * mem;
 
-  if (fread(b32, sizeof(b32), 1, file) != 1)
+  mem = (struct io_memory *) io;
+  if (pos < 0 || (size_t) pos > mem->size || len > mem->size - (size_t) pos)
     return ERR_IO;
 
-  * ret = (unsigned int) ((b32[0] << 24) | (b32[1] << 16) |
-                          (b32[2] << 8)  | b32[3]);
+  memcpy(ptr, mem->bytes + pos, len);
   return 0;
 }
 
 static int
-read_str(char ** ret, FILE * file) {
-  long pos;
-  size_t len;
-  char * str;
-  int err;
+memory_write_at(struct io * io, const void * ptr, size_t len, long pos) {
+  struct io_memory * mem;
+  size_t end;
+  size_t capa;
+  int ret;
 
-  err = 0;
+  mem = (struct io_memory *) io;
+  if (pos < 0 || (mem->owned == 0 && mem->fixed == 0))
+    return ERR_IO;
 
-  pos = ftell(file);
-  if (pos == -1) {
-    err = ERR_IO;
-    goto exit;
+  end = (size_t) pos + len;
+  if (end > mem->capa && mem->owned) {
+    capa = mem->capa ? mem->capa : STREAM_BUF_SIZE;
+    while (capa < end)
+      capa <<= 1;
+    if ((ret = mem_realloc(&mem->bytes, capa)) != 0)
+      return ret;
+    mem->capa = capa;
   }
+  if ((size_t) pos > mem->size && mem->size < mem->capa)
+    memset(mem->bytes + mem->size, 0,
+           ((size_t) pos < mem->capa ? (size_t) pos : mem->capa) - mem->size);
+
+  if ((size_t) pos < mem->capa)
+    memcpy(mem->bytes + pos, ptr,
+           len < mem->capa - (size_t) pos ? len : mem->capa - (size_t) pos);
+  if (end > mem->size)
+    mem->size = end;
+  io->map = mem->bytes;
+  return 0;
+}
 
-  len = 0;
+static int
+memory_size(struct io * io, long * ret) {
+  * ret = (long) ((struct io_memory *) io)->size;
+  return 0;
+}
 
-  for (;;) {
-    int c;
+static void
+memory_close(struct io * io) {
+  struct io_memory * mem;
 
-    c = fgetc(file);
-    if (c == EOF) {
-      err = ERR_IO;
-      goto exit;
-    }
-    if (c == '\0')
-      break;
+  mem = (struct io_memory *) io;
+  if (mem->owned)
+    mem_free(mem->bytes);
+  mem_free(mem);
+}
 
-    len++;
-  }
+static const struct io_ops memory_ops = {
+  memory_read_at, NULL, memory_write_at, NULL, NULL,
+  memory_size, memory_close
+};
 
-  str = malloc(len + 1);
-  if (str == NULL) {
-    err = ERR_MEM;
-    goto exit;
-  }
+/* Wrap size bytes; owned bytes (or NULL) can grow by writing and are
+   freed on close. */
+static int
+open_memory(struct io ** ret, const void * bytes, size_t size,
+            unsigned char owned) {
+  struct io_memory * io;
+  int err;
 
-  if (fseek(file, pos, SEEK_SET) == -1) {
-    err = ERR_IO;
-    goto free;
-  }
+  if ((err = mem_alloc(&io, sizeof(* io))) != 0)
+    return err;
+
+  io->bytes = (unsigned char *) bytes;
+  io->size = size;
+  io->capa = size;
+  io->owned = owned;
+  io->fixed = 0;
+  io->io.ops = &memory_ops;
+  io->io.map = bytes;
+  io->io.seq = 0;
+  * ret = &io->io;
+  return 0;
+}
 
-  if (fread(str, len + 1, 1, file) != 1) {
-    err = ERR_IO;
-    goto free;
-  }
+/* Write into the caller's buffer of capa bytes */
+static int
+open_buffer(struct io ** ret, void * buf, size_t capa) {
+  struct io_memory * io;
+  int err;
 
-  * ret = str;
-free:
-  if (err)
-    mem_free(str);
-exit:
-  return err;
+  if ((err = open_memory(ret, buf, 0, 0)) != 0)
+    return err;
+  io = (struct io_memory *) * ret;
+  io->capa = capa;
+  io->fixed = 1;
+  return 0;
 }
 
+#ifdef HAVE_POSIX
+struct io_fd {
+  struct io io;
+  int fd;
+  size_t map_size;
+  unsigned char copy;
+  long end; /* end of the last read or write */
+};
+
+/* Position fd for writing at pos, which a pipe must already be at */
 static int
-read_ver(unsigned char * version, unsigned int * flags, FILE * file) {
-  unsigned int b32;
-  int ret;
+fd_seek(struct io_fd * fio, long pos) {
+  if (fio->io.seq)
+    return pos == fio->end ? 0 : ERR_IO;
+  if (lseek(fio->fd, (off_t) pos, SEEK_SET) == -1)
+    return ERR_IO;
+  return 0;
+}
 
-  if ((ret = read_u32(&b32, file)) != 0)
-    return ret;
+/* Move a pipe forward to pos by reading and dropping bytes */
+static int
+fd_forward(struct io_fd * fio, long pos) {
+  unsigned char tmp[4096];
+  ssize_t n;
 
-  * version = (unsigned char) (b32 >> 24);
-  * flags = b32 & 0x00ffffff;
+  if (pos < fio->end)
+    return ERR_IO;
+  while (fio->end < pos) {
+    n = read(fio->fd, tmp, pos - fio->end < (long) sizeof(tmp) ?
+                           (size_t) (pos - fio->end) : sizeof(tmp));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return ERR_IO;
+    fio->end += (long) n;
+  }
   return 0;
 }
 
 static int
-read_tag(unsigned char * ret_tag, unsigned int * ret_len, FILE * file) {
-  unsigned char tag;
-  unsigned int len;
-  unsigned char c;
-  int i;
-  int ret;
-
-  if ((ret = read_u8(&tag, file)) != 0)
-    return ret;
+fd_read_at(struct io * io, void * ptr, size_t len, long pos) {
+  unsigned char * p;
+  struct io_fd * fio;
+  ssize_t n;
+  int err;
 
-  len = 0;
-  for (i = 0; i < 4; i++) {
-    if ((ret = read_u8(&c, file)) != 0)
-      return ret;
-    len <<= 7;
-    len |= c & 0x7f;
-    if ((c & 0x80) == 0)
-      break;
+  fio = (struct io_fd *) io;
+  if (io->seq && (err = fd_forward(fio, pos)) != 0)
+    return err;
+
+  p = ptr;
+  while (len) {
+    n = io->seq ? read(fio->fd, p, len) : pread(fio->fd, p, len, (off_t) pos);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return ERR_IO;
+    p += n;
+    len -= (size_t) n;
+    pos += (long) n;
   }
-  * ret_len = len;
-  * ret_tag = tag;
+  fio->end = pos;
   return 0;
 }
 
 static int
-read_mat(int * matrix, FILE * file) {
-  int i;
-  int ret;
+fd_read_some(struct io * io, void * ptr, size_t len, long pos,
+             size_t * ret) {
+  struct io_fd * fio;
+  ssize_t n;
+  int err;
 
-  for (i = 0; i < 9; i++)
-    if ((ret = read_s32(&matrix[i], file)) != 0)
-      return ret;
+  fio = (struct io_fd *) io;
+  if (io->seq && (err = fd_forward(fio, pos)) != 0)
+    return err;
+
+  do
+    n = io->seq ? read(fio->fd, ptr, len) :
+        pread(fio->fd, ptr, len, (off_t) pos);
+  while (n == -1 && errno == EINTR);
+  if (n == -1)
+    return ERR_IO;
 
+  * ret = (size_t) n;
+  fio->end = pos + (long) n;
   return 0;
 }
 
 static int
-read_box(FILE * file, struct box_info * info, box_t box,
-         struct box_func * funcs) {
-  struct box_info child;
-  char str[4];
-  size_t i;
-  int ret;
+fd_write_at(struct io * io, const void * ptr, size_t len, long pos) {
+  const unsigned char * p;
+  struct io_fd * fio;
+  ssize_t n;
 
-  child.dump = info->dump;
-  child.depth = info->depth + 1;
+  fio = (struct io_fd *) io;
+  if (io->seq && pos != fio->end)
+    return ERR_IO;
 
-  for (;;) {
-    if ((ret = get_pos(&child.pos, file)) != 0)
-      return ret;
+  p = ptr;
+  while (len) {
+    n = io->seq ? write(fio->fd, p, len) :
+        pwrite(fio->fd, p, len, (off_t) pos);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return ERR_IO;
+    p += n;
+    len -= (size_t) n;
+    pos += (long) n;
+  }
+  fio->end = pos;
+  return 0;
+}
 
-    if ((unsigned int) (child.pos - info->pos) > info->size)
-      return ERR_BOX_SIZE;
-    if ((unsigned int) (child.pos - info->pos) == info->size)
-      break;
+static int
+fd_write_vec_at(struct io * io, const struct io_vec * vec, size_t len,
+                long pos) {
+  struct iovec iov[VEC_MAX];
+  struct io_fd * fio;
+  size_t i;
+  size_t k;
+  size_t m;
+  size_t n;
+  ssize_t w;
+  int err;
 
-    if ((ret = read_u32(&child.size, file)) != 0 ||
-        (ret = read_u32(&child.type, file)) != 0)
-      return ret;
+  fio = (struct io_fd *) io;
+  if ((err = fd_seek(fio, pos)) != 0)
+    return err;
 
-    for (i = 0; funcs[i].name; i++)
-      if (funcs[i].name == child.type)
-        break;
+  for (i = 0; i < len; i += k) {
+    k = len - i < VEC_MAX ? len - i : VEC_MAX;
+    for (m = 0; m < k; m++) {
+      iov[m].iov_base = (void *) vec[i+m].ptr;
+      iov[m].iov_len = vec[i+m].len;
+    }
 
-    if (info->dump) {
-      print_spaces(info);
-      printf("[%.4s %u]\n", box_to_str(child.type, str), child.size);
+    for (m = 0; m < k;) {
+      w = writev(fio->fd, iov + m, (int) (k - m));
+      if (w == -1 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return ERR_IO;
+      fio->end += (long) w;
+
+      /* drop what got written, a short write resumes mid element */
+      for (n = (size_t) w; m < k && n >= iov[m].iov_len; m++)
+        n -= iov[m].iov_len;
+      if (m < k) {
+        iov[m].iov_base = (unsigned char *) iov[m].iov_base + n;
+        iov[m].iov_len -= n;
+      }
     }
+  }
+  return 0;
+}
 
-    if (funcs[i].name == 0)
-      return ERR_UNK_BOX;
+#ifdef HAVE_LINUX
+/* Copy from another fd backend without going through user space. Set
+   ret to the bytes copied; the caller copies the rest itself. */
+static int
+fd_copy_at(struct io * io, struct io * src, long pos, long src_pos,
+           size_t len, size_t * ret) {
+  struct io_fd * fio;
+  loff_t off_in;
+  loff_t off_out;
+  off_t off;
+  ssize_t n;
+  int fd;
+
+  * ret = 0;
+  if (src->ops->read_at != fd_read_at || src->seq)
+    return 0;
 
-    if (funcs[i].qty & (BOX_QTY_0_OR_1 | BOX_QTY_1))
-      if (funcs[i].count == 1)
-        return ERR_BOX_QTY;
+  fio = (struct io_fd *) io;
+  fd = ((struct io_fd *) src)->fd;
+  while (len && fio->copy != COPY_NONE) {
+    if (fio->copy == COPY_FILE_RANGE) {
+      off_in = (loff_t) src_pos;
+      off_out = (loff_t) pos;
+      n = copy_file_range(fd, &off_in, fio->fd, io->seq ? NULL : &off_out,
+                          len, 0);
+    } else {
+      if (io->seq && pos != fio->end)
+        return ERR_IO;
+      off = (off_t) src_pos;
+      n = fd_seek(fio, pos) != 0 ? -1 : sendfile(fio->fd, fd, &off, len);
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                    errno == EOPNOTSUPP || errno == ESPIPE)) {
+      fio->copy--; /* unsupported here, try the next way */
+      continue;
+    }
+    if (n == -1)
+      return ERR_IO;
+    if (n == 0)
+      break;
+    * ret += (size_t) n;
+    len -= (size_t) n;
+    pos += (long) n;
+    src_pos += (long) n;
+    fio->end = pos;
+  }
+  return 0;
+}
+#endif
 
-    if ((ret = funcs[i].func(file, &child, box)) != 0)
-      return ret;
+static int
+fd_size(struct io * io, long * ret) {
+  struct stat st;
 
-    funcs[i].count++;
+  if (io->seq) { /* known at the end only */
+    * ret = LONG_MAX;
+    return 0;
   }
 
-  for (i = 0; funcs[i].name; i++)
-    if (funcs[i].qty & (BOX_QTY_1 | BOX_QTY_1_TO_N))
-      if (funcs[i].count == 0)
-        return ERR_BOX_QTY;
+  if (fstat(((struct io_fd *) io)->fd, &st) == -1)
+    return ERR_IO;
 
+  * ret = (long) st.st_size;
   return 0;
 }
 
+static void
+fd_close(struct io * io) {
+  struct io_fd * fio;
+
+  fio = (struct io_fd *) io;
+  if (io->map != NULL)
+    munmap((void *) io->map, fio->map_size);
+  close(fio->fd);
+  mem_free(fio);
+}
+
+static const struct io_ops fd_ops = {
+  fd_read_at, fd_read_some, fd_write_at, fd_write_vec_at,
+#ifdef HAVE_LINUX
+  fd_copy_at,
+#else
+  NULL,
+#endif
+  fd_size, fd_close
+};
+
 static int
-read_iods(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned char tag;
-  unsigned int tag_len;
-  unsigned short object_descr_id;
-  unsigned char url_flag;
-  unsigned char include_inline_profile_level_flag;
-  unsigned char od_profile_level_idc;
-  unsigned char scene_profile_level_idc;
-  unsigned char audio_profile_level_idc;
-  unsigned char visual_profile_level_idc;
-  unsigned char graphics_profile_levvel_idc;
-  struct box_iods * iods;
-  struct initial_object_descr * iod;
+wrap_fd(struct io ** ret, int fd, unsigned char seq) {
+  struct io_fd * io;
+  int err;
+
+  if ((err = mem_alloc(&io, sizeof(* io))) != 0)
+    return err;
+
+  io->fd = fd;
+  io->map_size = 0;
+  io->copy = COPY_FILE_RANGE;
+  io->end = 0;
+  io->io.ops = &fd_ops;
+  io->io.map = NULL;
+  io->io.seq = seq;
+  * ret = &io->io;
+  return 0;
+}
+
+static int
+open_fd(struct io ** ret, const char * fname, int flags) {
+  int err;
+  int fd;
+
+  fd = open(fname, flags, 0666);
+  if (fd == -1)
+    return ERR_IO;
+
+  if ((err = wrap_fd(ret, fd, 0)) != 0)
+    close(fd);
+  return err;
+}
+
+/* pread backend whose content is mapped, NULL map if that fails */
+static int
+open_mmap(struct io ** ret, const char * fname) {
+  struct io * io;
+  struct io_fd * fio;
+  long size;
+  void * map;
+  int err;
+
+  if ((err = open_fd(&io, fname, O_RDONLY)) != 0)
+    return err;
+
+  if ((err = fd_size(io, &size)) != 0) {
+    fd_close(io);
+    return err;
+  }
+
+  fio = (struct io_fd *) io;
+  if (size > 0) {
+    map = mmap(NULL, (size_t) size, PROT_READ, MAP_PRIVATE, fio->fd, 0);
+    if (map != MAP_FAILED) {
+      io->map = map;
+      fio->map_size = (size_t) size;
+    }
+  }
+  * ret = io;
+  return 0;
+}
+#endif
+
+static int
+open_stream(struct stream * file, struct io * io, unsigned char out) {
   int ret;
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_tag(&tag, &tag_len, file)) != 0)
+  file->io = io;
+  file->map = out || io == NULL ? NULL : io->map;
+  file->buf = NULL;
+  file->buf_pos = 0;
+  file->buf_len = 0;
+  file->size = 0;
+  file->pos = 0;
+  file->out = out;
+  file->sizes = NULL;
+  file->splice = NULL;
+
+  if (io == NULL) /* measuring output, nothing is stored */
+    return 0;
+
+  if (out == 0 && (ret = io->ops->size(io, &file->size)) != 0)
     return ret;
 
-  if (tag != TAG_MP4_IOD)
-    return ERR_UNK_TAG;
+  if (file->map == NULL)
+    if ((ret = mem_alloc(&file->buf, STREAM_BUF_SIZE)) != 0)
+      return ret;
+  return 0;
+}
 
-  if (info->dump) {
-    print_spaces(info);
-    printf("[InitialObjectDescr %u]\n", tag_len);
-    info->depth++;
-  }
+static int
+flush_file(struct stream * file) {
+  int ret;
 
-  if ((ret = read_u16(&object_descr_id, file)) != 0)
+  if (file->out == 0 || file->io == NULL || file->buf_len == 0)
+    return 0;
+
+  if ((ret = file->io->ops->write_at(file->io, file->buf, file->buf_len,
+                                     file->buf_pos)) != 0)
     return ret;
 
-  url_flag = (unsigned char) ((object_descr_id >> 5) & 0x1);
-  include_inline_profile_level_flag =
-      (unsigned char) ((object_descr_id >> 4) & 0x1);
-  object_descr_id >>= 6;
+  file->buf_pos += (long) file->buf_len;
+  file->buf_len = 0;
+  return 0;
+}
 
-  if (info->dump) {
-    PRINT_U(object_descr_id, info);
-    PRINT_U(url_flag, info);
-    PRINT_U(include_inline_profile_level_flag, info);
+static int
+write_ary(const void * ptr, size_t size, size_t len, struct stream * file) {
+  size_t n;
+  int ret;
+
+  n = size * len;
+  if (file->io == NULL) {
+    file->pos += (long) n;
+    return 0;
   }
 
-  if (url_flag == 0) {
-    if ((ret = read_u8(&od_profile_level_idc, file)) != 0 ||
-        (ret = read_u8(&scene_profile_level_idc, file)) != 0 ||
-        (ret = read_u8(&audio_profile_level_idc, file)) != 0 ||
-        (ret = read_u8(&visual_profile_level_idc, file)) != 0 ||
-        (ret = read_u8(&graphics_profile_levvel_idc, file)) != 0)
+  if (n > STREAM_BUF_SIZE - file->buf_len) {
+    if ((ret = flush_file(file)) != 0)
       return ret;
 
-    if (info->dump) {
-      PRINT_U(od_profile_level_idc, info);
-      PRINT_U(scene_profile_level_idc, info);
-      PRINT_U(audio_profile_level_idc, info);
-      PRINT_U(visual_profile_level_idc, info);
-      PRINT_U(graphics_profile_levvel_idc, info);
+    if (n >= STREAM_BUF_SIZE) { /* too big to buffer */
+      if ((ret = file->io->ops->write_at(file->io, ptr, n, file->pos)) != 0)
+        return ret;
+      file->pos += (long) n;
+      file->buf_pos = file->pos;
+      return 0;
     }
   }
 
-  if (info->dump)
-    info->depth--;
+  memcpy(file->buf + file->buf_len, ptr, n);
+  file->buf_len += n;
+  file->pos += (long) n;
+  return 0;
+}
 
-  if ((ret = mem_alloc(&iods, sizeof(* iods))) != 0)
-    return ret;
+/* Gather write, straight to the backend if it supports it */
+static int
+write_vec(const struct io_vec * vec, size_t len, struct stream * file) {
+  size_t n;
+  size_t i;
+  int ret;
 
-  iod = &iods->iod;
-  iod->object_descr_id = object_descr_id;
-  iod->url_flag = url_flag;
-  iod->include_inline_profile_level_flag = include_inline_profile_level_flag;
-  if (url_flag == 0) {
-    iod->od_profile_level_idc = od_profile_level_idc;
-    iod->scene_profile_level_idc = scene_profile_level_idc;
-    iod->audio_profile_level_idc = audio_profile_level_idc;
-    iod->visual_profile_level_idc = visual_profile_level_idc;
-    iod->graphics_profile_levvel_idc = graphics_profile_levvel_idc;
+  if (file->io == NULL || file->io->ops->write_vec_at == NULL) {
+    for (i = 0; i < len; i++)
+      if ((ret = write_ary(vec[i].ptr, vec[i].len, 1, file)) != 0)
+        return ret;
+    return 0;
   }
 
-  p_box.moov->iods = iods;
+  if ((ret = flush_file(file)) != 0 ||
+      (ret = file->io->ops->write_vec_at(file->io, vec, len, file->pos)) != 0)
+    return ret;
+
+  for (n = 0, i = 0; i < len; i++)
+    n += vec[i].len;
+  file->pos += (long) n;
+  file->buf_pos = file->pos;
   return 0;
 }
 
 static int
-read_udta(FILE * file, struct box_info * info, box_t p_box) {
-  long pos;
+skip(struct stream * file, long offset) {
+  static const unsigned char zeros[16];
+  long n;
   int ret;
 
-  (void) p_box;
+  if (file->out && file->io == NULL) {
+    file->pos += offset;
+    return 0;
+  }
 
-  if ((ret = get_pos(&pos, file)) != 0 ||
-      (ret = skip(file, info->size - (unsigned int) (pos - info->pos))) != 0)
-    return ret;
+  if (file->out) { /* skipped output is zero filled */
+    for (; offset > 0; offset -= n) {
+      n = offset < (long) sizeof(zeros) ? offset : (long) sizeof(zeros);
+      if ((ret = write_ary(zeros, 1, (size_t) n, file)) != 0)
+        return ret;
+    }
+    return 0;
+  }
+
+  if (offset > file->size - file->pos || offset < -file->pos)
+    return ERR_IO;
+  file->pos += offset;
   return 0;
 }
 
 static int
-read_ftyp(FILE * file, struct box_info * info, box_t p_box) {
-  long pos;
+get_pos(long * ret, struct stream * file) {
+  * ret = file->pos;
+  if (file->splice != NULL) /* position in the planned output */
+    * ret += file->splice->src_total;
+  return 0;
+}
 
-  unsigned int m_brand; /* major brand */
-  unsigned int m_version; /* minor version */
-  unsigned int * c_brands; /* compatible brands */
+static int
+set_pos(long pos, struct stream * file) {
+  int ret;
 
-  struct box_ftyp * ftyp;
+  if (file->out) {
+    if ((ret = flush_file(file)) != 0)
+      return ret;
+    file->buf_pos = pos;
+  } else if (pos < 0 || pos > file->size) {
+    return ERR_IO;
+  }
 
-  unsigned int i;
-  unsigned int len;
-  int ret;
+  file->pos = pos;
+  return 0;
+}
 
-  ret = 0;
-  c_brands = NULL;
+/* take() from a pipe, which can only be read forward: the rest of the
+   window past pos is kept since it can't be read again. */
+static const unsigned char *
+take_seq(unsigned char * buf, size_t len, struct stream * file) {
+  unsigned char * dst;
+  size_t kept;
+  size_t n;
+  long end;
 
-  if ((ret = read_u32(&m_brand, file)) != 0 ||
-      (ret = read_u32(&m_version, file)) != 0 ||
-      (ret = get_pos(&pos, file)) != 0)
-    goto exit;
+  end = file->buf_pos + (long) file->buf_len;
+  if (file->pos < file->buf_pos)
+    return NULL;
 
-  if (info->dump) {
-    print_box("major_brand", m_brand, info);
-    print_u("minor_version", m_version, info);
+  kept = file->pos < end ? (size_t) (end - file->pos) : 0;
+  dst = len > STREAM_BUF_SIZE ? buf : file->buf;
+  memmove(dst, file->buf + (file->buf_len - kept), kept);
+
+  if (dst == buf) { /* too big for the window */
+    if (file->io->ops->read_at(file->io, buf + kept, len - kept,
+                               file->pos + (long) kept) != 0)
+      return NULL;
+    file->pos += (long) len;
+    file->buf_pos = file->pos;
+    file->buf_len = 0;
+    return buf;
   }
 
-  len = (info->size - (unsigned int) (pos - info->pos)) / 4;
+  file->buf_pos = file->pos;
+  file->buf_len = kept;
+  while (file->buf_len < len) {
+    if (file->io->ops->read_some(file->io, file->buf + file->buf_len,
+                                 STREAM_BUF_SIZE - file->buf_len,
+                                 file->buf_pos + (long) file->buf_len,
+                                 &n) != 0 || n == 0)
+      return NULL;
+    file->buf_len += n;
+  }
 
-  if ((ret = mem_alloc(&c_brands, len * sizeof(c_brands[0]))) != 0)
-    goto exit;
+  file->pos += (long) len;
+  return file->buf;
+}
 
-  for (i = 0; i < len; i++)
-    if ((ret = read_u32(&c_brands[i], file)) != 0)
-      goto free;
+/* Get the next len bytes: a pointer into the mapping or the read window,
+   or buf filled by the backend. NULL if the stream runs short. */
+static const unsigned char *
+take(unsigned char * buf, size_t len, struct stream * file) {
+  const unsigned char * p;
+  size_t n;
 
-  if (info->dump)
-    for (i = 0; i < len; i++)
-      print_box("compatible brand", c_brands[i], info);
+  if (len > (size_t) (file->size - file->pos))
+    return NULL;
 
-  ftyp = &p_box.top->ftyp;
-  ftyp->m_brand = m_brand;
-  ftyp->m_version = m_version;
-  ftyp->c_brands = c_brands;
-  ftyp->c_brands_len = len;
-free:
-  if (ret)
-    mem_free(c_brands);
-exit:
-  return ret;
-}
+  if (file->map != NULL) {
+    p = file->map + file->pos;
+    file->pos += (long) len;
+    return p;
+  }
 
-static int
-read_mvhd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int c_time;
-  unsigned int m_time;
-  unsigned int timescale;
-  unsigned int duration;
-  int rate;
-  short volume;
-  int matrix[9];
-  unsigned int next_track_id;
-  unsigned int i;
-  struct box_mvhd * mvhd;
-  int ret;
+  if (file->pos < file->buf_pos ||
+      file->pos + (long) len > file->buf_pos + (long) file->buf_len) {
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&c_time, file)) != 0 ||
-      (ret = read_u32(&m_time, file)) != 0 ||
-      (ret = read_u32(&timescale, file)) != 0 ||
-      (ret = read_u32(&duration, file)) != 0 ||
-      (ret = read_s32(&rate, file)) != 0 ||
-      (ret = read_s16(&volume, file)) != 0 ||
-      (ret = skip(file, 2 + 4 * 2)) != 0 || /* reserved */
-      (ret = read_mat(matrix, file)) != 0 ||
-      (ret = skip(file, 4 * 6)) != 0 || /* pre defined */
-      (ret = read_u32(&next_track_id, file)) != 0)
-    return ret;
+    if (file->io->seq)
+      return take_seq(buf, len, file);
 
-  if (info->dump) {
-    print_u("creation time", c_time, info);
-    print_u("modification time", m_time, info);
-    PRINT_U(timescale, info);
-    PRINT_U(duration, info);
-    PRINT_S_16(rate, info);
-    PRINT_S_8(volume, info);
-    PRINT_MAT(matrix, info);
-    PRINT_U(next_track_id, info);
+    if (len > STREAM_BUF_SIZE) { /* too big for the window */
+      if (file->io->ops->read_at(file->io, buf, len, file->pos) != 0)
+        return NULL;
+      file->pos += (long) len;
+      return buf;
+    }
+
+    n = (size_t) (file->size - file->pos);
+    if (n > STREAM_BUF_SIZE)
+      n = STREAM_BUF_SIZE;
+    if (file->io->ops->read_at(file->io, file->buf, n, file->pos) != 0)
+      return NULL;
+    file->buf_pos = file->pos;
+    file->buf_len = n;
   }
 
-  mvhd = &p_box.moov->mvhd;
-  mvhd->c_time = c_time;
-  mvhd->m_time = m_time;
-  mvhd->timescale = timescale;
-  mvhd->duration = duration;
-  mvhd->rate = rate;
-  mvhd->volume = volume;
-  for (i = 0; i < 9; i++)
-    mvhd->matrix[i] = matrix[i];
-  mvhd->next_track_id = next_track_id;
+  p = file->buf + (file->pos - file->buf_pos);
+  file->pos += (long) len;
+  return p;
+}
 
+/* Whether a pipe has no bytes past pos; the size of one is unknown
+   until then. What is read stays in the window. */
+static int
+stream_end(unsigned char * ret, struct stream * file) {
+  size_t n;
+  int err;
+
+  if (file->pos < file->buf_pos + (long) file->buf_len) {
+    * ret = 0;
+    return 0;
+  }
+
+  file->buf_pos = file->pos;
+  file->buf_len = 0;
+  if ((err = file->io->ops->read_some(file->io, file->buf, STREAM_BUF_SIZE,
+                                      file->pos, &n)) != 0)
+    return err;
+  file->buf_len = n;
+  * ret = n == 0;
   return 0;
 }
 
 static int
-read_tkhd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned char track_enabled;
-  unsigned char track_in_movie;
-  unsigned char track_in_preview;
-  unsigned int c_time;
-  unsigned int m_time;
-  unsigned int track_id;
-  unsigned int duration;
-  short layer;
-  short alternate_group;
-  short volume;
-  int matrix[9];
-  unsigned int width;
-  unsigned int height;
-  unsigned int i;
-  struct box_tkhd * tkhd;
-  int ret;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&c_time, file)) != 0 ||
-      (ret = read_u32(&m_time, file)) != 0 ||
-      (ret = read_u32(&track_id, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 || /* reserved */
-      (ret = read_u32(&duration, file)) != 0 ||
-      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
-      (ret = read_s16(&layer, file)) != 0 ||
-      (ret = read_s16(&alternate_group, file)) != 0 ||
-      (ret = read_s16(&volume, file)) != 0 ||
-      (ret = skip(file, 2)) != 0 || /* reserved */
-      (ret = read_mat(matrix, file)) != 0 ||
-      (ret = read_u32(&width, file)) != 0 ||
-      (ret = read_u32(&height, file)) != 0)
-    return ret;
+read_ary(void * ptr, size_t size, size_t len, struct stream * file) {
+  const unsigned char * p;
 
-  track_enabled = flags & 0x000001;
-  track_in_movie = (flags & 0x000002) != 0;
-  track_in_preview= (flags & 0x000004) != 0;
-
-  if (info->dump) {
-    PRINT_U(track_enabled, info);
-    PRINT_U(track_in_movie, info);
-    PRINT_U(track_in_preview, info);
-    print_u("creation time", c_time, info);
-    print_u("modification time", m_time, info);
-    PRINT_U(track_id, info);
-    PRINT_U(duration, info);
-    PRINT_S(layer, info);
-    PRINT_S(alternate_group, info);
-    PRINT_S_8(volume, info);
-    PRINT_MAT(matrix, info);
-    PRINT_U_16(width, info);
-    PRINT_U_16(height, info);
-  }
-
-  tkhd = &p_box.trak->tkhd;
-  tkhd->track_enabled = track_enabled;
-  tkhd->track_in_movie = track_in_movie;
-  tkhd->track_in_preview = track_in_preview;
-  tkhd->c_time = c_time;
-  tkhd->m_time = m_time;
-  tkhd->track_id = track_id;
-  tkhd->duration = duration;
-  tkhd->layer = layer;
-  tkhd->alternate_group = alternate_group;
-  tkhd->volume = volume;
-  for (i = 0; i < 9; i++)
-    tkhd->matrix[i] = matrix[i];
-  tkhd->width = width;
-  tkhd->height = height;
+  if ((p = take(ptr, size * len, file)) == NULL)
+    return ERR_IO;
 
+  if (p != ptr)
+    memcpy(ptr, p, size * len);
   return 0;
 }
 
+/* Get len bytes at pos, without copying if the stream is mapped. */
 static int
-read_elst(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int entry_count;
-  unsigned int segment_duration;
-  int media_time;
-  short media_rate_integer;
-  short media_rate_fraction;
-  struct elst_entry * entry;
-  struct box_elst * elst;
-  unsigned int i;
-  int ret;
+read_at(const unsigned char ** ret, long pos, size_t len,
+        unsigned char * buf, struct stream * file) {
+  const unsigned char * p;
+  int err;
 
-  ret = 0;
+  if ((err = set_pos(pos, file)) != 0)
+    return err;
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0 ||
-      (ret = mem_alloc(&entry, entry_count * sizeof(* entry))) != 0)
-    goto exit;
+  if ((p = take(buf, len, file)) == NULL)
+    return ERR_IO;
 
-  if (info->dump)
-    PRINT_U(entry_count, info);
+  * ret = p;
+  return 0;
+}
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&segment_duration, file)) != 0 ||
-        (ret = read_s32(&media_time, file)) != 0 ||
-        (ret = read_s16(&media_rate_integer, file)) != 0 ||
-        (ret = read_s16(&media_rate_fraction, file)) != 0)
-      goto free;
+static int
+put_piece(struct stream * plan, char c, long pos, long len) {
+  char buf[64];
 
-    entry[i].segment_duration = segment_duration;
-    entry[i].media_time = media_time;
-    entry[i].media_rate_integer = media_rate_integer;
-    entry[i].media_rate_fraction = media_rate_fraction;
+  if (len == 0)
+    return 0;
+  sprintf(buf, "%c %ld %ld\n", c, pos, len);
+  return write_ary(buf, strlen(buf), 1, plan);
+}
 
-    if (info->dump) {
-      PRINT_U(segment_duration, info);
-      PRINT_S(media_time, info);
-      PRINT_S(media_rate_integer, info);
-      PRINT_S(media_rate_fraction, info);
-    }
-  }
+/* Put the pending source range and the bytes stored after it in the
+   plan */
+static int
+end_splice(struct stream * file) {
+  struct splice * splice;
+  int ret;
 
-  elst = &p_box.edts->elst;
-  elst->entry_count = entry_count;
-  elst->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+  splice = file->splice;
+  if ((ret = put_piece(&splice->plan, 's', splice->src_pos,
+                       splice->src_len)) != 0 ||
+      (ret = put_piece(&splice->plan, 'h', splice->mark,
+                       file->pos - splice->mark)) != 0)
+    return ret;
+  splice->src_len = 0;
+  splice->mark = file->pos;
+  return 0;
 }
 
+/* Plan len bytes at pos of the source next, contiguous ranges as one */
 static int
-read_edts(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_ELST, 0, BOX_QTY_0_OR_1, read_elst},
-    {0, 0, 0, NULL}
-  };
-  box_t box;
-  box.edts = &p_box.trak->edts;
-  return read_box(file, info, box, funcs);
+splice_range(struct stream * file, long pos, long len) {
+  struct splice * splice;
+  int ret;
+
+  splice = file->splice;
+  if (len == 0)
+    return 0;
+  if (splice->src_len == 0 || splice->mark != file->pos ||
+      splice->src_pos + splice->src_len != pos) {
+    if ((ret = end_splice(file)) != 0)
+      return ret;
+    splice->src_pos = pos;
+  }
+  splice->src_len += len;
+  splice->src_total += len;
+  return 0;
 }
 
+/* Copy len bytes at pos of src to file, inside the kernel if the
+   backends can, else in one piece if src is mapped, else through buf of
+   COPY_BUF_SIZE bytes. */
 static int
-read_mdhd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int c_time;
-  unsigned int m_time;
-  unsigned int timescale;
-  unsigned int duration;
-  unsigned short lang_pack;
-  char lang[3];
-  struct box_mdhd * mdhd;
+copy_range(struct stream * file, long pos, long len,
+           unsigned char * buf, struct stream * src) {
+  const unsigned char * data;
+  size_t n;
   int ret;
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&c_time, file)) != 0 ||
-      (ret = read_u32(&m_time, file)) != 0 ||
-      (ret = read_u32(&timescale, file)) != 0 ||
-      (ret = read_u32(&duration, file)) != 0 ||
-      (ret = read_u16(&lang_pack, file)) != 0 ||
-      (ret = skip(file, 2)) != 0) /* pre defined */
-    return ret;
+  if (file->io == NULL) {
+    file->pos += len;
+    return 0;
+  }
 
-  lang[0] = (char) ((lang_pack >> 10) + 0x60);
-  lang[1] = (char) (((lang_pack >> 5) & 0x1f) + 0x60);
-  lang[2] = (char) ((lang_pack & 0x1f) + 0x60);
+  if (file->splice != NULL)
+    return splice_range(file, pos, len);
 
-  if (info->dump) {
-    print_u("creation time", c_time, info);
-    print_u("modification time", m_time, info);
-    PRINT_U(timescale, info);
-    PRINT_U(duration, info);
-    PRINT_C24(lang, info);
+  if (len > 0 && file->io->ops->copy_at != NULL) {
+    if ((ret = flush_file(file)) != 0 ||
+        (ret = file->io->ops->copy_at(file->io, src->io, file->pos, pos,
+                                      (size_t) len, &n)) != 0)
+      return ret;
+    file->pos += (long) n;
+    file->buf_pos = file->pos;
+    pos += (long) n;
+    len -= (long) n;
   }
 
-  mdhd = &p_box.mdia->mdhd;
-  mdhd->c_time = c_time;
-  mdhd->m_time = m_time;
-  mdhd->timescale = timescale;
-  mdhd->duration = duration;
-  memcpy(mdhd->lang, lang, sizeof(lang));
-
+  for (; len > 0; len -= (long) n, pos += (long) n) {
+    n = (size_t) len;
+    if (src->map == NULL && n > COPY_BUF_SIZE)
+      n = COPY_BUF_SIZE;
+    if ((ret = read_at(&data, pos, n, buf, src)) != 0 ||
+        (ret = write_ary(data, n, 1, file)) != 0)
+      return ret;
+  }
   return 0;
 }
 
-static int
-read_hdlr(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int type; /* handler type */
-  char * name;
-  struct box_hdlr * hdlr;
-  int ret;
+/* Reverse the bytes of the 32-bit words at src into dst as far as the
+   vector unit goes, and return how many it did */
+static size_t
+swap_words(unsigned char * dst, const unsigned char * src, size_t len) {
+  size_t i;
+#if defined(HAVE_AVX2)
+  __m256i mask;
+  __m256i v;
+
+  mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                          15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+                          11, 10, 9, 8, 15, 14, 13, 12);
+  for (i = 0; i + 8 <= len; i += 8) {
+    v = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+    _mm256_storeu_si256((__m256i *) (dst + 4 * i),
+                        _mm256_shuffle_epi8(v, mask));
+  }
+#elif defined(HAVE_SSE2)
+  __m128i v;
+
+  for (i = 0; i + 4 <= len; i += 4) {
+    v = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, 0xb1);
+    v = _mm_shufflehi_epi16(v, 0xb1);
+    _mm_storeu_si128((__m128i *) (dst + 4 * i), v);
+  }
+#elif defined(HAVE_NEON)
+  for (i = 0; i + 4 <= len; i += 4)
+    vst1q_u8(dst + 4 * i, vrev32q_u8(vld1q_u8(src + 4 * i)));
+#else
+  (void) dst;
+  (void) src;
+  (void) len;
+  i = 0;
+#endif
+  return i;
+}
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 || /* pre defined */
-      (ret = read_u32(&type, file)) != 0 ||
-      (ret = skip(file, 4 * 3)) != 0 || /* reserved */
-      (ret = read_str(&name, file)) != 0)
-    return ret;
+/* Convert len big-endian words at src */
+static void
+decode_u32s(unsigned int * dst, const unsigned char * src, size_t len) {
+  size_t i;
 
-  if (info->dump) {
-    print_box("handler_type", type, info);
-    PRINT_STR(name, info);
+  for (i = swap_words((unsigned char *) dst, src, len); i < len; i++)
+    dst[i] = (unsigned int) src[4 * i] << 24 |
+             (unsigned int) src[4 * i + 1] << 16 |
+             (unsigned int) src[4 * i + 2] << 8 |
+             (unsigned int) src[4 * i + 3];
+}
+
+static void
+encode_u32s(unsigned char * dst, const unsigned int * src, size_t len) {
+  size_t i;
+
+  for (i = swap_words(dst, (const unsigned char *) src, len); i < len; i++) {
+    dst[4 * i] = (unsigned char) (src[i] >> 24);
+    dst[4 * i + 1] = (unsigned char) (src[i] >> 16);
+    dst[4 * i + 2] = (unsigned char) (src[i] >> 8);
+    dst[4 * i + 3] = (unsigned char) src[i];
   }
+}
 
-  hdlr = &p_box.mdia->hdlr;
-  hdlr->type = type;
-  hdlr->name = name;
+/* Sum of len words, in 64-bit lanes where long has 64 bits */
+static unsigned long
+sum_words(const unsigned int * v, size_t len) {
+  unsigned long sum;
+  size_t i;
+#if ULONG_MAX > 0xffffffffUL && defined(HAVE_AVX2)
+  unsigned long lanes[4];
+  __m256i acc;
+
+  acc = _mm256_setzero_si256();
+  for (i = 0; i + 4 <= len; i += 4)
+    acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(
+                                  _mm_loadu_si128((const __m128i *) (v + i))));
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif ULONG_MAX > 0xffffffffUL && defined(HAVE_SSE2)
+  unsigned long lanes[2];
+  __m128i zero;
+  __m128i acc;
+  __m128i x;
+
+  zero = _mm_setzero_si128();
+  acc = zero;
+  for (i = 0; i + 4 <= len; i += 4) {
+    x = _mm_loadu_si128((const __m128i *) (v + i));
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(x, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(x, zero));
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  sum = lanes[0] + lanes[1];
+#elif ULONG_MAX > 0xffffffffUL && defined(HAVE_NEON)
+  uint64x2_t acc;
+
+  acc = vdupq_n_u64(0);
+  for (i = 0; i + 4 <= len; i += 4)
+    acc = vpadalq_u32(acc, vld1q_u32(v + i));
+  sum = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+#else
+  sum = 0;
+  i = 0;
+#endif
+  for (; i < len; i++)
+    sum += v[i];
+  return sum;
+}
 
+/* Read len words of a table, len up to U32_BLOCK, in place if the
+   stream is mapped or buffers them */
+static int
+read_u32s(unsigned int * ret, size_t len, struct stream * file) {
+  unsigned char raw[4 * U32_BLOCK];
+  const unsigned char * p;
+
+  if ((p = take(raw, 4 * len, file)) == NULL)
+    return ERR_IO;
+
+  decode_u32s(ret, p, len);
   return 0;
 }
 
+/* Read the next block of a table of count entries of width words
+   when entry i starts one */
 static int
-read_dref_entry(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned char self_contained;
-  char * name;
-  char * location;
-  struct box_dref * dref;
-  struct box_dref_entry * entry;
-  int ret;
+read_entries(unsigned int * block, unsigned int i, unsigned int count,
+             unsigned int width, struct stream * file) {
+  unsigned int n;
 
-  ret = 0;
+  if (i % (U32_BLOCK / width) != 0)
+    return 0;
+  n = U32_BLOCK / width;
+  if (n > count - i)
+    n = count - i;
+  return read_u32s(block, (size_t) n * width, file);
+}
 
-  if ((ret = read_ver(&version, &flags, file)) != 0)
-    goto exit;
+/* Read a table of len words into ret */
+static int
+read_table(unsigned int * ret, unsigned int len, struct stream * file) {
+  unsigned int i;
+  unsigned int n;
+  int err;
 
-  self_contained = flags & 0x1;
+  for (i = 0; i < len; i += n) {
+    n = len - i < U32_BLOCK ? len - i : U32_BLOCK;
+    if ((err = read_u32s(ret + i, n, file)) != 0)
+      return err;
+  }
+  return 0;
+}
 
-  if (info->dump)
-    PRINT_U(self_contained, info);
+static int
+read_s16(short * ret, struct stream * file) {
+  unsigned char b16[2];
+  const unsigned char * b;
 
-  dref = p_box.dref;
-  if ((ret = mem_realloc(&dref->entry, (dref->entry_count + 1) *
-                         sizeof(* dref->entry))) != 0)
-    goto exit;
+  if ((b = take(b16, sizeof(b16), file)) == NULL)
+    return ERR_IO;
 
-  entry = &dref->entry[dref->entry_count];
+  * ret = (short) ((b[0] << 8) | b[1]);
+  return 0;
+}
 
-  name = NULL;
-  location = NULL;
+static int
+read_s32(int * ret, struct stream * file) {
+  unsigned char b32[4];
+  const unsigned char * b;
 
-  if (info->type == BOX_URL) {
+  if ((b = take(b32, sizeof(b32), file)) == NULL)
+    return ERR_IO;
 
-    if (self_contained == 0) {
+  * ret = (int) ((b[0] << 24) | (b[1] << 16) |
+                 (b[2] << 8)  | b[3]);
+  return 0;
+}
 
-      if ((ret = read_str(&location, file)) != 0)
-        goto exit;
+static int
+read_u8(unsigned char * ret, struct stream * file) {
+  unsigned char b8;
+  const unsigned char * b;
 
-      if (info->dump)
-        PRINT_STR(location, info);
-    }
-  } else if (info->type == BOX_URN) {
-
-    if ((ret = read_str(&name, file)) != 0)
-      goto exit;
-    if ((ret = read_str(&location, file)) != 0)
-      goto free;
-
-    if (info->dump) {
-      PRINT_STR(name, info);
-      PRINT_STR(location, info);
-    }
-free:
-    if (ret) {
-      mem_free(name);
-      goto exit;
-    }
-  } else {
-    ret = ERR_UNK_BOX;
-    goto exit;
-  }
-  entry->type = info->type;
-  entry->self_contained = self_contained;
-  entry->name = name;
-  entry->location = location;
-
-  dref->entry_count++;
-exit:
-  return ret;
-}
+  if ((b = take(&b8, sizeof(b8), file)) == NULL)
+    return ERR_IO;
 
-static void
-free_dref_entry(struct box_dref_entry * entry) {
-  mem_free(entry->name);
-  mem_free(entry->location);
+  * ret = b[0];
+  return 0;
 }
 
 static int
-read_dref(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int entry_count;
-  struct box_func funcs[] = {
-    {BOX_URL, 0, BOX_QTY_0_TO_N, read_dref_entry},
-    {BOX_URN, 0, BOX_QTY_0_TO_N, read_dref_entry},
-    {0, 0, 0, NULL}
-  };
-  struct box_dref * dref;
-  box_t box;
-  int ret;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0)
-    return ret;
-
-  if (info->dump)
-    PRINT_U(entry_count, info);
-
-  box.dref = dref = &p_box.dinf->dref;
-  if ((ret = read_box(file, info, box, funcs)) != 0)
-    return ret;
+read_u16(unsigned short * ret, struct stream * file) {
+  unsigned char b16[2];
+  const unsigned char * b;
 
-  if (dref->entry_count != entry_count)
-    return ERR_ENTRY_COUNT;
+  if ((b = take(b16, sizeof(b16), file)) == NULL)
+    return ERR_IO;
 
+  * ret = (unsigned short) ((b[0] << 8) | b[1]);
   return 0;
 }
 
 static int
-read_dinf(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_DREF, 0, BOX_QTY_1, read_dref},
-    {0, 0, 0, NULL}
-  };
-  box_t box;
-  box.dinf = &p_box.mdia->minf.dinf;
-  return read_box(file, info, box, funcs);
-}
+read_u32(unsigned int * ret, struct stream * file) {
+  unsigned char b32[4];
+  const unsigned char * b;
 
-struct bits {
-  unsigned char * bytes;
-  unsigned int size;
-  unsigned int i; /* index of unread bytes */
-  unsigned int pos;
-  unsigned int buf;
-};
+  if ((b = take(b32, sizeof(b32), file)) == NULL)
+    return ERR_IO;
 
-static int
-read_bits_init(struct bits * bits, unsigned char * bytes, unsigned int size) {
-  if (size == 0)
-    return ERR_EMPTY_BITS;
-  bits->size = size;
-  bits->bytes = bytes;
-  bits->buf = bytes[0];
-  bits->i = 1;
-  bits->pos = 0;
+  * ret = (unsigned int) ((b[0] << 24) | (b[1] << 16) |
+                          (b[2] << 8)  | b[3]);
   return 0;
 }
 
+/* 64-bit sizes and offsets need a 64-bit long, C89 has nothing wider */
 static int
-read_code(unsigned int * ret, struct bits * bits) {
-  unsigned char * b; /* bytes */
-  unsigned int size; /* size */
-  unsigned int i; /* byte index */
-  unsigned int pos; /* bit position */
+read_u64(unsigned long * ret, struct stream * file) {
+  unsigned int hi;
+  unsigned int lo;
+  int ret_;
+
+  if ((ret_ = read_u32(&hi, file)) != 0 ||
+      (ret_ = read_u32(&lo, file)) != 0)
+    return ret_;
+
+  * ret = (unsigned long) hi << 16 << 16 | lo;
+  if (* ret >> 16 >> 16 != hi || * ret > LONG_MAX)
+    return ERR_BOX_SIZE;
+  return 0;
+}
 
-  unsigned int z; /* number of zeros */
-  unsigned int u; /* unsigned byte = byte buf */
-  unsigned int c; /* a copy of unsigned byte */
+/* In one pass, as a stream may have let go of the bytes behind it */
+static int
+read_str(char ** ret, struct arena * arena, struct stream * file) {
+  size_t len;
+  size_t capa;
+  char * str;
+  unsigned char c;
+  int err;
 
-  unsigned int l; /* last n bits */
+  str = NULL;
+  len = 0;
+  capa = 0;
+
+  do {
+    if ((err = read_u8(&c, file)) != 0)
+      return err;
+    if (len == capa) {
+      if ((err = arena_realloc(arena, &str, capa,
+                               capa ? capa * 2 : 16)) != 0)
+        return err;
+      capa = capa ? capa * 2 : 16;
+    }
+    str[len++] = (char) c;
+  } while (c != '\0');
 
-  b    = bits->bytes;
-  size = bits->size;
-  i    = bits->i;
-  pos  = bits->pos;
-  u    = bits->buf;
+  * ret = str;
+  return 0;
+}
 
-  /* read zeros */
-  z = 0;
-  u &= (unsigned int) 0xff >> pos;
-  if (u == 0) { /* the first leading '1' (bit) is not in this byte */
-    z += 8 - pos;
-    pos = 0;
-    for (;;) { /* read next byte to find the first leading '1' */
-      if (i >= size)
-        return ERR_READ_CODE; /* out of bound */
+static int
+read_ver(unsigned char * version, unsigned int * flags, struct stream * file) {
+  unsigned int b32;
+  int ret;
 
-      u = b[i++];
-      if (u)
-        break; /* the first leading '1' is found in this byte */
-      z += 8;
-    }
-  }
-  c = u << pos;
-  while ((c & 0x80) == 0) { /* read & count zeros (bit) */
-    c <<= 1;
-    z++;
-    pos++;
-  }
+  if ((ret = read_u32(&b32, file)) != 0)
+    return ret;
 
-  if (z > 32)
-    return ERR_READ_CODE; /* exceed the maximum of unsigned int */
+  * version = (unsigned char) (b32 >> 24);
+  * flags = b32 & 0x00ffffff;
+  return 0;
+}
 
-  /* first non-zero bit */
-  pos++;
+static int
+read_tag(unsigned char * ret_tag, unsigned int * ret_len,
+         struct stream * file) {
+  unsigned char tag;
+  unsigned int len;
+  unsigned char c;
+  int i;
+  int ret;
 
-  if (i + ((pos + z - 1) >> 3) > size)
-    return ERR_READ_CODE; /* out of bound */
+  if ((ret = read_u8(&tag, file)) != 0)
+    return ret;
 
-  /* last n bit */
-  if (z > 8 - pos) {
-    l = u & ((unsigned int) 0xff >> pos);
-    pos = z - (8 - pos);
-    for (; pos > 8; pos -= 8) {
-      u = b[i++];
-      l <<= 8;
-      l |= u;
-    }
-    if (pos) {
-      u = b[i++];
-      l <<= pos;
-      l |= u >> (8 - pos);
-    }
-  } else {
-    l = ((u << pos) & 0xff) >> (8 - z);
-    pos += z;
+  len = 0;
+  for (i = 0; i < 4; i++) {
+    if ((ret = read_u8(&c, file)) != 0)
+      return ret;
+    len <<= 7;
+    len |= c & 0x7f;
+    if ((c & 0x80) == 0)
+      break;
   }
+  * ret_len = len;
+  * ret_tag = tag;
+  return 0;
+}
 
-  if (z == 32 && l)
-    return ERR_READ_CODE; /* exceed the maximum of unsigned int */
-
-  if (z == 32)
-    l = 0xffffffff;
-  else
-    l += ~(0xffffffff << z);
+static int
+read_mat(int * matrix, struct stream * file) {
+  int i;
+  int ret;
 
-  bits->buf = u;
-  bits->pos = pos;
-  bits->i = i;
-  * ret = l;
+  for (i = 0; i < 9; i++)
+    if ((ret = read_s32(&matrix[i], file)) != 0)
+      return ret;
 
   return 0;
 }
 
+/* Skip what is left of the box */
 static int
-read_code_8(unsigned char * c, struct bits * bits) {
-  unsigned int n;
+skip_box(struct stream * file, struct box_info * info) {
+  long pos;
   int ret;
 
-  if ((ret = read_code(&n, bits)) != 0)
+  if ((ret = get_pos(&pos, file)) != 0 ||
+      (ret = skip(file, info->pos + (long) info->size - pos)) != 0)
     return ret;
-
-  if (n >> 8)
-    return ERR_READ_CODE;
-
-  * c = n & 0xff;
   return 0;
 }
 
 static int
-read_bit(unsigned char * ret, struct bits * bits) {
-  unsigned char * b;
+read_box(struct stream * file, struct box_info * info, box_t box,
+         struct box_func * funcs) {
+  struct box_info child;
   unsigned int size;
-  unsigned int i;
-  unsigned int pos;
-  unsigned int buf;
-  unsigned char bit;
+  unsigned char end;
+  char str[4];
+  size_t i;
+  int ret;
 
-  b    = bits->bytes;
-  size = bits->size;
-  i    = bits->i;
-  pos  = bits->pos;
-  buf  = bits->buf;
+  child.arena = info->arena;
+  child.dump = info->dump;
+  child.depth = info->depth + 1;
+  child.audio_only = info->audio_only;
 
-  if (pos == 8) {
-    if (i >= size)
-      return ERR_READ_BIT;
+  for (;;) {
+    if ((ret = get_pos(&child.pos, file)) != 0)
+      return ret;
 
-    buf = b[i++];
-    pos = 0;
-  }
+    if ((unsigned long) (child.pos - info->pos) > info->size)
+      return ERR_BOX_SIZE;
+    if ((unsigned long) (child.pos - info->pos) == info->size)
+      break;
+    if (info->type == BOX_TOP && file->io->seq) { /* of unknown size */
+      if ((ret = stream_end(&end, file)) != 0)
+        return ret;
+      if (end)
+        break;
+    }
 
-  bit = (buf & ((unsigned int) 0x80 >> pos)) != 0;
+    if ((ret = read_u32(&size, file)) != 0 ||
+        (ret = read_u32(&child.type, file)) != 0)
+      return ret;
 
-  bits->i = i;
-  bits->pos = pos + 1;
-  bits->buf = buf;
-  * ret = bit;
+    /* 1: 64-bit largesize follows, 0: box extends to the parent's end */
+    child.size = size;
+    if (size == 1 && (ret = read_u64(&child.size, file)) != 0)
+      return ret;
+    if (size == 0)
+      child.size = info->size - (unsigned long) (child.pos - info->pos);
+    if (child.size < (size == 1 ? 16UL : 8UL))
+      return ERR_BOX_SIZE;
 
-  return 0;
-}
+    for (i = 0; funcs[i].name; i++)
+      if (funcs[i].name == child.type)
+        break;
 
-static int
-read_bits(unsigned int * ret, unsigned char w, /* width */
-          struct bits * bits) {
-  unsigned char * b;
-  unsigned int size;
-  unsigned int i;
-  unsigned int pos;
-  unsigned int u; /* unsigned byte */
-  unsigned int r; /* result */
+    if (info->dump) {
+      print_spaces(info);
+      printf("[%.4s %lu]\n", box_to_str(child.type, str), child.size);
+    }
 
-  b    = bits->bytes;
-  size = bits->size;
-  i    = bits->i;
-  pos  = bits->pos;
-  u    = bits->buf;
+    if (funcs[i].name == 0)
+      return ERR_UNK_BOX;
 
-  /* width valid range: 1~32 */
-  if (w < 1 || w > 32)
-    return ERR_READ_BITS;
+    if (funcs[i].qty & (BOX_QTY_0_OR_1 | BOX_QTY_1))
+      if (funcs[i].count == 1)
+        return ERR_BOX_QTY;
 
-  if (i + ((pos + w - 1) >> 3) > size)
-    return ERR_READ_BITS; /* out of bound */
+    child.last = 0;
+    if ((ret = funcs[i].func(file, &child, box)) != 0)
+      return ret;
 
-  if (w > 8 - pos) {
-    r = u & ((unsigned int) 0xff >> pos);
-    pos = w - (8 - pos);
-    for (; pos > 8; pos -= 8) {
-      u = b[i++];
-      r <<= 8;
-      r |= u;
-    }
-    if (pos) {
-      u = b[i++];
-      r <<= pos;
-      r |= u >> (8 - pos);
-    }
-  } else {
-    r = ((u << pos) & 0xff) >> (8 - w);
-    pos += w;
+    funcs[i].count++;
+    if (child.last)
+      break;
   }
 
-  bits->i = i;
-  bits->pos = pos;
-  bits->buf = u;
-  * ret = r;
+  for (i = 0; funcs[i].name; i++)
+    if (funcs[i].qty & (BOX_QTY_1 | BOX_QTY_1_TO_N))
+      if (funcs[i].count == 0)
+        return ERR_BOX_QTY;
 
   return 0;
 }
 
 static int
-read_bits_8(unsigned char * c, unsigned char w, /* width <= 8 */
-            struct bits * bits) {
-  unsigned int n;
+read_iods(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned char tag;
+  unsigned int tag_len;
+  unsigned short object_descr_id;
+  unsigned char url_flag;
+  unsigned char include_inline_profile_level_flag;
+  unsigned char od_profile_level_idc;
+  unsigned char scene_profile_level_idc;
+  unsigned char audio_profile_level_idc;
+  unsigned char visual_profile_level_idc;
+  unsigned char graphics_profile_levvel_idc;
+  struct box_iods * iods;
+  struct initial_object_descr * iod;
   int ret;
 
-  if ((ret = read_bits(&n, w, bits)) != 0)
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_tag(&tag, &tag_len, file)) != 0)
     return ret;
 
-  * c = n & 0xff;
-  return 0;
-}
+  if (tag != TAG_MP4_IOD)
+    return ERR_UNK_TAG;
 
-/* no need to implement now */
-#if 0
-static int
-read_hrd_para(unsigned int * bi,
-              unsigned int * pos,
-              unsigned int * buf,
-              unsigned int size, unsigned char * bits) {
-  unsigned int cpb_cnt_minus1;
-#if 0
-  unsigned char bit_rate_scale;
-  unsigned char cpb_rate_scale;
-#endif
-  int ret;
+  if (info->dump) {
+    print_spaces(info);
+    printf("[InitialObjectDescr %u]\n", tag_len);
+    info->depth++;
+  }
 
-  ret = 0;
+  if ((ret = read_u16(&object_descr_id, file)) != 0)
+    return ret;
 
-  if ((ret = read_code(&cpb_cnt_minus1,
-                       bi, pos, buf, size, bits)) != 0)
-    goto exit;
+  url_flag = (unsigned char) ((object_descr_id >> 5) & 0x1);
+  include_inline_profile_level_flag =
+      (unsigned char) ((object_descr_id >> 4) & 0x1);
+  object_descr_id >>= 6;
 
-  PRINT_U(cpb_cnt_minus1, info);
+  if (info->dump) {
+    PRINT_U(object_descr_id, info);
+    PRINT_U(url_flag, info);
+    PRINT_U(include_inline_profile_level_flag, info);
+  }
 
-exit:
-  return ret;
-}
-#endif
+  if (url_flag == 0) {
+    if ((ret = read_u8(&od_profile_level_idc, file)) != 0 ||
+        (ret = read_u8(&scene_profile_level_idc, file)) != 0 ||
+        (ret = read_u8(&audio_profile_level_idc, file)) != 0 ||
+        (ret = read_u8(&visual_profile_level_idc, file)) != 0 ||
+        (ret = read_u8(&graphics_profile_levvel_idc, file)) != 0)
+      return ret;
 
-static int
-read_vui_para(struct vui * vui, struct bits * bits, struct box_info * info) {
-  unsigned char aspect_ratio_info_present_flag;
-  unsigned char aspect_ratio_idc;
+    if (info->dump) {
+      PRINT_U(od_profile_level_idc, info);
+      PRINT_U(scene_profile_level_idc, info);
+      PRINT_U(audio_profile_level_idc, info);
+      PRINT_U(visual_profile_level_idc, info);
+      PRINT_U(graphics_profile_levvel_idc, info);
+    }
+  }
 
-  unsigned char overscan_info_present_flag;
+  if (info->dump)
+    info->depth--;
 
-  unsigned char video_signal_type_present_flag;
-  unsigned char video_format;
-  unsigned char video_full_range_flag;
+  if ((ret = arena_alloc(info->arena, &iods, sizeof(* iods))) != 0)
+    return ret;
 
-  unsigned char colour_description_present_flag;
-  unsigned char colour_primaries;
-  unsigned char transfer_characteristics;
-  unsigned char matrix_coefficients;
+  iod = &iods->iod;
+  iod->object_descr_id = object_descr_id;
+  iod->url_flag = url_flag;
+  iod->include_inline_profile_level_flag = include_inline_profile_level_flag;
+  if (url_flag == 0) {
+    iod->od_profile_level_idc = od_profile_level_idc;
+    iod->scene_profile_level_idc = scene_profile_level_idc;
+    iod->audio_profile_level_idc = audio_profile_level_idc;
+    iod->visual_profile_level_idc = visual_profile_level_idc;
+    iod->graphics_profile_levvel_idc = graphics_profile_levvel_idc;
+  }
 
-  unsigned char chroma_loc_info_present_flag;
+  p_box.moov->iods = iods;
+  return 0;
+}
 
-  unsigned char timing_info_present_flag;
-  unsigned int num_units_in_tick;
-  unsigned int time_scale;
-  unsigned char fixed_frame_rate_flag;
+static int
+read_udta(struct stream * file, struct box_info * info, box_t p_box) {
+  (void) p_box;
 
-  unsigned char nal_hrd_para_present_flag;
-  unsigned char vcl_hrd_para_present_flag;
-  unsigned char pic_struct_present_flag;
+  return skip_box(file, info);
+}
 
-  unsigned char bitstream_restriction_flag;
-  unsigned char motion_vectors_over_pic_boundaries_flag;
-  unsigned char max_bytes_per_pic_denom;
-  unsigned char max_bits_per_mb_denom;
-  unsigned char log2_max_mv_length_horizontal;
-  unsigned char log2_max_mv_length_vertical;
-  unsigned int num_reorder_frames;
-  unsigned int max_dec_frame_buffering;
+static int
+read_ftyp(struct stream * file, struct box_info * info, box_t p_box) {
+  long pos;
+
+  unsigned int m_brand; /* major brand */
+  unsigned int m_version; /* minor version */
+  unsigned int * c_brands; /* compatible brands */
+
+  struct box_ftyp * ftyp;
 
+  unsigned int i;
+  unsigned int len;
   int ret;
 
   ret = 0;
 
-  if ((ret = read_bit(&aspect_ratio_info_present_flag, bits)) != 0)
+  if ((ret = read_u32(&m_brand, file)) != 0 ||
+      (ret = read_u32(&m_version, file)) != 0 ||
+      (ret = get_pos(&pos, file)) != 0)
     goto exit;
 
-  if (info->dump)
-    PRINT_U(aspect_ratio_info_present_flag, info);
-
-  if (aspect_ratio_info_present_flag) {
-    if ((ret = read_bits_8(&aspect_ratio_idc, 8, bits)) != 0)
-      goto exit;
-
-    if (info->dump) {
-      info->depth++;
-      PRINT_U(aspect_ratio_idc, info);
-      info->depth--;
-    }
-
-    if (aspect_ratio_idc == 0xff) {
-      ret = ERR_UNK_ASPECT_RATIO_IDC;
-      goto exit;
-    }
+  if (info->dump) {
+    print_box("major_brand", m_brand, info);
+    print_u("minor_version", m_version, info);
   }
 
-  if ((ret = read_bit(&overscan_info_present_flag, bits)) != 0)
-    goto exit;
-
-  if (info->dump)
-    PRINT_U(overscan_info_present_flag, info);
-
-  if (overscan_info_present_flag) {
-    ret = ERR_UNK_OVERSCAN_INFO_PRESENT_FLAG;
-    goto exit;
-  }
+  len = (unsigned int) ((info->size - (unsigned long) (pos - info->pos)) / 4);
 
-  if ((ret = read_bit(&video_signal_type_present_flag, bits)) != 0)
+  if ((ret = arena_alloc(info->arena, &c_brands,
+                         len * sizeof(c_brands[0]))) != 0)
     goto exit;
 
-  if (info->dump)
-    PRINT_U(video_signal_type_present_flag, info);
-
-  if (video_signal_type_present_flag) {
-    if ((ret = read_bits_8(&video_format, 3, bits)) != 0 ||
-        (ret = read_bit(&video_full_range_flag, bits)) != 0 ||
-        (ret = read_bit(&colour_description_present_flag, bits)) != 0)
+  for (i = 0; i < len; i++)
+    if ((ret = read_u32(&c_brands[i], file)) != 0)
       goto exit;
 
-    if (info->dump) {
-      info->depth++;
-      PRINT_U(video_format, info);
-      PRINT_U(video_full_range_flag, info);
-      PRINT_U(colour_description_present_flag, info);
-    }
+  if (info->dump)
+    for (i = 0; i < len; i++)
+      print_box("compatible brand", c_brands[i], info);
 
-    if (colour_description_present_flag) {
-      if ((ret = read_bits_8(&colour_primaries, 8, bits)) != 0 ||
-          (ret = read_bits_8(&transfer_characteristics, 8, bits)) != 0 ||
-          (ret = read_bits_8(&matrix_coefficients, 8, bits)) != 0)
-        goto exit;
+  ftyp = &p_box.top->ftyp;
+  ftyp->m_brand = m_brand;
+  ftyp->m_version = m_version;
+  ftyp->c_brands = c_brands;
+  ftyp->c_brands_len = len;
+exit:
+  return ret;
+}
+
+static int
+read_mvhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int c_time;
+  unsigned int m_time;
+  unsigned int timescale;
+  unsigned int duration;
+  int rate;
+  short volume;
+  int matrix[9];
+  unsigned int next_track_id;
+  unsigned int i;
+  struct box_mvhd * mvhd;
+  int ret;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&c_time, file)) != 0 ||
+      (ret = read_u32(&m_time, file)) != 0 ||
+      (ret = read_u32(&timescale, file)) != 0 ||
+      (ret = read_u32(&duration, file)) != 0 ||
+      (ret = read_s32(&rate, file)) != 0 ||
+      (ret = read_s16(&volume, file)) != 0 ||
+      (ret = skip(file, 2 + 4 * 2)) != 0 || /* reserved */
+      (ret = read_mat(matrix, file)) != 0 ||
+      (ret = skip(file, 4 * 6)) != 0 || /* pre defined */
+      (ret = read_u32(&next_track_id, file)) != 0)
+    return ret;
+
+  if (info->dump) {
+    print_u("creation time", c_time, info);
+    print_u("modification time", m_time, info);
+    PRINT_U(timescale, info);
+    PRINT_U(duration, info);
+    PRINT_S_16(rate, info);
+    PRINT_S_8(volume, info);
+    PRINT_MAT(matrix, info);
+    PRINT_U(next_track_id, info);
+  }
+
+  mvhd = &p_box.moov->mvhd;
+  mvhd->c_time = c_time;
+  mvhd->m_time = m_time;
+  mvhd->timescale = timescale;
+  mvhd->duration = duration;
+  mvhd->rate = rate;
+  mvhd->volume = volume;
+  for (i = 0; i < 9; i++)
+    mvhd->matrix[i] = matrix[i];
+  mvhd->next_track_id = next_track_id;
+
+  return 0;
+}
+
+static int
+read_tkhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned char track_enabled;
+  unsigned char track_in_movie;
+  unsigned char track_in_preview;
+  unsigned int c_time;
+  unsigned int m_time;
+  unsigned int track_id;
+  unsigned int duration;
+  short layer;
+  short alternate_group;
+  short volume;
+  int matrix[9];
+  unsigned int width;
+  unsigned int height;
+  unsigned int i;
+  struct box_tkhd * tkhd;
+  int ret;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&c_time, file)) != 0 ||
+      (ret = read_u32(&m_time, file)) != 0 ||
+      (ret = read_u32(&track_id, file)) != 0 ||
+      (ret = skip(file, 4)) != 0 || /* reserved */
+      (ret = read_u32(&duration, file)) != 0 ||
+      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
+      (ret = read_s16(&layer, file)) != 0 ||
+      (ret = read_s16(&alternate_group, file)) != 0 ||
+      (ret = read_s16(&volume, file)) != 0 ||
+      (ret = skip(file, 2)) != 0 || /* reserved */
+      (ret = read_mat(matrix, file)) != 0 ||
+      (ret = read_u32(&width, file)) != 0 ||
+      (ret = read_u32(&height, file)) != 0)
+    return ret;
+
+  track_enabled = flags & 0x000001;
+  track_in_movie = (flags & 0x000002) != 0;
+  track_in_preview= (flags & 0x000004) != 0;
+
+  if (info->dump) {
+    PRINT_U(track_enabled, info);
+    PRINT_U(track_in_movie, info);
+    PRINT_U(track_in_preview, info);
+    print_u("creation time", c_time, info);
+    print_u("modification time", m_time, info);
+    PRINT_U(track_id, info);
+    PRINT_U(duration, info);
+    PRINT_S(layer, info);
+    PRINT_S(alternate_group, info);
+    PRINT_S_8(volume, info);
+    PRINT_MAT(matrix, info);
+    PRINT_U_16(width, info);
+    PRINT_U_16(height, info);
+  }
+
+  tkhd = &p_box.trak->tkhd;
+  tkhd->track_enabled = track_enabled;
+  tkhd->track_in_movie = track_in_movie;
+  tkhd->track_in_preview = track_in_preview;
+  tkhd->c_time = c_time;
+  tkhd->m_time = m_time;
+  tkhd->track_id = track_id;
+  tkhd->duration = duration;
+  tkhd->layer = layer;
+  tkhd->alternate_group = alternate_group;
+  tkhd->volume = volume;
+  for (i = 0; i < 9; i++)
+    tkhd->matrix[i] = matrix[i];
+  tkhd->width = width;
+  tkhd->height = height;
+
+  return 0;
+}
+
+static int
+read_elst(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  unsigned int segment_duration;
+  int media_time;
+  short media_rate_integer;
+  short media_rate_fraction;
+  struct elst_entry * entry;
+  struct box_elst * elst;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &entry,
+                         entry_count * sizeof(* entry))) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if ((ret = read_u32(&segment_duration, file)) != 0 ||
+        (ret = read_s32(&media_time, file)) != 0 ||
+        (ret = read_s16(&media_rate_integer, file)) != 0 ||
+        (ret = read_s16(&media_rate_fraction, file)) != 0)
+      goto exit;
+
+    entry[i].segment_duration = segment_duration;
+    entry[i].media_time = media_time;
+    entry[i].media_rate_integer = media_rate_integer;
+    entry[i].media_rate_fraction = media_rate_fraction;
+
+    if (info->dump) {
+      PRINT_U(segment_duration, info);
+      PRINT_S(media_time, info);
+      PRINT_S(media_rate_integer, info);
+      PRINT_S(media_rate_fraction, info);
+    }
+  }
+
+  elst = &p_box.edts->elst;
+  elst->entry_count = entry_count;
+  elst->entry = entry;
+exit:
+  return ret;
+}
+
+static int
+read_edts(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_ELST, 0, BOX_QTY_0_OR_1, read_elst},
+    {0, 0, 0, NULL}
+  };
+  box_t box;
+  box.edts = &p_box.trak->edts;
+  return read_box(file, info, box, funcs);
+}
+
+static int
+read_mdhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int c_time;
+  unsigned int m_time;
+  unsigned int timescale;
+  unsigned int duration;
+  unsigned short lang_pack;
+  char lang[3];
+  struct box_mdhd * mdhd;
+  int ret;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&c_time, file)) != 0 ||
+      (ret = read_u32(&m_time, file)) != 0 ||
+      (ret = read_u32(&timescale, file)) != 0 ||
+      (ret = read_u32(&duration, file)) != 0 ||
+      (ret = read_u16(&lang_pack, file)) != 0 ||
+      (ret = skip(file, 2)) != 0) /* pre defined */
+    return ret;
+
+  lang[0] = (char) ((lang_pack >> 10) + 0x60);
+  lang[1] = (char) (((lang_pack >> 5) & 0x1f) + 0x60);
+  lang[2] = (char) ((lang_pack & 0x1f) + 0x60);
+
+  if (info->dump) {
+    print_u("creation time", c_time, info);
+    print_u("modification time", m_time, info);
+    PRINT_U(timescale, info);
+    PRINT_U(duration, info);
+    PRINT_C24(lang, info);
+  }
+
+  mdhd = &p_box.mdia->mdhd;
+  mdhd->c_time = c_time;
+  mdhd->m_time = m_time;
+  mdhd->timescale = timescale;
+  mdhd->duration = duration;
+  memcpy(mdhd->lang, lang, sizeof(lang));
+
+  return 0;
+}
+
+static int
+read_hdlr(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int type; /* handler type */
+  char * name;
+  struct box_hdlr * hdlr;
+  int ret;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = skip(file, 4)) != 0 || /* pre defined */
+      (ret = read_u32(&type, file)) != 0 ||
+      (ret = skip(file, 4 * 3)) != 0 || /* reserved */
+      (ret = read_str(&name, info->arena, file)) != 0)
+    return ret;
+
+  if (info->dump) {
+    print_box("handler_type", type, info);
+    PRINT_STR(name, info);
+  }
+
+  hdlr = &p_box.mdia->hdlr;
+  hdlr->type = type;
+  hdlr->name = name;
+
+  return 0;
+}
+
+static int
+read_dref_entry(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned char self_contained;
+  char * name;
+  char * location;
+  struct box_dref * dref;
+  struct box_dref_entry * entry;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0)
+    goto exit;
+
+  self_contained = flags & 0x1;
+
+  if (info->dump)
+    PRINT_U(self_contained, info);
+
+  dref = p_box.dref;
+  if ((ret = arena_realloc(info->arena, &dref->entry,
+                           dref->entry_count * sizeof(* dref->entry),
+                           (dref->entry_count + 1) *
+                           sizeof(* dref->entry))) != 0)
+    goto exit;
+
+  entry = &dref->entry[dref->entry_count];
+
+  name = NULL;
+  location = NULL;
+
+  if (info->type == BOX_URL) {
+
+    if (self_contained == 0) {
+
+      if ((ret = read_str(&location, info->arena, file)) != 0)
+        goto exit;
+
+      if (info->dump)
+        PRINT_STR(location, info);
+    }
+  } else if (info->type == BOX_URN) {
+
+    if ((ret = read_str(&name, info->arena, file)) != 0 ||
+        (ret = read_str(&location, info->arena, file)) != 0)
+      goto exit;
+
+    if (info->dump) {
+      PRINT_STR(name, info);
+      PRINT_STR(location, info);
+    }
+  } else {
+    ret = ERR_UNK_BOX;
+    goto exit;
+  }
+  entry->type = info->type;
+  entry->self_contained = self_contained;
+  entry->name = name;
+  entry->location = location;
+
+  dref->entry_count++;
+exit:
+  return ret;
+}
+
+static int
+read_dref(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  struct box_func funcs[] = {
+    {BOX_URL, 0, BOX_QTY_0_TO_N, read_dref_entry},
+    {BOX_URN, 0, BOX_QTY_0_TO_N, read_dref_entry},
+    {0, 0, 0, NULL}
+  };
+  struct box_dref * dref;
+  box_t box;
+  int ret;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0)
+    return ret;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  box.dref = dref = &p_box.dinf->dref;
+  if ((ret = read_box(file, info, box, funcs)) != 0)
+    return ret;
+
+  if (dref->entry_count != entry_count)
+    return ERR_ENTRY_COUNT;
+
+  return 0;
+}
+
+static int
+read_dinf(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_DREF, 0, BOX_QTY_1, read_dref},
+    {0, 0, 0, NULL}
+  };
+  box_t box;
+  box.dinf = &p_box.mdia->minf.dinf;
+  return read_box(file, info, box, funcs);
+}
+
+struct bits {
+  unsigned char * bytes;
+  unsigned int size;
+  unsigned int i; /* index of unread bytes */
+  unsigned int pos;
+  unsigned int buf;
+};
+
+static int
+read_bits_init(struct bits * bits, unsigned char * bytes, unsigned int size) {
+  if (size == 0)
+    return ERR_EMPTY_BITS;
+  bits->size = size;
+  bits->bytes = bytes;
+  bits->buf = bytes[0];
+  bits->i = 1;
+  bits->pos = 0;
+  return 0;
+}
+
+static int
+read_code(unsigned int * ret, struct bits * bits) {
+  unsigned char * b; /* bytes */
+  unsigned int size; /* size */
+  unsigned int i; /* byte index */
+  unsigned int pos; /* bit position */
+
+  unsigned int z; /* number of zeros */
+  unsigned int u; /* unsigned byte = byte buf */
+  unsigned int c; /* a copy of unsigned byte */
+
+  unsigned int l; /* last n bits */
+
+  b    = bits->bytes;
+  size = bits->size;
+  i    = bits->i;
+  pos  = bits->pos;
+  u    = bits->buf;
+
+  /* read zeros */
+  z = 0;
+  u &= (unsigned int) 0xff >> pos;
+  if (u == 0) { /* the first leading '1' (bit) is not in this byte */
+    z += 8 - pos;
+    pos = 0;
+    for (;;) { /* read next byte to find the first leading '1' */
+      if (i >= size)
+        return ERR_READ_CODE; /* out of bound */
+
+      u = b[i++];
+      if (u)
+        break; /* the first leading '1' is found in this byte */
+      z += 8;
+    }
+  }
+  c = u << pos;
+  while ((c & 0x80) == 0) { /* read & count zeros (bit) */
+    c <<= 1;
+    z++;
+    pos++;
+  }
+
+  if (z > 32)
+    return ERR_READ_CODE; /* exceed the maximum of unsigned int */
+
+  /* first non-zero bit */
+  pos++;
+
+  if (i + ((pos + z - 1) >> 3) > size)
+    return ERR_READ_CODE; /* out of bound */
+
+  /* last n bit */
+  if (z > 8 - pos) {
+    l = u & ((unsigned int) 0xff >> pos);
+    pos = z - (8 - pos);
+    for (; pos > 8; pos -= 8) {
+      u = b[i++];
+      l <<= 8;
+      l |= u;
+    }
+    if (pos) {
+      u = b[i++];
+      l <<= pos;
+      l |= u >> (8 - pos);
+    }
+  } else {
+    l = ((u << pos) & 0xff) >> (8 - z);
+    pos += z;
+  }
+
+  if (z == 32 && l)
+    return ERR_READ_CODE; /* exceed the maximum of unsigned int */
+
+  if (z == 32)
+    l = 0xffffffff;
+  else
+    l += ~(0xffffffff << z);
+
+  bits->buf = u;
+  bits->pos = pos;
+  bits->i = i;
+  * ret = l;
+
+  return 0;
+}
+
+static int
+read_code_8(unsigned char * c, struct bits * bits) {
+  unsigned int n;
+  int ret;
+
+  if ((ret = read_code(&n, bits)) != 0)
+    return ret;
+
+  if (n >> 8)
+    return ERR_READ_CODE;
+
+  * c = n & 0xff;
+  return 0;
+}
+
+static int
+read_bit(unsigned char * ret, struct bits * bits) {
+  unsigned char * b;
+  unsigned int size;
+  unsigned int i;
+  unsigned int pos;
+  unsigned int buf;
+  unsigned char bit;
+
+  b    = bits->bytes;
+  size = bits->size;
+  i    = bits->i;
+  pos  = bits->pos;
+  buf  = bits->buf;
+
+  if (pos == 8) {
+    if (i >= size)
+      return ERR_READ_BIT;
+
+    buf = b[i++];
+    pos = 0;
+  }
+
+  bit = (buf & ((unsigned int) 0x80 >> pos)) != 0;
+
+  bits->i = i;
+  bits->pos = pos + 1;
+  bits->buf = buf;
+  * ret = bit;
+
+  return 0;
+}
+
+static int
+read_bits(unsigned int * ret, unsigned char w, /* width */
+          struct bits * bits) {
+  unsigned char * b;
+  unsigned int size;
+  unsigned int i;
+  unsigned int pos;
+  unsigned int u; /* unsigned byte */
+  unsigned int r; /* result */
+
+  b    = bits->bytes;
+  size = bits->size;
+  i    = bits->i;
+  pos  = bits->pos;
+  u    = bits->buf;
+
+  /* width valid range: 1~32 */
+  if (w < 1 || w > 32)
+    return ERR_READ_BITS;
+
+  if (i + ((pos + w - 1) >> 3) > size)
+    return ERR_READ_BITS; /* out of bound */
+
+  if (w > 8 - pos) {
+    r = u & ((unsigned int) 0xff >> pos);
+    pos = w - (8 - pos);
+    for (; pos > 8; pos -= 8) {
+      u = b[i++];
+      r <<= 8;
+      r |= u;
+    }
+    if (pos) {
+      u = b[i++];
+      r <<= pos;
+      r |= u >> (8 - pos);
+    }
+  } else {
+    r = ((u << pos) & 0xff) >> (8 - w);
+    pos += w;
+  }
+
+  bits->i = i;
+  bits->pos = pos;
+  bits->buf = u;
+  * ret = r;
+
+  return 0;
+}
+
+static int
+read_bits_8(unsigned char * c, unsigned char w, /* width <= 8 */
+            struct bits * bits) {
+  unsigned int n;
+  int ret;
+
+  if ((ret = read_bits(&n, w, bits)) != 0)
+    return ret;
+
+  * c = n & 0xff;
+  return 0;
+}
+
+/* no need to implement now */
+#if 0
+static int
+read_hrd_para(unsigned int * bi,
+              unsigned int * pos,
+              unsigned int * buf,
+              unsigned int size, unsigned char * bits) {
+  unsigned int cpb_cnt_minus1;
+#if 0
+  unsigned char bit_rate_scale;
+  unsigned char cpb_rate_scale;
+#endif
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_code(&cpb_cnt_minus1,
+                       bi, pos, buf, size, bits)) != 0)
+    goto exit;
+
+  PRINT_U(cpb_cnt_minus1, info);
+
+exit:
+  return ret;
+}
+#endif
+
+static int
+read_vui_para(struct vui * vui, struct bits * bits, struct box_info * info) {
+  unsigned char aspect_ratio_info_present_flag;
+  unsigned char aspect_ratio_idc;
+
+  unsigned char overscan_info_present_flag;
+
+  unsigned char video_signal_type_present_flag;
+  unsigned char video_format;
+  unsigned char video_full_range_flag;
+
+  unsigned char colour_description_present_flag;
+  unsigned char colour_primaries;
+  unsigned char transfer_characteristics;
+  unsigned char matrix_coefficients;
+
+  unsigned char chroma_loc_info_present_flag;
+
+  unsigned char timing_info_present_flag;
+  unsigned int num_units_in_tick;
+  unsigned int time_scale;
+  unsigned char fixed_frame_rate_flag;
+
+  unsigned char nal_hrd_para_present_flag;
+  unsigned char vcl_hrd_para_present_flag;
+  unsigned char pic_struct_present_flag;
+
+  unsigned char bitstream_restriction_flag;
+  unsigned char motion_vectors_over_pic_boundaries_flag;
+  unsigned char max_bytes_per_pic_denom;
+  unsigned char max_bits_per_mb_denom;
+  unsigned char log2_max_mv_length_horizontal;
+  unsigned char log2_max_mv_length_vertical;
+  unsigned int num_reorder_frames;
+  unsigned int max_dec_frame_buffering;
+
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_bit(&aspect_ratio_info_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(aspect_ratio_info_present_flag, info);
+
+  if (aspect_ratio_info_present_flag) {
+    if ((ret = read_bits_8(&aspect_ratio_idc, 8, bits)) != 0)
+      goto exit;
+
+    if (info->dump) {
+      info->depth++;
+      PRINT_U(aspect_ratio_idc, info);
+      info->depth--;
+    }
+
+    if (aspect_ratio_idc == 0xff) {
+      ret = ERR_UNK_ASPECT_RATIO_IDC;
+      goto exit;
+    }
+  }
+
+  if ((ret = read_bit(&overscan_info_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(overscan_info_present_flag, info);
+
+  if (overscan_info_present_flag) {
+    ret = ERR_UNK_OVERSCAN_INFO_PRESENT_FLAG;
+    goto exit;
+  }
+
+  if ((ret = read_bit(&video_signal_type_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(video_signal_type_present_flag, info);
+
+  if (video_signal_type_present_flag) {
+    if ((ret = read_bits_8(&video_format, 3, bits)) != 0 ||
+        (ret = read_bit(&video_full_range_flag, bits)) != 0 ||
+        (ret = read_bit(&colour_description_present_flag, bits)) != 0)
+      goto exit;
+
+    if (info->dump) {
+      info->depth++;
+      PRINT_U(video_format, info);
+      PRINT_U(video_full_range_flag, info);
+      PRINT_U(colour_description_present_flag, info);
+    }
+
+    if (colour_description_present_flag) {
+      if ((ret = read_bits_8(&colour_primaries, 8, bits)) != 0 ||
+          (ret = read_bits_8(&transfer_characteristics, 8, bits)) != 0 ||
+          (ret = read_bits_8(&matrix_coefficients, 8, bits)) != 0)
+        goto exit;
+
+      if (info->dump) {
+        info->depth++;
+        PRINT_U(colour_primaries, info);
+        PRINT_U(transfer_characteristics, info);
+        PRINT_U(matrix_coefficients, info);
+        info->depth--;
+      }
+    }
+    if (info->dump)
+      info->depth--;
+  }
+
+  if ((ret = read_bit(&chroma_loc_info_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(chroma_loc_info_present_flag, info);
+
+  if (chroma_loc_info_present_flag) {
+    ret = ERR_UNK_CHROMA_LOC_INFO_PRESENT_FLAG;
+    goto exit;
+  }
+
+  if ((ret = read_bit(&timing_info_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(timing_info_present_flag, info);
+
+  if (timing_info_present_flag) {
+    if ((ret = read_bits(&num_units_in_tick, 32, bits)) != 0 ||
+        (ret = read_bits(&time_scale, 32, bits)) != 0 ||
+        (ret = read_bit(&fixed_frame_rate_flag, bits)) != 0)
+      goto exit;
+
+    if (info->dump) {
+      info->depth++;
+      PRINT_U(num_units_in_tick, info);
+      PRINT_U(time_scale, info);
+      PRINT_U(fixed_frame_rate_flag, info);
+      info->depth--;
+    }
+  }
+
+  if ((ret = read_bit(&nal_hrd_para_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(nal_hrd_para_present_flag, info);
+
+  if (nal_hrd_para_present_flag) {
+    ret = ERR_UNK_NAL_HRD_PARA_PRESENT_FLAG;
+    goto exit;
+  }
+
+  if ((ret = read_bit(&vcl_hrd_para_present_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(vcl_hrd_para_present_flag, info);
+
+  if (vcl_hrd_para_present_flag) {
+    ret = ERR_UNK_VCL_HRD_PARA_PRESENT_FLAG;
+    goto exit;
+  }
+  if (nal_hrd_para_present_flag ||
+      vcl_hrd_para_present_flag) {
+    ret = ERR_UNK_VCL_HRD_PARA_PRESENT_FLAG;
+    goto exit;
+  }
+
+  if ((ret = read_bit(&pic_struct_present_flag, bits)) != 0 ||
+      (ret = read_bit(&bitstream_restriction_flag, bits)) != 0)
+    goto exit;
+
+  if (info->dump) {
+    PRINT_U(pic_struct_present_flag, info);
+    PRINT_U(bitstream_restriction_flag, info);
+  }
+
+  if (bitstream_restriction_flag) {
+    if ((ret = read_bit(&motion_vectors_over_pic_boundaries_flag, bits)) != 0 ||
+        (ret = read_code_8(&max_bytes_per_pic_denom, bits)) != 0 ||
+        (ret = read_code_8(&max_bits_per_mb_denom, bits)) != 0 ||
+        (ret = read_code_8(&log2_max_mv_length_horizontal, bits)) != 0 ||
+        (ret = read_code_8(&log2_max_mv_length_vertical, bits)) != 0 ||
+        (ret = read_code(&num_reorder_frames, bits)) != 0 ||
+        (ret = read_code(&max_dec_frame_buffering, bits)) != 0)
+      goto exit;
+
+    if (info->dump) {
+      info->depth++;
+      PRINT_U(motion_vectors_over_pic_boundaries_flag, info);
+      PRINT_U(max_bytes_per_pic_denom, info);
+      PRINT_U(max_bits_per_mb_denom, info);
+      PRINT_U(log2_max_mv_length_horizontal, info);
+      PRINT_U(log2_max_mv_length_vertical, info);
+      PRINT_U(num_reorder_frames, info);
+      PRINT_U(max_dec_frame_buffering, info);
+      info->depth--;
+    }
+  }
+
+  vui->aspect_ratio_info_present_flag = aspect_ratio_info_present_flag;
+  if (aspect_ratio_info_present_flag)
+    vui->aspect_ratio_idc = aspect_ratio_idc;
+
+  vui->overscan_info_present_flag = overscan_info_present_flag;
+
+  vui->video_signal_type_present_flag = video_signal_type_present_flag;
+  if (video_signal_type_present_flag) {
+    vui->video_format = video_format;
+    vui->video_full_range_flag = video_full_range_flag;
+
+    vui->colour_description_present_flag = colour_description_present_flag;
+    if (colour_description_present_flag) {
+      vui->colour_primaries = colour_primaries;
+      vui->transfer_characteristics = transfer_characteristics;
+      vui->matrix_coefficients = matrix_coefficients;
+    }
+  }
+
+  vui->chroma_loc_info_present_flag = chroma_loc_info_present_flag;
+
+  vui->timing_info_present_flag = timing_info_present_flag;
+  if (timing_info_present_flag) {
+    vui->num_units_in_tick = num_units_in_tick;
+    vui->time_scale = time_scale;
+    vui->fixed_frame_rate_flag = fixed_frame_rate_flag;
+  }
+
+  vui->nal_hrd_para_present_flag = nal_hrd_para_present_flag;
+  vui->vcl_hrd_para_present_flag = vcl_hrd_para_present_flag;
+  vui->pic_struct_present_flag = pic_struct_present_flag;
+
+  vui->bitstream_restriction_flag = bitstream_restriction_flag;
+  if (bitstream_restriction_flag) {
+    vui->motion_vectors_over_pic_boundaries_flag =
+        motion_vectors_over_pic_boundaries_flag;
+    vui->max_bytes_per_pic_denom = max_bytes_per_pic_denom;
+    vui->max_bits_per_mb_denom = max_bits_per_mb_denom;
+    vui->log2_max_mv_length_horizontal = log2_max_mv_length_horizontal;
+    vui->log2_max_mv_length_vertical = log2_max_mv_length_vertical;
+    vui->num_reorder_frames = num_reorder_frames;
+    vui->max_dec_frame_buffering = max_dec_frame_buffering;
+  }
+exit:
+  return ret;
+}
+
+static int
+read_nalu(union nalu ret_nalu, unsigned int size, struct stream * file,
+          struct box_info * info) {
+  unsigned char nal_ref_idc;
+  unsigned char nal_unit_type;
+  unsigned int rbsp_size;
+  unsigned char * nalu;
+  unsigned char * rbsp;
+  struct bits bits;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = mem_alloc(&nalu, size)) != 0)
+    goto exit;
+
+  if ((ret = read_ary(nalu, size, 1, file)) != 0)
+    goto free;
+
+  nal_ref_idc = (unsigned char) ((nalu[0] >> 5) & 0x3);
+  nal_unit_type = (unsigned char) (nalu[0] & 0x1f);
+
+  if (info->dump) {
+    PRINT_U(nal_ref_idc, info);
+    PRINT_U(nal_unit_type, info);
+  }
+
+  rbsp = nalu;
+  rbsp_size = 0;
+  for (i = 1; i < size;) {
+    if (i + 2 < size && !nalu[i] && !nalu[i+1] && nalu[i+2] == 0x03) {
+      rbsp[rbsp_size++] = nalu[i++];
+      rbsp[rbsp_size++] = nalu[i++];
+      i++; /* emulation_prevention_tree_byte == 0x03 */
+    } else {
+      rbsp[rbsp_size++] = nalu[i++];
+    }
+  }
+
+  if (nal_unit_type == NAL_SPS) {
+    unsigned char profile_idc; /* AVC profile indication */
+    unsigned char profile_comp; /* profile compatibility */
+    unsigned char c_set0_flag; /* constraint set 0 flag */
+    unsigned char c_set1_flag; /* constraint set 1 flag */
+    unsigned char c_set2_flag; /* constraint set 2 flag */
+    unsigned char c_set3_flag; /* constraint set 3 flag */
+    unsigned char c_set4_flag; /* constraint set 4 flag */
+    unsigned char c_set5_flag; /* constraint set 5 flag */
+    unsigned char level_idc; /* AVC level indication */
+    unsigned char seq_para_set_id; /* seq parameter set id */
+    unsigned char log2_max_frame_num_minus4; /* MaxFrameNum used in frame_num */
+    unsigned char pic_order_cnt_type; /* to decode picture order count */
+    unsigned char log2_max_pic_order_cnt_lsb_minus4;
+    unsigned int max_num_ref_frames;
+    unsigned char gaps_in_frame_num_value_allowed_flag;
+    unsigned int pic_width_in_mbs_minus_1;
+    unsigned int pic_height_in_mbs_minus_1;
+    unsigned char frame_mbs_only_flag;
+    unsigned char mb_adaptive_frame_field_flag;
+    unsigned char direct_8x8_inference_flag;
+    unsigned char frame_cropping_flag;
+    unsigned int frame_crop_left_offset;
+    unsigned int frame_crop_right_offset;
+    unsigned int frame_crop_top_offset;
+    unsigned int frame_crop_bottom_offset;
+    unsigned char vui_para_present_flag;
+    struct sps * sps;
+
+    if ((ret = read_bits_init(&bits, rbsp, rbsp_size)) != 0 ||
+        (ret = read_bits_8(&profile_idc, 8, &bits)) != 0 ||
+        (ret = read_bits_8(&profile_comp, 8, &bits)) != 0 ||
+        (ret = read_bits_8(&level_idc, 8, &bits)) != 0 ||
+        (ret = read_code_8(&seq_para_set_id, &bits)) != 0 ||
+        (ret = read_code_8(&log2_max_frame_num_minus4, &bits)) != 0 ||
+        (ret = read_code_8(&pic_order_cnt_type, &bits)) != 0)
+      goto free;
+
+    c_set0_flag = (unsigned char) ((profile_comp >> 7) & 0x1);
+    c_set1_flag = (unsigned char) ((profile_comp >> 6) & 0x1);
+    c_set2_flag = (unsigned char) ((profile_comp >> 5) & 0x1);
+    c_set3_flag = (unsigned char) ((profile_comp >> 4) & 0x1);
+    c_set4_flag = (unsigned char) ((profile_comp >> 3) & 0x1);
+    c_set5_flag = (unsigned char) ((profile_comp >> 2) & 0x1);
+
+    if (info->dump) {
+      PRINT_U(profile_idc, info);
+      print_u("constraint_set0_flag", c_set0_flag, info);
+      print_u("constraint_set1_flag", c_set1_flag, info);
+      print_u("constraint_set2_flag", c_set2_flag, info);
+      print_u("constraint_set3_flag", c_set3_flag, info);
+      print_u("constraint_set4_flag", c_set4_flag, info);
+      print_u("constraint_set5_flag", c_set5_flag, info);
+      PRINT_U(level_idc, info);
+      PRINT_U(seq_para_set_id, info);
+      PRINT_U(log2_max_frame_num_minus4, info);
+      PRINT_U(pic_order_cnt_type, info);
+    }
+
+    if (pic_order_cnt_type == 0) {
+      if ((ret = read_code_8(&log2_max_pic_order_cnt_lsb_minus4, &bits)) != 0)
+        goto free;
+
+      if (info->dump)
+        PRINT_U(log2_max_pic_order_cnt_lsb_minus4, info);
+    } else if (pic_order_cnt_type == 2) {
+    } else {
+      ret = ERR_UNK_PIC_ORDER_CNT_TYPE;
+      goto free;
+    }
+
+    if ((ret = read_code(&max_num_ref_frames, &bits)) != 0 ||
+        (ret = read_bit(&gaps_in_frame_num_value_allowed_flag, &bits)) != 0 ||
+        (ret = read_code(&pic_width_in_mbs_minus_1, &bits)) != 0 ||
+        (ret = read_code(&pic_height_in_mbs_minus_1, &bits)) != 0 ||
+        (ret = read_bit(&frame_mbs_only_flag, &bits)) != 0)
+      goto free;
+
+    if (info->dump) {
+      PRINT_U(max_num_ref_frames, info);
+      PRINT_U(gaps_in_frame_num_value_allowed_flag, info);
+      PRINT_U(pic_width_in_mbs_minus_1, info);
+      PRINT_U(pic_height_in_mbs_minus_1, info);
+      PRINT_U(frame_mbs_only_flag, info);
+    }
+
+    if (!frame_mbs_only_flag) {
+      if ((ret = read_bit(&mb_adaptive_frame_field_flag, &bits)) != 0)
+        goto free;
+
+      if (info->dump)
+        PRINT_U(mb_adaptive_frame_field_flag, info);
+    }
+
+    if ((ret = read_bit(&direct_8x8_inference_flag, &bits)) != 0 ||
+        (ret = read_bit(&frame_cropping_flag, &bits)) != 0)
+      goto free;
+
+    if (info->dump) {
+      PRINT_U(direct_8x8_inference_flag, info);
+      PRINT_U(frame_cropping_flag, info);
+    }
+
+    if (frame_cropping_flag) {
+      if ((ret = read_code(&frame_crop_left_offset, &bits)) != 0 ||
+          (ret = read_code(&frame_crop_right_offset, &bits)) != 0 ||
+          (ret = read_code(&frame_crop_top_offset, &bits)) != 0 ||
+          (ret = read_code(&frame_crop_bottom_offset, &bits)) != 0)
+        goto free;
+
+      if (info->dump) {
+        PRINT_U(frame_crop_left_offset, info);
+        PRINT_U(frame_crop_right_offset, info);
+        PRINT_U(frame_crop_top_offset, info);
+        PRINT_U(frame_crop_bottom_offset, info);
+      }
+    }
+
+    sps = ret_nalu.sps;
+
+    if ((ret = read_bit(&vui_para_present_flag, &bits)) != 0)
+      goto free;
+
+    if (info->dump)
+      PRINT_U(vui_para_present_flag, info);
+
+    if (vui_para_present_flag) {
+
+      info->depth++;
+
+      if ((ret = read_vui_para(&sps->vui, &bits, info)) != 0)
+        goto free;
+
+      info->depth--;
+    }
+    sps->nal_ref_idc = nal_ref_idc;
+    sps->nal_unit_type = nal_unit_type;
+    sps->profile_idc = profile_idc;
+    sps->c_set0_flag = c_set0_flag;
+    sps->c_set1_flag = c_set1_flag;
+    sps->c_set2_flag = c_set2_flag;
+    sps->c_set3_flag = c_set3_flag;
+    sps->c_set4_flag = c_set4_flag;
+    sps->c_set5_flag = c_set5_flag;
+    sps->level_idc = level_idc;
+    sps->seq_para_set_id = seq_para_set_id;
+    sps->log2_max_frame_num_minus4 = log2_max_frame_num_minus4;
+    sps->pic_order_cnt_type = pic_order_cnt_type;
+
+    if (pic_order_cnt_type == 0)
+      sps->log2_max_pic_order_cnt_lsb_minus4 =
+          log2_max_pic_order_cnt_lsb_minus4;
+
+    sps->max_num_ref_frames = max_num_ref_frames;
+    sps->gaps_in_frame_num_value_allowed_flag =
+        gaps_in_frame_num_value_allowed_flag;
+    sps->pic_width_in_mbs_minus_1 = pic_width_in_mbs_minus_1;
+    sps->pic_height_in_mbs_minus_1 = pic_height_in_mbs_minus_1;
+    sps->frame_mbs_only_flag = frame_mbs_only_flag;
+
+    if (!frame_mbs_only_flag)
+      sps->mb_adaptive_frame_field_flag = mb_adaptive_frame_field_flag;
+
+    sps->direct_8x8_inference_flag = direct_8x8_inference_flag;
+    sps->frame_cropping_flag = frame_cropping_flag;
+
+    if (frame_cropping_flag) {
+      sps->frame_crop_left_offset = frame_crop_left_offset;
+      sps->frame_crop_right_offset = frame_crop_right_offset;
+      sps->frame_crop_top_offset = frame_crop_top_offset;
+      sps->frame_crop_bottom_offset = frame_crop_bottom_offset;
+    }
+    sps->vui_para_present_flag = vui_para_present_flag;
+  } else if (nal_unit_type == NAL_PPS) {
+    unsigned char pic_para_set_id;
+    unsigned char seq_para_set_id;
+    unsigned char entropy_coding_mode_flag;
+    unsigned char pic_order_present_flag;
+    unsigned char num_slice_groups_minus1;
+    unsigned char num_ref_idx_10_active_minus1;
+    unsigned char num_ref_idx_11_active_minus1;
+    unsigned char weighted_pred_flag;
+    unsigned char weighted_bipred_idc;
+    unsigned char pic_init_qp_minus26;
+    unsigned char pic_init_qs_minus26;
+    unsigned char chroma_qp_index_offset;
+    unsigned char deblocking_filter_control_present_flag;
+    unsigned char constrained_intra_pred_flag;
+    unsigned char redundant_pic_cnt_present_flag;
+    struct pps * pps;
+
+    if ((ret = read_bits_init(&bits, rbsp, rbsp_size)) != 0 ||
+        (ret = read_code_8(&pic_para_set_id, &bits)) != 0 ||
+        (ret = read_code_8(&seq_para_set_id, &bits)) != 0 ||
+        (ret = read_bit(&entropy_coding_mode_flag, &bits)) != 0 ||
+        (ret = read_bit(&pic_order_present_flag, &bits)) != 0 ||
+        (ret = read_code_8(&num_slice_groups_minus1, &bits)) != 0)
+      goto free;
+
+    if (info->dump) {
+      PRINT_U(pic_para_set_id, info);
+      PRINT_U(seq_para_set_id, info);
+      PRINT_U(entropy_coding_mode_flag, info);
+      PRINT_U(pic_order_present_flag, info);
+      PRINT_U(num_slice_groups_minus1, info);
+    }
+
+    if (num_slice_groups_minus1 > 0) {
+      ret = ERR_UNK_NUM_SLICE_GROUPS_MINUS1;
+      goto free;
+    }
+
+    if ((ret = read_code_8(&num_ref_idx_10_active_minus1, &bits)) != 0 ||
+        (ret = read_code_8(&num_ref_idx_11_active_minus1, &bits)) != 0 ||
+        (ret = read_bit(&weighted_pred_flag, &bits)) != 0 ||
+        (ret = read_bits_8(&weighted_bipred_idc, 2, &bits)) != 0 ||
+        (ret = read_code_8(&pic_init_qp_minus26, &bits)) != 0 ||
+        (ret = read_code_8(&pic_init_qs_minus26, &bits)) != 0 ||
+        (ret = read_code_8(&chroma_qp_index_offset, &bits)) != 0 ||
+        (ret = read_bit(&deblocking_filter_control_present_flag, &bits)) != 0 ||
+        (ret = read_bit(&constrained_intra_pred_flag, &bits)) != 0 ||
+        (ret = read_bit(&redundant_pic_cnt_present_flag, &bits)) != 0)
+      goto free;
+
+    if (info->dump) {
+      PRINT_U(num_ref_idx_10_active_minus1, info);
+      PRINT_U(num_ref_idx_11_active_minus1, info);
+      PRINT_U(weighted_pred_flag, info);
+      PRINT_U(weighted_bipred_idc, info);
+      PRINT_U(pic_init_qp_minus26, info);
+      PRINT_U(pic_init_qs_minus26, info);
+      PRINT_U(chroma_qp_index_offset, info);
+      PRINT_U(deblocking_filter_control_present_flag, info);
+      PRINT_U(constrained_intra_pred_flag, info);
+      PRINT_U(redundant_pic_cnt_present_flag, info);
+    }
+
+    pps = ret_nalu.pps;
+    pps->nal_ref_idc = nal_ref_idc;
+    pps->nal_unit_type = nal_unit_type;
+    pps->pic_para_set_id = pic_para_set_id;
+    pps->seq_para_set_id = seq_para_set_id;
+    pps->entropy_coding_mode_flag = entropy_coding_mode_flag;
+    pps->pic_order_present_flag = pic_order_present_flag;
+    pps->num_slice_groups_minus1 = num_slice_groups_minus1;
+    pps->num_ref_idx_10_active_minus1 = num_ref_idx_10_active_minus1;
+    pps->num_ref_idx_11_active_minus1 = num_ref_idx_11_active_minus1;
+    pps->weighted_pred_flag = weighted_pred_flag;
+    pps->weighted_bipred_idc = weighted_bipred_idc;
+    pps->pic_init_qp_minus26 = pic_init_qp_minus26;
+    pps->pic_init_qs_minus26 = pic_init_qs_minus26;
+    pps->chroma_qp_index_offset = chroma_qp_index_offset;
+    pps->deblocking_filter_control_present_flag =
+        deblocking_filter_control_present_flag;
+    pps->constrained_intra_pred_flag = constrained_intra_pred_flag;
+    pps->redundant_pic_cnt_present_flag = redundant_pic_cnt_present_flag;
+  } else {
+    ret = ERR_UNK_NAL_UNIT_TYPE;
+    goto free;
+  }
+
+free:
+  mem_free(rbsp);
+exit:
+  return ret;
+}
+
+static int
+read_avcc(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char conf_version; /* configuration version */
+  unsigned char profile_idc; /* AVC profile indication */
+  unsigned char profile_comp; /* profile compatibility */
+  unsigned char c_set0_flag; /* constraint set 0 flag */
+  unsigned char c_set1_flag; /* constraint set 1 flag */
+  unsigned char c_set2_flag; /* constraint set 2 flag */
+  unsigned char c_set3_flag; /* constraint set 3 flag */
+  unsigned char c_set4_flag; /* constraint set 4 flag */
+  unsigned char c_set5_flag; /* constraint set 5 flag */
+  unsigned char level_idc; /* AVC level indication */
+  unsigned char len_size_minus_one; /* NALU length size - 1 */
+
+  unsigned char num_of_sps; /* number of sequence parameter sets */
+  unsigned short sps_len; /* sequence parameter set length */
+
+  unsigned char num_of_pps; /* number of picture parameter sets */
+  unsigned short pps_len; /* picture parameter set length */
+
+/* no need to implement now */
+#if 0
+  unsigned char chroma_format;
+  unsigned char bit_depth_luma_minus8;
+  unsigned char bit_depth_chroma_minus8;
+
+  unsigned char num_of_sps_ext; /* number of sequence parameter set ext */
+  unsigned short sps_ext_len; /* sequence parameter set ext length */
+  unsigned char * sps_ext_nalu; /* sequence parameter set ext NALU */
+#endif
+
+  struct box_avcc * avcc;
+  struct sps * sps;
+  struct pps * pps;
+  union nalu nalu;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_u8(&conf_version, file)) != 0 ||
+      (ret = read_u8(&profile_idc, file)) != 0 ||
+      (ret = read_u8(&profile_comp, file)) != 0 ||
+      (ret = read_u8(&level_idc, file)) != 0 ||
+      (ret = read_u8(&len_size_minus_one, file)) != 0 ||
+      (ret = read_u8(&num_of_sps, file)) != 0)
+    goto exit;
+
+  c_set0_flag = (unsigned char) ((profile_comp >> 7) & 0x1);
+  c_set1_flag = (unsigned char) ((profile_comp >> 6) & 0x1);
+  c_set2_flag = (unsigned char) ((profile_comp >> 5) & 0x1);
+  c_set3_flag = (unsigned char) ((profile_comp >> 4) & 0x1);
+  c_set4_flag = (unsigned char) ((profile_comp >> 3) & 0x1);
+  c_set5_flag = (unsigned char) ((profile_comp >> 2) & 0x1);
+  len_size_minus_one = (unsigned char) (len_size_minus_one & 0x3);
+  num_of_sps = (unsigned char) (num_of_sps & 0x1f);
+
+  if (info->dump) {
+    PRINT_U(conf_version, info);
+    PRINT_U(profile_idc, info);
+    print_u("constraint_set0_flag", c_set0_flag, info);
+    print_u("constraint_set1_flag", c_set1_flag, info);
+    print_u("constraint_set2_flag", c_set2_flag, info);
+    print_u("constraint_set3_flag", c_set3_flag, info);
+    print_u("constraint_set4_flag", c_set4_flag, info);
+    print_u("constraint_set5_flag", c_set5_flag, info);
+    PRINT_U(level_idc, info);
+    PRINT_U(len_size_minus_one, info);
+    PRINT_U(num_of_sps, info);
+  }
+
+  /* sps */
+
+  if ((ret = arena_alloc(info->arena, &sps, num_of_sps * sizeof(* sps))) != 0)
+    goto exit;
+
+  for (i = 0; i < num_of_sps; i++) {
+    if ((ret = read_u16(&sps_len, file)) != 0)
+      goto exit;
+
+    if (info->dump)
+      PRINT_U(sps_len, info);
+
+    nalu.sps = &sps[i];
+
+    info->depth++;
+
+    if ((ret = read_nalu(nalu, sps_len, file, info)) != 0)
+      goto exit;
+
+    info->depth--;
+  }
+
+  /* pps */
+
+  if ((ret = read_u8(&num_of_pps, file)) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(num_of_pps, info);
+
+  if ((ret = arena_alloc(info->arena, &pps, num_of_pps * sizeof(* pps))) != 0)
+    goto exit;
+
+  for (i = 0; i < num_of_pps; i++) {
+    if ((ret = read_u16(&pps_len, file)) != 0)
+      goto exit;
+
+    if (info->dump)
+      PRINT_U(pps_len, info);
+
+    nalu.pps = &pps[i];
+
+    info->depth++;
+
+    if ((ret = read_nalu(nalu, pps_len, file, info)) != 0)
+      goto exit;
+
+    info->depth--;
+  }
+
+  if (profile_idc == 100 ||
+      profile_idc == 110 ||
+      profile_idc == 122 ||
+      profile_idc == 144) {
+    ret = ERR_UNK_PROFILE_IDC;
+    goto exit;
+  }
+
+  avcc = &p_box.vide->avcc;
+  avcc->conf_version = conf_version;
+  avcc->profile_idc = profile_idc;
+  avcc->c_set0_flag = c_set0_flag;
+  avcc->c_set1_flag = c_set1_flag;
+  avcc->c_set2_flag = c_set2_flag;
+  avcc->c_set3_flag = c_set3_flag;
+  avcc->c_set4_flag = c_set4_flag;
+  avcc->c_set5_flag = c_set5_flag;
+  avcc->level_idc = level_idc;
+  avcc->len_size_minus_one = len_size_minus_one;
+  avcc->num_of_sps = num_of_sps;
+  avcc->num_of_pps = num_of_pps;
+  avcc->sps.sps = sps;
+  avcc->pps.pps = pps;
+exit:
+  return ret;
+}
+
+static int
+read_btrt(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned int buffer_size_db;
+  unsigned int max_bitrate;
+  unsigned int avg_bitrate;
+  int ret;
+
+  (void) p_box;
+
+  if ((ret = read_u32(&buffer_size_db, file)) != 0 ||
+      (ret = read_u32(&max_bitrate, file)) != 0 ||
+      (ret = read_u32(&avg_bitrate, file)) != 0)
+    return ret;
+
+  if (info->dump) {
+    PRINT_U(buffer_size_db, info);
+    PRINT_U(max_bitrate, info);
+    PRINT_U(avg_bitrate, info);
+  }
+  return 0;
+}
+
+static void
+init_vide(struct box_vide * vide) {
+  vide->avcc.sps.sps = NULL;
+  vide->avcc.pps.pps = NULL;
+}
+
+static int
+read_vide(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned short dref_index; /* data reference index */
+  unsigned short width;
+  unsigned short height;
+  unsigned int h_rez;
+  unsigned int v_rez;
+  unsigned short frame_count;
+  unsigned char len;
+  char compressorname[32];
+  unsigned short depth;
+  struct box_func funcs[] = {
+    {BOX_AVCC, 0, BOX_QTY_1,      read_avcc},
+    {BOX_BTRT, 0, BOX_QTY_0_OR_1, read_btrt},
+    {0, 0, 0, NULL}
+  };
+  struct box_stsd * stsd;
+  struct box_vide * vide;
+  box_t box;
+  int ret;
+
+  ret = 0;
+
+  if (p_box.mdia->hdlr.type != BOX_VIDE) {
+    ret = ERR_UNK_HDLR_TYPE;
+    goto exit;
+  }
+
+  stsd = &p_box.mdia->minf.stbl.stsd;
+  if ((ret = arena_realloc(info->arena, &stsd->entry.vide,
+                           stsd->entry_count * sizeof(* stsd->entry.vide),
+                           (stsd->entry_count + 1) *
+                           sizeof(* stsd->entry.vide))) != 0)
+    goto exit;
+
+  box.vide = vide = &stsd->entry.vide[stsd->entry_count];
+
+  init_vide(vide);
+
+  if ((ret = skip(file, 6)) != 0 || /* reserved */
+      (ret = read_u16(&dref_index, file)) != 0 ||
+      (ret = skip(file, 2 + 2 + 4 * 3)) != 0 || /* pre / reserved / pre */
+      (ret = read_u16(&width, file)) != 0 ||
+      (ret = read_u16(&height, file)) != 0 ||
+      (ret = read_u32(&h_rez, file)) != 0 ||
+      (ret = read_u32(&v_rez, file)) != 0 ||
+      (ret = skip(file, 4)) != 0 || /* reserved */
+      (ret = read_u16(&frame_count, file)) != 0 ||
+      (ret = read_u8(&len, file)) != 0 ||
+      (ret = read_ary(compressorname,
+                      sizeof(compressorname) - 1, 1, file)) != 0 ||
+      (ret = read_u16(&depth, file)) != 0 ||
+      (ret = skip(file, 2)) != 0) /* pre defined */
+    goto exit;
+
+  if (len >= 32) {
+    ret = ERR_STR_LEN;
+    goto exit;
+  }
+  compressorname[len] = '\0';
+
+  if (info->dump) {
+    PRINT_U(dref_index, info);
+    PRINT_U(width, info);
+    PRINT_U(height, info);
+    PRINT_U_16(h_rez, info);
+    PRINT_U_16(v_rez, info);
+    PRINT_U(frame_count, info);
+    PRINT_STR(compressorname, info);
+    PRINT_U(depth, info);
+  }
+
+  if ((ret = read_box(file, info, box, funcs)) != 0)
+    goto exit;
+
+  vide->dref_index = dref_index;
+  vide->width = width;
+  vide->height = height;
+  vide->h_rez = h_rez;
+  vide->v_rez = v_rez;
+  vide->frame_count = frame_count;
+  memcpy(vide->compressorname, compressorname, sizeof(compressorname));
+  vide->depth = depth;
+
+  stsd->entry_count++;
+exit:
+  return ret;
+}
+
+static int
+id_to_codec(unsigned char * ret_codec, unsigned char id) {
+  struct pair {
+    unsigned char id;
+    unsigned char codec;
+  };
+  struct pair pairs[] = {
+    {OTI_AUDIO_AAC_MPEG4, CODEC_AAC} /* Audio ISO/IEC 14496-3 */
+  };
+  unsigned int i;
+
+  for (i = 0; i < sizeof(pairs)/sizeof(pairs[0]); i++)
+    if (pairs[i].id == id) {
+      * ret_codec = pairs[i].codec;
+      return 0;
+    }
+  return ERR_UNK_ID;
+}
+
+static int
+read_esds(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned char tag;
+  unsigned int tag_len;
+
+  unsigned short es_id;
+  unsigned char es_flags;
+
+  unsigned char object_type_idc;
+  unsigned char codec;
+  unsigned char stream_type;
+  unsigned char up_stream;
+  unsigned int buffer_size_db;
+  unsigned int max_bitrate;
+  unsigned int avg_bitrate;
+
+  unsigned char * bytes;
+  struct bits bits;
+
+  unsigned int audio_tag_len;
+  unsigned char audio_object_type;
+  unsigned char sampling_frequency_index;
+  unsigned int sampling_frequency;
+  unsigned char channel_configuration;
+  unsigned char channels;
+
+  unsigned char predefined;
+
+  struct box_esds * esds;
+  struct es_descr * es;
+  struct decoder_config_descr * dec;
+  struct sl_config_descr * sl;
+  struct audio_specific_config * audio;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_tag(&tag, &tag_len, file)) != 0)
+    goto exit;
+
+  if (tag != TAG_ES_DESCR) {
+    ret = ERR_UNK_TAG;
+    goto exit;
+  }
+
+  if (info->dump) {
+    print_spaces(info);
+    printf("[ES_Descr %u]\n", tag_len);
+    info->depth++;
+  }
+
+  if ((ret = read_u16(&es_id, file)) != 0 ||
+      (ret = read_u8(&es_flags, file)) != 0)
+    goto exit;
+
+  if (info->dump) {
+    PRINT_U(es_id, info);
+    PRINT_U(es_flags, info);
+  }
+
+  if (es_flags) {
+    ret = ERR_UNK_ES_FLAGS;
+    goto exit;
+  }
+
+  if ((ret = read_tag(&tag, &tag_len, file)) != 0)
+    goto exit;
+
+  if (tag != TAG_DECODER_CONFIG_DESCR) {
+    ret = ERR_UNK_TAG;
+    goto exit;
+  }
+
+  if (info->dump) {
+    print_spaces(info);
+    printf("[DecoderConfigDescr %u]\n", tag_len);
+    info->depth++;
+  }
+
+  if ((ret = read_u8(&object_type_idc, file)) != 0 ||
+      (ret = id_to_codec(&codec, object_type_idc)) != 0 ||
+      (ret = read_u32(&buffer_size_db, file)) != 0 ||
+      (ret = read_u32(&max_bitrate, file)) != 0 ||
+      (ret = read_u32(&avg_bitrate, file)) != 0 ||
+      (ret = read_tag(&tag, &tag_len, file)) != 0)
+    goto exit;
+
+  stream_type = (unsigned char) (buffer_size_db >> 26);
+  up_stream = (buffer_size_db >> 25) & 0x1;
+  buffer_size_db = buffer_size_db & 0xffffff; 
+
+  if (info->dump) {
+    PRINT_U(object_type_idc, info);
+    PRINT_U(stream_type, info);
+    PRINT_U(up_stream, info);
+    PRINT_U(buffer_size_db, info);
+    PRINT_U(max_bitrate, info);
+    PRINT_U(avg_bitrate, info);
+  }
+
+  if (tag != TAG_DEC_SPECIFIC_INFO ||
+      tag_len == 0) {
+    ret = ERR_UNK_TAG;
+    goto exit;
+  }
+
+  audio_tag_len = tag_len;
+
+  if (info->dump) {
+    print_spaces(info);
+    printf("[AudioSpecificConfig %u]\n", tag_len);
+    info->depth++;
+  }
+
+  if (codec == CODEC_AAC) {
+
+    if ((ret = mem_alloc(&bytes, tag_len)) != 0)
+      goto exit;
+
+    if ((ret = read_ary(bytes, tag_len, 1, file)) != 0 ||
+        (ret = read_bits_init(&bits, bytes, tag_len)) != 0 ||
+        (ret = read_bits_8(&audio_object_type, 5, &bits)) != 0)
+      goto free;
+
+    if (audio_object_type == 0x1f) {
+      if ((ret = read_bits_8(&audio_object_type, 6, &bits)) != 0)
+        goto free;
+      audio_object_type = (unsigned char) (audio_object_type + 0x20);
+    }
+
+    if (info->dump)
+      PRINT_U(audio_object_type, info);
+
+    if ((ret = read_bits_8(&sampling_frequency_index, 4, &bits)) != 0)
+      goto free;
+
+    if (info->dump)
+      PRINT_U(sampling_frequency_index, info);
+
+    if (sampling_frequency_index == 0xf) {
+      if ((ret = read_bits(&sampling_frequency, 24, &bits)) != 0)
+        goto free;
+
+      if (info->dump)
+        PRINT_U(sampling_frequency, info);
+    } else {
+      sampling_frequency = 0;
+    }
+
+    if ((ret = read_bits_8(&channel_configuration, 4, &bits)) != 0)
+      goto free;
+
+    if (info->dump)
+      PRINT_U(channel_configuration, info);
+
+    if (channel_configuration) {
+      channels = m4a_channels[channel_configuration-1];
+    } else {
+      ret = ERR_CHANNEL;
+      goto free;
+    }
+free:
+    mem_free(bytes);
+    if (ret)
+      goto exit;
+  } else {
+    ret = ERR_UNK_CODEC;
+    goto exit;
+  }
+
+  if (info->dump)
+    info->depth -= 2;
+
+  if ((ret = read_tag(&tag, &tag_len, file)) != 0)
+    goto exit;
+
+  if (tag != TAG_SL_CONFIG_DESCR) {
+    ret = ERR_UNK_TAG;
+    goto exit;
+  }
+
+  if (info->dump) {
+    print_spaces(info);
+    printf("[SLConfigDescr %u]\n", tag_len);
+    info->depth++;
+  }
+
+  if ((ret = read_u8(&predefined, file)) != 0)
+    goto exit;
+
+  if (info->dump) {
+    PRINT_U(predefined, info);
+    info->depth -= 2;
+  }
+
+  esds = &p_box.soun->esds;
+
+  es = &esds->es;
+  es->es_id = es_id;
+  es->es_flags = es_flags;;
+
+  dec = &es->dec_conf;
+  dec->object_type_idc = object_type_idc;
+  dec->stream_type = stream_type;
+  dec->up_stream = up_stream;
+  dec->buffer_size_db = buffer_size_db;
+  dec->max_bitrate = max_bitrate;
+  dec->avg_bitrate = avg_bitrate;
+
+  audio = &dec->audio;
+  audio->tag_len = audio_tag_len;
+  audio->audio_object_type = audio_object_type;
+  audio->sampling_frequency_index = sampling_frequency_index;
+  audio->sampling_frequency = sampling_frequency;
+  audio->channel_configuration = channel_configuration;
+  audio->channels = channels;
+
+  sl = &es->sl_conf;
+  sl->predefined = predefined;
+exit:
+  return ret;
+}
+
+static void
+init_soun(struct box_soun * soun) {
+  (void) soun;
+}
+
+static int
+read_soun(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned short dref_index; /* data reference index */
+  unsigned short channelcount;
+  unsigned short samplesize;
+  unsigned int samplerate;
+  struct box_func funcs[] = {
+    {BOX_ESDS, 0, BOX_QTY_1, read_esds},
+    {0, 0, 0, NULL}
+  };
+  struct box_stsd * stsd;
+  struct box_soun * soun;
+  box_t box;
+  int ret;
+
+  ret = 0;
+
+  if (p_box.mdia->hdlr.type != BOX_SOUN) {
+    ret = ERR_UNK_HDLR_TYPE;
+    goto exit;
+  }
+
+  stsd = &p_box.mdia->minf.stbl.stsd;
+  if ((ret = arena_realloc(info->arena, &stsd->entry.soun,
+                           stsd->entry_count * sizeof(* stsd->entry.soun),
+                           (stsd->entry_count + 1) *
+                           sizeof(* stsd->entry.soun))) != 0)
+    goto exit;
+
+  box.soun = soun = &stsd->entry.soun[stsd->entry_count];
+
+  init_soun(soun);
+
+  if ((ret = skip(file, 6)) != 0 || /* reserved */
+      (ret = read_u16(&dref_index, file)) != 0 ||
+      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
+      (ret = read_u16(&channelcount, file)) != 0 ||
+      (ret = read_u16(&samplesize, file)) != 0 ||
+      (ret = skip(file, 2 + 2)) != 0 || /* pre defined / reserved */
+      (ret = read_u32(&samplerate, file)) != 0)
+    goto exit;
+
+  if (info->dump) {
+    PRINT_U(dref_index, info);
+    PRINT_U(channelcount, info);
+    PRINT_U(samplesize, info);
+    PRINT_U_16(samplerate, info);
+  }
+
+  if ((ret = read_box(file, info, box, funcs)) != 0)
+    goto exit;
+
+  soun->dref_index = dref_index;
+  soun->channelcount = channelcount;
+  soun->samplesize = samplesize;
+  soun->samplerate = samplerate;
+
+  stsd->entry_count++;
+exit:
+  return ret;
+}
+
+static int
+read_stsd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  struct box_stsd * stsd;
+  struct box_func funcs[] = {
+    {BOX_AVC1, 0, BOX_QTY_0_TO_N, read_vide},
+    {BOX_MP4A, 0, BOX_QTY_0_TO_N, read_soun},
+    {0, 0, 0, NULL}
+  };
+  int ret;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0)
+    return ret;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  if ((ret = read_box(file, info, p_box, funcs)) != 0)
+    return ret;
+
+  stsd = &p_box.mdia->minf.stbl.stsd;
+  if (stsd->entry_count != entry_count)
+    return ERR_ENTRY_COUNT;
+
+  return 0;
+}
+
+static int
+read_stts(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  unsigned int sample_count;
+  unsigned int sample_delta;
+  struct stts_entry * entry;
+  struct box_stts * stts;
+  unsigned int block[U32_BLOCK];
+  unsigned int * w;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &entry,
+                         entry_count * sizeof(* entry))) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if ((ret = read_entries(block, i, entry_count, 2, file)) != 0)
+      goto exit;
+    w = block + i % (U32_BLOCK / 2) * 2;
+    sample_count = w[0];
+    sample_delta = w[1];
+
+    if (info->dump) {
+      print_spaces(info);
+      printf("[%u]\n", i);
+
+      info->depth++;
+
+      PRINT_U(sample_count, info);
+      PRINT_U(sample_delta, info);
+
+      info->depth--;
+    }
+
+    entry[i].sample_count = sample_count;
+    entry[i].sample_delta = sample_delta;
+  }
+
+  stts = &p_box.mdia->minf.stbl.stts;
+  stts->entry_count = entry_count;
+  stts->entry = entry;
+exit:
+  return ret;
+}
+
+static int
+read_ctts(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  unsigned int sample_count;
+  unsigned int sample_offset;
+  struct ctts_entry * entry;
+  struct box_ctts * ctts;
+  unsigned int block[U32_BLOCK];
+  unsigned int * w;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &entry,
+                         entry_count * sizeof(* entry))) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if ((ret = read_entries(block, i, entry_count, 2, file)) != 0)
+      goto exit;
+    w = block + i % (U32_BLOCK / 2) * 2;
+    sample_count = w[0];
+    sample_offset = w[1];
+
+    if (info->dump) {
+      if (entry_count <= 8 ||
+          i < 4 || i >= entry_count - 4) {
+
+        print_spaces(info);
+        printf("[%u]\n", i);
+
+        info->depth++;
+
+        PRINT_U(sample_count, info);
+        PRINT_U(sample_offset, info);
+
+        info->depth--;
+      } else if (i == 4) {
+        print_spaces(info);
+        printf("[...]\n");
+      }
+    }
+
+    entry[i].sample_count = sample_count;
+    entry[i].sample_offset = sample_offset;
+  }
+
+  ctts = &p_box.mdia->minf.stbl.ctts;
+  ctts->entry_count = entry_count;
+  ctts->entry = entry;
+exit:
+  return ret;
+}
+
+static int
+read_stsc(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  unsigned int first_chunk;
+  unsigned int samples_per_chunk;
+  unsigned int sample_desc_index;
+  struct stsc_entry * entry;
+  struct box_stsc * stsc;
+  unsigned int block[U32_BLOCK];
+  unsigned int * w;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &entry,
+                         entry_count * sizeof(* entry))) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if ((ret = read_entries(block, i, entry_count, 3, file)) != 0)
+      goto exit;
+    w = block + i % (U32_BLOCK / 3) * 3;
+    first_chunk = w[0];
+    samples_per_chunk = w[1];
+    sample_desc_index = w[2];
+
+    if (info->dump) {
+      if (entry_count <= 8 ||
+          i < 4 || i >= entry_count - 4) {
+
+        print_spaces(info);
+        printf("[%u]\n", i);
 
-      if (info->dump) {
         info->depth++;
-        PRINT_U(colour_primaries, info);
-        PRINT_U(transfer_characteristics, info);
-        PRINT_U(matrix_coefficients, info);
+
+        PRINT_U(first_chunk, info);
+        PRINT_U(samples_per_chunk, info);
+        PRINT_U(sample_desc_index, info);
+
         info->depth--;
+      } else if (i == 4) {
+        print_spaces(info);
+        printf("[...]\n");
       }
     }
-    if (info->dump)
-      info->depth--;
+
+    entry[i].first_chunk = first_chunk;
+    entry[i].samples_per_chunk = samples_per_chunk;
+    entry[i].sample_desc_index = sample_desc_index;
   }
+  stsc = &p_box.mdia->minf.stbl.stsc;
+  stsc->entry_count = entry_count;
+  stsc->entry = entry;
+exit:
+  return ret;
 
-  if ((ret = read_bit(&chroma_loc_info_present_flag, bits)) != 0)
+}
+
+static int
+read_stco(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  unsigned long * chunk_offset;
+  unsigned int * samples_per_chunk;
+  long * pos;
+  struct box_stco * stco;
+  unsigned int block[U32_BLOCK];
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &chunk_offset,
+                         entry_count * sizeof(* chunk_offset))) != 0 ||
+      (ret = arena_alloc(info->arena, &samples_per_chunk,
+                         entry_count * sizeof(* samples_per_chunk))) != 0 ||
+      (ret = arena_alloc(info->arena, &pos,
+                         entry_count * sizeof(* pos))) != 0)
+    goto exit;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if (info->type == BOX_CO64) {
+      if ((ret = read_u64(&chunk_offset[i], file)) != 0)
+        goto exit;
+    } else {
+      if ((ret = read_entries(block, i, entry_count, 1, file)) != 0)
+        goto exit;
+      chunk_offset[i] = block[i % U32_BLOCK];
+    }
+
+    if (info->dump) {
+      if (entry_count <= 10 ||
+          i < 5 || i >= entry_count - 5) {
+        print_spaces(info);
+        printf("[%u] chunk_offset:            %lu\n", i, chunk_offset[i]);
+      } else if (i == 5) {
+        print_spaces(info);
+        printf("[...]\n");
+      }
+    }
+  }
+  stco = &p_box.mdia->minf.stbl.stco;
+  stco->entry_count = entry_count;
+  stco->chunk_offset = chunk_offset;
+  stco->samples_per_chunk = samples_per_chunk;
+  stco->pos = pos;
+exit:
+  return ret;
+}
+
+static int
+read_stsz(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int sample_size;
+  unsigned int sample_count;
+  unsigned int * entry_size;
+  struct box_stsz * stsz;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&sample_size, file)) != 0 ||
+      (ret = read_u32(&sample_count, file)) != 0)
+    goto exit;
+
+  if (info->dump) {
+    PRINT_U(sample_size, info);
+    PRINT_U(sample_count, info);
+  }
+
+  if (sample_size == 0) {
+
+    if ((ret = arena_alloc(info->arena, &entry_size,
+                           sample_count * sizeof(* entry_size))) != 0 ||
+        (ret = read_table(entry_size, sample_count, file)) != 0)
+      goto exit;
+
+    for (i = 0; info->dump && i < sample_count; i++) {
+      if (sample_count <= 10 ||
+          i < 5 || i >= sample_count - 5) {
+        print_spaces(info);
+        printf("[%u] entry_size:            %u\n", i, entry_size[i]);
+      } else if (i == 5) {
+        print_spaces(info);
+        printf("[...]\n");
+      }
+    }
+  } else {
+    entry_size = NULL; /* see get_sample_size */
+  }
+  stsz = &p_box.mdia->minf.stbl.stsz;
+  stsz->sample_size = sample_size;
+  stsz->sample_count = sample_count;
+  stsz->entry_size = entry_size;
+exit:
+  return ret;
+}
+
+static int
+read_stss(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int entry_count;
+  unsigned int * sample_number;
+  struct box_stss * stss;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&entry_count, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &sample_number,
+                         entry_count * sizeof(* sample_number))) != 0 ||
+      (ret = read_table(sample_number, entry_count, file)) != 0)
     goto exit;
 
-  if (info->dump)
-    PRINT_U(chroma_loc_info_present_flag, info);
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; info->dump && i < entry_count; i++) {
+    if (entry_count <= 10 ||
+        i < 5 || i >= entry_count - 5) {
+      print_spaces(info);
+      printf("[%u] sample_number:            %u\n", i, sample_number[i]);
+    } else if (i == 5) {
+      print_spaces(info);
+      printf("[...]\n");
+    }
+  }
+  stss = &p_box.mdia->minf.stbl.stss;
+  stss->entry_count = entry_count;
+  stss->sample_number = sample_number;
+exit:
+  return ret;
+}
+
+static int
+read_sgpd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int grouping_type;
+  unsigned int default_length;
+  unsigned int entry_count;
+  short roll_distance;
+  unsigned int i;
+  int ret;
+
+  (void) p_box;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&grouping_type, file)) != 0)
+    return ret;
+
+  if (info->dump)
+    print_box("grouping_type", grouping_type, info);
+
+  if (version == 1) {
+    if ((ret = read_u32(&default_length, file)) != 0)
+      return ret;
+
+    if (info->dump)
+      PRINT_U(default_length, info);
+  }
+
+  if ((ret = read_u32(&entry_count, file)) != 0)
+    return ret;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if ((ret = read_s16(&roll_distance, file)) != 0)
+      return ret;
+
+    if (info->dump)
+      PRINT_S(roll_distance, info);
+  }
+  return 0;
+}
+
+static int
+read_sbgp(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int grouping_type;
+  unsigned int entry_count;
+  unsigned int sample_count;
+  unsigned int group_desc_index;
+  unsigned int i;
+  int ret;
+
+  (void) p_box;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&grouping_type, file)) != 0)
+    return ret;
+
+  if (info->dump)
+    print_box("grouping_type", grouping_type, info);
+
+  if ((ret = read_u32(&entry_count, file)) != 0)
+    return ret;
+
+  if (info->dump)
+    PRINT_U(entry_count, info);
+
+  for (i = 0; i < entry_count; i++) {
+    if ((ret = read_u32(&sample_count, file)) != 0 ||
+        (ret = read_u32(&group_desc_index, file)) != 0)
+      return ret;
+
+    if (info->dump) {
+      PRINT_U(sample_count, info);
+      PRINT_U(group_desc_index, info);
+    }
+  }
+  return 0;
+}
+
+static int
+read_stbl(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_STSD, 0, BOX_QTY_1,      read_stsd},
+    {BOX_STTS, 0, BOX_QTY_1,      read_stts},
+    {BOX_CTTS, 0, BOX_QTY_0_OR_1, read_ctts},
+    {BOX_STSC, 0, BOX_QTY_1,      read_stsc},
+    {BOX_STCO, 0, BOX_QTY_0_OR_1, read_stco},
+    {BOX_CO64, 0, BOX_QTY_0_OR_1, read_stco},
+    {BOX_STSZ, 0, BOX_QTY_1,      read_stsz},
+    {BOX_STSS, 0, BOX_QTY_0_OR_1, read_stss},
+    {BOX_SGPD, 0, BOX_QTY_0_TO_N, read_sgpd},
+    {BOX_SBGP, 0, BOX_QTY_0_TO_N, read_sbgp},
+    {0, 0, 0, NULL}
+  };
+  int ret;
+
+  if ((ret = read_box(file, info, p_box, funcs)) != 0)
+    return ret;
+
+  /* chunk offsets come from exactly one of stco and co64 */
+  if (funcs[4].count + funcs[5].count != 1)
+    return ERR_BOX_QTY;
+  return 0;
+}
+
+static int
+read_vmhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned short graphicsmode;
+  unsigned short opcolor[3];
+  struct box_vmhd * vmhd;
+  unsigned int i;
+  int ret;
 
-  if (chroma_loc_info_present_flag) {
-    ret = ERR_UNK_CHROMA_LOC_INFO_PRESENT_FLAG;
+  ret = 0;
+
+  if (p_box.mdia->hdlr.type != BOX_VIDE) {
+    ret = ERR_UNK_HDLR_TYPE;
     goto exit;
   }
 
-  if ((ret = read_bit(&timing_info_present_flag, bits)) != 0)
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u16(&graphicsmode, file)) != 0 ||
+      (ret = arena_alloc(info->arena, &vmhd, sizeof(* vmhd))) != 0)
     goto exit;
 
   if (info->dump)
-    PRINT_U(timing_info_present_flag, info);
+    PRINT_U(graphicsmode, info);
 
-  if (timing_info_present_flag) {
-    if ((ret = read_bits(&num_units_in_tick, 32, bits)) != 0 ||
-        (ret = read_bits(&time_scale, 32, bits)) != 0 ||
-        (ret = read_bit(&fixed_frame_rate_flag, bits)) != 0)
+  for (i = 0; i < 3; i++)
+    if ((ret = read_u16(&opcolor[i], file)) != 0)
       goto exit;
 
-    if (info->dump) {
-      info->depth++;
-      PRINT_U(num_units_in_tick, info);
-      PRINT_U(time_scale, info);
-      PRINT_U(fixed_frame_rate_flag, info);
-      info->depth--;
-    }
+  if (info->dump) {
+    print_u("opcolor[0]", opcolor[0], info);
+    print_u("opcolor[1]", opcolor[1], info);
+    print_u("opcolor[2]", opcolor[2], info);
   }
 
-  if ((ret = read_bit(&nal_hrd_para_present_flag, bits)) != 0)
-    goto exit;
+  vmhd->graphicsmode = graphicsmode;
 
-  if (info->dump)
-    PRINT_U(nal_hrd_para_present_flag, info);
+  for (i = 0; i < 3; i++)
+    vmhd->opcolor[i] = opcolor[i];
 
-  if (nal_hrd_para_present_flag) {
-    ret = ERR_UNK_NAL_HRD_PARA_PRESENT_FLAG;
+  p_box.mdia->minf.hd.vmhd = vmhd;
+exit:
+  return ret;
+}
+
+static int
+read_smhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  short balance;
+  struct box_smhd * smhd;
+  int ret;
+
+  ret = 0;
+
+  if (p_box.mdia->hdlr.type != BOX_SOUN) {
+    ret = ERR_UNK_HDLR_TYPE;
     goto exit;
   }
 
-  if ((ret = read_bit(&vcl_hrd_para_present_flag, bits)) != 0)
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_s16(&balance, file)) != 0 ||
+      (ret = skip(file, 2)) != 0 || /* reserved */
+      (ret = arena_alloc(info->arena, &smhd, sizeof(* smhd))) != 0)
     goto exit;
 
   if (info->dump)
-    PRINT_U(vcl_hrd_para_present_flag, info);
+    PRINT_S_8(balance, info);
 
-  if (vcl_hrd_para_present_flag) {
-    ret = ERR_UNK_VCL_HRD_PARA_PRESENT_FLAG;
-    goto exit;
-  }
-  if (nal_hrd_para_present_flag ||
-      vcl_hrd_para_present_flag) {
-    ret = ERR_UNK_VCL_HRD_PARA_PRESENT_FLAG;
+  smhd->balance = balance;
+
+  p_box.mdia->minf.hd.smhd = smhd;
+exit:
+  return ret;
+}
+
+static int
+read_minf(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_DINF, 0, BOX_QTY_1,      read_dinf},
+    {BOX_STBL, 0, BOX_QTY_1,      read_stbl},
+    {BOX_VMHD, 0, BOX_QTY_0_OR_1, read_vmhd},
+    {BOX_SMHD, 0, BOX_QTY_0_OR_1, read_smhd},
+    {0, 0, 0, NULL}
+  };
+  unsigned int type;
+
+  /* codec config and sample tables of a track extract_audio drops */
+  type = p_box.mdia->hdlr.type;
+  if (info->audio_only && type != BOX_NIL && type != BOX_SOUN)
+    return skip_box(file, info);
+  return read_box(file, info, p_box, funcs);
+}
+
+static int
+read_mdia(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_MDHD, 0, BOX_QTY_1, read_mdhd},
+    {BOX_HDLR, 0, BOX_QTY_1, read_hdlr},
+    {BOX_MINF, 0, BOX_QTY_1, read_minf},
+    {0, 0, 0, NULL}
+  };
+  box_t box;
+  box.mdia = &p_box.trak->mdia;
+  return read_box(file, info, box, funcs);
+}
+
+static void
+init_trak(struct box_trak * trak) {
+  trak->edts.elst.entry = NULL;
+  trak->edts.elst.entry_count = 0;
+  trak->mdia.hdlr.name = NULL;
+  trak->mdia.hdlr.type = BOX_NIL;
+  trak->mdia.minf.dinf.dref.entry = NULL;
+  trak->mdia.minf.dinf.dref.entry_count = 0;
+  trak->mdia.minf.stbl.stsd.entry.vide = NULL;
+  trak->mdia.minf.stbl.stsd.entry_count = 0;
+  trak->mdia.minf.stbl.stts.entry = NULL;
+  trak->mdia.minf.stbl.stts.entry_count = 0;
+  trak->mdia.minf.stbl.stts.capa = 0;
+  trak->mdia.minf.stbl.stts.start = NULL;
+  trak->mdia.minf.stbl.stts.time = NULL;
+  trak->mdia.minf.stbl.ctts.entry = NULL;
+  trak->mdia.minf.stbl.ctts.entry_count = 0;
+  trak->mdia.minf.stbl.ctts.capa = 0;
+  trak->mdia.minf.stbl.ctts.start = NULL;
+  trak->mdia.minf.stbl.stsc.entry = NULL;
+  trak->mdia.minf.stbl.stsc.entry_count = 0;
+  trak->mdia.minf.stbl.stsc.capa = 0;
+  trak->mdia.minf.stbl.stsc.start = NULL;
+  trak->mdia.minf.stbl.stco.chunk_offset = NULL;
+  trak->mdia.minf.stbl.stco.samples_per_chunk = NULL;
+  trak->mdia.minf.stbl.stco.pos = NULL;
+  trak->mdia.minf.stbl.stco.size = NULL;
+  trak->mdia.minf.stbl.stco.entry_count = 0;
+  trak->mdia.minf.stbl.stco.capa = 0;
+  trak->mdia.minf.stbl.stco.large = 0;
+  trak->mdia.minf.stbl.stsz.entry_size = NULL;
+  trak->mdia.minf.stbl.stsz.sample_count = 0;
+  trak->mdia.minf.stbl.stsz.capa = 0;
+  trak->mdia.minf.stbl.stss.sample_number = NULL;
+  trak->mdia.minf.stbl.stss.entry_count = 0;
+  trak->mdia.minf.hd.vmhd = NULL;
+  trak->trex.sample_desc_index = 1;
+  trak->trex.sample_duration = 0;
+  trak->trex.sample_size = 0;
+  trak->trex.sample_flags = 0;
+  trak->decode_time = 0;
+  trak->timed = 0;
+}
+
+static int
+read_trak(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_TKHD, 0, BOX_QTY_1,      read_tkhd},
+    {BOX_EDTS, 0, BOX_QTY_0_OR_1, read_edts},
+    {BOX_MDIA, 0, BOX_QTY_1,      read_mdia},
+    {0, 0, 0, NULL}
+  };
+  struct box_moov * moov;
+  struct box_trak * trak;
+  box_t box;
+  int ret;
+
+  ret = 0;
+
+  moov = p_box.moov;
+  if ((ret = arena_realloc(info->arena, &moov->trak,
+                           moov->trak_len * sizeof(* moov->trak),
+                           (moov->trak_len + 1) * sizeof(* moov->trak))) != 0)
     goto exit;
-  }
 
-  if ((ret = read_bit(&pic_struct_present_flag, bits)) != 0 ||
-      (ret = read_bit(&bitstream_restriction_flag, bits)) != 0)
+  box.trak = trak = &moov->trak[moov->trak_len];
+
+  init_trak(trak);
+
+  if ((ret = read_box(file, info, box, funcs)) != 0)
     goto exit;
 
-  if (info->dump) {
-    PRINT_U(pic_struct_present_flag, info);
-    PRINT_U(bitstream_restriction_flag, info);
-  }
+  moov->trak_len++;
+exit:
+  return ret;
+}
 
-  if (bitstream_restriction_flag) {
-    if ((ret = read_bit(&motion_vectors_over_pic_boundaries_flag, bits)) != 0 ||
-        (ret = read_code_8(&max_bytes_per_pic_denom, bits)) != 0 ||
-        (ret = read_code_8(&max_bits_per_mb_denom, bits)) != 0 ||
-        (ret = read_code_8(&log2_max_mv_length_horizontal, bits)) != 0 ||
-        (ret = read_code_8(&log2_max_mv_length_vertical, bits)) != 0 ||
-        (ret = read_code(&num_reorder_frames, bits)) != 0 ||
-        (ret = read_code(&max_dec_frame_buffering, bits)) != 0)
-      goto exit;
+static struct box_trak *
+find_trak(struct box_moov * moov, unsigned int track_id) {
+  unsigned int i;
 
-    if (info->dump) {
-      info->depth++;
-      PRINT_U(motion_vectors_over_pic_boundaries_flag, info);
-      PRINT_U(max_bytes_per_pic_denom, info);
-      PRINT_U(max_bits_per_mb_denom, info);
-      PRINT_U(log2_max_mv_length_horizontal, info);
-      PRINT_U(log2_max_mv_length_vertical, info);
-      PRINT_U(num_reorder_frames, info);
-      PRINT_U(max_dec_frame_buffering, info);
-      info->depth--;
-    }
-  }
+  for (i = 0; i < moov->trak_len; i++)
+    if (moov->trak[i].tkhd.track_id == track_id)
+      return &moov->trak[i];
+  return NULL;
+}
 
-  vui->aspect_ratio_info_present_flag = aspect_ratio_info_present_flag;
-  if (aspect_ratio_info_present_flag)
-    vui->aspect_ratio_idc = aspect_ratio_idc;
+static int
+read_mehd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned long fragment_duration;
+  unsigned int duration32;
+  int ret;
 
-  vui->overscan_info_present_flag = overscan_info_present_flag;
+  (void) p_box;
 
-  vui->video_signal_type_present_flag = video_signal_type_present_flag;
-  if (video_signal_type_present_flag) {
-    vui->video_format = video_format;
-    vui->video_full_range_flag = video_full_range_flag;
+  if ((ret = read_ver(&version, &flags, file)) != 0)
+    return ret;
 
-    vui->colour_description_present_flag = colour_description_present_flag;
-    if (colour_description_present_flag) {
-      vui->colour_primaries = colour_primaries;
-      vui->transfer_characteristics = transfer_characteristics;
-      vui->matrix_coefficients = matrix_coefficients;
-    }
+  if (version == 1) {
+    if ((ret = read_u64(&fragment_duration, file)) != 0)
+      return ret;
+  } else {
+    if ((ret = read_u32(&duration32, file)) != 0)
+      return ret;
+    fragment_duration = duration32;
   }
 
-  vui->chroma_loc_info_present_flag = chroma_loc_info_present_flag;
+  if (info->dump)
+    PRINT_LU(fragment_duration, info);
+  return 0;
+}
 
-  vui->timing_info_present_flag = timing_info_present_flag;
-  if (timing_info_present_flag) {
-    vui->num_units_in_tick = num_units_in_tick;
-    vui->time_scale = time_scale;
-    vui->fixed_frame_rate_flag = fixed_frame_rate_flag;
-  }
+static int
+read_trex(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int track_id;
+  struct box_trex trex;
+  struct box_trak * trak;
+  int ret;
 
-  vui->nal_hrd_para_present_flag = nal_hrd_para_present_flag;
-  vui->vcl_hrd_para_present_flag = vcl_hrd_para_present_flag;
-  vui->pic_struct_present_flag = pic_struct_present_flag;
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&track_id, file)) != 0 ||
+      (ret = read_u32(&trex.sample_desc_index, file)) != 0 ||
+      (ret = read_u32(&trex.sample_duration, file)) != 0 ||
+      (ret = read_u32(&trex.sample_size, file)) != 0 ||
+      (ret = read_u32(&trex.sample_flags, file)) != 0)
+    return ret;
 
-  vui->bitstream_restriction_flag = bitstream_restriction_flag;
-  if (bitstream_restriction_flag) {
-    vui->motion_vectors_over_pic_boundaries_flag =
-        motion_vectors_over_pic_boundaries_flag;
-    vui->max_bytes_per_pic_denom = max_bytes_per_pic_denom;
-    vui->max_bits_per_mb_denom = max_bits_per_mb_denom;
-    vui->log2_max_mv_length_horizontal = log2_max_mv_length_horizontal;
-    vui->log2_max_mv_length_vertical = log2_max_mv_length_vertical;
-    vui->num_reorder_frames = num_reorder_frames;
-    vui->max_dec_frame_buffering = max_dec_frame_buffering;
+  if (info->dump) {
+    PRINT_U(track_id, info);
+    print_u("sample_desc_index", trex.sample_desc_index, info);
+    print_u("sample_duration", trex.sample_duration, info);
+    print_u("sample_size", trex.sample_size, info);
+    print_u("sample_flags", trex.sample_flags, info);
   }
-exit:
-  return ret;
+
+  if ((trak = find_trak(p_box.moov, track_id)) == NULL)
+    return ERR_TRACK_ID;
+  trak->trex = trex;
+  return 0;
+}
+
+static int
+read_mvex(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_MEHD, 0, BOX_QTY_0_OR_1, read_mehd},
+    {BOX_TREX, 0, BOX_QTY_0_TO_N, read_trex},
+    {0, 0, 0, NULL}
+  };
+  p_box.moov->fragmented = 1;
+  return read_box(file, info, p_box, funcs);
+}
+
+static int
+read_moov(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_MVHD, 0, BOX_QTY_1,      read_mvhd},
+    {BOX_TRAK, 0, BOX_QTY_1_TO_N, read_trak},
+    {BOX_IODS, 0, BOX_QTY_0_OR_1, read_iods},
+    {BOX_UDTA, 0, BOX_QTY_0_TO_N, read_udta},
+    {BOX_MVEX, 0, BOX_QTY_0_OR_1, read_mvex},
+    {0, 0, 0, NULL}
+  };
+  box_t box;
+  box.moov = &p_box.top->moov;
+  return read_box(file, info, box, funcs);
 }
 
+/* Copy the runs that lie in the mdat of info out of a pipe, in input
+   order. Those past it are left for the next. */
 static int
-read_nalu(union nalu ret_nalu, unsigned int size, FILE * file,
-          struct box_info * info) {
-  unsigned char nal_ref_idc;
-  unsigned char nal_unit_type;
-  unsigned int rbsp_size;
-  unsigned char * nalu;
-  unsigned char * rbsp;
-  struct bits bits;
+copy_runs(struct stream * file, struct box_info * info,
+          struct box_mdat * mdat) {
+  struct frag_run run;
   unsigned int i;
+  unsigned int k;
+  size_t capa;
+  long end;
+  long pos;
   int ret;
 
-  ret = 0;
-
-  if ((ret = mem_alloc(&nalu, size)) != 0)
-    goto exit;
+  for (i = 1; i < mdat->run_len; i++) { /* trafs may be in any order */
+    run = mdat->run[i];
+    for (k = i; k > 0 && mdat->run[k - 1].src > run.src; k--)
+      mdat->run[k] = mdat->run[k - 1];
+    mdat->run[k] = run;
+  }
 
-  if ((ret = read_ary(nalu, size, 1, file)) != 0)
-    goto free;
+  end = info->pos + (long) info->size;
+  for (i = 0; i < mdat->run_len && mdat->run[i].src < end; i++) {
+    run = mdat->run[i];
+    if ((ret = get_pos(&pos, file)) != 0)
+      return ret;
+    if (run.src < pos || run.len > end - run.src) /* behind or split */
+      return ERR_STREAM_FRAG;
+
+    if ((size_t) (run.dst + run.len) > mdat->capa) {
+      capa = mdat->capa ? mdat->capa : COPY_BUF_SIZE;
+      while (capa < (size_t) (run.dst + run.len))
+        capa *= 2;
+      if ((ret = mem_realloc(&mdat->bytes, capa)) != 0)
+        return ret;
+      mdat->capa = capa;
+    }
+    if ((ret = skip(file, run.src - pos)) != 0 ||
+        (ret = read_ary(mdat->bytes + run.dst, 1, (size_t) run.len,
+                        file)) != 0)
+      return ret;
+  }
 
-  nal_ref_idc = (unsigned char) ((nalu[0] >> 5) & 0x3);
-  nal_unit_type = (unsigned char) (nalu[0] & 0x1f);
+  mdat->run_len -= i;
+  memmove(mdat->run, mdat->run + i, mdat->run_len * sizeof(* mdat->run));
+  return 0;
+}
 
-  if (info->dump) {
-    PRINT_U(nal_ref_idc, info);
-    PRINT_U(nal_unit_type, info);
-  }
+static int
+read_mdat(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_moov * moov;
+  struct box_mdat * mdat;
+  unsigned int i;
+  int ret;
 
-  rbsp = nalu;
-  rbsp_size = 0;
-  for (i = 1; i < size;) {
-    if (i + 2 < size && !nalu[i] && !nalu[i+1] && nalu[i+2] == 0x03) {
-      rbsp[rbsp_size++] = nalu[i++];
-      rbsp[rbsp_size++] = nalu[i++];
-      i++; /* emulation_prevention_tree_byte == 0x03 */
-    } else {
-      rbsp[rbsp_size++] = nalu[i++];
+  moov = &p_box.top->moov;
+  mdat = &p_box.top->mdat;
+
+  /* a pipe can't come back: samples of a progressive file are read from
+     here on while writing, so moov must be known already and nothing
+     after mdat is parsed. Those of fragments are copied out first. */
+  if (file->io->seq) {
+    if (moov->trak == NULL)
+      return ERR_STREAM_ORDER;
+    if (mdat->copied && (ret = copy_runs(file, info, mdat)) != 0)
+      return ret;
+    if (!mdat->fragments) {
+      for (i = 0; i < moov->trak_len; i++)
+        if (moov->trak[i].mdia.minf.stbl.stsz.sample_count)
+          break;
+      if (moov->fragmented && i == moov->trak_len)
+        return ERR_STREAM_FRAG; /* before the moof of its samples */
+      info->last = 1;
     }
   }
 
-  if (nal_unit_type == NAL_SPS) {
-    unsigned char profile_idc; /* AVC profile indication */
-    unsigned char profile_comp; /* profile compatibility */
-    unsigned char c_set0_flag; /* constraint set 0 flag */
-    unsigned char c_set1_flag; /* constraint set 1 flag */
-    unsigned char c_set2_flag; /* constraint set 2 flag */
-    unsigned char c_set3_flag; /* constraint set 3 flag */
-    unsigned char c_set4_flag; /* constraint set 4 flag */
-    unsigned char c_set5_flag; /* constraint set 5 flag */
-    unsigned char level_idc; /* AVC level indication */
-    unsigned char seq_para_set_id; /* seq parameter set id */
-    unsigned char log2_max_frame_num_minus4; /* MaxFrameNum used in frame_num */
-    unsigned char pic_order_cnt_type; /* to decode picture order count */
-    unsigned char log2_max_pic_order_cnt_lsb_minus4;
-    unsigned int max_num_ref_frames;
-    unsigned char gaps_in_frame_num_value_allowed_flag;
-    unsigned int pic_width_in_mbs_minus_1;
-    unsigned int pic_height_in_mbs_minus_1;
-    unsigned char frame_mbs_only_flag;
-    unsigned char mb_adaptive_frame_field_flag;
-    unsigned char direct_8x8_inference_flag;
-    unsigned char frame_cropping_flag;
-    unsigned int frame_crop_left_offset;
-    unsigned int frame_crop_right_offset;
-    unsigned int frame_crop_top_offset;
-    unsigned int frame_crop_bottom_offset;
-    unsigned char vui_para_present_flag;
-    struct sps * sps;
-
-    if ((ret = read_bits_init(&bits, rbsp, rbsp_size)) != 0 ||
-        (ret = read_bits_8(&profile_idc, 8, &bits)) != 0 ||
-        (ret = read_bits_8(&profile_comp, 8, &bits)) != 0 ||
-        (ret = read_bits_8(&level_idc, 8, &bits)) != 0 ||
-        (ret = read_code_8(&seq_para_set_id, &bits)) != 0 ||
-        (ret = read_code_8(&log2_max_frame_num_minus4, &bits)) != 0 ||
-        (ret = read_code_8(&pic_order_cnt_type, &bits)) != 0)
-      goto free;
+  if ((ret = skip_box(file, info)) != 0)
+    return ret;
 
-    c_set0_flag = (unsigned char) ((profile_comp >> 7) & 0x1);
-    c_set1_flag = (unsigned char) ((profile_comp >> 6) & 0x1);
-    c_set2_flag = (unsigned char) ((profile_comp >> 5) & 0x1);
-    c_set3_flag = (unsigned char) ((profile_comp >> 4) & 0x1);
-    c_set4_flag = (unsigned char) ((profile_comp >> 3) & 0x1);
-    c_set5_flag = (unsigned char) ((profile_comp >> 2) & 0x1);
+  mdat->file = file;
+  return 0;
+}
 
-    if (info->dump) {
-      PRINT_U(profile_idc, info);
-      print_u("constraint_set0_flag", c_set0_flag, info);
-      print_u("constraint_set1_flag", c_set1_flag, info);
-      print_u("constraint_set2_flag", c_set2_flag, info);
-      print_u("constraint_set3_flag", c_set3_flag, info);
-      print_u("constraint_set4_flag", c_set4_flag, info);
-      print_u("constraint_set5_flag", c_set5_flag, info);
-      PRINT_U(level_idc, info);
-      PRINT_U(seq_para_set_id, info);
-      PRINT_U(log2_max_frame_num_minus4, info);
-      PRINT_U(pic_order_cnt_type, info);
-    }
+/* Read the copied runs of a pipe's fragments from here on */
+static int
+open_runs(struct box_mdat * mdat) {
+  struct io * io;
+  int ret;
 
-    if (pic_order_cnt_type == 0) {
-      if ((ret = read_code_8(&log2_max_pic_order_cnt_lsb_minus4, &bits)) != 0)
-        goto free;
+  if (mdat->run_len) /* their mdat never came */
+    return ERR_IO;
 
-      if (info->dump)
-        PRINT_U(log2_max_pic_order_cnt_lsb_minus4, info);
-    } else if (pic_order_cnt_type == 2) {
-    } else {
-      ret = ERR_UNK_PIC_ORDER_CNT_TYPE;
-      goto free;
-    }
+  if ((ret = open_memory(&io, mdat->bytes, (size_t) mdat->len, 1)) != 0)
+    return ret;
+  mdat->bytes = NULL; /* io's now */
+  if ((ret = open_stream(&mdat->buf, io, 0)) != 0) {
+    io->ops->close(io);
+    return ret;
+  }
+  mdat->file = &mdat->buf;
+  return 0;
+}
 
-    if ((ret = read_code(&max_num_ref_frames, &bits)) != 0 ||
-        (ret = read_bit(&gaps_in_frame_num_value_allowed_flag, &bits)) != 0 ||
-        (ret = read_code(&pic_width_in_mbs_minus_1, &bits)) != 0 ||
-        (ret = read_code(&pic_height_in_mbs_minus_1, &bits)) != 0 ||
-        (ret = read_bit(&frame_mbs_only_flag, &bits)) != 0)
-      goto free;
+static int
+read_free(struct stream * file, struct box_info * info, box_t p_box) {
+  (void) p_box;
 
-    if (info->dump) {
-      PRINT_U(max_num_ref_frames, info);
-      PRINT_U(gaps_in_frame_num_value_allowed_flag, info);
-      PRINT_U(pic_width_in_mbs_minus_1, info);
-      PRINT_U(pic_height_in_mbs_minus_1, info);
-      PRINT_U(frame_mbs_only_flag, info);
-    }
+  return skip_box(file, info);
+}
 
-    if (!frame_mbs_only_flag) {
-      if ((ret = read_bit(&mb_adaptive_frame_field_flag, &bits)) != 0)
-        goto free;
+/* Make room for one more entry in a table of len entries, in arena or
+   on the heap if it is NULL */
+static int
+grow_table(struct arena * arena, void * ret, unsigned int len,
+           unsigned int * capa, size_t size) {
+  unsigned int n;
+  int err;
 
-      if (info->dump)
-        PRINT_U(mb_adaptive_frame_field_flag, info);
-    }
+  if (len < * capa)
+    return 0;
+  if (len > UINT_MAX / 2 - 16)
+    return ERR_ENTRY_COUNT;
 
-    if ((ret = read_bit(&direct_8x8_inference_flag, &bits)) != 0 ||
-        (ret = read_bit(&frame_cropping_flag, &bits)) != 0)
-      goto free;
+  n = (len + 16) * 2;
+  if ((err = arena_realloc(arena, ret, len * size, n * size)) != 0)
+    return err;
+  * capa = n;
+  return 0;
+}
 
-    if (info->dump) {
-      PRINT_U(direct_8x8_inference_flag, info);
-      PRINT_U(frame_cropping_flag, info);
-    }
+/* Append a track run as a chunk: stco and stsc */
+static int
+add_chunk(struct arena * arena, struct box_stbl * stbl, long pos,
+          unsigned int samples, unsigned int sample_desc_index) {
+  struct box_stco * stco;
+  struct box_stsc * stsc;
+  struct stsc_entry * last;
+  unsigned int capa;
+  int ret;
 
-    if (frame_cropping_flag) {
-      if ((ret = read_code(&frame_crop_left_offset, &bits)) != 0 ||
-          (ret = read_code(&frame_crop_right_offset, &bits)) != 0 ||
-          (ret = read_code(&frame_crop_top_offset, &bits)) != 0 ||
-          (ret = read_code(&frame_crop_bottom_offset, &bits)) != 0)
-        goto free;
+  stco = &stbl->stco;
+  stsc = &stbl->stsc;
 
-      if (info->dump) {
-        PRINT_U(frame_crop_left_offset, info);
-        PRINT_U(frame_crop_right_offset, info);
-        PRINT_U(frame_crop_top_offset, info);
-        PRINT_U(frame_crop_bottom_offset, info);
-      }
-    }
+  /* its arrays grow together */
+  capa = stco->capa;
+  if ((ret = grow_table(arena, &stco->chunk_offset, stco->entry_count,
+                        &capa, sizeof(* stco->chunk_offset))) != 0)
+    return ret;
+  capa = stco->capa;
+  if ((ret = grow_table(arena, &stco->samples_per_chunk, stco->entry_count,
+                        &capa, sizeof(* stco->samples_per_chunk))) != 0)
+    return ret;
+  capa = stco->capa;
+  if ((ret = grow_table(arena, &stco->pos, stco->entry_count,
+                        &capa, sizeof(* stco->pos))) != 0)
+    return ret;
+  stco->capa = capa;
+  stco->chunk_offset[stco->entry_count] = (unsigned long) pos;
+  stco->samples_per_chunk[stco->entry_count] = samples;
+  stco->pos[stco->entry_count] = pos;
+  stco->entry_count++;
+
+  last = stsc->entry_count ? &stsc->entry[stsc->entry_count - 1] : NULL;
+  if (last != NULL && last->samples_per_chunk == samples &&
+      last->sample_desc_index == sample_desc_index)
+    return 0;
 
-    sps = ret_nalu.sps;
+  if ((ret = grow_table(arena, &stsc->entry, stsc->entry_count,
+                        &stsc->capa, sizeof(* stsc->entry))) != 0)
+    return ret;
+  stsc->entry[stsc->entry_count].first_chunk = stco->entry_count;
+  stsc->entry[stsc->entry_count].samples_per_chunk = samples;
+  stsc->entry[stsc->entry_count].sample_desc_index = sample_desc_index;
+  stsc->entry_count++;
+  return 0;
+}
 
-    if ((ret = read_bit(&vui_para_present_flag, &bits)) != 0)
-      goto free;
+/* Queue a run of len bytes at src for copy_runs, after those before */
+static int
+add_run(struct arena * arena, struct box_mdat * mdat, long src, long len) {
+  struct frag_run * run;
+  int ret;
 
-    if (info->dump)
-      PRINT_U(vui_para_present_flag, info);
+  if (len > LONG_MAX - mdat->len)
+    return ERR_BOX_SIZE;
+  if ((ret = grow_table(arena, &mdat->run, mdat->run_len, &mdat->run_capa,
+                        sizeof(* mdat->run))) != 0)
+    return ret;
+  run = &mdat->run[mdat->run_len++];
+  run->src = src;
+  run->len = len;
+  run->dst = mdat->len;
+  mdat->len += len;
+  return 0;
+}
 
-    if (vui_para_present_flag) {
+/* Append a sample of a track run: stts, stsz and ctts if it has
+   composition offsets */
+static int
+add_sample(struct arena * arena, struct box_stbl * stbl,
+           unsigned int duration, unsigned int size,
+           unsigned int cts_offset, unsigned char has_cts) {
+  struct box_stts * stts;
+  struct box_ctts * ctts;
+  struct box_stsz * stsz;
+  unsigned int z;
+  int ret;
 
-      info->depth++;
+  stts = &stbl->stts;
+  ctts = &stbl->ctts;
+  stsz = &stbl->stsz;
 
-      if ((ret = read_vui_para(&sps->vui, &bits, info)) != 0)
-        goto free;
+  if (stts->entry_count &&
+      stts->entry[stts->entry_count - 1].sample_delta == duration) {
+    stts->entry[stts->entry_count - 1].sample_count++;
+  } else {
+    if ((ret = grow_table(arena, &stts->entry, stts->entry_count,
+                          &stts->capa, sizeof(* stts->entry))) != 0)
+      return ret;
+    stts->entry[stts->entry_count].sample_count = 1;
+    stts->entry[stts->entry_count].sample_delta = duration;
+    stts->entry_count++;
+  }
 
-      info->depth--;
+  if (has_cts || ctts->entry_count) {
+    /* samples before the first offset had none */
+    if (ctts->entry_count == 0 && stsz->sample_count) {
+      if ((ret = grow_table(arena, &ctts->entry, 0, &ctts->capa,
+                            sizeof(* ctts->entry))) != 0)
+        return ret;
+      ctts->entry[0].sample_count = stsz->sample_count;
+      ctts->entry[0].sample_offset = 0;
+      ctts->entry_count = 1;
     }
-    sps->nal_ref_idc = nal_ref_idc;
-    sps->nal_unit_type = nal_unit_type;
-    sps->profile_idc = profile_idc;
-    sps->c_set0_flag = c_set0_flag;
-    sps->c_set1_flag = c_set1_flag;
-    sps->c_set2_flag = c_set2_flag;
-    sps->c_set3_flag = c_set3_flag;
-    sps->c_set4_flag = c_set4_flag;
-    sps->c_set5_flag = c_set5_flag;
-    sps->level_idc = level_idc;
-    sps->seq_para_set_id = seq_para_set_id;
-    sps->log2_max_frame_num_minus4 = log2_max_frame_num_minus4;
-    sps->pic_order_cnt_type = pic_order_cnt_type;
+    if (ctts->entry_count &&
+        ctts->entry[ctts->entry_count - 1].sample_offset == cts_offset) {
+      ctts->entry[ctts->entry_count - 1].sample_count++;
+    } else {
+      if ((ret = grow_table(arena, &ctts->entry, ctts->entry_count,
+                            &ctts->capa, sizeof(* ctts->entry))) != 0)
+        return ret;
+      ctts->entry[ctts->entry_count].sample_count = 1;
+      ctts->entry[ctts->entry_count].sample_offset = cts_offset;
+      ctts->entry_count++;
+    }
+  }
 
-    if (pic_order_cnt_type == 0)
-      sps->log2_max_pic_order_cnt_lsb_minus4 =
-          log2_max_pic_order_cnt_lsb_minus4;
+  /* a constant sample_size is kept until a sample differs, then spelled
+     out from here on */
+  if (size != 0 && (stsz->sample_count == 0 ||
+                    (stsz->entry_size == NULL && stsz->sample_size == size))) {
+    stsz->entry_size = NULL;
+    stsz->sample_size = size;
+    stsz->sample_count++;
+    return 0;
+  }
+  if (stsz->entry_size == NULL) {
+    if ((ret = grow_table(arena, &stsz->entry_size, stsz->sample_count,
+                          &stsz->capa, sizeof(* stsz->entry_size))) != 0)
+      return ret;
+    for (z = 0; z < stsz->sample_count; z++)
+      stsz->entry_size[z] = stsz->sample_size;
+    stsz->sample_size = 0;
+  } else if ((ret = grow_table(arena, &stsz->entry_size, stsz->sample_count,
+                               &stsz->capa,
+                               sizeof(* stsz->entry_size))) != 0) {
+    return ret;
+  }
+  stsz->entry_size[stsz->sample_count++] = size;
+  return 0;
+}
 
-    sps->max_num_ref_frames = max_num_ref_frames;
-    sps->gaps_in_frame_num_value_allowed_flag =
-        gaps_in_frame_num_value_allowed_flag;
-    sps->pic_width_in_mbs_minus_1 = pic_width_in_mbs_minus_1;
-    sps->pic_height_in_mbs_minus_1 = pic_height_in_mbs_minus_1;
-    sps->frame_mbs_only_flag = frame_mbs_only_flag;
+static int
+read_mfhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int sequence_number;
+  int ret;
+
+  (void) p_box;
+
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&sequence_number, file)) != 0)
+    return ret;
 
-    if (!frame_mbs_only_flag)
-      sps->mb_adaptive_frame_field_flag = mb_adaptive_frame_field_flag;
+  if (info->dump)
+    PRINT_U(sequence_number, info);
+  return 0;
+}
 
-    sps->direct_8x8_inference_flag = direct_8x8_inference_flag;
-    sps->frame_cropping_flag = frame_cropping_flag;
+static int
+read_tfhd(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int track_id;
+  unsigned long base_data_offset;
+  struct box_traf * traf;
+  struct box_trak * trak;
+  struct box_trex * trex;
+  unsigned int type;
+  int ret;
 
-    if (frame_cropping_flag) {
-      sps->frame_crop_left_offset = frame_crop_left_offset;
-      sps->frame_crop_right_offset = frame_crop_right_offset;
-      sps->frame_crop_top_offset = frame_crop_top_offset;
-      sps->frame_crop_bottom_offset = frame_crop_bottom_offset;
-    }
-    sps->vui_para_present_flag = vui_para_present_flag;
-  } else if (nal_unit_type == NAL_PPS) {
-    unsigned char pic_para_set_id;
-    unsigned char seq_para_set_id;
-    unsigned char entropy_coding_mode_flag;
-    unsigned char pic_order_present_flag;
-    unsigned char num_slice_groups_minus1;
-    unsigned char num_ref_idx_10_active_minus1;
-    unsigned char num_ref_idx_11_active_minus1;
-    unsigned char weighted_pred_flag;
-    unsigned char weighted_bipred_idc;
-    unsigned char pic_init_qp_minus26;
-    unsigned char pic_init_qs_minus26;
-    unsigned char chroma_qp_index_offset;
-    unsigned char deblocking_filter_control_present_flag;
-    unsigned char constrained_intra_pred_flag;
-    unsigned char redundant_pic_cnt_present_flag;
-    struct pps * pps;
+  traf = p_box.traf;
 
-    if ((ret = read_bits_init(&bits, rbsp, rbsp_size)) != 0 ||
-        (ret = read_code_8(&pic_para_set_id, &bits)) != 0 ||
-        (ret = read_code_8(&seq_para_set_id, &bits)) != 0 ||
-        (ret = read_bit(&entropy_coding_mode_flag, &bits)) != 0 ||
-        (ret = read_bit(&pic_order_present_flag, &bits)) != 0 ||
-        (ret = read_code_8(&num_slice_groups_minus1, &bits)) != 0)
-      goto free;
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&track_id, file)) != 0)
+    return ret;
 
-    if (info->dump) {
-      PRINT_U(pic_para_set_id, info);
-      PRINT_U(seq_para_set_id, info);
-      PRINT_U(entropy_coding_mode_flag, info);
-      PRINT_U(pic_order_present_flag, info);
-      PRINT_U(num_slice_groups_minus1, info);
-    }
+  if ((trak = find_trak(&traf->moof->top->moov, track_id)) == NULL)
+    return ERR_TRACK_ID;
+
+  trex = &traf->trex;
+  * trex = trak->trex;
+  base_data_offset = 0;
+
+  if (((flags & TFHD_BASE_DATA_OFFSET) &&
+       (ret = read_u64(&base_data_offset, file)) != 0) ||
+      ((flags & TFHD_SAMPLE_DESC_INDEX) &&
+       (ret = read_u32(&trex->sample_desc_index, file)) != 0) ||
+      ((flags & TFHD_SAMPLE_DURATION) &&
+       (ret = read_u32(&trex->sample_duration, file)) != 0) ||
+      ((flags & TFHD_SAMPLE_SIZE) &&
+       (ret = read_u32(&trex->sample_size, file)) != 0) ||
+      ((flags & TFHD_SAMPLE_FLAGS) &&
+       (ret = read_u32(&trex->sample_flags, file)) != 0))
+    return ret;
 
-    if (num_slice_groups_minus1 > 0) {
-      ret = ERR_UNK_NUM_SLICE_GROUPS_MINUS1;
-      goto free;
-    }
+  if (info->dump) {
+    PRINT_U(track_id, info);
+    if (flags & TFHD_BASE_DATA_OFFSET)
+      PRINT_LU(base_data_offset, info);
+    if (flags & TFHD_SAMPLE_DESC_INDEX)
+      print_u("sample_desc_index", trex->sample_desc_index, info);
+    if (flags & TFHD_SAMPLE_DURATION)
+      print_u("sample_duration", trex->sample_duration, info);
+    if (flags & TFHD_SAMPLE_SIZE)
+      print_u("sample_size", trex->sample_size, info);
+    if (flags & TFHD_SAMPLE_FLAGS)
+      print_u("sample_flags", trex->sample_flags, info);
+  }
 
-    if ((ret = read_code_8(&num_ref_idx_10_active_minus1, &bits)) != 0 ||
-        (ret = read_code_8(&num_ref_idx_11_active_minus1, &bits)) != 0 ||
-        (ret = read_bit(&weighted_pred_flag, &bits)) != 0 ||
-        (ret = read_bits_8(&weighted_bipred_idc, 2, &bits)) != 0 ||
-        (ret = read_code_8(&pic_init_qp_minus26, &bits)) != 0 ||
-        (ret = read_code_8(&pic_init_qs_minus26, &bits)) != 0 ||
-        (ret = read_code_8(&chroma_qp_index_offset, &bits)) != 0 ||
-        (ret = read_bit(&deblocking_filter_control_present_flag, &bits)) != 0 ||
-        (ret = read_bit(&constrained_intra_pred_flag, &bits)) != 0 ||
-        (ret = read_bit(&redundant_pic_cnt_present_flag, &bits)) != 0)
-      goto free;
+  if (flags & TFHD_BASE_DATA_OFFSET)
+    traf->base = (long) base_data_offset;
+  else if (flags & TFHD_BASE_IS_MOOF)
+    traf->base = traf->moof->pos;
+  else
+    traf->base = traf->moof->data_end;
+  traf->data_end = traf->base;
+  traf->track_id = track_id;
+
+  /* runs of a track extract_audio drops are still read, a later traf
+     may start where they end */
+  type = trak->mdia.hdlr.type;
+  if (info->audio_only && type != BOX_NIL && type != BOX_SOUN)
+    traf->trak = NULL;
+  else
+    traf->trak = trak;
+  return 0;
+}
 
-    if (info->dump) {
-      PRINT_U(num_ref_idx_10_active_minus1, info);
-      PRINT_U(num_ref_idx_11_active_minus1, info);
-      PRINT_U(weighted_pred_flag, info);
-      PRINT_U(weighted_bipred_idc, info);
-      PRINT_U(pic_init_qp_minus26, info);
-      PRINT_U(pic_init_qs_minus26, info);
-      PRINT_U(chroma_qp_index_offset, info);
-      PRINT_U(deblocking_filter_control_present_flag, info);
-      PRINT_U(constrained_intra_pred_flag, info);
-      PRINT_U(redundant_pic_cnt_present_flag, info);
-    }
+/* Lengthen the last sample by gap, for a gap between fragments */
+static int
+stretch_last(struct arena * arena, struct box_stts * stts,
+             unsigned long gap) {
+  struct stts_entry * last;
+  int ret;
 
-    pps = ret_nalu.pps;
-    pps->nal_ref_idc = nal_ref_idc;
-    pps->nal_unit_type = nal_unit_type;
-    pps->pic_para_set_id = pic_para_set_id;
-    pps->seq_para_set_id = seq_para_set_id;
-    pps->entropy_coding_mode_flag = entropy_coding_mode_flag;
-    pps->pic_order_present_flag = pic_order_present_flag;
-    pps->num_slice_groups_minus1 = num_slice_groups_minus1;
-    pps->num_ref_idx_10_active_minus1 = num_ref_idx_10_active_minus1;
-    pps->num_ref_idx_11_active_minus1 = num_ref_idx_11_active_minus1;
-    pps->weighted_pred_flag = weighted_pred_flag;
-    pps->weighted_bipred_idc = weighted_bipred_idc;
-    pps->pic_init_qp_minus26 = pic_init_qp_minus26;
-    pps->pic_init_qs_minus26 = pic_init_qs_minus26;
-    pps->chroma_qp_index_offset = chroma_qp_index_offset;
-    pps->deblocking_filter_control_present_flag =
-        deblocking_filter_control_present_flag;
-    pps->constrained_intra_pred_flag = constrained_intra_pred_flag;
-    pps->redundant_pic_cnt_present_flag = redundant_pic_cnt_present_flag;
-  } else {
-    ret = ERR_UNK_NAL_UNIT_TYPE;
-    goto free;
+  last = &stts->entry[stts->entry_count - 1];
+  if (gap > UINT_MAX - last->sample_delta)
+    return ERR_TFDT;
+  if (last->sample_count == 1) {
+    last->sample_delta += (unsigned int) gap;
+    return 0;
   }
 
-free:
-  mem_free(rbsp);
-exit:
-  return ret;
+  if ((ret = grow_table(arena, &stts->entry, stts->entry_count,
+                        &stts->capa, sizeof(* stts->entry))) != 0)
+    return ret;
+  last = &stts->entry[stts->entry_count - 1];
+  last->sample_count--;
+  stts->entry[stts->entry_count].sample_count = 1;
+  stts->entry[stts->entry_count].sample_delta =
+    last->sample_delta + (unsigned int) gap;
+  stts->entry_count++;
+  return 0;
 }
 
+/* The first tfdt of a track places its samples so far on its timeline.
+   A later one past the end of the samples is a gap, which the last
+   sample spans; one before it can't be told by the sample tables. */
 static int
-read_avcc(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char conf_version; /* configuration version */
-  unsigned char profile_idc; /* AVC profile indication */
-  unsigned char profile_comp; /* profile compatibility */
-  unsigned char c_set0_flag; /* constraint set 0 flag */
-  unsigned char c_set1_flag; /* constraint set 1 flag */
-  unsigned char c_set2_flag; /* constraint set 2 flag */
-  unsigned char c_set3_flag; /* constraint set 3 flag */
-  unsigned char c_set4_flag; /* constraint set 4 flag */
-  unsigned char c_set5_flag; /* constraint set 5 flag */
-  unsigned char level_idc; /* AVC level indication */
-  unsigned char len_size_minus_one; /* NALU length size - 1 */
+read_tfdt(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned long base_media_decode_time;
+  unsigned int time32;
+  struct box_trak * trak;
+  int ret;
 
-  unsigned char num_of_sps; /* number of sequence parameter sets */
-  unsigned short sps_len; /* sequence parameter set length */
+  if ((ret = read_ver(&version, &flags, file)) != 0)
+    return ret;
 
-  unsigned char num_of_pps; /* number of picture parameter sets */
-  unsigned short pps_len; /* picture parameter set length */
+  if (version == 1) {
+    if ((ret = read_u64(&base_media_decode_time, file)) != 0)
+      return ret;
+  } else {
+    if ((ret = read_u32(&time32, file)) != 0)
+      return ret;
+    base_media_decode_time = time32;
+  }
 
-/* no need to implement now */
-#if 0
-  unsigned char chroma_format;
-  unsigned char bit_depth_luma_minus8;
-  unsigned char bit_depth_chroma_minus8;
+  if (info->dump)
+    PRINT_LU(base_media_decode_time, info);
 
-  unsigned char num_of_sps_ext; /* number of sequence parameter set ext */
-  unsigned short sps_ext_len; /* sequence parameter set ext length */
-  unsigned char * sps_ext_nalu; /* sequence parameter set ext NALU */
-#endif
+  if ((trak = p_box.traf->trak) == NULL)
+    return 0;
+  if (trak->timed && base_media_decode_time < trak->decode_time)
+    return ERR_TFDT;
+  if (trak->timed && base_media_decode_time > trak->decode_time &&
+      trak->mdia.minf.stbl.stts.entry_count &&
+      (ret = stretch_last(info->arena, &trak->mdia.minf.stbl.stts,
+                          base_media_decode_time - trak->decode_time)) != 0)
+    return ret;
+  trak->decode_time = base_media_decode_time;
+  trak->timed = 1;
+  return 0;
+}
 
-  struct box_avcc * avcc;
-  struct sps * sps;
-  struct pps * pps;
-  union nalu nalu;
+static int
+read_trun(struct stream * file, struct box_info * info, box_t p_box) {
+  unsigned char version;
+  unsigned int flags;
+  unsigned int sample_count;
+  int data_offset;
+  unsigned int first_sample_flags;
+  unsigned int sample_duration;
+  unsigned int sample_size;
+  unsigned int sample_flags;
+  unsigned int sample_cts_offset;
+  struct box_traf * traf;
+  struct box_stbl * stbl;
+  struct box_mdat * mdat;
+  long start;
+  long pos;
   unsigned int i;
   int ret;
 
-  ret = 0;
+  traf = p_box.traf;
+  if (traf->track_id == 0) /* tfhd comes first */
+    return ERR_TRACK_ID;
+  mdat = &traf->moof->top->mdat;
 
-  if ((ret = read_u8(&conf_version, file)) != 0 ||
-      (ret = read_u8(&profile_idc, file)) != 0 ||
-      (ret = read_u8(&profile_comp, file)) != 0 ||
-      (ret = read_u8(&level_idc, file)) != 0 ||
-      (ret = read_u8(&len_size_minus_one, file)) != 0 ||
-      (ret = read_u8(&num_of_sps, file)) != 0)
-    goto exit;
+  data_offset = 0;
+  first_sample_flags = 0;
 
-  c_set0_flag = (unsigned char) ((profile_comp >> 7) & 0x1);
-  c_set1_flag = (unsigned char) ((profile_comp >> 6) & 0x1);
-  c_set2_flag = (unsigned char) ((profile_comp >> 5) & 0x1);
-  c_set3_flag = (unsigned char) ((profile_comp >> 4) & 0x1);
-  c_set4_flag = (unsigned char) ((profile_comp >> 3) & 0x1);
-  c_set5_flag = (unsigned char) ((profile_comp >> 2) & 0x1);
-  len_size_minus_one = (unsigned char) (len_size_minus_one & 0x3);
-  num_of_sps = (unsigned char) (num_of_sps & 0x1f);
+  if ((ret = read_ver(&version, &flags, file)) != 0 ||
+      (ret = read_u32(&sample_count, file)) != 0 ||
+      ((flags & TRUN_DATA_OFFSET) &&
+       (ret = read_s32(&data_offset, file)) != 0) ||
+      ((flags & TRUN_FIRST_SAMPLE_FLAGS) &&
+       (ret = read_u32(&first_sample_flags, file)) != 0))
+    return ret;
 
   if (info->dump) {
-    PRINT_U(conf_version, info);
-    PRINT_U(profile_idc, info);
-    print_u("constraint_set0_flag", c_set0_flag, info);
-    print_u("constraint_set1_flag", c_set1_flag, info);
-    print_u("constraint_set2_flag", c_set2_flag, info);
-    print_u("constraint_set3_flag", c_set3_flag, info);
-    print_u("constraint_set4_flag", c_set4_flag, info);
-    print_u("constraint_set5_flag", c_set5_flag, info);
-    PRINT_U(level_idc, info);
-    PRINT_U(len_size_minus_one, info);
-    PRINT_U(num_of_sps, info);
+    PRINT_U(sample_count, info);
+    if (flags & TRUN_DATA_OFFSET)
+      PRINT_S(data_offset, info);
+    if (flags & TRUN_FIRST_SAMPLE_FLAGS)
+      PRINT_U(first_sample_flags, info);
   }
 
-  sps = NULL;
-  pps = NULL;
+  /* without an offset, the run follows the previous one */
+  pos = flags & TRUN_DATA_OFFSET ? traf->base + data_offset : traf->data_end;
+  start = pos;
 
-  /* sps */
+  /* a copied run is a chunk where the copy will be */
+  stbl = traf->trak != NULL ? &traf->trak->mdia.minf.stbl : NULL;
+  if (stbl != NULL && sample_count &&
+      (ret = add_chunk(info->arena, stbl, mdat->copied ? mdat->len : pos,
+                       sample_count, traf->trex.sample_desc_index)) != 0)
+    return ret;
 
-  if ((ret = mem_alloc(&sps, num_of_sps * sizeof(* sps))) != 0)
-    goto free;
+  for (i = 0; i < sample_count; i++) {
+    sample_duration = traf->trex.sample_duration;
+    sample_size = traf->trex.sample_size;
+    sample_cts_offset = 0;
+
+    if (((flags & TRUN_SAMPLE_DURATION) &&
+         (ret = read_u32(&sample_duration, file)) != 0) ||
+        ((flags & TRUN_SAMPLE_SIZE) &&
+         (ret = read_u32(&sample_size, file)) != 0) ||
+        ((flags & TRUN_SAMPLE_FLAGS) &&
+         (ret = read_u32(&sample_flags, file)) != 0) ||
+        ((flags & TRUN_SAMPLE_CTS_OFFSET) &&
+         (ret = read_u32(&sample_cts_offset, file)) != 0))
+      return ret;
 
-  for (i = 0; i < num_of_sps; i++) {
-    if ((ret = read_u16(&sps_len, file)) != 0)
-      goto free;
+    if (info->dump) {
+      if (sample_count <= 10 ||
+          i < 5 || i >= sample_count - 5) {
+        print_spaces(info);
+        printf("[%u] sample_duration:         %u\n", i, sample_duration);
+        print_spaces(info);
+        printf("[%u] sample_size:             %u\n", i, sample_size);
+      } else if (i == 5) {
+        print_spaces(info);
+        printf("[...]\n");
+      }
+    }
 
-    if (info->dump)
-      PRINT_U(sps_len, info);
+    pos += (long) sample_size;
+    if (stbl == NULL)
+      continue;
+    if ((ret = add_sample(info->arena, stbl, sample_duration, sample_size,
+                          sample_cts_offset,
+                          flags & TRUN_SAMPLE_CTS_OFFSET ? 1 : 0)) != 0)
+      return ret;
+    traf->trak->decode_time += sample_duration;
+  }
 
-    nalu.sps = &sps[i];
+  if (stbl != NULL && sample_count && mdat->copied &&
+      (ret = add_run(info->arena, mdat, start, pos - start)) != 0)
+    return ret;
 
-    info->depth++;
+  traf->data_end = pos;
+  traf->moof->data_end = pos;
+  return 0;
+}
 
-    if ((ret = read_nalu(nalu, sps_len, file, info)) != 0)
-      goto free;
+static int
+read_traf(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_TFHD, 0, BOX_QTY_1,      read_tfhd},
+    {BOX_TFDT, 0, BOX_QTY_0_OR_1, read_tfdt},
+    {BOX_TRUN, 0, BOX_QTY_0_TO_N, read_trun},
+    {BOX_SDTP, 0, BOX_QTY_0_OR_1, read_free},
+    {BOX_SBGP, 0, BOX_QTY_0_TO_N, read_sbgp},
+    {BOX_SGPD, 0, BOX_QTY_0_TO_N, read_sgpd},
+    {BOX_SAIZ, 0, BOX_QTY_0_TO_N, read_free},
+    {BOX_SAIO, 0, BOX_QTY_0_TO_N, read_free},
+    {0, 0, 0, NULL}
+  };
+  struct box_traf traf;
+  box_t box;
+
+  traf.moof = p_box.moof;
+  traf.trak = NULL;
+  traf.track_id = 0;
+  traf.base = p_box.moof->data_end;
+  traf.data_end = traf.base;
+
+  box.traf = &traf;
+  return read_box(file, info, box, funcs);
+}
+
+static int
+read_moof(struct stream * file, struct box_info * info, box_t p_box) {
+  struct box_func funcs[] = {
+    {BOX_MFHD, 0, BOX_QTY_1,      read_mfhd},
+    {BOX_TRAF, 0, BOX_QTY_0_TO_N, read_traf},
+    {0, 0, 0, NULL}
+  };
+  struct box_moof moof;
+  box_t box;
+
+  /* a dump needs no samples, see read_trun */
+  p_box.top->mdat.fragments = 1;
+  if (file->io->seq && !info->dump)
+    p_box.top->mdat.copied = 1;
+
+  moof.top = p_box.top;
+  moof.pos = info->pos;
+  moof.data_end = info->pos;
+
+  box.moof = &moof;
+  return read_box(file, info, box, funcs);
+}
+
+static unsigned int
+cpu_count(void) {
+#ifdef HAVE_POSIX
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned int) n : 1;
+#else
+  return 1;
+#endif
+}
+
+/* The sizes of chunks [begin, end), whose first sample is z */
+struct chunk_sum {
+  struct box_stco * stco;
+  const unsigned int * entry_size;
+  unsigned int begin;
+  unsigned int end;
+  unsigned long z;
+#ifdef HAVE_POSIX
+  pthread_t thread;
+  unsigned char started;
+#endif
+};
 
-    info->depth--;
+static void *
+sum_chunks(void * arg) {
+  struct chunk_sum * sum;
+  const unsigned int * entry_size;
+  unsigned int o;
+
+  sum = arg;
+  entry_size = sum->entry_size + sum->z;
+  for (o = sum->begin; o < sum->end; o++) {
+    sum->stco->size[o] = (long) sum_words(entry_size,
+                                          sum->stco->samples_per_chunk[o]);
+    entry_size += sum->stco->samples_per_chunk[o];
   }
+  return NULL;
+}
 
-  /* pps */
-
-  if ((ret = read_u8(&num_of_pps, file)) != 0)
-    goto free;
+/* Sum the sample sizes of each chunk once, for the walks of the
+   writers and the offsets of the output's chunks. Huge tables are
+   split between up to max_threads threads at chunk boundaries. */
+static int
+fill_sizes(struct box_stco * stco, const struct box_stsz * stsz,
+           unsigned int max_threads, struct arena * arena) {
+  struct chunk_sum sums[SUM_THREADS];
+  unsigned int threads;
+  unsigned int t;
+  unsigned int o;
+  unsigned long z;
+  int ret;
 
-  if (info->dump)
-    PRINT_U(num_of_pps, info);
+  if ((ret = arena_alloc(arena, &stco->size,
+                         stco->entry_count * sizeof(* stco->size))) != 0)
+    return ret;
 
-  if ((ret = mem_alloc(&pps, num_of_pps * sizeof(* pps))) != 0)
-    goto free;
+  if (stsz->entry_size == NULL) {
+    for (o = 0; o < stco->entry_count; o++)
+      stco->size[o] = (long) stco->samples_per_chunk[o] *
+                      (long) stsz->sample_size;
+    return 0;
+  }
 
-  for (i = 0; i < num_of_pps; i++) {
-    if ((ret = read_u16(&pps_len, file)) != 0)
-      goto free;
+  threads = stsz->sample_count / SUM_THREAD_SAMPLES;
+  if (threads > max_threads)
+    threads = max_threads;
+  if (threads > cpu_count())
+    threads = cpu_count();
+  if (threads == 0)
+    threads = 1;
+
+  /* a thread starts at the first chunk past its share of samples */
+  for (t = 0, o = 0, z = 0; t < threads; t++) {
+    sums[t].stco = stco;
+    sums[t].entry_size = stsz->entry_size;
+    sums[t].begin = o;
+    sums[t].z = z;
+    for (; o < stco->entry_count &&
+           (t + 1 == threads ||
+            z < (unsigned long) stsz->sample_count * (t + 1) / threads); o++)
+      z += stco->samples_per_chunk[o];
+    sums[t].end = o;
+  }
 
-    if (info->dump)
-      PRINT_U(pps_len, info);
+#ifdef HAVE_POSIX
+  for (t = 1; t < threads; t++)
+    sums[t].started = pthread_create(&sums[t].thread, NULL, sum_chunks,
+                                     &sums[t]) == 0;
+  sum_chunks(&sums[0]);
+  for (t = 1; t < threads; t++)
+    if (sums[t].started)
+      pthread_join(sums[t].thread, NULL);
+    else
+      sum_chunks(&sums[t]);
+#else
+  sum_chunks(&sums[0]);
+#endif
+  return 0;
+}
 
-    nalu.pps = &pps[i];
+static int
+fill_runs(struct box_stbl * stbl, struct arena * arena) {
+  struct box_stts * stts;
+  struct box_ctts * ctts;
+  struct box_stsc * stsc;
+  unsigned long z;
+  unsigned long t;
+  unsigned int begin;
+  unsigned int end;
+  unsigned int i;
+  int ret;
 
-    info->depth++;
+  stts = &stbl->stts;
+  ctts = &stbl->ctts;
+  stsc = &stbl->stsc;
+  if ((ret = arena_alloc(arena, &stts->start,
+                         stts->entry_count * sizeof(* stts->start))) != 0 ||
+      (ret = arena_alloc(arena, &stts->time,
+                         stts->entry_count * sizeof(* stts->time))) != 0 ||
+      (ret = arena_alloc(arena, &ctts->start,
+                         ctts->entry_count * sizeof(* ctts->start))) != 0 ||
+      (ret = arena_alloc(arena, &stsc->start,
+                         stsc->entry_count * sizeof(* stsc->start))) != 0)
+    return ret;
 
-    if ((ret = read_nalu(nalu, pps_len, file, info)) != 0)
-      goto free;
+  for (i = 0, z = 0, t = 0; i < stts->entry_count; i++) {
+    stts->start[i] = z;
+    stts->time[i] = t;
+    z += stts->entry[i].sample_count;
+    t += (unsigned long) stts->entry[i].sample_count *
+         stts->entry[i].sample_delta;
+  }
 
-    info->depth--;
+  for (i = 0, z = 0; i < ctts->entry_count; i++) {
+    ctts->start[i] = z;
+    z += ctts->entry[i].sample_count;
   }
 
-  if (profile_idc == 100 ||
-      profile_idc == 110 ||
-      profile_idc == 122 ||
-      profile_idc == 144) {
-    ret = ERR_UNK_PROFILE_IDC;
-    goto free;
+  /* a run ends at the next one's first chunk, as in fill_stbl */
+  for (i = 0, z = 0; i < stsc->entry_count; i++) {
+    stsc->start[i] = z;
+    begin = stsc->entry[i].first_chunk - 1;
+    end = i + 1 < stsc->entry_count ? stsc->entry[i + 1].first_chunk - 1 :
+                                      stbl->stco.entry_count;
+    if (end > begin)
+      z += (unsigned long) (end - begin) * stsc->entry[i].samples_per_chunk;
   }
+  return 0;
+}
 
-  avcc = &p_box.vide->avcc;
-  avcc->conf_version = conf_version;
-  avcc->profile_idc = profile_idc;
-  avcc->c_set0_flag = c_set0_flag;
-  avcc->c_set1_flag = c_set1_flag;
-  avcc->c_set2_flag = c_set2_flag;
-  avcc->c_set3_flag = c_set3_flag;
-  avcc->c_set4_flag = c_set4_flag;
-  avcc->c_set5_flag = c_set5_flag;
-  avcc->level_idc = level_idc;
-  avcc->len_size_minus_one = len_size_minus_one;
-  avcc->num_of_sps = num_of_sps;
-  avcc->num_of_pps = num_of_pps;
-  avcc->sps.sps = sps;
-  avcc->pps.pps = pps;
-free:
-  if (ret) {
-    mem_free(sps);
-    mem_free(pps);
+/* The run of start, of len runs, holding sample z: the last one
+   starting at or before it, which isn't empty if z is in the table */
+static unsigned int
+find_run(const unsigned long * start, unsigned int len, unsigned long z) {
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+
+  lo = 0;
+  hi = len;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (start[mid] <= z)
+      lo = mid;
+    else
+      hi = mid;
   }
-exit:
-  return ret;
+  return lo;
 }
 
+/* Give each chunk its samples_per_chunk from the stsc runs, and its
+   size. Sample positions are found by walking the chunks, see struct
+   sample_iter. */
 static int
-read_btrt(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned int buffer_size_db;
-  unsigned int max_bitrate;
-  unsigned int avg_bitrate;
+fill_stbl(struct box_top * top, unsigned int max_threads,
+          struct arena * arena) {
+  struct box_moov * moov;
+  struct box_stbl * stbl;
+  struct box_stco * stco;
+  struct box_stsc * stsc;
+  unsigned int i;
+  unsigned int o; /* stco's entry o */
+  unsigned int c; /* stsc->entry[c], index of chunk */
+  unsigned int first_chunk;
+  unsigned long sample_count;
   int ret;
 
-  (void) p_box;
+  moov = &top->moov;
 
-  if ((ret = read_u32(&buffer_size_db, file)) != 0 ||
-      (ret = read_u32(&max_bitrate, file)) != 0 ||
-      (ret = read_u32(&avg_bitrate, file)) != 0)
-    return ret;
+  for (i = 0; i < moov->trak_len; i++) {
+    stbl = &moov->trak[i].mdia.minf.stbl;
+    stco = &stbl->stco;
+    stsc = &stbl->stsc;
+    first_chunk = stco->entry_count;
+    sample_count = 0;
 
-  if (info->dump) {
-    PRINT_U(buffer_size_db, info);
-    PRINT_U(max_bitrate, info);
-    PRINT_U(avg_bitrate, info);
+    for (o = 0; o < stco->entry_count; o++)
+      stco->pos[o] = (long) stco->chunk_offset[o];
+    for (o = 0; o < stco->entry_count; o++)
+      stco->samples_per_chunk[o] = 0;
+
+    /* iterate each stsc entry reversely */
+    for (c = stsc->entry_count; c--;) {
+
+      if (stsc->entry[c].first_chunk == 0 ||
+          stsc->entry[c].first_chunk - 1 > stco->entry_count)
+        return ERR_ENTRY_COUNT;
+
+      /* iterate each chunk reversely */
+      for (o = first_chunk; o-- > stsc->entry[c].first_chunk-1;) {
+        stco->samples_per_chunk[o] = stsc->entry[c].samples_per_chunk;
+        sample_count += stsc->entry[c].samples_per_chunk;
+      }
+      first_chunk = stsc->entry[c].first_chunk-1;
+    }
+
+    if (sample_count != stbl->stsz.sample_count)
+      return ERR_ENTRY_COUNT;
+    if ((ret = fill_sizes(stco, &stbl->stsz, max_threads, arena)) != 0 ||
+        (ret = fill_runs(stbl, arena)) != 0)
+      return ret;
   }
   return 0;
 }
 
+/* moov of a fragmented file has no durations, or those of mehd: take
+   them from the samples of the fragments */
 static void
-init_vide(struct box_vide * vide) {
-  vide->avcc.sps.sps = NULL;
-  vide->avcc.pps.pps = NULL;
+fill_duration(struct box_top * top) {
+  struct box_moov * moov;
+  struct box_trak * trak;
+  struct box_stts * stts;
+  unsigned long duration;
+  unsigned long max;
+  unsigned int i;
+  unsigned int e;
+
+  moov = &top->moov;
+  if (!moov->fragmented)
+    return;
+
+  max = 0;
+  for (i = 0; i < moov->trak_len; i++) {
+    trak = &moov->trak[i];
+    stts = &trak->mdia.minf.stbl.stts;
+
+    duration = 0;
+    for (e = 0; e < stts->entry_count; e++)
+      duration += (unsigned long) stts->entry[e].sample_count *
+                  stts->entry[e].sample_delta;
+    trak->mdia.mdhd.duration =
+      (unsigned int) (duration > 0xffffffffUL ? 0xffffffffUL : duration);
+
+    /* tkhd is in the timescale of mvhd */
+    if (trak->mdia.mdhd.timescale)
+      duration = duration * moov->mvhd.timescale /
+                 trak->mdia.mdhd.timescale;
+    if (duration > 0xffffffffUL)
+      duration = 0xffffffffUL;
+    trak->tkhd.duration = (unsigned int) duration;
+    if (duration > max)
+      max = duration;
+  }
+  moov->mvhd.duration = (unsigned int) max;
 }
 
+static unsigned int
+get_sample_size(const struct box_stsz * stsz, unsigned int z) {
+  return stsz->entry_size == NULL ? stsz->sample_size : stsz->entry_size[z];
+}
+
+static unsigned int
+max_sample_size(const struct box_stsz * stsz) {
+  unsigned int max;
+  unsigned int z;
+
+  if (stsz->entry_size == NULL)
+    return stsz->sample_size;
+  for (max = 0, z = 0; z < stsz->sample_count; z++)
+    max = stsz->entry_size[z] > max ? stsz->entry_size[z] : max;
+  return max;
+}
+
+/* Walk the samples of a track chunk by chunk, so nothing per sample
+   but stsz's sizes is kept in memory. */
+struct sample_iter {
+  const struct box_stco * stco;
+  const struct box_stsz * stsz;
+  unsigned int o; /* next chunk */
+  unsigned int z; /* next sample */
+  unsigned int left; /* samples left in chunk o-1 */
+  long pos; /* input offset of sample z */
+};
+
 static void
-free_vide(struct box_vide * vide) {
-  mem_free(vide->avcc.sps.sps);
-  mem_free(vide->avcc.pps.pps);
+init_sample_iter(struct sample_iter * it, const struct box_stbl * stbl) {
+  it->stco = &stbl->stco;
+  it->stsz = &stbl->stsz;
+  it->o = 0;
+  it->z = 0;
+  it->left = 0;
+  it->pos = 0;
 }
 
+/* Next sample's input offset and size, 0 after the last one */
 static int
-read_vide(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned short dref_index; /* data reference index */
-  unsigned short width;
-  unsigned short height;
-  unsigned int h_rez;
-  unsigned int v_rez;
-  unsigned short frame_count;
-  unsigned char len;
-  char compressorname[32];
-  unsigned short depth;
+next_sample(struct sample_iter * it, long * pos, unsigned int * size) {
+  while (it->left == 0) {
+    if (it->o >= it->stco->entry_count)
+      return 0;
+    it->pos = it->stco->pos[it->o];
+    it->left = it->stco->samples_per_chunk[it->o++];
+  }
+
+  * pos = it->pos;
+  * size = get_sample_size(it->stsz, it->z++);
+  it->pos += (long) * size;
+  it->left--;
+  return 1;
+}
+
+/* Next whole chunk as one byte range (its samples are contiguous),
+   0 after the last one */
+static int
+next_chunk(struct sample_iter * it, long * pos, long * size) {
+  if (it->o >= it->stco->entry_count)
+    return 0;
+
+  * pos = it->stco->pos[it->o];
+  * size = it->stco->size[it->o];
+  it->z += it->stco->samples_per_chunk[it->o++];
+  it->left = 0;
+  return 1;
+}
+
+static int
+read_top(struct stream * file, struct box_top * top, struct arena * arena,
+         unsigned char dump, unsigned char audio_only,
+         unsigned int max_threads) {
+  struct box_info info;
   struct box_func funcs[] = {
-    {BOX_AVCC, 0, BOX_QTY_1,      read_avcc},
-    {BOX_BTRT, 0, BOX_QTY_0_OR_1, read_btrt},
+    {BOX_FTYP, 0, BOX_QTY_1,      read_ftyp},
+    {BOX_MOOV, 0, BOX_QTY_1,      read_moov},
+    {BOX_MDAT, 0, BOX_QTY_1_TO_N, read_mdat},
+    {BOX_FREE, 0, BOX_QTY_0_TO_N, read_free},
+    {BOX_MOOF, 0, BOX_QTY_0_TO_N, read_moof},
+    {BOX_STYP, 0, BOX_QTY_0_TO_N, read_free},
+    {BOX_SIDX, 0, BOX_QTY_0_TO_N, read_free},
+    {BOX_MFRA, 0, BOX_QTY_0_OR_1, read_free},
+    {BOX_EMSG, 0, BOX_QTY_0_TO_N, read_free},
+    {BOX_PRFT, 0, BOX_QTY_0_TO_N, read_free},
     {0, 0, 0, NULL}
   };
-  struct box_stsd * stsd;
-  struct box_vide * vide;
   box_t box;
   int ret;
 
-  ret = 0;
-
-  if (p_box.mdia->hdlr.type != BOX_VIDE) {
-    ret = ERR_UNK_HDLR_TYPE;
-    goto exit;
-  }
-
-  stsd = &p_box.mdia->minf.stbl.stsd;
-  if ((ret = mem_realloc(&stsd->entry.vide, (stsd->entry_count + 1) *
-                         sizeof(* stsd->entry.vide))) != 0)
-    goto exit;
-
-  box.vide = vide = &stsd->entry.vide[stsd->entry_count];
+  if ((ret = set_pos(0, file)) != 0)
+    return ret;
 
-  init_vide(vide);
+  info.pos = 0;
+  info.size = (unsigned long) file->size;
+  info.type = BOX_TOP;
+  info.arena = arena;
+  info.depth = 0;
+  info.dump = dump;
+  info.audio_only = audio_only;
 
-  if ((ret = skip(file, 6)) != 0 || /* reserved */
-      (ret = read_u16(&dref_index, file)) != 0 ||
-      (ret = skip(file, 2 + 2 + 4 * 3)) != 0 || /* pre / reserved / pre */
-      (ret = read_u16(&width, file)) != 0 ||
-      (ret = read_u16(&height, file)) != 0 ||
-      (ret = read_u32(&h_rez, file)) != 0 ||
-      (ret = read_u32(&v_rez, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 || /* reserved */
-      (ret = read_u16(&frame_count, file)) != 0 ||
-      (ret = read_u8(&len, file)) != 0 ||
-      (ret = read_ary(compressorname,
-                      sizeof(compressorname) - 1, 1, file)) != 0 ||
-      (ret = read_u16(&depth, file)) != 0 ||
-      (ret = skip(file, 2)) != 0) /* pre defined */
-    goto free;
+  top->ftyp.c_brands = NULL;
+  top->moov.iods = NULL;
+  top->moov.trak = NULL;
+  top->moov.trak_len = 0;
+  top->moov.fragmented = 0;
+  top->mdat.file = NULL;
+  top->mdat.fragments = 0;
+  top->mdat.copied = 0;
+  top->mdat.bytes = NULL;
+  top->mdat.capa = 0;
+  top->mdat.len = 0;
+  top->mdat.run = NULL;
+  top->mdat.run_len = 0;
+  top->mdat.run_capa = 0;
 
-  if (len >= 32) {
-    ret = ERR_STR_LEN;
-    goto free;
+  box.top = top;
+  if ((ret = read_box(file, &info, box, funcs)) != 0 ||
+      (ret = fill_stbl(top, max_threads, arena)) != 0 ||
+      (top->mdat.copied && (ret = open_runs(&top->mdat)) != 0)) {
+    mem_free(top->mdat.bytes);
+    return ret;
   }
-  compressorname[len] = '\0';
+  fill_duration(top);
+  top->moov.fragmented = 0; /* its fragments are in the sample tables */
+  return 0;
+}
 
-  if (info->dump) {
-    PRINT_U(dref_index, info);
-    PRINT_U(width, info);
-    PRINT_U(height, info);
-    PRINT_U_16(h_rez, info);
-    PRINT_U_16(v_rez, info);
-    PRINT_U(frame_count, info);
-    PRINT_STR(compressorname, info);
-    PRINT_U(depth, info);
-  }
+/* Standard output, for "-" as output. Not seekable, so every write
+   must follow the previous one. */
+static int
+open_stdout(struct io ** ret, unsigned char io_type) {
+  struct io_stdio * io;
+  int err;
 
-  if ((ret = read_box(file, info, box, funcs)) != 0)
-    goto free;
+#ifdef HAVE_POSIX
+  if (io_type != IO_STDIO) {
+    fflush(stdout);
+    return wrap_fd(ret, STDOUT_FILENO, 1);
+  }
+#endif
+  (void) io_type;
 
-  vide->dref_index = dref_index;
-  vide->width = width;
-  vide->height = height;
-  vide->h_rez = h_rez;
-  vide->v_rez = v_rez;
-  vide->frame_count = frame_count;
-  memcpy(vide->compressorname, compressorname, sizeof(compressorname));
-  vide->depth = depth;
+  if ((err = mem_alloc(&io, sizeof(* io))) != 0)
+    return err;
 
-  stsd->entry_count++;
-free:
-  if (ret)
-    free_vide(vide);
-exit:
-  return ret;
+  io->file = stdout;
+  io->end = 0;
+  io->io.ops = &stdio_ops;
+  io->io.map = NULL;
+  io->io.seq = 1;
+  * ret = &io->io;
+  return 0;
 }
 
+/* Standard input, for "-" as input. A pipe is read forward only. */
 static int
-id_to_codec(unsigned char * ret_codec, unsigned char id) {
-  struct pair {
-    unsigned char id;
-    unsigned char codec;
-  };
-  struct pair pairs[] = {
-    {OTI_AUDIO_AAC_MPEG4, CODEC_AAC} /* Audio ISO/IEC 14496-3 */
-  };
-  unsigned int i;
-
-  for (i = 0; i < sizeof(pairs)/sizeof(pairs[0]); i++)
-    if (pairs[i].id == id) {
-      * ret_codec = pairs[i].codec;
-      return 0;
-    }
-  return ERR_UNK_ID;
-}
+open_stdin(struct io ** ret, unsigned char io_type) {
+  struct io_stdio * io;
+  int err;
+#ifdef HAVE_POSIX
+  struct stat st;
 
-static int
-read_esds(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned char tag;
-  unsigned int tag_len;
+  if (io_type == IO_PREAD || io_type == IO_MMAP) {
+    if (fstat(STDIN_FILENO, &st) == -1)
+      return ERR_IO;
+    return wrap_fd(ret, STDIN_FILENO, S_ISREG(st.st_mode) ? 0 : 1);
+  }
+#endif
+  (void) io_type;
 
-  unsigned short es_id;
-  unsigned char es_flags;
+  if ((err = mem_alloc(&io, sizeof(* io))) != 0)
+    return err;
 
-  unsigned char object_type_idc;
-  unsigned char codec;
-  unsigned char stream_type;
-  unsigned char up_stream;
-  unsigned int buffer_size_db;
-  unsigned int max_bitrate;
-  unsigned int avg_bitrate;
+  io->file = stdin;
+  io->end = 0;
+  io->io.ops = &stdio_ops;
+  io->io.map = NULL;
+  io->io.seq = fseek(stdin, 0, SEEK_CUR) == -1 ? 1 : 0;
+  * ret = &io->io;
+  return 0;
+}
 
+/* Read a whole file into memory, for the in-memory backend */
+static int
+load_file(struct io ** ret, const char * fname) {
+  struct io * io;
+  struct io * mem;
   unsigned char * bytes;
-  struct bits bits;
+  size_t n;
+  long size;
+  int err;
 
-  unsigned int audio_tag_len;
-  unsigned char audio_object_type;
-  unsigned char sampling_frequency_index;
-  unsigned int sampling_frequency;
-  unsigned char channel_configuration;
-  unsigned char channels;
+  if (strcmp(fname, "-") == 0)
+    err = open_stdin(&io, IO_STDIO);
+  else
+    err = open_stdio(&io, fname, "rb");
+  if (err)
+    return err;
+
+  bytes = NULL;
+  if (io->seq) { /* size unknown, grow while reading */
+    if ((err = mem_alloc(&bytes, STREAM_BUF_SIZE)) != 0 ||
+        (err = open_memory(&mem, NULL, 0, 1)) != 0)
+      goto close;
+    for (size = 0;; size += (long) n) {
+      if ((err = io->ops->read_some(io, bytes, STREAM_BUF_SIZE, size,
+                                    &n)) != 0 ||
+          (n && (err = mem->ops->write_at(mem, bytes, n, size)) != 0)) {
+        mem->ops->close(mem);
+        goto close;
+      }
+      if (n == 0)
+        break;
+    }
+    mem_free(bytes);
+    bytes = NULL;
+  } else if ((err = io->ops->size(io, &size)) != 0 ||
+             (err = mem_alloc(&bytes, (size_t) size + 1)) != 0 ||
+             (err = io->ops->read_at(io, bytes, (size_t) size, 0)) != 0 ||
+             (err = open_memory(&mem, bytes, (size_t) size, 1)) != 0) {
+    goto close;
+  }
 
-  unsigned char predefined;
+  * ret = mem;
+close:
+  if (err)
+    mem_free(bytes);
+  io->ops->close(io);
+  return err;
+}
 
-  struct box_esds * esds;
-  struct es_descr * es;
-  struct decoder_config_descr * dec;
-  struct sl_config_descr * sl;
-  struct audio_specific_config * audio;
+static int
+open_file(struct stream * file, const char * fname, unsigned char io_type) {
+  struct io * io;
   int ret;
 
-  ret = 0;
+  if (io_type == IO_MEMORY)
+    ret = load_file(&io, fname);
+  else if (strcmp(fname, "-") == 0)
+    ret = open_stdin(&io, io_type);
+#ifdef HAVE_POSIX
+  else if (io_type == IO_MMAP)
+    ret = open_mmap(&io, fname);
+  else if (io_type == IO_PREAD)
+    ret = open_fd(&io, fname, O_RDONLY);
+#endif
+  else
+    ret = open_stdio(&io, fname, "rb");
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_tag(&tag, &tag_len, file)) != 0)
-    goto exit;
+  if (ret)
+    return ret;
 
-  if (tag != TAG_ES_DESCR) {
-    ret = ERR_UNK_TAG;
-    goto exit;
+  if ((ret = open_stream(file, io, 0)) != 0) {
+    mem_free(file->buf);
+    io->ops->close(io);
   }
+  return ret;
+}
 
-  if (info->dump) {
-    print_spaces(info);
-    printf("[ES_Descr %u]\n", tag_len);
-    info->depth++;
-  }
+static int
+create_file(struct stream * file, const char * fname, unsigned char io_type) {
+  struct io * io;
+  int ret;
 
-  if ((ret = read_u16(&es_id, file)) != 0 ||
-      (ret = read_u8(&es_flags, file)) != 0)
-    goto exit;
+  if (strcmp(fname, "-") == 0)
+    ret = open_stdout(&io, io_type);
+#ifdef HAVE_POSIX
+  else if (io_type != IO_STDIO)
+    ret = open_fd(&io, fname, O_WRONLY | O_CREAT | O_TRUNC);
+#endif
+  else
+    ret = open_stdio(&io, fname, "wb");
 
-  if (info->dump) {
-    PRINT_U(es_id, info);
-    PRINT_U(es_flags, info);
-  }
+  if (ret)
+    return ret;
 
-  if (es_flags) {
-    ret = ERR_UNK_ES_FLAGS;
-    goto exit;
+  if ((ret = open_stream(file, io, 1)) != 0) {
+    io->ops->close(io);
+    file->io = NULL; /* nothing left to close */
   }
+  return ret;
+}
 
-  if ((ret = read_tag(&tag, &tag_len, file)) != 0)
-    goto exit;
+static void
+close_file(struct stream * file) {
+  mem_free(file->buf);
+  file->io->ops->close(file->io);
+}
 
-  if (tag != TAG_DECODER_CONFIG_DESCR) {
-    ret = ERR_UNK_TAG;
-    goto exit;
-  }
+/* Where a writer puts its output: the file fname, or io if not NULL,
+   which the caller closes */
+struct output {
+  const char * fname;
+  unsigned char io_type;
+  struct io * io;
+};
 
-  if (info->dump) {
-    print_spaces(info);
-    printf("[DecoderConfigDescr %u]\n", tag_len);
-    info->depth++;
-  }
+static int
+create_output(struct stream * file, const struct output * out) {
+  if (out->io != NULL)
+    return open_stream(file, out->io, 1);
+  return create_file(file, out->fname, out->io_type);
+}
 
-  if ((ret = read_u8(&object_type_idc, file)) != 0 ||
-      (ret = id_to_codec(&codec, object_type_idc)) != 0 ||
-      (ret = read_u32(&buffer_size_db, file)) != 0 ||
-      (ret = read_u32(&max_bitrate, file)) != 0 ||
-      (ret = read_u32(&avg_bitrate, file)) != 0 ||
-      (ret = read_tag(&tag, &tag_len, file)) != 0)
-    goto exit;
+static void
+close_output(struct stream * file, const struct output * out) {
+  if (out->io != NULL)
+    mem_free(file->buf);
+  else
+    close_file(file);
+}
 
-  stream_type = (unsigned char) (buffer_size_db >> 26);
-  up_stream = (buffer_size_db >> 25) & 0x1;
-  buffer_size_db = buffer_size_db & 0xffffff; 
+/* fname without its extension, with room for a suffix of files named
+   after it */
+static int
+base_name(char ** ret, size_t * base_len, const char * fname) {
+  const char * slash;
+  const char * dot;
+  int err;
 
-  if (info->dump) {
-    PRINT_U(object_type_idc, info);
-    PRINT_U(stream_type, info);
-    PRINT_U(up_stream, info);
-    PRINT_U(buffer_size_db, info);
-    PRINT_U(max_bitrate, info);
-    PRINT_U(avg_bitrate, info);
-  }
+  slash = strrchr(fname, '/');
+  dot = strrchr(fname, '.');
+  * base_len = dot != NULL && (slash == NULL || dot > slash) ?
+               (size_t) (dot - fname) : strlen(fname);
 
-  if (tag != TAG_DEC_SPECIFIC_INFO ||
-      tag_len == 0) {
-    ret = ERR_UNK_TAG;
-    goto exit;
-  }
+  if ((err = mem_alloc(ret, * base_len + 32)) != 0)
+    return err;
+  memcpy(* ret, fname, * base_len);
+  (* ret)[* base_len] = '\0';
+  return 0;
+}
 
-  audio_tag_len = tag_len;
+/* A splice plan instead of an output: the stored bytes go to
+   <base>.hdr, the plan to <base>.splice, name holding <base> */
+static int
+create_splice(struct stream * file, struct splice * splice, char * name,
+              size_t base_len, unsigned char io_type) {
+  int ret;
 
-  if (info->dump) {
-    print_spaces(info);
-    printf("[AudioSpecificConfig %u]\n", tag_len);
-    info->depth++;
+  strcpy(name + base_len, ".splice");
+  if ((ret = create_file(&splice->plan, name, io_type)) != 0)
+    return ret;
+  strcpy(name + base_len, ".hdr");
+  if ((ret = create_file(file, name, io_type)) != 0) {
+    close_file(&splice->plan);
+    return ret;
   }
+  splice->mark = 0;
+  splice->src_pos = 0;
+  splice->src_len = 0;
+  splice->src_total = 0;
+  file->splice = splice;
+  return 0;
+}
 
-  if (codec == CODEC_AAC) {
+static int
+flush_splice(struct stream * file) {
+  int ret;
 
-    if ((ret = mem_alloc(&bytes, tag_len)) != 0)
-      goto exit;
+  if ((ret = end_splice(file)) != 0 ||
+      (ret = flush_file(file)) != 0 ||
+      (ret = flush_file(&file->splice->plan)) != 0)
+    return ret;
+  return 0;
+}
 
-    if ((ret = read_ary(bytes, tag_len, 1, file)) != 0 ||
-        (ret = read_bits_init(&bits, bytes, tag_len)) != 0 ||
-        (ret = read_bits_8(&audio_object_type, 5, &bits)) != 0)
-      goto free;
+static void
+close_splice(struct stream * file) {
+  close_file(&file->splice->plan);
+  close_file(file);
+}
 
-    if (audio_object_type == 0x1f) {
-      if ((ret = read_bits_8(&audio_object_type, 6, &bits)) != 0)
-        goto free;
-      audio_object_type = (unsigned char) (audio_object_type + 0x20);
-    }
+static int
+write_s16(short x, struct stream * file) {
+  unsigned char b16[2];
 
-    if (info->dump)
-      PRINT_U(audio_object_type, info);
+  b16[0] = (unsigned char) (x >> 8);
+  b16[1] = (unsigned char) x;
 
-    if ((ret = read_bits_8(&sampling_frequency_index, 4, &bits)) != 0)
-      goto free;
+  return write_ary(b16, sizeof(b16), 1, file);
+}
 
-    if (info->dump)
-      PRINT_U(sampling_frequency_index, info);
+static int
+write_s32(int x, struct stream * file) {
+  unsigned char b32[4];
 
-    if (sampling_frequency_index == 0xf) {
-      if ((ret = read_bits(&sampling_frequency, 24, &bits)) != 0)
-        goto free;
+  b32[0] = (unsigned char) (x >> 24);
+  b32[1] = (unsigned char) (x >> 16);
+  b32[2] = (unsigned char) (x >> 8);
+  b32[3] = (unsigned char) x;
 
-      if (info->dump)
-        PRINT_U(sampling_frequency, info);
-    } else {
-      sampling_frequency = 0;
-    }
+  return write_ary(b32, sizeof(b32), 1, file);
+}
 
-    if ((ret = read_bits_8(&channel_configuration, 4, &bits)) != 0)
-      goto free;
+static int
+write_u8(unsigned char x, struct stream * file) {
+  return write_ary(&x, 1, 1, file);
+}
 
-    if (info->dump)
-      PRINT_U(channel_configuration, info);
+static int
+write_u16(unsigned short x, struct stream * file) {
+  unsigned char b16[2];
 
-    if (channel_configuration) {
-      channels = m4a_channels[channel_configuration-1];
-    } else {
-      ret = ERR_CHANNEL;
-      goto free;
-    }
-free:
-    mem_free(bytes);
-    if (ret)
-      goto exit;
-  } else {
-    ret = ERR_UNK_CODEC;
-    goto exit;
-  }
+  b16[0] = (unsigned char) (x >> 8);
+  b16[1] = (unsigned char) x;
 
-  if (info->dump)
-    info->depth -= 2;
+  return write_ary(b16, sizeof(b16), 1, file);
+}
 
-  if ((ret = read_tag(&tag, &tag_len, file)) != 0)
-    goto exit;
+static int
+write_u32(unsigned int x, struct stream * file) {
+  unsigned char b32[4];
 
-  if (tag != TAG_SL_CONFIG_DESCR) {
-    ret = ERR_UNK_TAG;
-    goto exit;
-  }
+  b32[0] = (unsigned char) (x >> 24);
+  b32[1] = (unsigned char) (x >> 16);
+  b32[2] = (unsigned char) (x >> 8);
+  b32[3] = (unsigned char) x;
 
-  if (info->dump) {
-    print_spaces(info);
-    printf("[SLConfigDescr %u]\n", tag_len);
-    info->depth++;
-  }
+  return write_ary(b32, sizeof(b32), 1, file);
+}
 
-  if ((ret = read_u8(&predefined, file)) != 0)
-    goto exit;
+/* Write len words of a table, len up to U32_BLOCK */
+static int
+write_u32s(const unsigned int * block, size_t len, struct stream * file) {
+  unsigned char raw[4 * U32_BLOCK];
 
-  if (info->dump) {
-    PRINT_U(predefined, info);
-    info->depth -= 2;
+  if (file->io == NULL) { /* measuring */
+    file->pos += (long) (4 * len);
+    return 0;
   }
 
-  esds = &p_box.soun->esds;
-
-  es = &esds->es;
-  es->es_id = es_id;
-  es->es_flags = es_flags;;
+  encode_u32s(raw, block, len);
+  return write_ary(raw, 4, len, file);
+}
 
-  dec = &es->dec_conf;
-  dec->object_type_idc = object_type_idc;
-  dec->stream_type = stream_type;
-  dec->up_stream = up_stream;
-  dec->buffer_size_db = buffer_size_db;
-  dec->max_bitrate = max_bitrate;
-  dec->avg_bitrate = avg_bitrate;
+static int
+write_table(const unsigned int * table, unsigned int len,
+            struct stream * file) {
+  unsigned int i;
+  unsigned int n;
+  int ret;
 
-  audio = &dec->audio;
-  audio->tag_len = audio_tag_len;
-  audio->audio_object_type = audio_object_type;
-  audio->sampling_frequency_index = sampling_frequency_index;
-  audio->sampling_frequency = sampling_frequency;
-  audio->channel_configuration = channel_configuration;
-  audio->channels = channels;
+  for (i = 0; i < len; i += n) {
+    n = len - i < U32_BLOCK ? len - i : U32_BLOCK;
+    if ((ret = write_u32s(table + i, n, file)) != 0)
+      return ret;
+  }
+  return 0;
+}
 
-  sl = &es->sl_conf;
-  sl->predefined = predefined;
-exit:
-  return ret;
+static int
+write_u64(unsigned long x, struct stream * file) {
+  int ret;
+
+  if ((ret = write_u32((unsigned int) (x >> 16 >> 16), file)) != 0 ||
+      (ret = write_u32((unsigned int) (x & 0xffffffffUL), file)) != 0)
+    return ret;
+  return 0;
 }
 
-static void
-init_soun(struct box_soun * soun) {
-  (void) soun;
+static int
+write_str(char * str, struct stream * file) {
+  return write_ary(str, strlen(str) + 1, 1, file);
 }
 
-static void
-free_soun(struct box_soun * soun) {
-  (void) soun;
+static int
+write_ver(unsigned char version, unsigned int flags, struct stream * file) {
+  unsigned int b32;
+  b32 = ((unsigned int) version << 24) | flags;
+  return write_u32(b32, file);
 }
 
 static int
-read_soun(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned short dref_index; /* data reference index */
-  unsigned short channelcount;
-  unsigned short samplesize;
-  unsigned int samplerate;
-  struct box_func funcs[] = {
-    {BOX_ESDS, 0, BOX_QTY_1, read_esds},
-    {0, 0, 0, NULL}
-  };
-  struct box_stsd * stsd;
-  struct box_soun * soun;
-  box_t box;
+write_tag(unsigned char tag, unsigned int len, struct stream * file) {
+  unsigned int m; /* mask */
+  unsigned int n; /* bit length of len */
+  unsigned int b; /* byte */
   int ret;
 
-  ret = 0;
+  if ((ret = write_u8(tag, file)) != 0)
+    return ret;
 
-  if (p_box.mdia->hdlr.type != BOX_SOUN) {
-    ret = ERR_UNK_HDLR_TYPE;
-    goto exit;
-  }
+  if (len == 0)
+    return write_u8(0, file);
 
-  stsd = &p_box.mdia->minf.stbl.stsd;
-  if ((ret = mem_realloc(&stsd->entry.soun, (stsd->entry_count + 1) *
-                         sizeof(* stsd->entry.soun))) != 0)
-    goto exit;
+  n = 32;
+  m = 0x80000000;
+  while ((len & m) == 0) {
+    n--;
+    m >>= 1;
+  }
+  if (n % 7) {
+    n -= n % 7;
+    b = (len >> n) | (n ? 0x80 : 0);
+    if ((ret = write_u8((unsigned char) b, file)) != 0)
+      return ret;
+  }
+  while (n >= 7) {
+    n -= 7;
+    b = ((len >> n) & 0x7f) | (n ? 0x80 : 0);
+    if ((ret = write_u8((unsigned char) b, file)) != 0)
+      return ret;
+  }
+  return 0;
+}
 
-  box.soun = soun = &stsd->entry.soun[stsd->entry_count];
+static int
+write_mat(int * matrix, struct stream * file) {
+  int i;
+  int ret;
 
-  init_soun(soun);
+  for (i = 0; i < 9; i++)
+    if ((ret = write_s32(matrix[i], file)) != 0)
+      return ret;
 
-  if ((ret = skip(file, 6)) != 0 || /* reserved */
-      (ret = read_u16(&dref_index, file)) != 0 ||
-      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
-      (ret = read_u16(&channelcount, file)) != 0 ||
-      (ret = read_u16(&samplesize, file)) != 0 ||
-      (ret = skip(file, 2 + 2)) != 0 || /* pre defined / reserved */
-      (ret = read_u32(&samplerate, file)) != 0)
-    goto free;
+  return 0;
+}
 
-  if (info->dump) {
-    PRINT_U(dref_index, info);
-    PRINT_U(channelcount, info);
-    PRINT_U(samplesize, info);
-    PRINT_U_16(samplerate, info);
-  }
+/* Slot for the size of the next box or descriptor: reserved by the
+   first measuring pass, else holding the size the last one found. */
+static int
+take_size(unsigned int * ret, struct stream * file) {
+  struct box_sizes * sizes;
+  int err;
 
-  if ((ret = read_box(file, info, box, funcs)) != 0)
-    goto free;
+  sizes = file->sizes;
 
-  soun->dref_index = dref_index;
-  soun->channelcount = channelcount;
-  soun->samplesize = samplesize;
-  soun->samplerate = samplerate;
+  if (sizes->i == sizes->len) {
+    if (file->io != NULL)
+      return ERR_BOX_SIZE;
+    if (sizes->len == sizes->capa) {
+      if ((err = mem_realloc(&sizes->size, (sizes->capa + 16) * 2 *
+                                           sizeof(* sizes->size))) != 0)
+        return err;
+      sizes->capa = (sizes->capa + 16) * 2;
+    }
+    sizes->size[sizes->len++] = 0;
+  }
 
-  stsd->entry_count++;
-free:
-  if (ret)
-    free_soun(soun);
-exit:
-  return ret;
+  * ret = sizes->i++;
+  return 0;
 }
 
 static int
-read_stsd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int entry_count;
-  struct box_stsd * stsd;
-  struct box_func funcs[] = {
-    {BOX_AVC1, 0, BOX_QTY_0_TO_N, read_vide},
-    {BOX_MP4A, 0, BOX_QTY_0_TO_N, read_soun},
-    {0, 0, 0, NULL}
-  };
-  int ret;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0)
-    return ret;
-
-  if (info->dump)
-    PRINT_U(entry_count, info);
+put_size(unsigned int i, unsigned long size, struct stream * file) {
+  struct box_sizes * sizes;
 
-  if ((ret = read_box(file, info, p_box, funcs)) != 0)
-    return ret;
+  sizes = file->sizes;
 
-  stsd = &p_box.mdia->minf.stbl.stsd;
-  if (stsd->entry_count != entry_count)
-    return ERR_ENTRY_COUNT;
+  if (file->io != NULL)
+    return sizes->size[i] == size ? 0 : ERR_BOX_SIZE;
 
+  /* past 4 GiB the box needs the largesize header it was measured
+     without */
+  if (size > 0xffffffffUL && sizes->size[i] <= 0xffffffffUL)
+    sizes->again = 1;
+  sizes->size[i] = size;
   return 0;
 }
 
+/* Sizes are measured by a first pass (see write_top), so nothing is
+   patched after the fact. */
 static int
-read_stts(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int entry_count;
-  unsigned int sample_count;
-  unsigned int sample_delta;
-  struct stts_entry * entry;
-  struct box_stts * stts;
+write_box(struct stream * file, box_t box, unsigned int box_type,
+          int (* func)(struct stream * file, box_t box)) {
+  unsigned long size;
   unsigned int i;
+  long pos;
+  long now;
   int ret;
 
-  ret = 0;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0 ||
-      (ret = mem_alloc(&entry, entry_count * sizeof(* entry))) != 0)
-    goto exit;
-
-  if (info->dump)
-    PRINT_U(entry_count, info);
-
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&sample_count, file)) != 0 ||
-        (ret = read_u32(&sample_delta, file)) != 0)
-      goto free;
+  if ((ret = take_size(&i, file)) != 0 ||
+      (ret = get_pos(&pos, file)) != 0)
+    return ret;
 
-    if (info->dump) {
-      print_spaces(info);
-      printf("[%u]\n", i);
+  size = file->sizes->size[i];
+  if (size > 0xffffffffUL) {
+    if ((ret = write_u32(1, file)) != 0 ||
+        (ret = write_u32(box_type, file)) != 0 ||
+        (ret = write_u64(size, file)) != 0)
+      return ret;
+  } else {
+    if ((ret = write_u32((unsigned int) size, file)) != 0 ||
+        (ret = write_u32(box_type, file)) != 0)
+      return ret;
+  }
 
-      info->depth++;
+  if ((ret = func(file, box)) != 0 ||
+      (ret = get_pos(&now, file)) != 0 ||
+      (ret = put_size(i, (unsigned long) (now - pos), file)) != 0)
+    return ret;
+  return 0;
+}
 
-      PRINT_U(sample_count, info);
-      PRINT_U(sample_delta, info);
+/* Descriptor tag whose length is known after its content is written */
+static int
+begin_tag(unsigned int * ret_i, long * ret_pos, unsigned char tag,
+          struct stream * file) {
+  int ret;
 
-      info->depth--;
-    }
+  if ((ret = take_size(ret_i, file)) != 0 ||
+      (ret = get_pos(ret_pos, file)) != 0 ||
+      (ret = write_tag(tag, (unsigned int) file->sizes->size[* ret_i],
+                       file)) != 0)
+    return ret;
+  return 0;
+}
 
-    entry[i].sample_count = sample_count;
-    entry[i].sample_delta = sample_delta;
-  }
+static int
+end_tag(unsigned int i, long pos, struct stream * file) {
+  long now;
+  int ret;
 
-  stts = &p_box.mdia->minf.stbl.stts;
-  stts->entry_count = entry_count;
-  stts->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+  if ((ret = get_pos(&now, file)) != 0 ||
+      (ret = put_size(i, (unsigned long) (now - pos - 2), file)) != 0)
+    return ret;
+  return 0;
 }
 
 static int
-read_ctts(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int entry_count;
-  unsigned int sample_count;
-  unsigned int sample_offset;
-  struct ctts_entry * entry;
-  struct box_ctts * ctts;
+write_ftyp(struct stream * file, box_t p_box) {
+  struct box_ftyp * ftyp;
   unsigned int i;
   int ret;
 
-  ret = 0;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0 ||
-      (ret = mem_alloc(&entry, entry_count * sizeof(* entry))) != 0)
-    goto exit;
+  ftyp = &p_box.top->ftyp;
+  if ((ret = write_u32(ftyp->m_brand, file)) != 0 ||
+      (ret = write_u32(ftyp->m_version, file)) != 0)
+    return ret;
 
-  if (info->dump)
-    PRINT_U(entry_count, info);
+  for (i = 0; i < ftyp->c_brands_len; i++)
+    if ((ret = write_u32(ftyp->c_brands[i], file)) != 0)
+      return ret;
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&sample_count, file)) != 0 ||
-        (ret = read_u32(&sample_offset, file)) != 0)
-      goto free;
+  return 0;
+}
 
-    if (info->dump) {
-      if (entry_count <= 8 ||
-          i < 4 || i >= entry_count - 4) {
+static int
+write_mvhd(struct stream * file, box_t p_box) {
+  struct box_mvhd * mvhd;
+  int ret;
 
-        print_spaces(info);
-        printf("[%u]\n", i);
+  mvhd = &p_box.moov->mvhd;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(mvhd->c_time, file)) != 0 ||
+      (ret = write_u32(mvhd->m_time, file)) != 0 ||
+      (ret = write_u32(mvhd->timescale, file)) != 0 ||
+      (ret = write_u32(mvhd->duration, file)) != 0 ||
+      (ret = write_s32(mvhd->rate, file)) != 0 ||
+      (ret = write_s16(mvhd->volume, file)) != 0 ||
+      (ret = skip(file, 2 + 4 * 2)) != 0 || /* reserved */
+      (ret = write_mat(mvhd->matrix, file)) != 0 ||
+      (ret = skip(file, 4 * 6)) != 0 || /* pre defined */
+      (ret = write_u32(mvhd->next_track_id, file)) != 0)
+    return ret;
+  return 0;
+}
 
-        info->depth++;
+static int
+write_iods(struct stream * file, box_t p_box) {
+  unsigned short object_descr_id;
+  struct box_iods * iods;
+  struct initial_object_descr * iod;
+  unsigned int i;
+  long pos;
+  int ret;
 
-        PRINT_U(sample_count, info);
-        PRINT_U(sample_offset, info);
+  iods = p_box.moov->iods;
+  iod = &iods->iod;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = begin_tag(&i, &pos, TAG_MP4_IOD, file)) != 0)
+    return ret;
 
-        info->depth--;
-      } else if (i == 4) {
-        print_spaces(info);
-        printf("[...]\n");
-      }
-    }
+  object_descr_id = (unsigned short)
+      ((iod->object_descr_id << 6) |
+       (iod->url_flag << 5) |
+       (iod->include_inline_profile_level_flag << 4) |
+       0x0f);
+  if ((ret = write_u16(object_descr_id, file)) != 0)
+    return ret;
 
-    entry[i].sample_count = sample_count;
-    entry[i].sample_offset = sample_offset;
+  if (iod->url_flag == 0) {
+    if ((ret = write_u8(iod->od_profile_level_idc, file)) != 0 ||
+        (ret = write_u8(iod->scene_profile_level_idc, file)) != 0 ||
+        (ret = write_u8(iod->audio_profile_level_idc, file)) != 0 ||
+        (ret = write_u8(iod->visual_profile_level_idc, file)) != 0 ||
+        (ret = write_u8(iod->graphics_profile_levvel_idc, file)) != 0)
+      return ret;
   }
-
-  ctts = &p_box.mdia->minf.stbl.ctts;
-  ctts->entry_count = entry_count;
-  ctts->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+  return end_tag(i, pos, file);
 }
 
 static int
-read_stsc(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
+write_tkhd(struct stream * file, box_t p_box) {
   unsigned int flags;
-  unsigned int entry_count;
-  unsigned int first_chunk;
-  unsigned int samples_per_chunk;
-  unsigned int sample_desc_index;
-  struct stsc_entry * entry;
-  struct box_stsc * stsc;
-  unsigned int i;
+  struct box_tkhd * tkhd;
   int ret;
 
-  ret = 0;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0 ||
-      (ret = mem_alloc(&entry, entry_count * sizeof(* entry))) != 0)
-    goto exit;
-
-  if (info->dump)
-    PRINT_U(entry_count, info);
+  tkhd = &p_box.trak->tkhd;
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&first_chunk, file)) != 0 ||
-        (ret = read_u32(&samples_per_chunk, file)) != 0 ||
-        (ret = read_u32(&sample_desc_index, file)) != 0)
-      goto free;
+  flags = (unsigned int) (tkhd->track_enabled |
+                          (tkhd->track_in_movie << 1) |
+                          (tkhd->track_in_preview << 2));
 
-    if (info->dump) {
-      if (entry_count <= 8 ||
-          i < 4 || i >= entry_count - 4) {
+  if ((ret = write_ver(0, flags, file)) != 0 ||
+      (ret = write_u32(tkhd->c_time, file)) != 0 ||
+      (ret = write_u32(tkhd->m_time, file)) != 0 ||
+      (ret = write_u32(tkhd->track_id, file)) != 0 ||
+      (ret = skip(file, 4)) != 0 || /* reserved */
+      (ret = write_u32(tkhd->duration, file)) != 0 ||
+      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
+      (ret = write_s16(tkhd->layer, file)) != 0 ||
+      (ret = write_s16(tkhd->alternate_group, file)) != 0 ||
+      (ret = write_s16(tkhd->volume, file)) != 0 ||
+      (ret = skip(file, 2)) != 0 || /* reserved */
+      (ret = write_mat(tkhd->matrix, file)) != 0 ||
+      (ret = write_u32(tkhd->width, file)) != 0 ||
+      (ret = write_u32(tkhd->height, file)) != 0)
+    return ret;
+  return 0;
+}
 
-        print_spaces(info);
-        printf("[%u]\n", i);
+static int
+write_mdhd(struct stream * file, box_t p_box) {
+  unsigned short lang_pack;
+  struct box_mdhd * mdhd;
+  int ret;
 
-        info->depth++;
+  mdhd = &p_box.mdia->mdhd;
 
-        PRINT_U(first_chunk, info);
-        PRINT_U(samples_per_chunk, info);
-        PRINT_U(sample_desc_index, info);
+  lang_pack = (unsigned short) (((mdhd->lang[0] - 0x60) << 10) |
+                                ((mdhd->lang[1] - 0x60) << 5) |
+                                (mdhd->lang[2] - 0x60));
 
-        info->depth--;
-      } else if (i == 4) {
-        print_spaces(info);
-        printf("[...]\n");
-      }
-    }
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(mdhd->c_time, file)) != 0 ||
+      (ret = write_u32(mdhd->m_time, file)) != 0 ||
+      (ret = write_u32(mdhd->timescale, file)) != 0 ||
+      (ret = write_u32(mdhd->duration, file)) != 0 ||
+      (ret = write_u16(lang_pack, file)) != 0 ||
+      (ret = write_u16(0, file)) != 0) /* pre defined */
+    return ret;
+  return 0;
+}
 
-    entry[i].first_chunk = first_chunk;
-    entry[i].samples_per_chunk = samples_per_chunk;
-    entry[i].sample_desc_index = sample_desc_index;
-  }
-  stsc = &p_box.mdia->minf.stbl.stsc;
-  stsc->entry_count = entry_count;
-  stsc->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+static int
+write_hdlr(struct stream * file, box_t p_box) {
+  struct box_hdlr * hdlr;
+  int ret;
 
+  hdlr = &p_box.mdia->hdlr;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = skip(file, 4)) != 0 || /* pre defined */
+      (ret = write_u32(hdlr->type, file)) != 0 ||
+      (ret = skip(file, 4 * 3)) != 0 || /* reserved */
+      (ret = write_str(hdlr->name, file)) != 0)
+    return ret;
+  return 0;
 }
 
 static int
-read_stco(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
+write_dref_entry(struct stream * file, box_t box) {
   unsigned int flags;
-  unsigned int entry_count;
-  unsigned int chunk_offset;
-  struct stco_entry * entry;
-  struct box_stco * stco;
-  unsigned int i;
+  struct box_dref_entry * entry;
   int ret;
 
-  ret = 0;
+  entry = box.dref_entry;
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0 ||
-      (ret = mem_alloc(&entry, entry_count * sizeof(* entry))) != 0)
-    goto exit;
+  flags = entry->self_contained;
 
-  if (info->dump)
-    PRINT_U(entry_count, info);
+  if ((ret = write_ver(0, flags, file)) != 0)
+    return ret;
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&chunk_offset, file)) != 0)
-      goto free;
+  if (entry->type == BOX_URL) {
 
-    if (info->dump) {
-      if (entry_count <= 10 ||
-          i < 5 || i >= entry_count - 5) {
-        print_spaces(info);
-        printf("[%u] chunk_offset:            %u\n", i, chunk_offset);
-      } else if (i == 5) {
-        print_spaces(info);
-        printf("[...]\n");
-      }
-    }
+    if (entry->self_contained == 0)
+      if ((ret = write_str(entry->location, file)) != 0)
+        return ret;
+  } else if (entry->type == BOX_URN) {
 
-    entry[i].chunk_offset = chunk_offset;
+    if ((ret = write_str(entry->name, file)) != 0 ||
+        (ret = write_str(entry->location, file)) != 0)
+      return ret;
+  } else {
+    return ERR_UNK_BOX;
   }
-  stco = &p_box.mdia->minf.stbl.stco;
-  stco->entry_count = entry_count;
-  stco->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+  return 0;
 }
 
 static int
-read_stsz(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int sample_size;
-  unsigned int sample_count;
-  unsigned int entry_size;
-  struct stsz_entry * entry;
-  struct box_stsz * stsz;
+write_dref(struct stream * file, box_t p_box) {
+  struct box_dref * dref;
+  box_t box;
   unsigned int i;
   int ret;
 
-  ret = 0;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&sample_size, file)) != 0 ||
-      (ret = read_u32(&sample_count, file)) != 0)
-    goto exit;
-
-  if (info->dump) {
-    PRINT_U(sample_size, info);
-    PRINT_U(sample_count, info);
-  }
-
-  if (sample_size == 0) {
-
-    if ((ret = mem_alloc(&entry, sample_count * sizeof(* entry))) != 0)
-      goto exit;
-
-    for (i = 0; i < sample_count; i++) {
-      if ((ret = read_u32(&entry_size, file)) != 0)
-        goto free;
-
-      if (info->dump) {
-        if (sample_count <= 10 ||
-            i < 5 || i >= sample_count - 5) {
-          print_spaces(info);
-          printf("[%u] entry_size:            %u\n", i, entry_size);
-        } else if (i == 5) {
-          print_spaces(info);
-          printf("[...]\n");
-        }
-      }
-
-      entry[i].entry_size = entry_size;
-    }
-  } else {
-
-    if ((ret = mem_alloc(&entry, sample_count * sizeof(* entry))) != 0)
-      goto exit;
+  dref = &p_box.dinf->dref;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(dref->entry_count, file)) != 0)
+    return ret;
 
-    for (i = 0; i < sample_count; i++)
-      entry[i].entry_size = sample_size;
+  for (i = 0; i < dref->entry_count; i++) {
+    box.dref_entry = &dref->entry[i];
+    if ((ret = write_box(file, box, dref->entry[i].type,
+                         write_dref_entry)) != 0)
+      return ret;
   }
-  stsz = &p_box.mdia->minf.stbl.stsz;
-  stsz->sample_size = sample_size;
-  stsz->sample_count = sample_count;
-  stsz->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+  return 0;
 }
 
 static int
-read_stss(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int entry_count;
-  unsigned int sample_number;
-  struct stss_entry * entry;
-  struct box_stss * stss;
-  unsigned int i;
+write_dinf(struct stream * file, box_t p_box) {
+  box_t box;
   int ret;
 
-  ret = 0;
+  box.dinf = &p_box.mdia->minf.dinf;
+  if ((ret = write_box(file, box, BOX_DREF, write_dref)) != 0)
+    return ret;
+  return 0;
+}
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&entry_count, file)) != 0 ||
-      (ret = mem_alloc(&entry, entry_count * sizeof(* entry))) != 0)
-    goto exit;
+static int
+write_bits_init(struct bits * b, unsigned char * bytes, unsigned int size) {
+  if (size == 0)
+    return ERR_EMPTY_BITS;
+  b->size = size;
+  b->bytes = bytes;
+  b->buf = 0;
+  b->i = 0;
+  b->pos = 0;
+  return 0;
+}
 
-  if (info->dump)
-    PRINT_U(entry_count, info);
+static int
+write_bits_resize(struct bits * b) {
+  int ret;
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&sample_number, file)) != 0)
-      goto free;
+  if ((ret = mem_realloc(&b->bytes, b->size << 1)) != 0)
+    return ret;
+  b->size <<= 1;
+  return 0;
+}
 
-    if (info->dump) {
-      if (entry_count <= 10 ||
-          i < 5 || i >= entry_count - 5) {
-        print_spaces(info);
-        printf("[%u] sample_number:            %u\n", i, sample_number);
-      } else if (i == 5) {
-        print_spaces(info);
-        printf("[...]\n");
-      }
-    }
+static int
+write_bits_flush(struct bits * b) {
+  int ret;
 
-    entry[i].sample_number = sample_number;
-  }
-  stss = &p_box.mdia->minf.stbl.stss;
-  stss->entry_count = entry_count;
-  stss->entry = entry;
-free:
-  if (ret)
-    mem_free(entry);
-exit:
-  return ret;
+  if (b->pos == 0)
+    return 0;
+  if (b->i >= b->size)
+    if ((ret = write_bits_resize(b)) != 0)
+      return ret;
+  b->bytes[b->i++] = (b->buf << (8 - b->pos)) & 0xff;
+  b->pos = 0;
+  b->buf = 0;
+  return 0;
 }
 
 static int
-read_sgpd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int grouping_type;
-  unsigned int default_length;
-  unsigned int entry_count;
-  short roll_distance;
+write_code(unsigned int n, struct bits * bits) {
+  unsigned int z; /* number of leading zeros */
+  unsigned int j;
+
+  unsigned char * b;
+  unsigned int size;
   unsigned int i;
+  unsigned int pos;
+  unsigned int u;
+
   int ret;
 
-  (void) p_box;
+  b    = bits->bytes;
+  size = bits->size;
+  i    = bits->i;
+  pos  = bits->pos;
+  u    = bits->buf;
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&grouping_type, file)) != 0)
-    return ret;
+  if (n == 0xffffffff) {
 
-  if (info->dump)
-    print_box("grouping_type", grouping_type, info);
+    /* step 1: add by 1 */
+    n = 0;
 
-  if (version == 1) {
-    if ((ret = read_u32(&default_length, file)) != 0)
-      return ret;
+    /* step 2: count leading zeros */
+    z = 32;
 
-    if (info->dump)
-      PRINT_U(default_length, info);
-  }
+  } else {
 
-  if ((ret = read_u32(&entry_count, file)) != 0)
-    return ret;
+    /* step 1: add by 1 */
+    n++;
 
-  if (info->dump)
-    PRINT_U(entry_count, info);
+    /* step 2: count leading zeros */
+    z = 0;
+    j = n;
+    while (j > 1) {
+      j >>= 1;
+      z++;
+    }
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_s16(&roll_distance, file)) != 0)
+    /* step 3: remove first non-zero bit */
+    n &= ~((unsigned int) 1 << z);
+  }
+
+  while (i + ((pos + z + z + 1 - 1) >> 3) > size) {
+    if ((ret = write_bits_resize(bits)) != 0)
       return ret;
+    b    = bits->bytes;
+    size = bits->size;
+  }
 
-    if (info->dump)
-      PRINT_S(roll_distance, info);
+  /* write zeros */
+  if (z > 8 - pos) {
+    u <<= 8 - pos;
+    pos = z - (8 - pos);
+    while (pos > 8) {
+      pos -= 8;
+      b[i++] = u & 0xff;
+      u = 0;
+    }
+    if (pos) {
+      b[i++] = u & 0xff;
+      u = 0;
+    }
+  } else {
+    u <<= z;
+    pos += z;
+  }
+
+  /* first non-zero bit */
+  if (pos == 8) {
+    pos = 1;
+    b[i++] = u & 0xff;
+    u = 1;
+  } else {
+    u <<= 1;
+    u |= 1;
+    pos += 1;
+  }
+
+  /* last n bit */
+  if (z > 8 - pos) {
+    u <<= 8 - pos;
+    pos = z - (8 - pos);
+    u |= n >> pos;
+    while (pos > 8) {
+      pos -= 8;
+      b[i++] = u & 0xff;
+      u = n >> pos;
+    }
+    if (pos) {
+      b[i++] = u & 0xff;
+      u = n;
+    }
+  } else {
+    u <<= z;
+    u |= n;
+    pos += z;
   }
+
+  bits->buf = u;
+  bits->pos = pos;
+  bits->i = i;
   return 0;
 }
 
 static int
-read_sbgp(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned int grouping_type;
-  unsigned int entry_count;
-  unsigned int sample_count;
-  unsigned int group_desc_index;
+write_bit(unsigned char n, struct bits * bits) {
+  unsigned char * b;
+  unsigned int size;
   unsigned int i;
-  int ret;
-
-  (void) p_box;
-
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u32(&grouping_type, file)) != 0)
-    return ret;
-
-  if (info->dump)
-    print_box("grouping_type", grouping_type, info);
+  unsigned int pos;
+  unsigned int u;
 
-  if ((ret = read_u32(&entry_count, file)) != 0)
-    return ret;
+  int ret;
 
-  if (info->dump)
-    PRINT_U(entry_count, info);
+  b    = bits->bytes;
+  size = bits->size;
+  i    = bits->i;
+  pos  = bits->pos;
+  u    = bits->buf;
 
-  for (i = 0; i < entry_count; i++) {
-    if ((ret = read_u32(&sample_count, file)) != 0 ||
-        (ret = read_u32(&group_desc_index, file)) != 0)
-      return ret;
+  if (n > 1)
+    return ERR_WRITE_BIT;
 
-    if (info->dump) {
-      PRINT_U(sample_count, info);
-      PRINT_U(group_desc_index, info);
+  if (pos == 8) {
+    while (i >= size) {
+      if ((ret = write_bits_resize(bits)) != 0)
+        return ret;
+      b    = bits->bytes;
+      size = bits->size;
     }
+    pos = 1;
+    b[i++] = u & 0xff;
+    u = n;
+  } else {
+    u <<= 1;
+    u |= n;
+    pos += 1;
   }
-  return 0;
-}
 
-static int
-read_stbl(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_STSD, 0, BOX_QTY_1,      read_stsd},
-    {BOX_STTS, 0, BOX_QTY_1,      read_stts},
-    {BOX_CTTS, 0, BOX_QTY_0_OR_1, read_ctts},
-    {BOX_STSC, 0, BOX_QTY_1,      read_stsc},
-    {BOX_STCO, 0, BOX_QTY_1,      read_stco},
-    {BOX_STSZ, 0, BOX_QTY_1,      read_stsz},
-    {BOX_STSS, 0, BOX_QTY_0_OR_1, read_stss},
-    {BOX_SGPD, 0, BOX_QTY_0_TO_N, read_sgpd},
-    {BOX_SBGP, 0, BOX_QTY_0_TO_N, read_sbgp},
-    {0, 0, 0, NULL}
-  };
-  return read_box(file, info, p_box, funcs);
+  bits->buf = u;
+  bits->pos = pos;
+  bits->i = i;
+  return 0;
 }
 
 static int
-read_vmhd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  unsigned short graphicsmode;
-  unsigned short opcolor[3];
-  struct box_vmhd * vmhd;
+write_bits(unsigned int n, unsigned char w, /* width */
+           struct bits * bits) {
+  unsigned char * b;
+  unsigned int size;
   unsigned int i;
-  int ret;
-
-  ret = 0;
+  unsigned int pos;
+  unsigned int u;
 
-  if (p_box.mdia->hdlr.type != BOX_VIDE) {
-    ret = ERR_UNK_HDLR_TYPE;
-    goto exit;
-  }
+  int ret;
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_u16(&graphicsmode, file)) != 0 ||
-      (ret = mem_alloc(&vmhd, sizeof(* vmhd))) != 0)
-    goto exit;
+  b    = bits->bytes;
+  size = bits->size;
+  i    = bits->i;
+  pos  = bits->pos;
+  u    = bits->buf;
 
-  if (info->dump)
-    PRINT_U(graphicsmode, info);
+  /* width valid range: 1~32 */
+  if (w < 1 || w > 32)
+    return ERR_WRITE_BITS;
 
-  for (i = 0; i < 3; i++)
-    if ((ret = read_u16(&opcolor[i], file)) != 0)
-      goto free;
+  while (i + ((pos + w - 1) >> 3) > size) {
+    if ((ret = write_bits_resize(bits)) != 0)
+      return ret;
+    b    = bits->bytes;
+    size = bits->size;
+  }
 
-  if (info->dump) {
-    print_u("opcolor[0]", opcolor[0], info);
-    print_u("opcolor[1]", opcolor[1], info);
-    print_u("opcolor[2]", opcolor[2], info);
+  if (w > 8 - pos) {
+    u <<= 8 - pos;
+    pos = w - (8 - pos);
+    u |= n >> pos;
+    while (pos > 8) {
+      pos -= 8;
+      b[i++] = u & 0xff;
+      u = n >> pos;
+    }
+    if (pos) {
+      b[i++] = u & 0xff;
+      u = n;
+    }
+  } else {
+    u <<= w;
+    u |= n;
+    pos += w;
   }
 
-  vmhd->graphicsmode = graphicsmode;
-
-  for (i = 0; i < 3; i++)
-    vmhd->opcolor[i] = opcolor[i];
-
-  p_box.mdia->minf.hd.vmhd = vmhd;
-free:
-  if (ret)
-    mem_free(vmhd);
-exit:
-  return ret;
+  bits->buf = u;
+  bits->pos = pos;
+  bits->i = i;
+  return 0;
 }
 
 static int
-read_smhd(FILE * file, struct box_info * info, box_t p_box) {
-  unsigned char version;
-  unsigned int flags;
-  short balance;
-  struct box_smhd * smhd;
+write_vui_para(struct vui * vui, struct bits * bits) {
   int ret;
 
   ret = 0;
 
-  if (p_box.mdia->hdlr.type != BOX_SOUN) {
-    ret = ERR_UNK_HDLR_TYPE;
+  if ((ret = write_bit(vui->aspect_ratio_info_present_flag, bits)) != 0)
     goto exit;
-  }
 
-  if ((ret = read_ver(&version, &flags, file)) != 0 ||
-      (ret = read_s16(&balance, file)) != 0 ||
-      (ret = skip(file, 2)) != 0 || /* reserved */
-      (ret = mem_alloc(&smhd, sizeof(* smhd))) != 0)
-    goto exit;
+  if (vui->aspect_ratio_info_present_flag)
+    if ((ret = write_bits(vui->aspect_ratio_idc, 8, bits)) != 0)
+      goto exit;
 
-  if (info->dump)
-    PRINT_S_8(balance, info);
+  if ((ret = write_bit(vui->overscan_info_present_flag, bits)) != 0)
+    goto exit;
 
-  smhd->balance = balance;
+  if ((ret = write_bit(vui->video_signal_type_present_flag, bits)) != 0)
+    goto exit;
 
-  p_box.mdia->minf.hd.smhd = smhd;
-exit:
-  return ret;
-}
+  if (vui->video_signal_type_present_flag) {
+    if ((ret = write_bits(vui->video_format, 3, bits)) != 0 ||
+        (ret = write_bit(vui->video_full_range_flag, bits)) != 0 ||
+        (ret = write_bit(vui->colour_description_present_flag, bits)) != 0)
+      goto exit;
 
-static int
-read_minf(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_DINF, 0, BOX_QTY_1,      read_dinf},
-    {BOX_STBL, 0, BOX_QTY_1,      read_stbl},
-    {BOX_VMHD, 0, BOX_QTY_0_OR_1, read_vmhd},
-    {BOX_SMHD, 0, BOX_QTY_0_OR_1, read_smhd},
-    {0, 0, 0, NULL}
-  };
-  return read_box(file, info, p_box, funcs);
-}
+    if (vui->colour_description_present_flag)
+      if ((ret = write_bits(vui->colour_primaries, 8, bits)) != 0 ||
+          (ret = write_bits(vui->transfer_characteristics, 8, bits)) != 0 ||
+          (ret = write_bits(vui->matrix_coefficients, 8, bits)) != 0)
+        goto exit;
+  }
 
-static int
-read_mdia(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_MDHD, 0, BOX_QTY_1, read_mdhd},
-    {BOX_HDLR, 0, BOX_QTY_1, read_hdlr},
-    {BOX_MINF, 0, BOX_QTY_1, read_minf},
-    {0, 0, 0, NULL}
-  };
-  box_t box;
-  box.mdia = &p_box.trak->mdia;
-  return read_box(file, info, box, funcs);
-}
+  if ((ret = write_bit(vui->chroma_loc_info_present_flag, bits)) != 0)
+    goto exit;
 
-static void
-init_trak(struct box_trak * trak) {
-  trak->edts.elst.entry = NULL;
-  trak->edts.elst.entry_count = 0;
-  trak->mdia.hdlr.name = NULL;
-  trak->mdia.hdlr.type = BOX_NIL;
-  trak->mdia.minf.dinf.dref.entry = NULL;
-  trak->mdia.minf.dinf.dref.entry_count = 0;
-  trak->mdia.minf.stbl.stsd.entry.vide = NULL;
-  trak->mdia.minf.stbl.stsd.entry_count = 0;
-  trak->mdia.minf.stbl.stts.entry = NULL;
-  trak->mdia.minf.stbl.ctts.entry = NULL;
-  trak->mdia.minf.stbl.ctts.entry_count = 0;
-  trak->mdia.minf.stbl.stsc.entry = NULL;
-  trak->mdia.minf.stbl.stco.entry = NULL;
-  trak->mdia.minf.stbl.stsz.entry = NULL;
-  trak->mdia.minf.stbl.stss.entry = NULL;
-  trak->mdia.minf.stbl.stss.entry_count = 0;
-  trak->mdia.minf.hd.vmhd = NULL;
-}
+  if ((ret = write_bit(vui->timing_info_present_flag, bits)) != 0)
+    goto exit;
 
-static void
-free_trak(struct box_trak * trak) {
-  unsigned int i;
+  if (vui->timing_info_present_flag)
+    if ((ret = write_bits(vui->num_units_in_tick, 32, bits)) != 0 ||
+        (ret = write_bits(vui->time_scale, 32, bits)) != 0 ||
+        (ret = write_bit(vui->fixed_frame_rate_flag, bits)) != 0)
+      goto exit;
 
-  mem_free(trak->edts.elst.entry);
-  mem_free(trak->mdia.hdlr.name);
+  if ((ret = write_bit(vui->nal_hrd_para_present_flag, bits)) != 0)
+    goto exit;
 
-  for (i = 0; i < trak->mdia.minf.dinf.dref.entry_count; i++)
-    free_dref_entry(&trak->mdia.minf.dinf.dref.entry[i]);
-  mem_free(trak->mdia.minf.dinf.dref.entry);
+  if ((ret = write_bit(vui->vcl_hrd_para_present_flag, bits)) != 0)
+    goto exit;
 
-  if (trak->mdia.hdlr.type == BOX_VIDE) {
-    for (i = 0; i < trak->mdia.minf.stbl.stsd.entry_count; i++)
-      free_vide(&trak->mdia.minf.stbl.stsd.entry.vide[i]);
-    mem_free(trak->mdia.minf.stbl.stsd.entry.vide);
-  } else if (trak->mdia.hdlr.type == BOX_SOUN) {
-    for (i = 0; i < trak->mdia.minf.stbl.stsd.entry_count; i++)
-      free_soun(&trak->mdia.minf.stbl.stsd.entry.soun[i]);
-    mem_free(trak->mdia.minf.stbl.stsd.entry.soun);
-  }
+  if ((ret = write_bit(vui->pic_struct_present_flag, bits)) != 0 ||
+      (ret = write_bit(vui->bitstream_restriction_flag, bits)) != 0)
+    goto exit;
 
-  mem_free(trak->mdia.minf.stbl.stts.entry);
-  mem_free(trak->mdia.minf.stbl.ctts.entry);
-  mem_free(trak->mdia.minf.stbl.stsc.entry);
-  mem_free(trak->mdia.minf.stbl.stco.entry);
-  mem_free(trak->mdia.minf.stbl.stsz.entry);
-  mem_free(trak->mdia.minf.stbl.stss.entry);
-  mem_free(trak->mdia.minf.hd.vmhd);
+  if (vui->bitstream_restriction_flag)
+    if ((ret = write_bit(vui->motion_vectors_over_pic_boundaries_flag,
+                         bits)) != 0 ||
+        (ret = write_code(vui->max_bytes_per_pic_denom, bits)) != 0 ||
+        (ret = write_code(vui->max_bits_per_mb_denom, bits)) != 0 ||
+        (ret = write_code(vui->log2_max_mv_length_horizontal, bits)) != 0 ||
+        (ret = write_code(vui->log2_max_mv_length_vertical, bits)) != 0 ||
+        (ret = write_code(vui->num_reorder_frames, bits)) != 0 ||
+        (ret = write_code(vui->max_dec_frame_buffering, bits)) != 0)
+      goto exit;
+exit:
+  return ret;
 }
 
 static int
-read_trak(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_TKHD, 0, BOX_QTY_1,      read_tkhd},
-    {BOX_EDTS, 0, BOX_QTY_0_OR_1, read_edts},
-    {BOX_MDIA, 0, BOX_QTY_1,      read_mdia},
-    {0, 0, 0, NULL}
-  };
-  struct box_moov * moov;
-  struct box_trak * trak;
-  box_t box;
+write_nalu(union nalu arg_nalu, struct stream * file) {
+  unsigned char nal_ref_idc;
+  unsigned char nal_unit_type;
+  struct bits bits;
+  unsigned char * nalu;
+  unsigned int size;
+  unsigned int len;
+  unsigned int i;
   int ret;
 
-  ret = 0;
-
-  moov = p_box.moov;
-  if ((ret = mem_realloc(&moov->trak,
-                         (moov->trak_len + 1) * sizeof(* moov->trak))) != 0)
-    goto exit;
+  nal_ref_idc = arg_nalu.sps->nal_ref_idc;
+  nal_unit_type = arg_nalu.sps->nal_unit_type;
 
-  box.trak = trak = &moov->trak[moov->trak_len];
+  size = 1;
 
-  init_trak(trak);
+  if ((ret = mem_alloc(&nalu, size)) != 0)
+    goto exit;
 
-  if ((ret = read_box(file, info, box, funcs)) != 0)
+  if ((ret = write_bits_init(&bits, nalu, size)) != 0 ||
+      (ret = write_bits(nal_ref_idc, 3, &bits)) != 0 ||
+      (ret = write_bits(nal_unit_type, 5, &bits)) != 0)
     goto free;
 
-  moov->trak_len++;
-free:
-  if (ret)
-    free_trak(trak);
-exit:
-  return ret;
-}
+  if (nal_unit_type == NAL_SPS) {
+    unsigned char profile_comp;
+    struct sps * sps;
 
-static int
-read_moov(FILE * file, struct box_info * info, box_t p_box) {
-  struct box_func funcs[] = {
-    {BOX_MVHD, 0, BOX_QTY_1,      read_mvhd},
-    {BOX_TRAK, 0, BOX_QTY_1_TO_N, read_trak},
-    {BOX_IODS, 0, BOX_QTY_0_OR_1, read_iods},
-    {BOX_UDTA, 0, BOX_QTY_0_TO_N, read_udta},
-    {0, 0, 0, NULL}
-  };
-  box_t box;
-  box.moov = &p_box.top->moov;
-  return read_box(file, info, box, funcs);
-}
+    sps = arg_nalu.sps;
 
-static int
-read_mdat(FILE * file, struct box_info * info, box_t p_box) {
-  long pos;
-  int ret;
+    profile_comp = (unsigned char) ((sps->c_set0_flag << 7) |
+                                    (sps->c_set1_flag << 6) |
+                                    (sps->c_set2_flag << 5) |
+                                    (sps->c_set3_flag << 4) |
+                                    (sps->c_set4_flag << 3) |
+                                    (sps->c_set5_flag << 2));
 
-  if ((ret = get_pos(&pos, file)) != 0 ||
-      (ret = skip(file, info->size - (unsigned int) (pos - info->pos))) != 0)
-    return ret;
+    if ((ret = write_bits(sps->profile_idc, 8, &bits)) != 0 ||
+        (ret = write_bits(profile_comp, 8, &bits)) != 0 ||
+        (ret = write_bits(sps->level_idc, 8, &bits)) != 0 ||
+        (ret = write_code(sps->seq_para_set_id, &bits)) != 0 ||
+        (ret = write_code(sps->log2_max_frame_num_minus4, &bits)) != 0 ||
+        (ret = write_code(sps->pic_order_cnt_type, &bits)) != 0)
+      goto free;
 
-  p_box.top->mdat.file = file;
-  return 0;
-}
+    if (sps->pic_order_cnt_type == 0)
+      if ((ret = write_code(sps->log2_max_pic_order_cnt_lsb_minus4,
+                            &bits)) != 0)
+        goto free;
 
-static int
-read_free(FILE * file, struct box_info * info, box_t p_box) {
-  long pos;
-  int ret;
+    if ((ret = write_code(sps->max_num_ref_frames, &bits)) != 0 ||
+        (ret = write_bit(sps->gaps_in_frame_num_value_allowed_flag,
+                         &bits)) != 0 ||
+        (ret = write_code(sps->pic_width_in_mbs_minus_1, &bits)) != 0 ||
+        (ret = write_code(sps->pic_height_in_mbs_minus_1, &bits)) != 0 ||
+        (ret = write_bit(sps->frame_mbs_only_flag, &bits)) != 0)
+      goto free;
 
-  (void) p_box;
+    if (!sps->frame_mbs_only_flag)
+      if ((ret = write_bit(sps->mb_adaptive_frame_field_flag, &bits)) != 0)
+        goto free;
 
-  if ((ret = get_pos(&pos, file)) != 0 ||
-      (ret = skip(file, info->size - (unsigned int) (pos - info->pos))) != 0)
-    return ret;
-  return 0;
-}
+    if ((ret = write_bit(sps->direct_8x8_inference_flag, &bits)) != 0 ||
+        (ret = write_bit(sps->frame_cropping_flag, &bits)) != 0)
+      goto free;
 
-static int
-fill_stbl(struct box_top * top) {
-  struct box_moov * moov;
-  struct box_stbl * stbl;
-  struct box_stco * stco;
-  struct box_stsc * stsc;
-  struct box_stsz * stsz;
-  unsigned int i;
-  unsigned int j;
-  unsigned int o; /* stco->entry[o] */
-  unsigned int c; /* stsc->entry[c], index of chunk */
-  unsigned int z; /* stsz->entry[z], index of sample */
-  unsigned int first_chunk;
-  unsigned int sample_offset;
+    if (sps->frame_cropping_flag) {
+      if ((ret = write_code(sps->frame_crop_left_offset, &bits)) != 0 ||
+          (ret = write_code(sps->frame_crop_right_offset, &bits)) != 0 ||
+          (ret = write_code(sps->frame_crop_top_offset, &bits)) != 0 ||
+          (ret = write_code(sps->frame_crop_bottom_offset, &bits)) != 0)
+        goto free;
+    }
 
-  moov = &top->moov;
+    if ((ret = write_bit(sps->vui_para_present_flag, &bits)) != 0)
+      goto free;
+
+    if (sps->vui_para_present_flag)
+      if ((ret = write_vui_para(&sps->vui, &bits)) != 0)
+        goto free;
+  } else if (nal_unit_type == NAL_PPS) {
+    struct pps * pps;
 
-  for (i = 0; i < moov->trak_len; i++) {
-    stbl = &moov->trak[i].mdia.minf.stbl;
-    stco = &stbl->stco;
-    stsc = &stbl->stsc;
-    stsz = &stbl->stsz;
-    first_chunk = stco->entry_count;
-    z = stsz->sample_count;
+    pps = arg_nalu.pps;
+    if ((ret = write_code(pps->pic_para_set_id, &bits)) != 0 ||
+        (ret = write_code(pps->seq_para_set_id, &bits)) != 0 ||
+        (ret = write_bit(pps->entropy_coding_mode_flag, &bits)) != 0 ||
+        (ret = write_bit(pps->pic_order_present_flag, &bits)) != 0 ||
+        (ret = write_code(pps->num_slice_groups_minus1, &bits)) != 0 ||
+        (ret = write_code(pps->num_ref_idx_10_active_minus1, &bits)) != 0 ||
+        (ret = write_code(pps->num_ref_idx_11_active_minus1, &bits)) != 0 ||
+        (ret = write_bit(pps->weighted_pred_flag, &bits)) != 0 ||
+        (ret = write_bits(pps->weighted_bipred_idc, 2, &bits)) != 0 ||
+        (ret = write_code(pps->pic_init_qp_minus26, &bits)) != 0 ||
+        (ret = write_code(pps->pic_init_qs_minus26, &bits)) != 0 ||
+        (ret = write_code(pps->chroma_qp_index_offset, &bits)) != 0 ||
+        (ret = write_bit(pps->deblocking_filter_control_present_flag,
+                         &bits)) != 0 ||
+        (ret = write_bit(pps->constrained_intra_pred_flag, &bits)) != 0 ||
+        (ret = write_bit(pps->redundant_pic_cnt_present_flag, &bits)) != 0)
+      goto free;
+  } else {
+    ret = ERR_UNK_NAL_UNIT_TYPE;
+    goto free;
+  }
 
-    /* iterate each stsc entry reversely */
-    for (c = stsc->entry_count; c--;) {
+  if ((ret = write_bit(1, &bits)) != 0 || /* rbsp_stop_one_bit */
+      (ret = write_bits_flush(&bits)) != 0) /* rbsp_alignment_zero_bit */
+    goto free;
 
-      /* iterate each chunk reversely */
-      for (o = first_chunk; o-- > stsc->entry[c].first_chunk-1;) {
+  size = bits.i;
+  nalu = bits.bytes;
 
-        sample_offset = stco->entry[o].chunk_offset;
-        z -= stsc->entry[c].samples_per_chunk;
+  /* size after emulation prevention */
+  len = size;
+  for (i = 1; i < size;) {
+    if (i + 2 < size && !nalu[i] && !nalu[i+1] && !(nalu[i+2] & 0xfc)) {
+      len++;
+      i += 3;
+    } else {
+      i++;
+    }
+  }
 
-        /* iterate each sample */
-        for (j = 0; j < stsc->entry[c].samples_per_chunk; j++) {
-          stsz->entry[z+j].pos = sample_offset; /* set sample's pos */
-          sample_offset += stsz->entry[z+j].entry_size;
-        }
+  if ((ret = write_u16((unsigned short) len, file)) != 0 ||
+      (ret = write_u8(nalu[0], file)) != 0)
+    goto free;
 
-        /* set chunk's samples_per_chunk */
-        stco->entry[o].samples_per_chunk = stsc->entry[c].samples_per_chunk;
-      }
-      first_chunk = stsc->entry[c].first_chunk-1;
+  for (i = 1; i < size;) {
+    if (i + 2 < size && !nalu[i] && !nalu[i+1] && !(nalu[i+2] & 0xfc)) {
+      if ((ret = write_u8(nalu[i++], file)) != 0 ||
+          (ret = write_u8(nalu[i++], file)) != 0 ||
+          (ret = write_u8(0x03, file)) != 0 ||
+          (ret = write_u8(nalu[i++], file)) != 0)
+        goto free;
+    } else {
+      if ((ret = write_u8(nalu[i++], file)) != 0)
+        goto free;
     }
   }
-  return 0;
+free:
+  nalu = bits.bytes;
+  mem_free(nalu);
+exit:
+  return ret;
 }
 
 static int
-read_top(FILE * file, struct box_top * top, unsigned char dump) {
-  struct box_info info;
-  struct box_func funcs[] = {
-    {BOX_FTYP, 0, BOX_QTY_1,      read_ftyp},
-    {BOX_MOOV, 0, BOX_QTY_1,      read_moov},
-    {BOX_MDAT, 0, BOX_QTY_1,      read_mdat},
-    {BOX_FREE, 0, BOX_QTY_0_TO_N, read_free},
-    {0, 0, 0, NULL}
-  };
-  box_t box;
-  long size;
+write_avcc(struct stream * file, box_t p_box) {
+  unsigned char profile_comp;
+  unsigned int i;
+  struct box_avcc * avcc;
+  union nalu nalu;
   int ret;
 
-  if (fseek(file, 0, SEEK_END) == -1)
-    return ERR_IO;
-
-  if ((ret = get_pos(&size, file)) != 0)
-    return ret;
-
-  if (fseek(file, 0, SEEK_SET) == -1)
-    return ERR_IO;
-
-  info.pos = 0;
-  info.size = (unsigned int) size;
-  info.type = BOX_TOP;
-  info.depth = 0;
-  info.dump = dump;
+  avcc = &p_box.vide->avcc;
 
-  top->ftyp.c_brands = NULL;
-  top->moov.iods = NULL;
-  top->moov.trak = NULL;
-  top->moov.trak_len = 0;
+  profile_comp = (unsigned char) ((avcc->c_set0_flag << 7) |
+                                  (avcc->c_set1_flag << 6) |
+                                  (avcc->c_set2_flag << 5) |
+                                  (avcc->c_set3_flag << 4) |
+                                  (avcc->c_set4_flag << 3) |
+                                  (avcc->c_set5_flag << 2));
 
-  box.top = top;
-  if ((ret = read_box(file, &info, box, funcs)) != 0 ||
-      (ret = fill_stbl(top)) != 0)
+  if ((ret = write_u8(avcc->conf_version, file)) != 0 ||
+      (ret = write_u8(avcc->profile_idc, file)) != 0 ||
+      (ret = write_u8(profile_comp, file)) != 0 ||
+      (ret = write_u8(avcc->level_idc, file)) != 0 ||
+      (ret = write_u8(avcc->len_size_minus_one | 0xfc, file)) != 0 ||
+      (ret = write_u8(avcc->num_of_sps | 0xe0, file)) != 0)
     return ret;
-  return 0;
-}
 
-static void
-free_top(struct box_top * top) {
-  unsigned int i;
-
-  for (i = 0; i < top->moov.trak_len; i++)
-    free_trak(&top->moov.trak[i]);
-
-  mem_free(top->moov.trak);
-  mem_free(top->moov.iods);
-  mem_free(top->ftyp.c_brands);
-}
-
-static int
-open_file(FILE ** file_p, const char * fname) {
-  FILE * file;
+  for (i = 0; i < avcc->num_of_sps; i++) {
+    nalu.sps = &avcc->sps.sps[i];
+    if ((ret = write_nalu(nalu, file)) != 0)
+      return ret;
+  }
 
-  file = fopen(fname, "rb");
-  if (file == NULL)
-    return ERR_IO;
+  if ((ret = write_u8(avcc->num_of_pps, file)) != 0)
+    return ret;
 
-  * file_p = file;
+  for (i = 0; i < avcc->num_of_pps; i++) {
+    nalu.pps = &avcc->pps.pps[i];
+    if ((ret = write_nalu(nalu, file)) != 0)
+      return ret;
+  }
   return 0;
 }
 
-static void
-close_file(FILE * file) {
-  fclose(file);
-}
-
 static int
-write_ary(void * ptr, size_t size, size_t len, FILE * file) {
-  if (fwrite(ptr, size, len, file) != len)
-    return ERR_IO;
-  return 0;
-}
+write_vide(struct stream * file, box_t box) {
+  unsigned char len;
+  struct box_vide * vide;
+  int ret;
 
-static int
-write_s16(short x, FILE * file) {
-  unsigned char b16[2];
+  vide = box.vide;
 
-  b16[0] = (unsigned char) (x >> 8);
-  b16[1] = (unsigned char) x;
+  len = (unsigned char) strlen(vide->compressorname);
 
-  if (fwrite(b16, sizeof(b16), 1, file) != 1)
-    return ERR_IO;
+  if ((ret = skip(file, 6)) != 0 || /* reserved */
+      (ret = write_u16(vide->dref_index, file)) != 0 ||
+      (ret = skip(file, 2 + 2 + 4 * 3)) != 0 || /* pre / reserved / pre */
+      (ret = write_u16(vide->width, file)) != 0 ||
+      (ret = write_u16(vide->height, file)) != 0 ||
+      (ret = write_u32(vide->h_rez, file)) != 0 ||
+      (ret = write_u32(vide->v_rez, file)) != 0 ||
+      (ret = skip(file, 4)) != 0 || /* reserved */
+      (ret = write_u16(vide->frame_count, file)) != 0 ||
+      (ret = write_u8(len, file)) != 0 ||
+      (ret = write_ary(vide->compressorname,
+                       sizeof(vide->compressorname) - 1, 1, file)) != 0 ||
+      (ret = write_u16(vide->depth, file)) != 0 ||
+      (ret = write_s16((short) -1, file)) != 0 || /* pre defined */
+      (ret = write_box(file, box, BOX_AVCC, write_avcc)) != 0)
+    return ret;
   return 0;
 }
 
 static int
-write_s32(int x, FILE * file) {
-  unsigned char b32[4];
-
-  b32[0] = (unsigned char) (x >> 24);
-  b32[1] = (unsigned char) (x >> 16);
-  b32[2] = (unsigned char) (x >> 8);
-  b32[3] = (unsigned char) x;
+write_esds(struct stream * file, box_t p_box) {
+  struct box_esds * esds;
+  struct es_descr * es;
+  struct decoder_config_descr * dec;
+  struct sl_config_descr * sl;
+  struct audio_specific_config * audio;
 
-  if (fwrite(b32, sizeof(b32), 1, file) != 1)
-    return ERR_IO;
-  return 0;
-}
+  struct bits bits;
+  unsigned char codec;
+  unsigned int buffer_size_db;
+  unsigned int i;
+  unsigned int i_es;
+  unsigned int i_dec;
+  unsigned int i_audio;
+  unsigned int i_sl;
+  long pos_es;
+  long pos_dec;
+  long pos_audio;
+  long pos_sl;
+  int ret;
 
-static int
-write_u8(unsigned char x, FILE * file) {
-  if (fputc(x, file) == EOF)
-    return ERR_IO;
-  return 0;
-}
+  esds = &p_box.soun->esds;
+  es = &esds->es;
+  dec = &es->dec_conf;
+  audio = &dec->audio;
+  sl = &es->sl_conf;
 
-static int
-write_u16(unsigned short x, FILE * file) {
-  unsigned char b16[2];
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = begin_tag(&i_es, &pos_es, TAG_ES_DESCR, file)) != 0)
+    return ret;
 
-  b16[0] = (unsigned char) (x >> 8);
-  b16[1] = (unsigned char) x;
+  if ((ret = write_u16(es->es_id, file)) != 0 ||
+      (ret = write_u8(es->es_flags, file)) != 0 ||
+      (ret = begin_tag(&i_dec, &pos_dec, TAG_DECODER_CONFIG_DESCR,
+                       file)) != 0)
+    return ret;
 
-  if (fwrite(b16, sizeof(b16), 1, file) != 1)
-    return ERR_IO;
-  return 0;
-}
+  buffer_size_db = ((unsigned int) (dec->stream_type << 26) |
+                    (unsigned int) (dec->up_stream << 25) |
+                    (1 << 24) | /* reserved */
+                    dec->buffer_size_db);
 
-static int
-write_u32(unsigned int x, FILE * file) {
-  unsigned char b32[4];
+  if ((ret = write_u8(dec->object_type_idc, file)) != 0 ||
+      (ret = id_to_codec(&codec, dec->object_type_idc)) != 0 ||
+      (ret = write_u32(buffer_size_db, file)) != 0 ||
+      (ret = write_u32(dec->max_bitrate, file)) != 0 ||
+      (ret = write_u32(dec->avg_bitrate, file)) != 0 ||
+      (ret = begin_tag(&i_audio, &pos_audio, TAG_DEC_SPECIFIC_INFO,
+                       file)) != 0)
+    return ret;
 
-  b32[0] = (unsigned char) (x >> 24);
-  b32[1] = (unsigned char) (x >> 16);
-  b32[2] = (unsigned char) (x >> 8);
-  b32[3] = (unsigned char) x;
+  if (codec == CODEC_AAC) {
 
-  if (fwrite(b32, sizeof(b32), 1, file) != 1)
-    return ERR_IO;
-  return 0;
-}
+    if ((ret = mem_alloc(&bits.bytes, audio->tag_len)) != 0)
+      return ret;
 
-static int
-write_str(char * str, FILE * file) {
-  if (fwrite(str, strlen(str) + 1, 1, file) != 1)
-    return ERR_IO;
-  return 0;
-}
+    for (i = 0; i < audio->tag_len; i++)
+      bits.bytes[i] = 0;
 
-static int
-write_ver(unsigned char version, unsigned int flags, FILE * file) {
-  unsigned int b32;
-  b32 = ((unsigned int) version << 24) | flags;
-  return write_u32(b32, file);
-}
+    if ((ret = write_bits_init(&bits, bits.bytes, audio->tag_len)) != 0)
+      goto free;
 
-static int
-write_tag(unsigned char tag, unsigned int len, FILE * file) {
-  unsigned int m; /* mask */
-  unsigned int n; /* bit length of len */
-  unsigned int b; /* byte */
-  int ret;
+    if (audio->audio_object_type >= 0x20) {
+      if ((ret = write_bits(0x1f, 5, &bits)) != 0 ||
+          (ret = write_bits((unsigned int)
+                            audio->audio_object_type - 0x20, 6, &bits)) != 0)
+        goto free;
+    } else {
+      if ((ret = write_bits(audio->audio_object_type, 5, &bits)) != 0)
+        goto free;
+    }
 
-  if ((ret = write_u8(tag, file)) != 0)
-    return ret;
+    if ((ret = write_bits(audio->sampling_frequency_index, 4, &bits)) != 0)
+      goto free;
 
-  if (len == 0)
-    return write_u8(0, file);
+    if (audio->sampling_frequency_index == 0xf)
+      if ((ret = write_bits(audio->sampling_frequency, 24, &bits)) != 0)
+        goto free;
 
-  n = 32;
-  m = 0x80000000;
-  while ((len & m) == 0) {
-    n--;
-    m >>= 1;
-  }
-  if (n % 7) {
-    n -= n % 7;
-    b = (len >> n) | (n ? 0x80 : 0);
-    if ((ret = write_u8((unsigned char) b, file)) != 0)
-      return ret;
-  }
-  while (n >= 7) {
-    n -= 7;
-    b = ((len >> n) & 0x7f) | (n ? 0x80 : 0);
-    if ((ret = write_u8((unsigned char) b, file)) != 0)
+    if ((ret = write_bits(audio->channel_configuration, 4, &bits)) != 0 ||
+        (ret = write_bits_flush(&bits)) != 0 ||
+        (ret = write_ary(bits.bytes, bits.size, 1, file)) != 0)
+      goto free;
+free:
+    mem_free(bits.bytes);
+    if (ret)
       return ret;
+  } else {
+    return ERR_UNK_CODEC;
   }
+
+  if ((ret = end_tag(i_audio, pos_audio, file)) != 0 ||
+      (ret = end_tag(i_dec, pos_dec, file)) != 0 ||
+      (ret = begin_tag(&i_sl, &pos_sl, TAG_SL_CONFIG_DESCR, file)) != 0 ||
+      (ret = write_u8(sl->predefined, file)) != 0 ||
+      (ret = end_tag(i_sl, pos_sl, file)) != 0 ||
+      (ret = end_tag(i_es, pos_es, file)) != 0)
+    return ret;
   return 0;
 }
 
 static int
-write_mat(int * matrix, FILE * file) {
-  int i;
+write_soun(struct stream * file, box_t box) {
+  struct box_soun * soun;
   int ret;
 
-  for (i = 0; i < 9; i++)
-    if ((ret = write_s32(matrix[i], file)) != 0)
-      return ret;
+  soun = box.soun;
 
+  if ((ret = skip(file, 6)) != 0 || /* reserved */
+      (ret = write_u16(soun->dref_index, file)) != 0 ||
+      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
+      (ret = write_u16(soun->channelcount, file)) != 0 ||
+      (ret = write_u16(soun->samplesize, file)) != 0 ||
+      (ret = skip(file, 2 + 2)) != 0 || /* pre defined / reserved */
+      (ret = write_u32(soun->samplerate, file)) != 0 ||
+      (ret = write_box(file, box, BOX_ESDS, write_esds)) != 0)
+    return ret;
   return 0;
 }
 
 static int
-write_box(FILE * file, box_t box, unsigned int box_type,
-          int (* func)(FILE * file, box_t box)) {
-  long pos;
-  long now;
+write_stsd(struct stream * file, box_t p_box) {
+  struct box_stsd * stsd;
+  unsigned int type;
+  unsigned int i;
+  box_t box;
   int ret;
 
-  if ((ret = get_pos(&pos, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 ||
-      (ret = write_u32(box_type, file)) != 0 ||
-      (ret = func(file, box)) != 0 ||
-      (ret = get_pos(&now, file)) != 0 ||
-      (ret = set_pos(pos, file)) != 0 ||
-      (ret = write_u32((unsigned int) (now - pos), file)) != 0 ||
-      (ret = set_pos(now, file)) != 0)
+  stsd = &p_box.mdia->minf.stbl.stsd;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(stsd->entry_count, file)) != 0)
     return ret;
 
+  type = p_box.mdia->hdlr.type;
+  for (i = 0; i < stsd->entry_count; i++) {
+    if (type == BOX_VIDE) {
+      box.vide = &stsd->entry.vide[i];
+      if ((ret = write_box(file, box, BOX_AVC1, write_vide)) != 0)
+        return ret;
+    } else if (type == BOX_SOUN) {
+      box.soun = &stsd->entry.soun[i];
+      if ((ret = write_box(file, box, BOX_MP4A, write_soun)) != 0)
+        return ret;
+    } else {
+      return ERR_UNK_HDLR_TYPE;
+    }
+  }
   return 0;
 }
 
 static int
-write_ftyp(FILE * file, box_t p_box) {
-  struct box_ftyp * ftyp;
+write_stts(struct stream * file, box_t p_box) {
+  struct box_stts * stts;
+  unsigned int block[U32_BLOCK];
+  unsigned int n;
   unsigned int i;
   int ret;
 
-  ftyp = &p_box.top->ftyp;
-  if ((ret = write_u32(ftyp->m_brand, file)) != 0 ||
-      (ret = write_u32(ftyp->m_version, file)) != 0)
+  stts = &p_box.mdia->minf.stbl.stts;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(stts->entry_count, file)) != 0)
     return ret;
 
-  for (i = 0; i < ftyp->c_brands_len; i++)
-    if ((ret = write_u32(ftyp->c_brands[i], file)) != 0)
-      return ret;
-
+  for (i = 0, n = 0; i < stts->entry_count; i++) {
+    block[n++] = stts->entry[i].sample_count;
+    block[n++] = stts->entry[i].sample_delta;
+    if (n > U32_BLOCK - 2 || i + 1 == stts->entry_count) {
+      if ((ret = write_u32s(block, n, file)) != 0)
+        return ret;
+      n = 0;
+    }
+  }
   return 0;
 }
 
 static int
-write_mvhd(FILE * file, box_t p_box) {
-  struct box_mvhd * mvhd;
+write_ctts(struct stream * file, box_t p_box) {
+  struct box_ctts * ctts;
+  unsigned int block[U32_BLOCK];
+  unsigned int n;
+  unsigned int i;
   int ret;
 
-  mvhd = &p_box.moov->mvhd;
+  ctts = &p_box.mdia->minf.stbl.ctts;
   if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(mvhd->c_time, file)) != 0 ||
-      (ret = write_u32(mvhd->m_time, file)) != 0 ||
-      (ret = write_u32(mvhd->timescale, file)) != 0 ||
-      (ret = write_u32(mvhd->duration, file)) != 0 ||
-      (ret = write_s32(mvhd->rate, file)) != 0 ||
-      (ret = write_s16(mvhd->volume, file)) != 0 ||
-      (ret = skip(file, 2 + 4 * 2)) != 0 || /* reserved */
-      (ret = write_mat(mvhd->matrix, file)) != 0 ||
-      (ret = skip(file, 4 * 6)) != 0 || /* pre defined */
-      (ret = write_u32(mvhd->next_track_id, file)) != 0)
+      (ret = write_u32(ctts->entry_count, file)) != 0)
     return ret;
+
+  for (i = 0, n = 0; i < ctts->entry_count; i++) {
+    block[n++] = ctts->entry[i].sample_count;
+    block[n++] = ctts->entry[i].sample_offset;
+    if (n > U32_BLOCK - 2 || i + 1 == ctts->entry_count) {
+      if ((ret = write_u32s(block, n, file)) != 0)
+        return ret;
+      n = 0;
+    }
+  }
   return 0;
 }
 
 static int
-write_iods(FILE * file, box_t p_box) {
-  unsigned short object_descr_id;
-  struct box_iods * iods;
-  struct initial_object_descr * iod;
-  long pos;
-  long now;
+write_stsc(struct stream * file, box_t p_box) {
+  struct box_stsc * stsc;
+  unsigned int block[U32_BLOCK];
+  unsigned int n;
+  unsigned int i;
   int ret;
 
-  iods = p_box.moov->iods;
-  iod = &iods->iod;
+  stsc = &p_box.mdia->minf.stbl.stsc;
   if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = get_pos(&pos, file)) != 0 ||
-      (ret = skip(file, 2)) != 0)
-    return ret;
-
-  object_descr_id = (unsigned short)
-      ((iod->object_descr_id << 6) |
-       (iod->url_flag << 5) |
-       (iod->include_inline_profile_level_flag << 4) |
-       0x0f);
-  if ((ret = write_u16(object_descr_id, file)) != 0)
+      (ret = write_u32(stsc->entry_count, file)) != 0)
     return ret;
 
-  if (iod->url_flag == 0) {
-    if ((ret = write_u8(iod->od_profile_level_idc, file)) != 0 ||
-        (ret = write_u8(iod->scene_profile_level_idc, file)) != 0 ||
-        (ret = write_u8(iod->audio_profile_level_idc, file)) != 0 ||
-        (ret = write_u8(iod->visual_profile_level_idc, file)) != 0 ||
-        (ret = write_u8(iod->graphics_profile_levvel_idc, file)) != 0)
-      return ret;
+  for (i = 0, n = 0; i < stsc->entry_count; i++) {
+    block[n++] = stsc->entry[i].first_chunk;
+    block[n++] = stsc->entry[i].samples_per_chunk;
+    block[n++] = stsc->entry[i].sample_desc_index;
+    if (n > U32_BLOCK - 3 || i + 1 == stsc->entry_count) {
+      if ((ret = write_u32s(block, n, file)) != 0)
+        return ret;
+      n = 0;
+    }
   }
-  if ((ret = get_pos(&now, file)) != 0 ||
-      (ret = set_pos(pos, file)) != 0 ||
-      (ret = write_tag(TAG_MP4_IOD,
-                       (unsigned int) (now - pos - 2), file)) != 0 ||
-      (ret = set_pos(now, file)) != 0)
-    return ret;
   return 0;
 }
 
 static int
-write_tkhd(FILE * file, box_t p_box) {
-  unsigned int flags;
-  struct box_tkhd * tkhd;
+write_stco(struct stream * file, box_t p_box) {
+  struct box_stco * stco;
+  unsigned int block[U32_BLOCK];
+  unsigned int n;
+  unsigned int i;
   int ret;
 
-  tkhd = &p_box.trak->tkhd;
+  stco = &p_box.mdia->minf.stbl.stco;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(stco->entry_count, file)) != 0)
+    return ret;
 
-  flags = (unsigned int) (tkhd->track_enabled |
-                          (tkhd->track_in_movie << 1) |
-                          (tkhd->track_in_preview << 2));
+  /* set by write_mdat while measuring */
+  if (stco->large) {
+    for (i = 0; i < stco->entry_count; i++)
+      if ((ret = write_u64(stco->chunk_offset[i], file)) != 0)
+        return ret;
+    return 0;
+  }
 
-  if ((ret = write_ver(0, flags, file)) != 0 ||
-      (ret = write_u32(tkhd->c_time, file)) != 0 ||
-      (ret = write_u32(tkhd->m_time, file)) != 0 ||
-      (ret = write_u32(tkhd->track_id, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 || /* reserved */
-      (ret = write_u32(tkhd->duration, file)) != 0 ||
-      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
-      (ret = write_s16(tkhd->layer, file)) != 0 ||
-      (ret = write_s16(tkhd->alternate_group, file)) != 0 ||
-      (ret = write_s16(tkhd->volume, file)) != 0 ||
-      (ret = skip(file, 2)) != 0 || /* reserved */
-      (ret = write_mat(tkhd->matrix, file)) != 0 ||
-      (ret = write_u32(tkhd->width, file)) != 0 ||
-      (ret = write_u32(tkhd->height, file)) != 0)
-    return ret;
+  for (i = 0, n = 0; i < stco->entry_count; i++) {
+    block[n++] = (unsigned int) stco->chunk_offset[i];
+    if (n > U32_BLOCK - 1 || i + 1 == stco->entry_count) {
+      if ((ret = write_u32s(block, n, file)) != 0)
+        return ret;
+      n = 0;
+    }
+  }
   return 0;
 }
 
 static int
-write_mdhd(FILE * file, box_t p_box) {
-  unsigned short lang_pack;
-  struct box_mdhd * mdhd;
+write_stsz(struct stream * file, box_t p_box) {
+  struct box_stsz * stsz;
   int ret;
 
-  mdhd = &p_box.mdia->mdhd;
-
-  lang_pack = (unsigned short) (((mdhd->lang[0] - 0x60) << 10) |
-                                ((mdhd->lang[1] - 0x60) << 5) |
-                                (mdhd->lang[2] - 0x60));
-
+  stsz = &p_box.mdia->minf.stbl.stsz;
   if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(mdhd->c_time, file)) != 0 ||
-      (ret = write_u32(mdhd->m_time, file)) != 0 ||
-      (ret = write_u32(mdhd->timescale, file)) != 0 ||
-      (ret = write_u32(mdhd->duration, file)) != 0 ||
-      (ret = write_u16(lang_pack, file)) != 0 ||
-      (ret = write_u16(0, file)) != 0) /* pre defined */
+      (ret = write_u32(stsz->sample_size, file)) != 0 ||
+      (ret = write_u32(stsz->sample_count, file)) != 0)
     return ret;
+
+  if (stsz->sample_size == 0)
+    return write_table(stsz->entry_size, stsz->sample_count, file);
   return 0;
 }
 
 static int
-write_hdlr(FILE * file, box_t p_box) {
-  struct box_hdlr * hdlr;
+write_stss(struct stream * file, box_t p_box) {
+  struct box_stss * stss;
   int ret;
 
-  hdlr = &p_box.mdia->hdlr;
+  stss = &p_box.mdia->minf.stbl.stss;
   if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 || /* pre defined */
-      (ret = write_u32(hdlr->type, file)) != 0 ||
-      (ret = skip(file, 4 * 3)) != 0 || /* reserved */
-      (ret = write_str(hdlr->name, file)) != 0)
+      (ret = write_u32(stss->entry_count, file)) != 0)
     return ret;
-  return 0;
+
+  return write_table(stss->sample_number, stss->entry_count, file);
 }
 
 static int
-write_dref_entry(FILE * file, box_t box) {
-  unsigned int flags;
-  struct box_dref_entry * entry;
+write_stbl(struct stream * file, box_t p_box) {
+  struct box_stbl * stbl;
   int ret;
 
-  entry = box.dref_entry;
+  stbl = &p_box.mdia->minf.stbl;
 
-  flags = entry->self_contained;
+  if ((ret = write_box(file, p_box, BOX_STSD, write_stsd)) != 0 ||
+      (ret = write_box(file, p_box, BOX_STTS, write_stts)) != 0)
+    return ret;
 
-  if ((ret = write_ver(0, flags, file)) != 0)
+  if (stbl->ctts.entry_count)
+    if ((ret = write_box(file, p_box, BOX_CTTS, write_ctts)) != 0)
+      return ret;
+
+  if ((ret = write_box(file, p_box, BOX_STSC, write_stsc)) != 0 ||
+      (ret = write_box(file, p_box, stbl->stco.large ? BOX_CO64 : BOX_STCO,
+                       write_stco)) != 0 ||
+      (ret = write_box(file, p_box, BOX_STSZ, write_stsz)) != 0)
     return ret;
 
-  if (entry->type == BOX_URL) {
+  if (stbl->stss.entry_count)
+    if ((ret = write_box(file, p_box, BOX_STSS, write_stss)) != 0)
+      return ret;
+  return 0;
+}
 
-    if (entry->self_contained == 0)
-      if ((ret = write_str(entry->location, file)) != 0)
-        return ret;
-  } else if (entry->type == BOX_URN) {
+static int
+write_vmhd(struct stream * file, box_t p_box) {
+  struct box_vmhd * vmhd;
+  unsigned int i;
+  int ret;
 
-    if ((ret = write_str(entry->name, file)) != 0 ||
-        (ret = write_str(entry->location, file)) != 0)
+  vmhd = p_box.mdia->minf.hd.vmhd;
+
+  if ((ret = write_ver(0, 1, file)) != 0 ||
+      (ret = write_u16(vmhd->graphicsmode, file)) != 0)
+    return ret;
+
+  for (i = 0; i < 3; i++)
+    if ((ret = write_u16(vmhd->opcolor[i], file)) != 0)
       return ret;
-  } else {
-    return ERR_UNK_BOX;
-  }
   return 0;
 }
 
 static int
-write_dref(FILE * file, box_t p_box) {
-  struct box_dref * dref;
-  box_t box;
-  unsigned int i;
+write_smhd(struct stream * file, box_t p_box) {
+  struct box_smhd * smhd;
+  int ret;
+
+  smhd = p_box.mdia->minf.hd.smhd;
+
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_s16(smhd->balance, file)) != 0 ||
+      (ret = write_u16(0, file)) != 0) /* reserved */
+    return ret;
+  return 0;
+}
+
+static int
+write_minf(struct stream * file, box_t p_box) {
+  unsigned int type;
   int ret;
 
-  dref = &p_box.dinf->dref;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(dref->entry_count, file)) != 0)
+  if ((ret = write_box(file, p_box, BOX_DINF, write_dinf)) != 0 ||
+      (ret = write_box(file, p_box, BOX_STBL, write_stbl)) != 0)
     return ret;
 
-  for (i = 0; i < dref->entry_count; i++) {
-    box.dref_entry = &dref->entry[i];
-    if ((ret = write_box(file, box, dref->entry[i].type,
-                         write_dref_entry)) != 0)
+  type = p_box.mdia->hdlr.type;
+
+  if (type == BOX_VIDE) {
+    if ((ret = write_box(file, p_box, BOX_VMHD, write_vmhd)) != 0)
+      return ret;
+  } else if (type == BOX_SOUN) {
+    if ((ret = write_box(file, p_box, BOX_SMHD, write_smhd)) != 0)
       return ret;
+  } else {
+    return ERR_UNK_HDLR_TYPE;
   }
   return 0;
 }
 
 static int
-write_dinf(FILE * file, box_t p_box) {
-  box_t box;
+write_elst(struct stream * file, box_t p_box) {
+  struct box_elst * elst;
+  unsigned int i;
   int ret;
 
-  box.dinf = &p_box.mdia->minf.dinf;
-  if ((ret = write_box(file, box, BOX_DREF, write_dref)) != 0)
+  elst = &p_box.edts->elst;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(elst->entry_count, file)) != 0)
     return ret;
-  return 0;
-}
 
-static int
-write_bits_init(struct bits * b, unsigned char * bytes, unsigned int size) {
-  if (size == 0)
-    return ERR_EMPTY_BITS;
-  b->size = size;
-  b->bytes = bytes;
-  b->buf = 0;
-  b->i = 0;
-  b->pos = 0;
+  for (i = 0; i < elst->entry_count; i++)
+    if ((ret = write_u32(elst->entry[i].segment_duration, file)) != 0 ||
+        (ret = write_s32(elst->entry[i].media_time, file)) != 0 ||
+        (ret = write_s16(elst->entry[i].media_rate_integer, file)) != 0 ||
+        (ret = write_s16(elst->entry[i].media_rate_fraction, file)) != 0)
+      return ret;
   return 0;
 }
 
 static int
-write_bits_resize(struct bits * b) {
-  int ret;
-
-  if ((ret = mem_realloc(&b->bytes, b->size << 1)) != 0)
-    return ret;
-  b->size <<= 1;
-  return 0;
+write_edts(struct stream * file, box_t p_box) {
+  box_t box;
+  box.edts = &p_box.trak->edts;
+  return write_box(file, box, BOX_ELST, write_elst);
 }
 
 static int
-write_bits_flush(struct bits * b) {
+write_mdia(struct stream * file, box_t p_box) {
+  box_t box;
   int ret;
 
-  if (b->pos == 0)
-    return 0;
-  if (b->i >= b->size)
-    if ((ret = write_bits_resize(b)) != 0)
-      return ret;
-  b->bytes[b->i++] = (b->buf << (8 - b->pos)) & 0xff;
-  b->pos = 0;
-  b->buf = 0;
+  box.mdia = &p_box.trak->mdia;
+  if ((ret = write_box(file, box, BOX_MDHD, write_mdhd)) != 0 ||
+      (ret = write_box(file, box, BOX_HDLR, write_hdlr)) != 0 ||
+      (ret = write_box(file, box, BOX_MINF, write_minf)) != 0)
+    return ret;
   return 0;
 }
 
 static int
-write_code(unsigned int n, struct bits * bits) {
-  unsigned int z; /* number of leading zeros */
-  unsigned int j;
-
-  unsigned char * b;
-  unsigned int size;
-  unsigned int i;
-  unsigned int pos;
-  unsigned int u;
-
+write_trak(struct stream * file, box_t box) {
+  struct box_trak * trak;
   int ret;
 
-  b    = bits->bytes;
-  size = bits->size;
-  i    = bits->i;
-  pos  = bits->pos;
-  u    = bits->buf;
-
-  if (n == 0xffffffff) {
-
-    /* step 1: add by 1 */
-    n = 0;
-
-    /* step 2: count leading zeros */
-    z = 32;
-
-  } else {
-
-    /* step 1: add by 1 */
-    n++;
-
-    /* step 2: count leading zeros */
-    z = 0;
-    j = n;
-    while (j > 1) {
-      j >>= 1;
-      z++;
-    }
+  trak = box.trak;
 
-    /* step 3: remove first non-zero bit */
-    n &= ~((unsigned int) 1 << z);
-  }
+  if ((ret = write_box(file, box, BOX_TKHD, write_tkhd)) != 0)
+    return ret;
 
-  while (i + ((pos + z + z + 1 - 1) >> 3) > size) {
-    if ((ret = write_bits_resize(bits)) != 0)
+  if (trak->edts.elst.entry_count)
+    if ((ret = write_box(file, box, BOX_EDTS, write_edts)) != 0)
       return ret;
-    b    = bits->bytes;
-    size = bits->size;
-  }
-
-  /* write zeros */
-  if (z > 8 - pos) {
-    u <<= 8 - pos;
-    pos = z - (8 - pos);
-    while (pos > 8) {
-      pos -= 8;
-      b[i++] = u & 0xff;
-      u = 0;
-    }
-    if (pos) {
-      b[i++] = u & 0xff;
-      u = 0;
-    }
-  } else {
-    u <<= z;
-    pos += z;
-  }
-
-  /* first non-zero bit */
-  if (pos == 8) {
-    pos = 1;
-    b[i++] = u & 0xff;
-    u = 1;
-  } else {
-    u <<= 1;
-    u |= 1;
-    pos += 1;
-  }
-
-  /* last n bit */
-  if (z > 8 - pos) {
-    u <<= 8 - pos;
-    pos = z - (8 - pos);
-    u |= n >> pos;
-    while (pos > 8) {
-      pos -= 8;
-      b[i++] = u & 0xff;
-      u = n >> pos;
-    }
-    if (pos) {
-      b[i++] = u & 0xff;
-      u = n;
-    }
-  } else {
-    u <<= z;
-    u |= n;
-    pos += z;
-  }
 
-  bits->buf = u;
-  bits->pos = pos;
-  bits->i = i;
+  if ((ret = write_box(file, box, BOX_MDIA, write_mdia)) != 0)
+    return ret;
   return 0;
 }
 
 static int
-write_bit(unsigned char n, struct bits * bits) {
-  unsigned char * b;
-  unsigned int size;
-  unsigned int i;
-  unsigned int pos;
-  unsigned int u;
-
+write_trex(struct stream * file, box_t p_box) {
   int ret;
 
-  b    = bits->bytes;
-  size = bits->size;
-  i    = bits->i;
-  pos  = bits->pos;
-  u    = bits->buf;
-
-  if (n > 1)
-    return ERR_WRITE_BIT;
-
-  if (pos == 8) {
-    while (i >= size) {
-      if ((ret = write_bits_resize(bits)) != 0)
-        return ret;
-      b    = bits->bytes;
-      size = bits->size;
-    }
-    pos = 1;
-    b[i++] = u & 0xff;
-    u = n;
-  } else {
-    u <<= 1;
-    u |= n;
-    pos += 1;
-  }
-
-  bits->buf = u;
-  bits->pos = pos;
-  bits->i = i;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(p_box.trak->tkhd.track_id, file)) != 0 ||
+      (ret = write_u32(1, file)) != 0 || /* sample_desc_index */
+      (ret = write_u32(0, file)) != 0 || /* sample_duration */
+      (ret = write_u32(0, file)) != 0 || /* sample_size */
+      (ret = write_u32(0x2000000, file)) != 0) /* depends on no sample */
+    return ret;
   return 0;
 }
 
 static int
-write_bits(unsigned int n, unsigned char w, /* width */
-           struct bits * bits) {
-  unsigned char * b;
-  unsigned int size;
+write_mvex(struct stream * file, box_t p_box) {
+  box_t box;
   unsigned int i;
-  unsigned int pos;
-  unsigned int u;
-
   int ret;
 
-  b    = bits->bytes;
-  size = bits->size;
-  i    = bits->i;
-  pos  = bits->pos;
-  u    = bits->buf;
-
-  /* width valid range: 1~32 */
-  if (w < 1 || w > 32)
-    return ERR_WRITE_BITS;
-
-  while (i + ((pos + w - 1) >> 3) > size) {
-    if ((ret = write_bits_resize(bits)) != 0)
+  for (i = 0; i < p_box.moov->trak_len; i++) {
+    box.trak = &p_box.moov->trak[i];
+    if ((ret = write_box(file, box, BOX_TREX, write_trex)) != 0)
       return ret;
-    b    = bits->bytes;
-    size = bits->size;
-  }
-
-  if (w > 8 - pos) {
-    u <<= 8 - pos;
-    pos = w - (8 - pos);
-    u |= n >> pos;
-    while (pos > 8) {
-      pos -= 8;
-      b[i++] = u & 0xff;
-      u = n >> pos;
-    }
-    if (pos) {
-      b[i++] = u & 0xff;
-      u = n;
-    }
-  } else {
-    u <<= w;
-    u |= n;
-    pos += w;
   }
-
-  bits->buf = u;
-  bits->pos = pos;
-  bits->i = i;
   return 0;
 }
 
 static int
-write_vui_para(struct vui * vui, struct bits * bits) {
+write_moov(struct stream * file, box_t p_box) {
+  struct box_moov * moov;
+  box_t box;
+  unsigned int i;
   int ret;
 
-  ret = 0;
-
-  if ((ret = write_bit(vui->aspect_ratio_info_present_flag, bits)) != 0)
-    goto exit;
-
-  if (vui->aspect_ratio_info_present_flag)
-    if ((ret = write_bits(vui->aspect_ratio_idc, 8, bits)) != 0)
-      goto exit;
-
-  if ((ret = write_bit(vui->overscan_info_present_flag, bits)) != 0)
-    goto exit;
-
-  if ((ret = write_bit(vui->video_signal_type_present_flag, bits)) != 0)
-    goto exit;
+  box.moov = moov = &p_box.top->moov;
+  if ((ret = write_box(file, box, BOX_MVHD, write_mvhd)) != 0)
+    return ret;
 
-  if (vui->video_signal_type_present_flag) {
-    if ((ret = write_bits(vui->video_format, 3, bits)) != 0 ||
-        (ret = write_bit(vui->video_full_range_flag, bits)) != 0 ||
-        (ret = write_bit(vui->colour_description_present_flag, bits)) != 0)
-      goto exit;
+  if (moov->iods != NULL)
+    if ((ret = write_box(file, box, BOX_IODS, write_iods)) != 0)
+      return ret;
 
-    if (vui->colour_description_present_flag)
-      if ((ret = write_bits(vui->colour_primaries, 8, bits)) != 0 ||
-          (ret = write_bits(vui->transfer_characteristics, 8, bits)) != 0 ||
-          (ret = write_bits(vui->matrix_coefficients, 8, bits)) != 0)
-        goto exit;
+  for (i = 0; i < moov->trak_len; i++) {
+    box.trak = &moov->trak[i];
+    if ((ret = write_box(file, box, BOX_TRAK, write_trak)) != 0)
+      return ret;
   }
 
-  if ((ret = write_bit(vui->chroma_loc_info_present_flag, bits)) != 0)
-    goto exit;
-
-  if ((ret = write_bit(vui->timing_info_present_flag, bits)) != 0)
-    goto exit;
-
-  if (vui->timing_info_present_flag)
-    if ((ret = write_bits(vui->num_units_in_tick, 32, bits)) != 0 ||
-        (ret = write_bits(vui->time_scale, 32, bits)) != 0 ||
-        (ret = write_bit(vui->fixed_frame_rate_flag, bits)) != 0)
-      goto exit;
-
-  if ((ret = write_bit(vui->nal_hrd_para_present_flag, bits)) != 0)
-    goto exit;
-
-  if ((ret = write_bit(vui->vcl_hrd_para_present_flag, bits)) != 0)
-    goto exit;
-
-  if ((ret = write_bit(vui->pic_struct_present_flag, bits)) != 0 ||
-      (ret = write_bit(vui->bitstream_restriction_flag, bits)) != 0)
-    goto exit;
-
-  if (vui->bitstream_restriction_flag)
-    if ((ret = write_bit(vui->motion_vectors_over_pic_boundaries_flag,
-                         bits)) != 0 ||
-        (ret = write_code(vui->max_bytes_per_pic_denom, bits)) != 0 ||
-        (ret = write_code(vui->max_bits_per_mb_denom, bits)) != 0 ||
-        (ret = write_code(vui->log2_max_mv_length_horizontal, bits)) != 0 ||
-        (ret = write_code(vui->log2_max_mv_length_vertical, bits)) != 0 ||
-        (ret = write_code(vui->num_reorder_frames, bits)) != 0 ||
-        (ret = write_code(vui->max_dec_frame_buffering, bits)) != 0)
-      goto exit;
-exit:
-  return ret;
+  box.moov = moov;
+  if (moov->fragmented)
+    if ((ret = write_box(file, box, BOX_MVEX, write_mvex)) != 0)
+      return ret;
+  return 0;
 }
 
 static int
-write_nalu(union nalu arg_nalu, FILE * file) {
-  unsigned char nal_ref_idc;
-  unsigned char nal_unit_type;
-  struct bits bits;
-  unsigned char * nalu;
-  unsigned int size;
+write_mdat(struct stream * file, box_t p_box) {
+  struct box_moov * moov;
+  struct box_stbl * stbl;
+  struct box_stco * stco;
   unsigned int i;
+  unsigned int o; /* index of chunk */
+  unsigned int trak_count;
+  unsigned char * buf;
+  struct sample_iter * iters; /* for each track */
+  struct stream * sample_file;
+  long chunk_pos;
+  long chunk_size;
+  long run_pos; /* pending run of contiguous input bytes */
+  long run_len;
   long pos;
-  long now;
   int ret;
 
-  nal_ref_idc = arg_nalu.sps->nal_ref_idc;
-  nal_unit_type = arg_nalu.sps->nal_unit_type;
+  ret = 0;
 
-  size = 1;
+  moov = &p_box.top->moov;
 
-  if ((ret = mem_alloc(&nalu, size)) != 0)
-    goto exit;
+  trak_count = 0;
 
-  if ((ret = write_bits_init(&bits, nalu, size)) != 0 ||
-      (ret = write_bits(nal_ref_idc, 3, &bits)) != 0 ||
-      (ret = write_bits(nal_unit_type, 5, &bits)) != 0)
-    goto free;
+  sample_file = p_box.top->mdat.file;
 
-  if (nal_unit_type == NAL_SPS) {
-    unsigned char profile_comp;
-    struct sps * sps;
+  buf = NULL;
+  iters = NULL;
 
-    sps = arg_nalu.sps;
+  if ((file->io != NULL && sample_file->map == NULL &&
+       (ret = mem_alloc(&buf, COPY_BUF_SIZE)) != 0) ||
+      (ret = mem_alloc(&iters, moov->trak_len * sizeof(* iters))) != 0 ||
+      (ret = get_pos(&pos, file)) != 0)
+    goto exit;
 
-    profile_comp = (unsigned char) ((sps->c_set0_flag << 7) |
-                                    (sps->c_set1_flag << 6) |
-                                    (sps->c_set2_flag << 5) |
-                                    (sps->c_set3_flag << 4) |
-                                    (sps->c_set4_flag << 3) |
-                                    (sps->c_set5_flag << 2));
+  for (i = 0; i < moov->trak_len; i++)
+    init_sample_iter(&iters[i], &moov->trak[i].mdia.minf.stbl);
 
-    if ((ret = write_bits(sps->profile_idc, 8, &bits)) != 0 ||
-        (ret = write_bits(profile_comp, 8, &bits)) != 0 ||
-        (ret = write_bits(sps->level_idc, 8, &bits)) != 0 ||
-        (ret = write_code(sps->seq_para_set_id, &bits)) != 0 ||
-        (ret = write_code(sps->log2_max_frame_num_minus4, &bits)) != 0 ||
-        (ret = write_code(sps->pic_order_cnt_type, &bits)) != 0)
-      goto free;
+  run_pos = 0;
+  run_len = 0;
 
-    if (sps->pic_order_cnt_type == 0)
-      if ((ret = write_code(sps->log2_max_pic_order_cnt_lsb_minus4,
-                            &bits)) != 0)
-        goto free;
+  /* iterate each chunk */
+  for (o = 0;; o++) {
 
-    if ((ret = write_code(sps->max_num_ref_frames, &bits)) != 0 ||
-        (ret = write_bit(sps->gaps_in_frame_num_value_allowed_flag,
-                         &bits)) != 0 ||
-        (ret = write_code(sps->pic_width_in_mbs_minus_1, &bits)) != 0 ||
-        (ret = write_code(sps->pic_height_in_mbs_minus_1, &bits)) != 0 ||
-        (ret = write_bit(sps->frame_mbs_only_flag, &bits)) != 0)
-      goto free;
+    /* iterate each track */
+    for (i = 0; i < moov->trak_len; i++) {
 
-    if (!sps->frame_mbs_only_flag)
-      if ((ret = write_bit(sps->mb_adaptive_frame_field_flag, &bits)) != 0)
-        goto free;
+      stbl = &moov->trak[i].mdia.minf.stbl;
+      stco = &stbl->stco;
 
-    if ((ret = write_bit(sps->direct_8x8_inference_flag, &bits)) != 0 ||
-        (ret = write_bit(sps->frame_cropping_flag, &bits)) != 0)
-      goto free;
+      if (!next_chunk(&iters[i], &chunk_pos, &chunk_size)) {
+        trak_count++;
+        break;
+      }
 
-    if (sps->frame_cropping_flag) {
-      if ((ret = write_code(sps->frame_crop_left_offset, &bits)) != 0 ||
-          (ret = write_code(sps->frame_crop_right_offset, &bits)) != 0 ||
-          (ret = write_code(sps->frame_crop_top_offset, &bits)) != 0 ||
-          (ret = write_code(sps->frame_crop_bottom_offset, &bits)) != 0)
-        goto free;
+      stco->chunk_offset[o] = (unsigned long) pos;
+      if (file->io == NULL && (unsigned long) pos > 0xffffffffUL &&
+          !stco->large) {
+        stco->large = 1; /* measure again with co64 */
+        file->sizes->again = 1;
+      }
+      pos += chunk_size;
+      if (chunk_size == 0)
+        continue;
+
+      /* extend the pending run, or copy it and start a new one */
+      if (run_pos + run_len != chunk_pos) {
+        if ((ret = copy_range(file, run_pos, run_len, buf, sample_file)) != 0)
+          goto exit;
+        run_pos = chunk_pos;
+        run_len = 0;
+      }
+      run_len += chunk_size;
     }
 
-    if ((ret = write_bit(sps->vui_para_present_flag, &bits)) != 0)
-      goto free;
+    if (trak_count == moov->trak_len)
+      break;
+  }
 
-    if (sps->vui_para_present_flag)
-      if ((ret = write_vui_para(&sps->vui, &bits)) != 0)
-        goto free;
-  } else if (nal_unit_type == NAL_PPS) {
-    struct pps * pps;
+  ret = copy_range(file, run_pos, run_len, buf, sample_file);
+exit:
+  mem_free(iters);
+  mem_free(buf);
+  return ret;
+}
 
-    pps = arg_nalu.pps;
-    if ((ret = write_code(pps->pic_para_set_id, &bits)) != 0 ||
-        (ret = write_code(pps->seq_para_set_id, &bits)) != 0 ||
-        (ret = write_bit(pps->entropy_coding_mode_flag, &bits)) != 0 ||
-        (ret = write_bit(pps->pic_order_present_flag, &bits)) != 0 ||
-        (ret = write_code(pps->num_slice_groups_minus1, &bits)) != 0 ||
-        (ret = write_code(pps->num_ref_idx_10_active_minus1, &bits)) != 0 ||
-        (ret = write_code(pps->num_ref_idx_11_active_minus1, &bits)) != 0 ||
-        (ret = write_bit(pps->weighted_pred_flag, &bits)) != 0 ||
-        (ret = write_bits(pps->weighted_bipred_idc, 2, &bits)) != 0 ||
-        (ret = write_code(pps->pic_init_qp_minus26, &bits)) != 0 ||
-        (ret = write_code(pps->pic_init_qs_minus26, &bits)) != 0 ||
-        (ret = write_code(pps->chroma_qp_index_offset, &bits)) != 0 ||
-        (ret = write_bit(pps->deblocking_filter_control_present_flag,
-                         &bits)) != 0 ||
-        (ret = write_bit(pps->constrained_intra_pred_flag, &bits)) != 0 ||
-        (ret = write_bit(pps->redundant_pic_cnt_present_flag, &bits)) != 0)
-      goto free;
-  } else {
-    ret = ERR_UNK_NAL_UNIT_TYPE;
-    goto free;
-  }
+static int
+write_boxes(struct stream * file, box_t box) {
+  int ret;
 
-  if ((ret = write_bit(1, &bits)) != 0 || /* rbsp_stop_one_bit */
-      (ret = write_bits_flush(&bits)) != 0) /* rbsp_alignment_zero_bit */
-    goto free;
+  if ((ret = write_box(file, box, BOX_FTYP, write_ftyp)) != 0 ||
+      (ret = write_box(file, box, BOX_MOOV, write_moov)) != 0 ||
+      (ret = write_box(file, box, BOX_MDAT, write_mdat)) != 0)
+    return ret;
+  return 0;
+}
 
-  if ((ret = get_pos(&pos, file)) != 0 ||
-      (ret = skip(file, 2)) != 0)
-    goto free;
+/* Measure the sizes of func's boxes without storing anything, again
+   while one of them or a chunk offset outgrows 32 bits */
+static int
+measure_boxes(struct box_sizes * sizes, box_t box,
+              int (* func)(struct stream * file, box_t box)) {
+  struct stream stream;
+  int ret;
 
-  size = bits.i;
-  nalu = bits.bytes;
+  do {
+    sizes->i = 0;
+    sizes->again = 0;
+    if ((ret = open_stream(&stream, NULL, 1)) != 0)
+      return ret;
+    stream.sizes = sizes;
+    if ((ret = func(&stream, box)) != 0)
+      return ret;
+  } while (sizes->again);
 
-  if ((ret = write_u8(nalu[0], file)) != 0)
-    goto free;
+  sizes->i = 0;
+  return 0;
+}
 
-  for (i = 1; i < size;) {
-    if (i + 2 < size && !nalu[i] && !nalu[i+1] && !(nalu[i+2] & 0xfc)) {
-      if ((ret = write_u8(nalu[i++], file)) != 0 ||
-          (ret = write_u8(nalu[i++], file)) != 0 ||
-          (ret = write_u8(0x03, file)) != 0 ||
-          (ret = write_u8(nalu[i++], file)) != 0)
-        goto free;
-    } else {
-      if ((ret = write_u8(nalu[i++], file)) != 0)
-        goto free;
-    }
+/* Two passes: measure box sizes and chunk offsets, then write
+   everything in order without seeking. Output past 4 GiB takes
+   another measuring pass for co64 and largesize. If spliced, the output
+   file isn't written but planned: ftyp, moov and the mdat header go to
+   <base>.hdr, its plan to <base>.splice. */
+static int
+write_top(struct box_top * top, const struct output * out,
+          unsigned char spliced) {
+  struct stream stream;
+  struct stream * file;
+  struct splice splice;
+  struct box_sizes sizes;
+  size_t base_len;
+  char * name;
+  box_t box;
+  int ret;
+
+  sizes.size = NULL;
+  sizes.len = 0;
+  sizes.capa = 0;
+  name = NULL;
+  box.top = top;
+  if ((ret = measure_boxes(&sizes, box, write_boxes)) != 0)
+    goto exit;
+
+  file = &stream;
+  if (spliced) {
+    if ((ret = base_name(&name, &base_len, out->fname)) != 0 ||
+        (ret = create_splice(file, &splice, name, base_len,
+                             out->io_type)) != 0)
+      goto exit;
+  } else if ((ret = create_output(file, out)) != 0) {
+    goto exit;
   }
-  if ((ret = get_pos(&now, file)) != 0 ||
-      (ret = set_pos(pos, file)) != 0 ||
-      (ret = write_u16((unsigned short) (now - pos - 2), file)) != 0 ||
-      (ret = set_pos(now, file)) != 0)
-    goto free;
-free:
-  nalu = bits.bytes;
-  mem_free(nalu);
+  file->sizes = &sizes;
+  if ((ret = write_boxes(file, box)) == 0)
+    ret = spliced ? flush_splice(file) : flush_file(file);
+  if (spliced)
+    close_splice(file);
+  else
+    close_output(file, out);
 exit:
+  mem_free(name);
+  mem_free(sizes.size);
   return ret;
 }
 
+/* A fragment of fragmented output, samples of the track's sample
+   tables from it on */
+struct fragment {
+  struct box_top * top;
+  const struct box_stts * stts;
+  struct sample_iter it;
+  unsigned int e; /* stts->entry[e - 1] holds the delta of sample it.z */
+  unsigned int e_left;
+  unsigned long decode_time;
+  unsigned int sequence_number;
+  unsigned int sample_count;
+  unsigned int sample_duration; /* common to all its samples, else 0 */
+  unsigned long size; /* bytes of its samples */
+  struct sample_iter next_it; /* the next fragment's it, e, e_left */
+  unsigned int next_e;
+  unsigned int next_e_left;
+  unsigned long next_decode_time;
+  unsigned char * buf; /* see copy_range */
+};
+
+/* Next sample's delta, 0 past the end of stts */
+static unsigned int
+next_delta(const struct box_stts * stts, unsigned int * e,
+           unsigned int * left) {
+  while (* left == 0) {
+    if (* e >= stts->entry_count)
+      return 0;
+    * left = stts->entry[(* e)++].sample_count;
+  }
+  (* left)--;
+  return stts->entry[* e - 1].sample_delta;
+}
+
+/* Take samples from frag->it on until they last duration, at least one
+   unless there are none left */
+static void
+plan_fragment(struct fragment * frag, unsigned long duration) {
+  struct sample_iter it;
+  unsigned int e;
+  unsigned int left;
+  unsigned int delta;
+  unsigned int size;
+  unsigned long time;
+  long pos;
+
+  it = frag->it;
+  e = frag->e;
+  left = frag->e_left;
+  time = 0;
+
+  frag->sample_count = 0;
+  frag->sample_duration = 0;
+  frag->size = 0;
+
+  while (time < duration && next_sample(&it, &pos, &size)) {
+    delta = next_delta(frag->stts, &e, &left);
+    if (frag->sample_count == 0)
+      frag->sample_duration = delta;
+    else if (delta != frag->sample_duration)
+      frag->sample_duration = 0;
+    frag->sample_count++;
+    frag->size += size;
+    time += delta;
+  }
+
+  frag->next_it = it;
+  frag->next_e = e;
+  frag->next_e_left = left;
+  frag->next_decode_time = frag->decode_time + time;
+}
+
 static int
-write_avcc(FILE * file, box_t p_box) {
-  unsigned char profile_comp;
-  unsigned int i;
-  struct box_avcc * avcc;
-  union nalu nalu;
+write_mfhd(struct stream * file, box_t p_box) {
   int ret;
 
-  avcc = &p_box.vide->avcc;
+  if ((ret = write_ver(0, 0, file)) != 0 ||
+      (ret = write_u32(p_box.fragment->sequence_number, file)) != 0)
+    return ret;
+  return 0;
+}
 
-  profile_comp = (unsigned char) ((avcc->c_set0_flag << 7) |
-                                  (avcc->c_set1_flag << 6) |
-                                  (avcc->c_set2_flag << 5) |
-                                  (avcc->c_set3_flag << 4) |
-                                  (avcc->c_set4_flag << 3) |
-                                  (avcc->c_set5_flag << 2));
+static int
+write_tfhd(struct stream * file, box_t p_box) {
+  struct fragment * frag;
+  unsigned int flags;
+  int ret;
 
-  if ((ret = write_u8(avcc->conf_version, file)) != 0 ||
-      (ret = write_u8(avcc->profile_idc, file)) != 0 ||
-      (ret = write_u8(profile_comp, file)) != 0 ||
-      (ret = write_u8(avcc->level_idc, file)) != 0 ||
-      (ret = write_u8(avcc->len_size_minus_one | 0xfc, file)) != 0 ||
-      (ret = write_u8(avcc->num_of_sps | 0xe0, file)) != 0)
-    return ret;
+  frag = p_box.fragment;
 
-  for (i = 0; i < avcc->num_of_sps; i++) {
-    nalu.sps = &avcc->sps.sps[i];
-    if ((ret = write_nalu(nalu, file)) != 0)
-      return ret;
-  }
+  flags = TFHD_BASE_IS_MOOF;
+  if (frag->sample_duration)
+    flags |= TFHD_SAMPLE_DURATION;
 
-  if ((ret = write_u8(avcc->num_of_pps, file)) != 0)
+  if ((ret = write_ver(0, flags, file)) != 0 ||
+      (ret = write_u32(frag->top->moov.trak[0].tkhd.track_id, file)) != 0)
     return ret;
 
-  for (i = 0; i < avcc->num_of_pps; i++) {
-    nalu.pps = &avcc->pps.pps[i];
-    if ((ret = write_nalu(nalu, file)) != 0)
+  if (frag->sample_duration)
+    if ((ret = write_u32(frag->sample_duration, file)) != 0)
       return ret;
-  }
   return 0;
 }
 
 static int
-write_vide(FILE * file, box_t box) {
-  unsigned char len;
-  struct box_vide * vide;
+write_tfdt(struct stream * file, box_t p_box) {
   int ret;
 
-  vide = box.vide;
-
-  len = (unsigned char) strlen(vide->compressorname);
-
-  if ((ret = skip(file, 6)) != 0 || /* reserved */
-      (ret = write_u16(vide->dref_index, file)) != 0 ||
-      (ret = skip(file, 2 + 2 + 4 * 3)) != 0 || /* pre / reserved / pre */
-      (ret = write_u16(vide->width, file)) != 0 ||
-      (ret = write_u16(vide->height, file)) != 0 ||
-      (ret = write_u32(vide->h_rez, file)) != 0 ||
-      (ret = write_u32(vide->v_rez, file)) != 0 ||
-      (ret = skip(file, 4)) != 0 || /* reserved */
-      (ret = write_u16(vide->frame_count, file)) != 0 ||
-      (ret = write_u8(len, file)) != 0 ||
-      (ret = write_ary(vide->compressorname,
-                       sizeof(vide->compressorname) - 1, 1, file)) != 0 ||
-      (ret = write_u16(vide->depth, file)) != 0 ||
-      (ret = write_s16((short) -1, file)) != 0 || /* pre defined */
-      (ret = write_box(file, box, BOX_AVCC, write_avcc)) != 0)
+  if ((ret = write_ver(1, 0, file)) != 0 ||
+      (ret = write_u64(p_box.fragment->decode_time, file)) != 0)
     return ret;
   return 0;
 }
 
 static int
-write_esds(FILE * file, box_t p_box) {
-  struct box_esds * esds;
-  struct es_descr * es;
-  struct decoder_config_descr * dec;
-  struct sl_config_descr * sl;
-  struct audio_specific_config * audio;
-
-  struct bits bits;
-  unsigned char codec;
-  unsigned int buffer_size_db;
+write_trun(struct stream * file, box_t p_box) {
+  struct fragment * frag;
+  struct sample_iter it;
+  unsigned long data_offset;
+  unsigned int flags;
+  unsigned int e;
+  unsigned int left;
+  unsigned int delta;
+  unsigned int size;
   unsigned int i;
-  long pos_es;
-  long pos_dec;
-  long pos_audio;
-  long pos_sl;
-  long now;
+  long pos;
   int ret;
 
-  esds = &p_box.soun->esds;
-  es = &esds->es;
-  dec = &es->dec_conf;
-  audio = &dec->audio;
-  sl = &es->sl_conf;
-
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = get_pos(&pos_es, file)) != 0 ||
-      (ret = skip(file, 2)) != 0)
-    return ret;
+  frag = p_box.fragment;
 
-  if ((ret = write_u16(es->es_id, file)) != 0 ||
-      (ret = write_u8(es->es_flags, file)) != 0 ||
-      (ret = get_pos(&pos_dec, file)) != 0 ||
-      (ret = skip(file, 2)) != 0)
-    return ret;
+  flags = TRUN_DATA_OFFSET | TRUN_SAMPLE_SIZE;
+  if (frag->sample_duration == 0)
+    flags |= TRUN_SAMPLE_DURATION;
 
-  buffer_size_db = ((unsigned int) (dec->stream_type << 26) |
-                    (unsigned int) (dec->up_stream << 25) |
-                    (1 << 24) | /* reserved */
-                    dec->buffer_size_db);
+  /* samples start after moof, whose size is the fragment's first slot,
+     and the header of mdat. While measuring any value does. */
+  data_offset = 0;
+  if (file->io != NULL)
+    data_offset = file->sizes->size[0] +
+                  (frag->size + 8 > 0xffffffffUL ? 16 : 8);
 
-  if ((ret = write_u8(dec->object_type_idc, file)) != 0 ||
-      (ret = id_to_codec(&codec, dec->object_type_idc)) != 0 ||
-      (ret = write_u32(buffer_size_db, file)) != 0 ||
-      (ret = write_u32(dec->max_bitrate, file)) != 0 ||
-      (ret = write_u32(dec->avg_bitrate, file)) != 0 ||
-      (ret = get_pos(&pos_audio, file)) != 0 ||
-      (ret = skip(file, 2)) != 0)
+  if ((ret = write_ver(0, flags, file)) != 0 ||
+      (ret = write_u32(frag->sample_count, file)) != 0 ||
+      (ret = write_u32((unsigned int) data_offset, file)) != 0)
     return ret;
 
-  if (codec == CODEC_AAC) {
-
-    if ((ret = mem_alloc(&bits.bytes, audio->tag_len)) != 0)
-      return ret;
-
-    for (i = 0; i < audio->tag_len; i++)
-      bits.bytes[i] = 0;
-
-    if ((ret = write_bits_init(&bits, bits.bytes, audio->tag_len)) != 0)
-      goto free;
-
-    if (audio->audio_object_type >= 0x20) {
-      if ((ret = write_bits(0x1f, 5, &bits)) != 0 ||
-          (ret = write_bits((unsigned int)
-                            audio->audio_object_type - 0x20, 6, &bits)) != 0)
-        goto free;
-    } else {
-      if ((ret = write_bits(audio->audio_object_type, 5, &bits)) != 0)
-        goto free;
-    }
-
-    if ((ret = write_bits(audio->sampling_frequency_index, 4, &bits)) != 0)
-      goto free;
+  it = frag->it;
+  e = frag->e;
+  left = frag->e_left;
 
-    if (audio->sampling_frequency_index == 0xf)
-      if ((ret = write_bits(audio->sampling_frequency, 24, &bits)) != 0)
-        goto free;
+  for (i = 0; i < frag->sample_count; i++) {
+    next_sample(&it, &pos, &size);
+    delta = next_delta(frag->stts, &e, &left);
 
-    if ((ret = write_bits(audio->channel_configuration, 4, &bits)) != 0 ||
-        (ret = write_bits_flush(&bits)) != 0 ||
-        (ret = write_ary(bits.bytes, bits.size, 1, file)) != 0)
-      goto free;
-free:
-    mem_free(bits.bytes);
-    if (ret)
+    if ((frag->sample_duration == 0 &&
+         (ret = write_u32(delta, file)) != 0) ||
+        (ret = write_u32(size, file)) != 0)
       return ret;
-  } else {
-    return ERR_UNK_CODEC;
   }
+  return 0;
+}
 
-  if ((ret = get_pos(&now, file)) != 0 ||
-      (ret = set_pos(pos_audio, file)) != 0 ||
-      (ret = write_tag(TAG_DEC_SPECIFIC_INFO,
-                       (unsigned int) (now - pos_audio - 2), file)) != 0 ||
-      (ret = set_pos(pos_dec, file)) != 0 ||
-      (ret = write_tag(TAG_DECODER_CONFIG_DESCR,
-                       (unsigned int) (now - pos_dec - 2), file)) != 0 ||
-      (ret = set_pos(now, file)) != 0 ||
-      (ret = skip(file, 2)) != 0)
-    return ret;
-
-  pos_sl = now;
+static int
+write_traf(struct stream * file, box_t p_box) {
+  int ret;
 
-  if ((ret = write_u8(sl->predefined, file)) != 0 ||
-      (ret = get_pos(&now, file)) != 0 ||
-      (ret = set_pos(pos_sl, file)) != 0 ||
-      (ret = write_tag(TAG_SL_CONFIG_DESCR,
-                       (unsigned int) (now - pos_sl - 2), file)) != 0 ||
-      (ret = set_pos(pos_es, file)) != 0 ||
-      (ret = write_tag(TAG_ES_DESCR,
-                       (unsigned int) (now - pos_es - 2), file)) != 0 ||
-      (ret = set_pos(now, file)) != 0)
+  if ((ret = write_box(file, p_box, BOX_TFHD, write_tfhd)) != 0 ||
+      (ret = write_box(file, p_box, BOX_TFDT, write_tfdt)) != 0 ||
+      (ret = write_box(file, p_box, BOX_TRUN, write_trun)) != 0)
     return ret;
   return 0;
 }
 
 static int
-write_soun(FILE * file, box_t box) {
-  struct box_soun * soun;
+write_moof(struct stream * file, box_t p_box) {
   int ret;
 
-  soun = box.soun;
-
-  if ((ret = skip(file, 6)) != 0 || /* reserved */
-      (ret = write_u16(soun->dref_index, file)) != 0 ||
-      (ret = skip(file, 4 * 2)) != 0 || /* reserved */
-      (ret = write_u16(soun->channelcount, file)) != 0 ||
-      (ret = write_u16(soun->samplesize, file)) != 0 ||
-      (ret = skip(file, 2 + 2)) != 0 || /* pre defined / reserved */
-      (ret = write_u32(soun->samplerate, file)) != 0 ||
-      (ret = write_box(file, box, BOX_ESDS, write_esds)) != 0)
+  if ((ret = write_box(file, p_box, BOX_MFHD, write_mfhd)) != 0 ||
+      (ret = write_box(file, p_box, BOX_TRAF, write_traf)) != 0)
     return ret;
   return 0;
 }
 
+/* The fragment's samples, contiguous ones copied as one range */
 static int
-write_stsd(FILE * file, box_t p_box) {
-  struct box_stsd * stsd;
-  unsigned int type;
+write_frag_mdat(struct stream * file, box_t p_box) {
+  struct fragment * frag;
+  struct sample_iter it;
+  unsigned int size;
   unsigned int i;
-  box_t box;
+  long run_pos;
+  long run_len;
+  long pos;
   int ret;
 
-  stsd = &p_box.mdia->minf.stbl.stsd;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(stsd->entry_count, file)) != 0)
-    return ret;
+  frag = p_box.fragment;
+  it = frag->it;
+  run_pos = 0;
+  run_len = 0;
 
-  type = p_box.mdia->hdlr.type;
-  for (i = 0; i < stsd->entry_count; i++) {
-    if (type == BOX_VIDE) {
-      box.vide = &stsd->entry.vide[i];
-      if ((ret = write_box(file, box, BOX_AVC1, write_vide)) != 0)
-        return ret;
-    } else if (type == BOX_SOUN) {
-      box.soun = &stsd->entry.soun[i];
-      if ((ret = write_box(file, box, BOX_MP4A, write_soun)) != 0)
+  for (i = 0; i < frag->sample_count; i++) {
+    next_sample(&it, &pos, &size);
+    if (run_pos + run_len != pos) {
+      if ((ret = copy_range(file, run_pos, run_len, frag->buf,
+                            frag->top->mdat.file)) != 0)
         return ret;
-    } else {
-      return ERR_UNK_HDLR_TYPE;
+      run_pos = pos;
+      run_len = 0;
     }
+    run_len += (long) size;
   }
-  return 0;
+  return copy_range(file, run_pos, run_len, frag->buf, frag->top->mdat.file);
 }
 
 static int
-write_stts(FILE * file, box_t p_box) {
-  struct box_stts * stts;
-  unsigned int i;
+write_fragment(struct stream * file, box_t box) {
   int ret;
 
-  stts = &p_box.mdia->minf.stbl.stts;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(stts->entry_count, file)) != 0)
+  if ((ret = write_box(file, box, BOX_MOOF, write_moof)) != 0 ||
+      (ret = write_box(file, box, BOX_MDAT, write_frag_mdat)) != 0)
     return ret;
-
-  for (i = 0; i < stts->entry_count; i++)
-    if ((ret = write_u32(stts->entry[i].sample_count, file)) != 0 ||
-        (ret = write_u32(stts->entry[i].sample_delta, file)) != 0)
-      return ret;
   return 0;
 }
 
 static int
-write_ctts(FILE * file, box_t p_box) {
-  struct box_ctts * ctts;
-  unsigned int i;
+write_init(struct stream * file, box_t box) {
   int ret;
 
-  ctts = &p_box.mdia->minf.stbl.ctts;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(ctts->entry_count, file)) != 0)
+  if ((ret = write_box(file, box, BOX_FTYP, write_ftyp)) != 0 ||
+      (ret = write_box(file, box, BOX_MOOV, write_moov)) != 0)
     return ret;
+  return 0;
+}
 
-  for (i = 0; i < ctts->entry_count; i++)
-    if ((ret = write_u32(ctts->entry[i].sample_count, file)) != 0 ||
-        (ret = write_u32(ctts->entry[i].sample_offset, file)) != 0)
-      return ret;
+/* The init segment of fragmented output: the sound track with empty
+   sample tables and no duration, and mvex. init shares what it points
+   to with top. */
+static void
+make_init(struct box_top * init, struct box_trak * trak,
+          struct box_top * top) {
+  static unsigned int c_brands[] = {BOX_ISO6, BOX_CMFC, BOX_MP41};
+  struct box_stbl * stbl;
+
+  * init = * top;
+  * trak = top->moov.trak[0];
+  stbl = &trak->mdia.minf.stbl;
+  stbl->stts.entry_count = 0;
+  stbl->ctts.entry_count = 0;
+  stbl->stsc.entry_count = 0;
+  stbl->stco.entry_count = 0;
+  stbl->stco.large = 0;
+  stbl->stsz.sample_size = 0;
+  stbl->stsz.sample_count = 0;
+  stbl->stss.entry_count = 0;
+  trak->tkhd.duration = 0;
+  trak->mdia.mdhd.duration = 0;
+  init->moov.mvhd.duration = 0;
+  init->moov.trak = trak;
+  init->moov.fragmented = 1;
+  init->ftyp.m_brand = BOX_ISO6;
+  init->ftyp.m_version = 0;
+  init->ftyp.c_brands = c_brands;
+  init->ftyp.c_brands_len = sizeof(c_brands) / sizeof(c_brands[0]);
+}
+
+static int
+start_fragments(struct fragment * frag, struct box_top * top) {
+  struct box_stbl * stbl;
+
+  stbl = &top->moov.trak[0].mdia.minf.stbl;
+  frag->top = top;
+  frag->stts = &stbl->stts;
+  init_sample_iter(&frag->it, stbl);
+  frag->e = 0;
+  frag->e_left = 0;
+  frag->decode_time = 0;
+  frag->sequence_number = 1;
+  frag->buf = NULL;
+  if (top->mdat.file->map == NULL)
+    return mem_alloc(&frag->buf, COPY_BUF_SIZE);
   return 0;
 }
 
+static void
+next_fragment(struct fragment * frag) {
+  frag->it = frag->next_it;
+  frag->e = frag->next_e;
+  frag->e_left = frag->next_e_left;
+  frag->decode_time = frag->next_decode_time;
+  frag->sequence_number++;
+}
+
+/* Measure, then write one box sequence, e.g. a fragment */
 static int
-write_stsc(FILE * file, box_t p_box) {
-  struct box_stsc * stsc;
-  unsigned int i;
+write_measured(struct stream * file, struct box_sizes * sizes, box_t box,
+               int (* func)(struct stream * file, box_t box)) {
   int ret;
 
-  stsc = &p_box.mdia->minf.stbl.stsc;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(stsc->entry_count, file)) != 0)
+  sizes->len = 0; /* the sizes of earlier boxes aren't needed */
+  if ((ret = measure_boxes(sizes, box, func)) != 0)
     return ret;
-
-  for (i = 0; i < stsc->entry_count; i++)
-    if ((ret = write_u32(stsc->entry[i].first_chunk, file)) != 0 ||
-        (ret = write_u32(stsc->entry[i].samples_per_chunk, file)) != 0 ||
-        (ret = write_u32(stsc->entry[i].sample_desc_index, file)) != 0)
-      return ret;
-  return 0;
+  file->sizes = sizes;
+  return func(file, box);
 }
 
+/* Fragmented output: an init segment, ftyp and a moov without samples
+   but with mvex, then moof and mdat pairs of about frag_ms each. Each
+   fragment is measured just before it is written, so only its sizes
+   are kept. */
 static int
-write_stco(FILE * file, box_t p_box) {
-  struct box_stco * stco;
+write_frag(struct box_top * top, const struct output * out,
+           unsigned int frag_ms) {
+  struct stream stream;
+  struct stream * file;
+  struct box_sizes sizes;
+  struct box_top init;
+  struct box_trak trak;
+  struct fragment frag;
+  unsigned long duration;
+  box_t box;
   int ret;
 
-  stco = &p_box.mdia->minf.stbl.stco;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(stco->entry_count, file)) != 0 ||
-      (ret = get_pos(&stco->pos, file)) != 0 ||
-      (ret = skip(file, stco->entry_count * 4)) != 0)
-    return ret;
-  return 0;
+  sizes.size = NULL;
+  sizes.len = 0;
+  sizes.capa = 0;
+  frag.buf = NULL;
+
+  make_init(&init, &trak, top);
+  box.top = &init;
+  if ((ret = measure_boxes(&sizes, box, write_init)) != 0)
+    goto exit;
+
+  file = &stream;
+  if ((ret = create_output(file, out)) != 0)
+    goto exit;
+  file->sizes = &sizes;
+  if ((ret = write_init(file, box)) != 0 ||
+      (ret = start_fragments(&frag, top)) != 0)
+    goto close;
+
+  duration = (unsigned long) frag_ms * top->moov.trak[0].mdia.mdhd.timescale /
+             1000;
+  box.fragment = &frag;
+
+  for (;;) {
+    plan_fragment(&frag, duration ? duration : 1);
+    if (frag.sample_count == 0)
+      break;
+    if ((ret = write_measured(file, &sizes, box, write_fragment)) != 0)
+      goto close;
+    next_fragment(&frag);
+  }
+  ret = flush_file(file);
+close:
+  close_output(file, out);
+exit:
+  mem_free(frag.buf);
+  mem_free(sizes.size);
+  return ret;
+}
+
+/* ADTS framing of the sound track's samples */
+struct adts {
+  unsigned char header[7]; /* protection_absent = 1, frame_length = 0 */
+  unsigned char * headers; /* ADTS_BATCH patched headers */
+  unsigned char * sample; /* payloads of an unmapped input */
+  size_t sample_capa;
+  struct io_vec * vec;
+  struct stream * sample_file;
+};
+
+static void
+close_adts(struct adts * adts) {
+  mem_free(adts->vec);
+  mem_free(adts->headers);
+  mem_free(adts->sample);
 }
 
 static int
-write_stsz(FILE * file, box_t p_box) {
+open_adts(struct adts * adts, struct box_top * top) {
+  struct box_stbl * stbl;
+  struct box_stsd * stsd;
   struct box_stsz * stsz;
-  unsigned int i;
+  struct decoder_config_descr * dec;
+  struct bits b;
+  unsigned char version;
+  unsigned char profile;
+  unsigned char sampling_frequency_index;
+  unsigned char channels;
   int ret;
 
-  stsz = &p_box.mdia->minf.stbl.stsz;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(stsz->sample_size, file)) != 0 ||
-      (ret = write_u32(stsz->sample_count, file)) != 0)
+  adts->headers = NULL;
+  adts->sample = NULL;
+  adts->vec = NULL;
+  adts->sample_file = top->mdat.file;
+
+  stbl = &top->moov.trak[0].mdia.minf.stbl;
+  stsd = &stbl->stsd;
+  stsz = &stbl->stsz;
+
+  if (stsd->entry_count == 0)
+    return ERR_NO_SOUN_CONF;
+
+  dec = &stsd->entry.soun[0].esds.es.dec_conf;
+  if (dec->object_type_idc == OTI_AUDIO_AAC_MPEG4) {
+    version = 0;
+    profile = (unsigned char) (dec->audio.audio_object_type - 1);
+  } else {
+    version = 1;
+    profile = (unsigned char) (dec->object_type_idc - OTI_AUDIO_AAC_MPEG2_MP);
+  }
+  sampling_frequency_index = dec->audio.sampling_frequency_index;
+  channels = dec->audio.channels;
+
+  /* header template, frame_length is patched in per frame */
+  if ((ret = write_bits_init(&b, adts->header, sizeof(adts->header))) != 0 ||
+      (ret = write_bits(0xfff, 12, &b)) != 0 || /* sync */
+      (ret = write_bit(version, &b)) != 0 ||
+      (ret = write_bits(0, 2, &b)) != 0 || /* layer */
+      (ret = write_bit(1, &b)) != 0 || /* protection_absent */
+      (ret = write_bits(profile, 2, &b)) != 0 ||
+      (ret = write_bits(sampling_frequency_index, 4, &b)) != 0 ||
+      (ret = write_bit(0, &b)) != 0 || /* private stream */
+      (ret = write_bits(channels, 3, &b)) != 0 ||
+      (ret = write_bits(0, 4, &b)) != 0 || /* originality */
+      (ret = write_bits(0, 13, &b)) != 0 || /* frame_length */
+      (ret = write_bits(0x7ff, 11, &b)) != 0 || /* buffer fullness */
+      (ret = write_bits(0, 2, &b)) != 0 || /* number of aac frame - 1 */
+      (ret = write_bits_flush(&b)) != 0)
     return ret;
 
-  if (stsz->sample_size == 0)
-    for (i = 0; i < stsz->sample_count; i++)
-      if ((ret = write_u32(stsz->entry[i].entry_size, file)) != 0)
-        return ret;
-  return 0;
+  adts->sample_capa = 1;
+  if (adts->sample_file->map == NULL) {
+    adts->sample_capa = COPY_BUF_SIZE;
+    if (max_sample_size(stsz) > adts->sample_capa)
+      adts->sample_capa = max_sample_size(stsz);
+  }
+
+  if ((ret = mem_alloc(&adts->sample, adts->sample_capa)) != 0 ||
+      (ret = mem_alloc(&adts->headers, 7 * ADTS_BATCH)) != 0 ||
+      (ret = mem_alloc(&adts->vec, 2 * ADTS_BATCH * sizeof(* adts->vec))) != 0)
+    close_adts(adts);
+  return ret;
 }
 
+/* Queue up to ADTS_BATCH frames, and no more than max, from it as
+   header/payload pairs, no more than sample holds if the input is
+   unmapped, and send them with one gather write. len is set to the
+   number of frames, 0 at the end. */
 static int
-write_stss(FILE * file, box_t p_box) {
-  struct box_stss * stss;
-  unsigned int i;
+write_adts(struct stream * file, struct sample_iter * it, unsigned int max,
+           unsigned int * len, struct adts * adts) {
+  struct sample_iter next;
+  const unsigned char * data;
+  unsigned char * h;
+  unsigned int frame_length;
+  unsigned int sample_size;
+  unsigned int k;
+  size_t used;
+  long pos;
   int ret;
 
-  stss = &p_box.mdia->minf.stbl.stss;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(stss->entry_count, file)) != 0)
-    return ret;
+  used = 0;
+  for (k = 0; k < ADTS_BATCH && k < max; k++) {
 
-  for (i = 0; i < stss->entry_count; i++)
-    if ((ret = write_u32(stss->entry[i].sample_number, file)) != 0)
+    next = * it;
+    if (!next_sample(&next, &pos, &sample_size) ||
+        (adts->sample_file->map == NULL &&
+         used + sample_size > adts->sample_capa))
+      break;
+    * it = next;
+
+    /* only frame_length (13 bits from bit 30) differs between frames */
+    if (sample_size > 0x1fff - 7)
+      return ERR_ADTS_SIZE;
+    frame_length = 7 + sample_size;
+    h = adts->headers + 7 * k;
+    memcpy(h, adts->header, 7);
+    h[3] = (unsigned char) ((adts->header[3] & 0xfc) | (frame_length >> 11));
+    h[4] = (unsigned char) ((frame_length >> 3) & 0xff);
+    h[5] = (unsigned char) ((adts->header[5] & 0x1f) |
+                            ((frame_length & 7) << 5));
+
+    /* payloads of an unmapped input are collected in sample */
+    if ((ret = read_at(&data, pos, sample_size,
+                       adts->sample + used, adts->sample_file)) != 0)
       return ret;
-  return 0;
+    if (adts->sample_file->map == NULL) {
+      if (data != adts->sample + used)
+        memcpy(adts->sample + used, data, sample_size);
+      data = adts->sample + used;
+      used += sample_size;
+    }
+
+    adts->vec[2*k].ptr = h;
+    adts->vec[2*k].len = 7;
+    adts->vec[2*k+1].ptr = data;
+    adts->vec[2*k+1].len = sample_size;
+  }
+
+  * len = k;
+  return write_vec(adts->vec, 2 * k, file);
 }
 
 static int
-write_stbl(FILE * file, box_t p_box) {
-  struct box_stbl * stbl;
+write_raw(struct box_top * top, const struct output * out) {
+  struct stream stream;
+  struct stream * file;
+  struct sample_iter it;
+  struct adts adts;
+  unsigned int len;
   int ret;
 
-  stbl = &p_box.mdia->minf.stbl;
+  if ((ret = open_adts(&adts, top)) != 0)
+    goto exit;
 
-  if ((ret = write_box(file, p_box, BOX_STSD, write_stsd)) != 0 ||
-      (ret = write_box(file, p_box, BOX_STTS, write_stts)) != 0)
-    return ret;
+  file = &stream;
+  if ((ret = create_output(file, out)) != 0)
+    goto free;
 
-  if (stbl->ctts.entry_count)
-    if ((ret = write_box(file, p_box, BOX_CTTS, write_ctts)) != 0)
-      return ret;
+  init_sample_iter(&it, &top->moov.trak[0].mdia.minf.stbl);
+  do
+    if ((ret = write_adts(file, &it, UINT_MAX, &len, &adts)) != 0)
+      goto close;
+  while (len);
+  ret = flush_file(file);
+close:
+  close_output(file, out);
+free:
+  close_adts(&adts);
+exit:
+  return ret;
+}
 
-  if ((ret = write_box(file, p_box, BOX_STSC, write_stsc)) != 0 ||
-      (ret = write_box(file, p_box, BOX_STCO, write_stco)) != 0 ||
-      (ret = write_box(file, p_box, BOX_STSZ, write_stsz)) != 0)
-    return ret;
+/* The segments written, for the playlist */
+struct segment {
+  unsigned long duration;
+  unsigned long offset; /* byte range in the one file of a splice plan */
+  unsigned long size;
+};
 
-  if (stbl->stss.entry_count)
-    if ((ret = write_box(file, p_box, BOX_STSS, write_stss)) != 0)
-      return ret;
-  return 0;
+struct segments {
+  struct segment * entry;
+  unsigned int len;
+  unsigned int capa;
+  unsigned long init_size; /* not 0 if segments are byte ranges */
+};
+
+static int
+write_text(const char * str, struct stream * file) {
+  return write_ary(str, strlen(str), 1, file);
+}
+
+/* d in timescale as decimal seconds */
+static void
+format_seconds(char * buf, unsigned long d, unsigned int timescale) {
+  unsigned long ms;
+
+  ms = timescale ? d * 1000 / timescale : 0;
+  sprintf(buf, "%lu.%03lu", ms / 1000, ms % 1000);
 }
 
+/* One segment file: ADTS frames if adts isn't NULL, else moof+mdat */
 static int
-write_vmhd(FILE * file, box_t p_box) {
-  struct box_vmhd * vmhd;
-  unsigned int i;
+write_segment(struct fragment * frag, struct adts * adts,
+              struct box_sizes * sizes, const char * name,
+              unsigned char io_type) {
+  struct stream stream;
+  struct sample_iter it;
+  unsigned int left;
+  unsigned int len;
+  box_t box;
   int ret;
 
-  vmhd = p_box.mdia->minf.hd.vmhd;
-
-  if ((ret = write_ver(0, 1, file)) != 0 ||
-      (ret = write_u16(vmhd->graphicsmode, file)) != 0)
+  if ((ret = create_file(&stream, name, io_type)) != 0)
     return ret;
 
-  for (i = 0; i < 3; i++)
-    if ((ret = write_u16(vmhd->opcolor[i], file)) != 0)
-      return ret;
-  return 0;
+  if (adts != NULL) {
+    it = frag->it;
+    for (left = frag->sample_count; left; left -= len) {
+      if ((ret = write_adts(&stream, &it, left, &len, adts)) != 0)
+        goto close;
+      if (len == 0)
+        break;
+    }
+  } else {
+    box.fragment = frag;
+    if ((ret = write_measured(&stream, sizes, box, write_fragment)) != 0)
+      goto close;
+  }
+  ret = flush_file(&stream);
+close:
+  close_file(&stream);
+  return ret;
 }
 
 static int
-write_smhd(FILE * file, box_t p_box) {
-  struct box_smhd * smhd;
+write_init_file(struct box_top * top, struct box_sizes * sizes,
+                const char * name, unsigned char io_type) {
+  struct stream stream;
+  struct box_top init;
+  struct box_trak trak;
+  box_t box;
   int ret;
 
-  smhd = p_box.mdia->minf.hd.smhd;
-
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_s16(smhd->balance, file)) != 0 ||
-      (ret = write_u16(0, file)) != 0) /* reserved */
+  make_init(&init, &trak, top);
+  box.top = &init;
+  if ((ret = create_file(&stream, name, io_type)) != 0)
     return ret;
-  return 0;
+  if ((ret = write_measured(&stream, sizes, box, write_init)) == 0)
+    ret = flush_file(&stream);
+  close_file(&stream);
+  return ret;
 }
 
+/* name holds the segment path up to base_len, its URI starts at uri.
+   Byte range segments are in <base>.mp4 after the init segment. */
 static int
-write_minf(FILE * file, box_t p_box) {
-  unsigned int type;
+write_hls(struct stream * file, const struct segments * segs,
+          unsigned int timescale, char * name, size_t base_len,
+          const char * uri, unsigned char raw) {
+  char buf[64];
+  unsigned long max;
+  unsigned int i;
   int ret;
 
-  if ((ret = write_box(file, p_box, BOX_DINF, write_dinf)) != 0 ||
-      (ret = write_box(file, p_box, BOX_STBL, write_stbl)) != 0)
+  max = 0;
+  for (i = 0; i < segs->len; i++)
+    if (segs->entry[i].duration > max)
+      max = segs->entry[i].duration;
+
+  /* EXTINF rounded to the nearest integer can't exceed it */
+  sprintf(buf, "#EXT-X-VERSION:%u\n#EXT-X-TARGETDURATION:%lu\n",
+          raw ? 3 : 7, timescale ? (max + timescale / 2) / timescale : 0);
+  if ((ret = write_text("#EXTM3U\n", file)) != 0 ||
+      (ret = write_text(buf, file)) != 0 ||
+      (ret = write_text("#EXT-X-PLAYLIST-TYPE:VOD\n", file)) != 0)
     return ret;
 
-  type = p_box.mdia->hdlr.type;
+  if (!raw) {
+    strcpy(name + base_len, segs->init_size ? ".mp4" : "_init.mp4");
+    if ((ret = write_text("#EXT-X-MAP:URI=\"", file)) != 0 ||
+        (ret = write_text(uri, file)) != 0)
+      return ret;
+    if (segs->init_size) {
+      sprintf(buf, "\",BYTERANGE=\"%lu@0", segs->init_size);
+      if ((ret = write_text(buf, file)) != 0)
+        return ret;
+    }
+    if ((ret = write_text("\"\n", file)) != 0)
+      return ret;
+  }
 
-  if (type == BOX_VIDE) {
-    if ((ret = write_box(file, p_box, BOX_VMHD, write_vmhd)) != 0)
+  for (i = 0; i < segs->len; i++) {
+    format_seconds(buf, segs->entry[i].duration, timescale);
+    if ((ret = write_text("#EXTINF:", file)) != 0 ||
+        (ret = write_text(buf, file)) != 0 ||
+        (ret = write_text(",\n", file)) != 0)
       return ret;
-  } else if (type == BOX_SOUN) {
-    if ((ret = write_box(file, p_box, BOX_SMHD, write_smhd)) != 0)
+    if (segs->init_size) {
+      sprintf(buf, "#EXT-X-BYTERANGE:%lu@%lu\n", segs->entry[i].size,
+              segs->entry[i].offset);
+      if ((ret = write_text(buf, file)) != 0)
+        return ret;
+    } else {
+      sprintf(name + base_len, raw ? "_%u.aac" : "_%u.m4s", i + 1);
+    }
+    if ((ret = write_text(uri, file)) != 0 ||
+        (ret = write_text("\n", file)) != 0)
       return ret;
-  } else {
-    return ERR_UNK_HDLR_TYPE;
   }
-  return 0;
+  return write_text("#EXT-X-ENDLIST\n", file);
 }
 
+/* A static MPD with a SegmentTemplate, durations in a SegmentTimeline
+   with runs of equal ones folded */
 static int
-write_elst(FILE * file, box_t p_box) {
-  struct box_elst * elst;
+write_mpd(struct stream * file, const struct segments * segs,
+          struct box_top * top, char * name, size_t base_len,
+          const char * uri) {
+  struct box_trak * trak;
+  struct decoder_config_descr * dec;
+  char buf[128];
+  unsigned long total;
+  unsigned int timescale;
   unsigned int i;
+  unsigned int r;
   int ret;
 
-  elst = &p_box.edts->elst;
-  if ((ret = write_ver(0, 0, file)) != 0 ||
-      (ret = write_u32(elst->entry_count, file)) != 0)
+  trak = &top->moov.trak[0];
+  timescale = trak->mdia.mdhd.timescale;
+  dec = &trak->mdia.minf.stbl.stsd.entry.soun[0].esds.es.dec_conf;
+
+  total = 0;
+  for (i = 0; i < segs->len; i++)
+    total += segs->entry[i].duration;
+
+  if ((ret = write_text("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" "
+                        "type=\"static\"\n"
+                        "     profiles=\"urn:mpeg:dash:profile:"
+                        "isoff-live:2011\"\n"
+                        "     mediaPresentationDuration=\"PT",
+                        file)) != 0)
+    return ret;
+  format_seconds(buf, total, timescale);
+  if ((ret = write_text(buf, file)) != 0 ||
+      (ret = write_text("S\" minBufferTime=\"PT2S\">\n"
+                        "  <Period>\n"
+                        "    <AdaptationSet contentType=\"audio\" "
+                        "mimeType=\"audio/mp4\" segmentAlignment=\"true\">\n",
+                        file)) != 0)
     return ret;
 
-  for (i = 0; i < elst->entry_count; i++)
-    if ((ret = write_u32(elst->entry[i].segment_duration, file)) != 0 ||
-        (ret = write_s32(elst->entry[i].media_time, file)) != 0 ||
-        (ret = write_s16(elst->entry[i].media_rate_integer, file)) != 0 ||
-        (ret = write_s16(elst->entry[i].media_rate_fraction, file)) != 0)
+  if (dec->object_type_idc == OTI_AUDIO_AAC_MPEG4)
+    sprintf(buf, "      <Representation id=\"1\" codecs=\"mp4a.40.%u\"",
+            dec->audio.audio_object_type);
+  else
+    sprintf(buf, "      <Representation id=\"1\" codecs=\"mp4a.%02x\"",
+            dec->object_type_idc);
+  if ((ret = write_text(buf, file)) != 0)
+    return ret;
+  sprintf(buf, " audioSamplingRate=\"%u\" bandwidth=\"%u\">\n",
+          timescale, dec->avg_bitrate ? dec->avg_bitrate : dec->max_bitrate);
+  if ((ret = write_text(buf, file)) != 0)
+    return ret;
+
+  sprintf(buf, "        <SegmentTemplate timescale=\"%u\" startNumber=\"1\"",
+          timescale);
+  strcpy(name + base_len, "_init.mp4");
+  if ((ret = write_text(buf, file)) != 0 ||
+      (ret = write_text("\n            initialization=\"", file)) != 0 ||
+      (ret = write_text(uri, file)) != 0)
+    return ret;
+  strcpy(name + base_len, "_$Number$.m4s");
+  if ((ret = write_text("\"\n            media=\"", file)) != 0 ||
+      (ret = write_text(uri, file)) != 0 ||
+      (ret = write_text("\">\n          <SegmentTimeline>\n", file)) != 0)
+    return ret;
+
+  for (i = 0; i < segs->len; i += r + 1) {
+    for (r = 0; i + r + 1 < segs->len; r++)
+      if (segs->entry[i + r + 1].duration != segs->entry[i].duration)
+        break;
+    if (i == 0)
+      sprintf(buf, "            <S t=\"0\" d=\"%lu\"",
+              segs->entry[i].duration);
+    else
+      sprintf(buf, "            <S d=\"%lu\"", segs->entry[i].duration);
+    if ((ret = write_text(buf, file)) != 0)
       return ret;
-  return 0;
-}
+    sprintf(buf, r ? " r=\"%u\"/>\n" : "/>\n", r);
+    if ((ret = write_text(buf, file)) != 0)
+      return ret;
+  }
 
-static int
-write_edts(FILE * file, box_t p_box) {
-  box_t box;
-  box.edts = &p_box.trak->edts;
-  return write_box(file, box, BOX_ELST, write_elst);
+  return write_text("          </SegmentTimeline>\n"
+                    "        </SegmentTemplate>\n"
+                    "      </Representation>\n"
+                    "    </AdaptationSet>\n"
+                    "  </Period>\n"
+                    "</MPD>\n", file);
 }
 
+/* Segmented output in one pass over the samples: segments of about
+   seg_ms each, cut at sample boundaries like fragments, then the
+   playlist fname. Segments are named after fname without its
+   extension: <base>_<n>.aac (ADTS, raw) or <base>_<n>.m4s after
+   <base>_init.mp4. If spliced, no segment is written but a splice plan
+   of <base>.mp4, which holds them all as byte ranges. */
 static int
-write_mdia(FILE * file, box_t p_box) {
+write_segments(struct box_top * top, const char * fname,
+               unsigned char io_type, unsigned int seg_ms,
+               unsigned char playlist, unsigned char raw,
+               unsigned char spliced) {
+  struct stream stream;
+  struct stream hdr;
+  struct splice splice;
+  struct box_sizes sizes;
+  struct segments segs;
+  struct segment * seg;
+  struct fragment frag;
+  struct adts adts;
+  struct box_top init;
+  struct box_trak trak;
+  unsigned long duration;
+  unsigned int timescale;
+  const char * slash;
+  const char * uri;
+  size_t base_len;
+  char * name;
   box_t box;
+  long pos;
+  long end;
   int ret;
 
-  box.mdia = &p_box.trak->mdia;
-  if ((ret = write_box(file, box, BOX_MDHD, write_mdhd)) != 0 ||
-      (ret = write_box(file, box, BOX_HDLR, write_hdlr)) != 0 ||
-      (ret = write_box(file, box, BOX_MINF, write_minf)) != 0)
-    return ret;
-  return 0;
-}
-
-static int
-write_trak(FILE * file, box_t box) {
-  struct box_trak * trak;
-  int ret;
+  sizes.size = NULL;
+  sizes.len = 0;
+  sizes.capa = 0;
+  segs.entry = NULL;
+  segs.len = 0;
+  segs.capa = 0;
+  segs.init_size = 0;
+  frag.buf = NULL;
+  adts.headers = NULL;
+  adts.sample = NULL;
+  adts.vec = NULL;
+  hdr.io = NULL;
+
+  if ((ret = base_name(&name, &base_len, fname)) != 0)
+    goto exit;
+  slash = strrchr(fname, '/');
+  uri = slash != NULL ? name + (slash + 1 - fname) : name;
 
-  trak = box.trak;
+  if (raw) {
+    if ((ret = open_adts(&adts, top)) != 0)
+      goto free;
+  } else if (spliced) {
+    if ((ret = create_splice(&hdr, &splice, name, base_len, io_type)) != 0)
+      goto free;
+    make_init(&init, &trak, top);
+    box.top = &init;
+    if ((ret = write_measured(&hdr, &sizes, box, write_init)) != 0)
+      goto free;
+    segs.init_size = (unsigned long) hdr.pos;
+  } else {
+    strcpy(name + base_len, "_init.mp4");
+    if ((ret = write_init_file(top, &sizes, name, io_type)) != 0)
+      goto free;
+  }
 
-  if ((ret = write_box(file, box, BOX_TKHD, write_tkhd)) != 0)
-    return ret;
+  if ((ret = start_fragments(&frag, top)) != 0)
+    goto free;
 
-  if (trak->edts.elst.entry_count)
-    if ((ret = write_box(file, box, BOX_EDTS, write_edts)) != 0)
-      return ret;
+  timescale = top->moov.trak[0].mdia.mdhd.timescale;
+  duration = (unsigned long) seg_ms * timescale / 1000;
+  box.fragment = &frag;
 
-  if ((ret = write_box(file, box, BOX_MDIA, write_mdia)) != 0)
-    return ret;
-  return 0;
-}
+  for (;;) {
+    plan_fragment(&frag, duration ? duration : 1);
+    if (frag.sample_count == 0)
+      break;
 
-static int
-write_moov(FILE * file, box_t p_box) {
-  struct box_moov * moov;
-  box_t box;
-  unsigned int i;
-  int ret;
+    if ((ret = grow_table(NULL, &segs.entry, segs.len, &segs.capa,
+                          sizeof(* segs.entry))) != 0)
+      goto free;
+    seg = &segs.entry[segs.len++];
+    seg->duration = frag.next_decode_time - frag.decode_time;
 
-  box.moov = moov = &p_box.top->moov;
-  if ((ret = write_box(file, box, BOX_MVHD, write_mvhd)) != 0)
-    return ret;
+    if (spliced) {
+      if ((ret = get_pos(&pos, &hdr)) != 0 ||
+          (ret = write_measured(&hdr, &sizes, box, write_fragment)) != 0 ||
+          (ret = get_pos(&end, &hdr)) != 0)
+        goto free;
+      seg->offset = (unsigned long) pos;
+      seg->size = (unsigned long) (end - pos);
+    } else {
+      sprintf(name + base_len, raw ? "_%u.aac" : "_%u.m4s", segs.len);
+      if ((ret = write_segment(&frag, raw ? &adts : NULL, &sizes, name,
+                               io_type)) != 0)
+        goto free;
+    }
+    next_fragment(&frag);
+  }
 
-  if (moov->iods != NULL)
-    if ((ret = write_box(file, box, BOX_IODS, write_iods)) != 0)
-      return ret;
+  if (spliced && (ret = flush_splice(&hdr)) != 0)
+    goto free;
 
-  for (i = 0; i < moov->trak_len; i++) {
-    box.trak = &moov->trak[i];
-    if ((ret = write_box(file, box, BOX_TRAK, write_trak)) != 0)
-      return ret;
-  }
-  return 0;
+  if ((ret = create_file(&stream, fname, io_type)) != 0)
+    goto free;
+  if (playlist == PLAYLIST_HLS)
+    ret = write_hls(&stream, &segs, timescale, name, base_len, uri, raw);
+  else
+    ret = write_mpd(&stream, &segs, top, name, base_len, uri);
+  if (ret == 0)
+    ret = flush_file(&stream);
+  close_file(&stream);
+free:
+  if (hdr.io != NULL)
+    close_splice(&hdr);
+  close_adts(&adts);
+  mem_free(frag.buf);
+  mem_free(segs.entry);
+  mem_free(name);
+exit:
+  mem_free(sizes.size);
+  return ret;
 }
 
+/* The other tracks stay in the arena until it is released */
 static int
-write_mdat(FILE * file, box_t p_box) {
+extract_audio(struct box_top * top) {
   struct box_moov * moov;
-  struct box_stbl * stbl;
-  struct box_stco * stco;
-  struct box_stsz * stsz;
   unsigned int i;
-  unsigned int j;
-  unsigned int o; /* stco->entry[o], index of chunk */
-  unsigned int z; /* stsz->entry[z], index of sample */
-  unsigned int trak_count;
-  unsigned int sample_size;
-  unsigned int sample_capa;
-  unsigned char * sample;
-  unsigned int * sample_i; /* sample index for each track */
-  FILE * sample_file;
-  long pos;
-  int ret;
 
-  ret = 0;
+  moov = &top->moov;
 
-  moov = &p_box.top->moov;
+  for (i = 0; i < moov->trak_len; i++) {
 
-  trak_count = 0;
+    if (moov->trak[i].mdia.hdlr.type == BOX_SOUN) {
 
-  sample_capa = 1;
-  sample_file = p_box.top->mdat.file;
+      if (i != 0)
+        moov->trak[0] = moov->trak[i];
 
-  sample = NULL;
-  sample_i = NULL;
+      moov->trak[0].tkhd.track_id = 1;
+      moov->trak_len = 1;
+      moov->mvhd.next_track_id = 2;
+      return 0;
+    }
+  }
+  return ERR_NO_SOUN;
+}
 
-  if ((ret = mem_alloc(&sample, sample_capa)) != 0 ||
-      (ret = mem_alloc(&sample_i, moov->trak_len * sizeof(sample_i))) != 0)
-    goto exit;
+struct ea_arena {
+  struct arena arena;
+};
 
-  for (i = 0; i < moov->trak_len; i++)
-    sample_i[i] = 0;
+struct ea_context {
+  struct stream file;
+  struct box_top top;
+  struct arena own;
+  struct arena * arena; /* of top, own or a caller's to reset */
+  unsigned char io;
+  unsigned char parsed;
+  unsigned char failed; /* to parse or select, top is unusable */
+  unsigned char selected;
+};
 
-  /* iterate each chunk */
-  for (o = 0;; o++) {
+/* segments and plans are named after the output, DASH has no ADTS,
+   byte ranges are of MP4 or of fMP4 for HLS */
+static int
+check_options(const struct ea_options * options, const char * fname) {
+  if ((options->raw && options->frag_ms) ||
+      (options->playlist && options->frag_ms) ||
+      (options->playlist && options->segment_ms == 0) ||
+      ((options->playlist || options->splice) && strcmp(fname, "-") == 0) ||
+      (options->playlist == PLAYLIST_DASH && options->raw) ||
+      (options->splice && (options->raw || options->frag_ms ||
+                           options->playlist == PLAYLIST_DASH)))
+    return ERR_ARG;
+  return 0;
+}
 
-    /* iterate each track */
-    for (i = 0; i < moov->trak_len; i++) {
+int
+ea_open(struct ea_context ** ret, const char * fname, unsigned char io) {
+  struct ea_context * ctx;
+  int err;
 
-      stbl = &moov->trak[i].mdia.minf.stbl;
-      stco = &stbl->stco;
-      stsz = &stbl->stsz;
+  if ((err = mem_alloc(&ctx, sizeof(* ctx))) != 0)
+    return err;
+  if ((err = open_file(&ctx->file, fname, io)) != 0) {
+    mem_free(ctx);
+    return err;
+  }
+  init_arena(&ctx->own);
+  ctx->arena = &ctx->own;
+  ctx->io = io;
+  ctx->parsed = 0;
+  ctx->failed = 0;
+  ctx->selected = 0;
+  * ret = ctx;
+  return 0;
+}
 
-      if (o >= stco->entry_count) {
-        trak_count++;
-        break;
-      }
+int
+ea_open_memory(struct ea_context ** ret, const void * bytes, size_t size) {
+  struct ea_context * ctx;
+  struct io * io;
+  int err;
 
-      if ((ret = get_pos(&pos, file)) != 0)
-        goto exit;
+  if ((err = mem_alloc(&ctx, sizeof(* ctx))) != 0)
+    return err;
+  if ((err = open_memory(&io, bytes, size, 0)) != 0) {
+    mem_free(ctx);
+    return err;
+  }
+  if ((err = open_stream(&ctx->file, io, 0)) != 0) {
+    io->ops->close(io);
+    mem_free(ctx);
+    return err;
+  }
+  init_arena(&ctx->own);
+  ctx->arena = &ctx->own;
+  ctx->io = IO_MEMORY;
+  ctx->parsed = 0;
+  ctx->failed = 0;
+  ctx->selected = 0;
+  * ret = ctx;
+  return 0;
+}
+
+int
+ea_parse(struct ea_context * ctx, unsigned int flags) {
+  int ret;
+
+  if (ctx->parsed)
+    return ERR_CALL;
+  ctx->parsed = 1;
+  if ((ret = read_top(&ctx->file, &ctx->top, ctx->arena,
+                      flags & EA_DUMP ? 1 : 0,
+                      flags & (EA_DUMP | EA_ALL_TRACKS) ? 0 : 1,
+                      flags & EA_ONE_THREAD ? 1 : SUM_THREADS)) != 0)
+    ctx->failed = 1;
+  return ret;
+}
 
-      stco->entry[o].chunk_offset = (unsigned int) pos; /* set chunk offset */
+int
+ea_arena_new(struct ea_arena ** ret) {
+  int err;
 
-      /* iterate each sample */
-      for (j = 0; j < stco->entry[o].samples_per_chunk; j++) {
+  if ((err = mem_alloc(ret, sizeof(** ret))) != 0)
+    return err;
+  init_arena(&(* ret)->arena);
+  return 0;
+}
 
-        z = sample_i[i]++;
+int
+ea_use_arena(struct ea_context * ctx, struct ea_arena * arena) {
+  if (ctx->parsed)
+    return ERR_CALL;
+  ctx->arena = &arena->arena;
+  return 0;
+}
 
-        sample_size = stsz->entry[z].entry_size;
-        while (sample_size > sample_capa) {
-          if ((ret = mem_realloc(&sample, sample_capa << 1)) != 0)
-            goto exit;
-          sample_capa <<= 1;
-        }
+void
+ea_arena_free(struct ea_arena * arena) {
+  if (arena == NULL)
+    return;
+  free_arena(&arena->arena);
+  mem_free(arena);
+}
 
-        /* write sample */
-        if ((ret = set_pos(stsz->entry[z].pos, sample_file)) != 0 ||
-            (ret = read_ary(sample, sample_size, 1, sample_file)) != 0 ||
-            (ret = write_ary(sample, sample_size, 1, file)) != 0)
-          goto exit;
-      }
-    }
+int
+ea_select_audio(struct ea_context * ctx) {
+  int ret;
 
-    if (trak_count == moov->trak_len)
-      break;
+  if (!ctx->parsed || ctx->failed || ctx->selected)
+    return ERR_CALL;
+  if ((ret = extract_audio(&ctx->top)) != 0) {
+    ctx->failed = 1;
+    return ret;
   }
+  ctx->selected = 1;
+  return 0;
+}
 
-  /* iterate each track */
-  for (i = 0; i < moov->trak_len; i++) {
+static int
+write_output(struct ea_context * ctx, const struct output * out,
+             const struct ea_options * options) {
+  struct box_top * top;
 
-    stco = &moov->trak[i].mdia.minf.stbl.stco;
+  top = &ctx->top;
+  if (options->playlist)
+    return write_segments(top, out->fname, out->io_type,
+                          options->segment_ms, options->playlist,
+                          options->raw, options->splice);
+  if (options->raw)
+    return write_raw(top, out);
+  if (options->frag_ms)
+    return write_frag(top, out, options->frag_ms);
+  return write_top(top, out, options->splice);
+}
 
-    if ((ret = get_pos(&pos, file)) != 0 ||
-        (ret = set_pos(stco->pos, file)) != 0)
-      goto exit;
+int
+ea_write(struct ea_context * ctx, const char * fname,
+         const struct ea_options * options) {
+  struct output out;
+  int ret;
 
-    /* write chunk offset */
-    for (j = 0; j < stco->entry_count; j++)
-      if ((ret = write_u32(stco->entry[j].chunk_offset, file)) != 0)
-        goto exit;
+  if (!ctx->selected)
+    return ERR_CALL;
+  if ((ret = check_options(options, fname)) != 0)
+    return ret;
+  /* a plan's ranges would be of the copy, not of the input */
+  if (options->splice && ctx->top.mdat.file == &ctx->top.mdat.buf)
+    return ERR_STREAM_FRAG;
 
-    if ((ret = set_pos(pos, file)) != 0)
-      goto exit;
-  }
-exit:
-  mem_free(sample_i);
-  mem_free(sample);
-  return ret;
+  out.fname = fname;
+  out.io_type = ctx->io;
+  out.io = NULL;
+  return write_output(ctx, &out, options);
 }
 
+/* Into memory: a buffer of capa bytes if buf isn't NULL, else one
+   allocated, which * ret then holds */
 static int
-write_top(struct box_top * top, const char * fname) {
-  FILE * file;
-  box_t box;
-  int ret;
+write_memory(struct ea_context * ctx, void ** ret, void * buf, size_t capa,
+             size_t * ret_size, const struct ea_options * options) {
+  struct io_memory * mem;
+  struct output out;
+  int err;
 
-  file = fopen(fname, "wb");
-  if (file == NULL) {
-    ret = ERR_IO;
-    goto exit;
+  if (!ctx->selected)
+    return ERR_CALL;
+  if (options->playlist || options->splice) /* more than one file */
+    return ERR_ARG;
+  if ((err = check_options(options, "")) != 0)
+    return err;
+
+  out.fname = NULL;
+  out.io_type = IO_MEMORY;
+  if ((err = buf != NULL ? open_buffer(&out.io, buf, capa) :
+                           open_memory(&out.io, NULL, 0, 1)) != 0)
+    return err;
+  mem = (struct io_memory *) out.io;
+
+  if ((err = write_output(ctx, &out, options)) == 0) {
+    * ret_size = mem->size;
+    if (buf != NULL && mem->size > capa) {
+      err = ERR_BUF_SIZE;
+    } else if (buf == NULL) {
+      * ret = mem->bytes; /* taken from mem, freed by the caller */
+      mem->bytes = NULL;
+    }
   }
+  out.io->ops->close(out.io);
+  return err;
+}
 
-  box.top = top;
-  if ((ret = write_box(file, box, BOX_FTYP, write_ftyp)) != 0 ||
-      (ret = write_box(file, box, BOX_MOOV, write_moov)) != 0 ||
-      (ret = write_box(file, box, BOX_MDAT, write_mdat)) != 0)
-    goto close;
+int
+ea_write_memory(struct ea_context * ctx, void ** ret, size_t * ret_size,
+                const struct ea_options * options) {
+  return write_memory(ctx, ret, NULL, 0, ret_size, options);
+}
 
-close:
-  fclose(file);
-exit:
-  return ret;
+int
+ea_write_buffer(struct ea_context * ctx, void * buf, size_t capa,
+                size_t * ret_size, const struct ea_options * options) {
+  return write_memory(ctx, NULL, buf, capa, ret_size, options);
 }
 
-static int
-write_raw(struct box_top * top, const char * fname) {
-  FILE * file;
-  FILE * sample_file;
+int
+ea_walk_samples(struct ea_context * ctx, ea_sample_func func, void * arg) {
   struct box_stbl * stbl;
-  struct box_stsd * stsd;
-  struct box_stsz * stsz;
-  struct decoder_config_descr * dec;
-  struct bits b;
-  unsigned char header[7]; /* ADTS header size = 7 if protection_absent = 1 */
-  unsigned char version;
-  unsigned char profile;
-  unsigned char sampling_frequency_index;
-  unsigned char channels;
-  unsigned char * sample;
-  unsigned int sample_capa;
-  unsigned int sample_size;
-  unsigned int i;
+  struct box_ctts * ctts;
+  struct stream * file;
+  struct sample_iter it;
+  struct ea_sample sample;
+  const unsigned char * data;
+  unsigned char * buf; /* samples of an unmapped input */
+  size_t capa;
+  unsigned int e; /* stts entry */
+  unsigned int left;
+  unsigned int c; /* ctts entry */
+  unsigned int c_left;
+  unsigned int offset;
+  unsigned int size;
+  long pos;
   int ret;
 
-  file = fopen(fname, "wb");
-  if (file == NULL) {
-    ret = ERR_IO;
-    goto exit;
-  }
+  if (!ctx->selected)
+    return ERR_CALL;
 
-  sample_file = top->mdat.file;
+  stbl = &ctx->top.moov.trak[0].mdia.minf.stbl;
+  ctts = &stbl->ctts;
+  file = ctx->top.mdat.file;
+  buf = NULL;
+  capa = 0;
+  e = left = 0;
+  c = c_left = 0;
+  ret = 0;
 
-  stbl = &top->moov.trak[0].mdia.minf.stbl;
-  stsd = &stbl->stsd;
-  stsz = &stbl->stsz;
+  sample.dts = 0;
+  sample.timescale = ctx->top.moov.trak[0].mdia.mdhd.timescale;
+  init_sample_iter(&it, stbl);
+  while (next_sample(&it, &pos, &size)) {
+
+    while (c_left == 0 && c < ctts->entry_count)
+      c_left = ctts->entry[c++].sample_count;
+    offset = 0;
+    if (c_left) {
+      offset = ctts->entry[c - 1].sample_offset;
+      c_left--;
+    }
 
-  if (stsd->entry_count == 0) {
-    ret = ERR_NO_SOUN_CONF;
-    goto close;
-  }
+    if (file->map == NULL && size > capa) {
+      if ((ret = mem_realloc(&buf, size)) != 0)
+        break;
+      capa = size;
+    }
+    if ((ret = read_at(&data, pos, size, buf, file)) != 0)
+      break;
 
-  dec = &stsd->entry.soun[0].esds.es.dec_conf;
-  if (dec->object_type_idc == OTI_AUDIO_AAC_MPEG4) {
-    version = 0;
-    profile = (unsigned char) (dec->audio.audio_object_type - 1);
-  } else {
-    version = 1;
-    profile = (unsigned char) (dec->object_type_idc - OTI_AUDIO_AAC_MPEG2_MP);
+    /* ctts offsets of version 1 are signed */
+    sample.pts = sample.dts + (offset > 0x7fffffffU ?
+                               (long) offset - 0x100000000L : (long) offset);
+    sample.duration = next_delta(&stbl->stts, &e, &left);
+    sample.size = size;
+    sample.data = data;
+    if ((ret = func(arg, &sample)) != 0)
+      break;
+    sample.dts += sample.duration;
   }
-  sampling_frequency_index = dec->audio.sampling_frequency_index;
-  channels = dec->audio.channels;
 
-  sample_capa = 1;
-  for (i = 0; i < stsz->sample_count; i++)
-    if (stsz->entry[i].entry_size > sample_capa)
-      sample_capa = stsz->entry[i].entry_size;
+  mem_free(buf);
+  return ret;
+}
 
-  if ((ret = mem_alloc(&sample, sample_capa)) != 0)
-    goto close;
+int
+ea_sample_at(struct ea_context * ctx, unsigned int index,
+             struct ea_sample * sample) {
+  struct box_stbl * stbl;
+  struct box_stts * stts;
+  struct box_ctts * ctts;
+  struct box_stsc * stsc;
+  struct box_stsz * stsz;
+  struct stream * file;
+  unsigned int r; /* run */
+  unsigned int k; /* index of the sample in its run */
+  unsigned int n; /* samples before it in its chunk */
+  unsigned int o; /* its chunk */
+  unsigned int offset;
+  long pos;
 
-  for (i = 0; i < stsz->sample_count; i++) {
-
-    sample_size = stsz->entry[i].entry_size;
-
-    if ((ret = write_bits_init(&b, header, sizeof(header))) != 0 ||
-        (ret = write_bits(0xfff, 12, &b)) != 0 || /* sync */
-        (ret = write_bit(version, &b)) != 0 ||
-        (ret = write_bits(0, 2, &b)) != 0 || /* layer */
-        (ret = write_bit(1, &b)) != 0 || /* protection_absent */
-        (ret = write_bits(profile, 2, &b)) != 0 ||
-        (ret = write_bits(sampling_frequency_index, 4, &b)) != 0 ||
-        (ret = write_bit(0, &b)) != 0 || /* private stream */
-        (ret = write_bits(channels, 3, &b)) != 0 ||
-        (ret = write_bits(0, 4, &b)) != 0 || /* originality */
-        (ret = write_bits(7+sample_size, 13, &b)) != 0 ||
-        (ret = write_bits(0x7ff, 11, &b)) != 0 || /* buffer fullness */
-        (ret = write_bits(0, 2, &b)) != 0 || /* number of aac frame - 1 */
-        (ret = write_bits_flush(&b)) != 0 ||
-        (ret = write_ary(b.bytes, b.i, 1, file)) != 0)
-      goto free;
+  if (!ctx->selected)
+    return ERR_CALL;
 
-    if ((ret = set_pos(stsz->entry[i].pos, sample_file)) != 0 ||
-        (ret = read_ary(sample, sample_size, 1, sample_file)) != 0 ||
-        (ret = write_ary(sample, sample_size, 1, file)) != 0)
-      goto free;
+  stbl = &ctx->top.moov.trak[0].mdia.minf.stbl;
+  stts = &stbl->stts;
+  ctts = &stbl->ctts;
+  stsc = &stbl->stsc;
+  stsz = &stbl->stsz;
+  if (index >= stsz->sample_count)
+    return ERR_NO_SAMPLE;
+
+  /* past the runs of stts, as next_delta */
+  sample->duration = 0;
+  sample->dts = 0;
+  if (stts->entry_count) {
+    r = find_run(stts->start, stts->entry_count, index);
+    k = (unsigned int) (index - stts->start[r]);
+    if (k < stts->entry[r].sample_count) {
+      sample->duration = stts->entry[r].sample_delta;
+      sample->dts = (long) (stts->time[r] +
+                            (unsigned long) k * sample->duration);
+    } else {
+      sample->dts = (long) (stts->time[r] + (unsigned long)
+                            stts->entry[r].sample_count *
+                            stts->entry[r].sample_delta);
+    }
   }
-free:
-  mem_free(sample);
-close:
-  fclose(file);
-exit:
-  return ret;
-}
-
-static int
-extract_audio(struct box_top * top) {
-  struct box_moov * moov;
-  struct box_trak * trak;
-  unsigned int i;
-  unsigned int j;
-  int ret;
 
-  ret = 0;
+  offset = 0;
+  if (ctts->entry_count) {
+    r = find_run(ctts->start, ctts->entry_count, index);
+    if (index - ctts->start[r] < ctts->entry[r].sample_count)
+      offset = ctts->entry[r].sample_offset;
+  }
+  sample->pts = sample->dts + (offset > 0x7fffffffU ?
+                               (long) offset - 0x100000000L : (long) offset);
+
+  /* fill_stbl checked that the chunks hold every sample */
+  r = find_run(stsc->start, stsc->entry_count, index);
+  k = (unsigned int) (index - stsc->start[r]);
+  o = stsc->entry[r].first_chunk - 1 + k / stsc->entry[r].samples_per_chunk;
+  n = k % stsc->entry[r].samples_per_chunk;
+  pos = stbl->stco.pos[o];
+  if (stsz->entry_size == NULL)
+    pos += (long) n * (long) stsz->sample_size;
+  else
+    pos += (long) sum_words(stsz->entry_size + index - n, n);
 
-  moov = &top->moov;
+  file = ctx->top.mdat.file;
+  sample->timescale = ctx->top.moov.trak[0].mdia.mdhd.timescale;
+  sample->size = get_sample_size(stsz, index);
+  sample->data = file->map != NULL ? file->map + pos : NULL;
+  return 0;
+}
 
-  for (i = 0; i < moov->trak_len; i++) {
+void
+ea_close(struct ea_context * ctx) {
+  if (ctx == NULL)
+    return;
+  if (ctx->parsed && ctx->top.mdat.file == &ctx->top.mdat.buf)
+    close_file(&ctx->top.mdat.buf);
+  if (ctx->arena == &ctx->own)
+    free_arena(&ctx->own);
+  else
+    reset_arena(ctx->arena);
+  close_file(&ctx->file);
+  mem_free(ctx);
+}
 
-    if (moov->trak[i].mdia.hdlr.type == BOX_SOUN) {
+const char *
+ea_strerror(int err) {
+  return err_to_str(err);
+}
 
-      if ((ret = mem_alloc(&trak, sizeof(* trak))) != 0)
-        return ret;
+#ifndef EXTRACT_AUDIO_LIB
 
-      * trak = moov->trak[i];
+static void
+error_arg(const char * exe) {
+  fprintf(stderr, "Usage: %s [-d|--dump|-r|--raw] "
+          "[--io=stdio|pread|mmap|memory] "
+          "[--frag=<MS>|--hls=<MS>|--dash=<MS>] [--splice] "
+          "<INPUT> [<OUTPUT>]\n"
+          "       %s --batch=<JOBS> [--jobs=<N>]\n", exe, exe);
+}
 
-      for (j = 0; j < moov->trak_len; j++)
-        if (j != i)
-          free_trak(&moov->trak[j]);
-      mem_free(moov->trak);
+static int
+str_to_io(unsigned char * ret_io, const char * name) {
+  struct pair {
+    const char * name;
+    unsigned char io;
+  };
+  struct pair pairs[] = {
+    {"stdio",  IO_STDIO},
+    {"pread",  IO_PREAD},
+    {"mmap",   IO_MMAP},
+    {"memory", IO_MEMORY}
+  };
+  unsigned int i;
 
-      trak->tkhd.track_id = 1;
-      moov->trak_len = 1;
-      moov->trak = trak;
-      moov->mvhd.next_track_id = 2;
-      return ret;
+  for (i = 0; i < sizeof(pairs)/sizeof(pairs[0]); i++)
+    if (strcmp(pairs[i].name, name) == 0) {
+      * ret_io = pairs[i].io;
+      return 0;
     }
-  }
-  return ERR_NO_SOUN;
+  return ERR_ARG;
 }
 
-static void
-error_arg(const char * exe) {
-  fprintf(stderr, "Usage: %s [-d|--dump|-r|--raw] <INPUT> [<OUTPUT>]\n", exe);
+/* A positive number, e.g. a duration in milliseconds */
+static int
+str_to_uint(unsigned int * ret, const char * str) {
+  unsigned long n;
+  char * end;
+
+  n = strtoul(str, &end, 10);
+  if (end == str || * end != '\0' || n == 0 || n > UINT_MAX)
+    return ERR_ARG;
+  * ret = (unsigned int) n;
+  return 0;
 }
 
+/* Options of one run, or of a batch of them */
+struct args {
+  const char * input;
+  const char * output;
+  unsigned char dump;
+  unsigned char io;
+  struct ea_options options;
+  const char * batch; /* job list */
+  unsigned int jobs; /* threads, 0 for one per CPU */
+};
+
 static int
-parse_args(const char ** input,
-           const char ** output,
-           unsigned char * dump,
-           unsigned char * raw, int argc, char ** argv) {
-  const char * exe;
+parse_args(struct args * args, int argc, char ** argv) {
   const char * arg;
   int i;
 
-  if (argc <= 0)
-    return ERR_ARG;
-
-  exe = argv[0];
-
-  * input = * output = NULL;
-  * dump = * raw = 0;
+  args->input = args->output = NULL;
+  args->dump = 0;
+  args->io = IO_MMAP;
+  args->options.raw = 0;
+  args->options.frag_ms = 0;
+  args->options.playlist = 0;
+  args->options.segment_ms = 0;
+  args->options.splice = 0;
+  args->batch = NULL;
+  args->jobs = 0;
 
   for (i = 1; i < argc; i++) {
     arg = argv[i];
     if (strcmp(arg, "-d") == 0 ||
         strcmp(arg, "--dump") == 0) {
-      * dump = 1;
+      args->dump = 1;
     } else if (strcmp(arg, "-r") == 0 ||
                strcmp(arg, "--raw") == 0) {
-      * raw = 1;
-    } else if (* input == NULL) {
-      * input = arg;
-    } else if (* output == NULL) {
-      * output = arg;
+      args->options.raw = 1;
+    } else if (strcmp(arg, "--splice") == 0) {
+      args->options.splice = 1;
+    } else if (strncmp(arg, "--io=", 5) == 0) {
+      if (str_to_io(&args->io, arg + 5) != 0)
+        return ERR_ARG;
+    } else if (strncmp(arg, "--frag=", 7) == 0) {
+      if (str_to_uint(&args->options.frag_ms, arg + 7) != 0)
+        return ERR_ARG;
+    } else if (strncmp(arg, "--hls=", 6) == 0) {
+      args->options.playlist = PLAYLIST_HLS;
+      if (str_to_uint(&args->options.segment_ms, arg + 6) != 0)
+        return ERR_ARG;
+    } else if (strncmp(arg, "--dash=", 7) == 0) {
+      args->options.playlist = PLAYLIST_DASH;
+      if (str_to_uint(&args->options.segment_ms, arg + 7) != 0)
+        return ERR_ARG;
+    } else if (strncmp(arg, "--batch=", 8) == 0) {
+      args->batch = arg + 8;
+    } else if (strncmp(arg, "--jobs=", 7) == 0) {
+      if (str_to_uint(&args->jobs, arg + 7) != 0)
+        return ERR_ARG;
+    } else if (args->input == NULL) {
+      args->input = arg;
+    } else if (args->output == NULL) {
+      args->output = arg;
     } else {
-      error_arg(exe);
       return ERR_ARG;
     }
   }
-  if (* input == NULL) {
-    error_arg(exe);
+
+  /* the options of a batch are those of its jobs */
+  if (args->batch != NULL)
+    return args->input != NULL || args->dump || args->options.raw ||
+           args->options.frag_ms || args->options.playlist ||
+           args->options.splice ? ERR_ARG : 0;
+
+  if (args->input == NULL || args->jobs)
     return ERR_ARG;
-  }
-  return 0;
+  if (args->output == NULL)
+    return args->options.playlist || args->options.splice ? ERR_ARG : 0;
+  return check_options(&args->options, args->output);
 }
 
-int
-main(int argc, char ** argv) {
-  const char * input;
-  const char * output;
-  unsigned char dump;
-  unsigned char raw;
-  FILE * file;
-  struct box_top top;
+/* Dump input, or extract its audio to output. flags are added to
+   those of ea_parse. */
+static int
+run(const struct args * args, struct ea_arena * arena, unsigned int flags) {
+  struct ea_context * ctx;
   int ret;
 
-  ret = 0;
+  if ((ret = ea_open(&ctx, args->input, args->io)) != 0)
+    return ret;
+  if (arena != NULL)
+    ea_use_arena(ctx, arena);
+
+  if (args->dump)
+    flags |= EA_DUMP;
+  else if (args->output == NULL)
+    flags |= EA_ALL_TRACKS;
+  if ((ret = ea_parse(ctx, flags)) == 0 &&
+      args->output != NULL)
+    if ((ret = ea_select_audio(ctx)) == 0)
+      ret = ea_write(ctx, args->output, &args->options);
+
+  ea_close(ctx);
+  return ret;
+}
 
-  if ((ret = parse_args(&input, &output, &dump, &raw, argc, argv)) != 0 ||
-      (ret = open_file(&file, input)) != 0)
-    goto exit;
+/* A line of the job list: options, input and output as on the command
+   line, separated by blanks */
+struct job {
+  struct args args;
+  char ** argv;
+  unsigned int line;
+  int ret; /* ERR_ARG if the line doesn't parse */
+};
 
-  if ((ret = read_top(file, &top, dump)) != 0)
-    goto close;
+/* Runs jobs from job[begin] to job[end - 1], taking them from the
+   front. An idle worker steals from the back of another's. */
+struct worker {
+  struct batch * batch;
+  unsigned int begin;
+  unsigned int end;
+#ifdef HAVE_POSIX
+  pthread_t thread;
+  pthread_mutex_t lock; /* of begin and end */
+  unsigned char started;
+#endif
+};
 
-  if (output != NULL) {
+struct batch {
+  struct job * job;
+  unsigned int len;
+  struct worker * worker;
+  unsigned int worker_len;
+  unsigned char failed;
+#ifdef HAVE_POSIX
+  pthread_mutex_t lock; /* of failed and of stdout */
+#endif
+};
 
-    if ((ret = extract_audio(&top)) != 0)
-      goto free;
+/* Split the job list text into jobs, in place */
+static int
+parse_jobs(struct batch * batch, char * text) {
+  struct job * job;
+  unsigned int capa;
+  unsigned int line;
+  char * next;
+  char * p;
+  int argc;
+  int ret;
 
-    if (raw) {
-      if ((ret = write_raw(&top, output)) != 0)
-        goto free;
-    } else {
-      if ((ret = write_top(&top, output)) != 0)
-        goto free;
+  capa = 0;
+  for (line = 1; * text != '\0'; line++, text = next) {
+    next = strchr(text, '\n');
+    if (next != NULL)
+      * next++ = '\0';
+    else
+      next = text + strlen(text);
+
+    /* count the words, skipping blank lines and # comments */
+    argc = 1;
+    for (p = text; * p != '\0'; argc++) {
+      p += strspn(p, " \t\r");
+      if (* p == '\0' || * p == '#')
+        break;
+      p += strcspn(p, " \t\r");
+    }
+    if (argc == 1)
+      continue;
+
+    if ((ret = grow_table(NULL, &batch->job, batch->len, &capa,
+                          sizeof(* batch->job))) != 0)
+      return ret;
+    job = &batch->job[batch->len];
+    if ((ret = mem_alloc(&job->argv,
+                         (size_t) (argc + 1) * sizeof(* job->argv))) != 0)
+      return ret;
+    batch->len++;
+    job->line = line;
+
+    job->argv[0] = (char *) "";
+    for (argc = 1, p = text;; argc++) {
+      p += strspn(p, " \t\r");
+      if (* p == '\0' || * p == '#')
+        break;
+      job->argv[argc] = p;
+      p += strcspn(p, " \t\r");
+      if (* p != '\0')
+        * p++ = '\0';
+    }
+    job->argv[argc] = NULL;
+
+    /* results go to stdout, one job writes nothing else there */
+    job->ret = parse_args(&job->args, argc, job->argv);
+    if (job->ret == 0 &&
+        (job->args.batch != NULL || job->args.dump ||
+         job->args.output == NULL || strcmp(job->args.input, "-") == 0 ||
+         strcmp(job->args.output, "-") == 0))
+      job->ret = ERR_ARG;
+  }
+  return 0;
+}
+
+static void
+print_json_str(const char * str) {
+  const unsigned char * c;
+
+  if (str == NULL) {
+    printf("null");
+    return;
+  }
+  putchar('"');
+  for (c = (const unsigned char *) str; * c != '\0'; c++)
+    if (* c == '"' || * c == '\\')
+      printf("\\%c", * c);
+    else if (* c < 0x20)
+      printf("\\u%04x", * c);
+    else
+      putchar(* c);
+  putchar('"');
+}
+
+/* One JSON line per job as it ends */
+static void
+report_job(struct batch * batch, const struct job * job) {
+#ifdef HAVE_POSIX
+  pthread_mutex_lock(&batch->lock);
+#endif
+  if (job->ret)
+    batch->failed = 1;
+  printf("{\"line\": %u, \"input\": ", job->line);
+  print_json_str(job->args.input);
+  printf(", \"output\": ");
+  print_json_str(job->args.output);
+  if (job->ret) {
+    printf(", \"status\": \"error\", \"error\": ");
+    print_json_str(ea_strerror(job->ret));
+    printf("}\n");
+  } else {
+    printf(", \"status\": \"ok\"}\n");
+  }
+  fflush(stdout);
+#ifdef HAVE_POSIX
+  pthread_mutex_unlock(&batch->lock);
+#endif
+}
+
+/* The worker's next job, else the last one of the next worker that has
+   any left */
+static int
+take_job(struct worker * worker, unsigned int * ret) {
+  struct batch * batch;
+  struct worker * victim;
+  unsigned int self;
+  unsigned int k;
+  int found;
+
+  batch = worker->batch;
+  self = (unsigned int) (worker - batch->worker);
+  found = 0;
+  for (k = 0; k < batch->worker_len && !found; k++) {
+    victim = &batch->worker[(self + k) % batch->worker_len];
+#ifdef HAVE_POSIX
+    pthread_mutex_lock(&victim->lock);
+#endif
+    if (victim->begin < victim->end) {
+      * ret = k == 0 ? victim->begin++ : --victim->end;
+      found = 1;
     }
+#ifdef HAVE_POSIX
+    pthread_mutex_unlock(&victim->lock);
+#endif
+  }
+  return found;
+}
+
+static void *
+run_worker(void * arg) {
+  struct worker * worker;
+  struct ea_arena * arena;
+  struct job * job;
+  unsigned int j;
+
+  worker = arg;
+  if (ea_arena_new(&arena) != 0)
+    arena = NULL; /* each file in its own */
+  while (take_job(worker, &j)) {
+    job = &worker->batch->job[j];
+    if (job->ret == 0)
+      job->ret = run(&job->args, arena, EA_ONE_THREAD); /* of the pool */
+    report_job(worker->batch, job);
+  }
+  ea_arena_free(arena);
+  return NULL;
+}
+
+/* Jobs of the job list fname run by threads, each starting with an even
+   share of them. The results go to stdout as JSON lines, in the order
+   the jobs end. */
+static int
+run_batch(const char * fname, unsigned int threads) {
+  struct batch batch;
+  struct worker * worker;
+  struct io * io;
+  const unsigned char * map;
+  char * text;
+  long size;
+  unsigned int i;
+  int ret;
+
+  batch.job = NULL;
+  batch.len = 0;
+  batch.worker = NULL;
+  batch.failed = 0;
+  text = NULL;
+
+  if ((ret = load_file(&io, fname)) != 0)
+    return ret;
+  map = io->map;
+  if ((ret = io->ops->size(io, &size)) != 0 ||
+      (ret = mem_alloc(&text, (size_t) size + 1)) != 0) {
+    io->ops->close(io);
+    goto free;
+  }
+  if (size > 0)
+    memcpy(text, map, (size_t) size);
+  text[size] = '\0';
+  io->ops->close(io);
+
+  if ((ret = parse_jobs(&batch, text)) != 0)
+    goto free;
+
+#ifdef HAVE_POSIX
+  if (threads == 0)
+    threads = cpu_count();
+#else
+  threads = 1;
+#endif
+  batch.worker_len = threads < batch.len ? threads : batch.len;
+  if (batch.worker_len == 0)
+    goto free;
+  if ((ret = mem_alloc(&batch.worker, batch.worker_len *
+                                      sizeof(* batch.worker))) != 0)
+    goto free;
+
+  for (i = 0; i < batch.worker_len; i++) {
+    worker = &batch.worker[i];
+    worker->batch = &batch;
+    worker->begin = (unsigned int) ((unsigned long) batch.len * i /
+                                    batch.worker_len);
+    worker->end = (unsigned int) ((unsigned long) batch.len * (i + 1) /
+                                  batch.worker_len);
   }
 
+#ifdef HAVE_POSIX
+  pthread_mutex_init(&batch.lock, NULL);
+  for (i = 0; i < batch.worker_len; i++)
+    pthread_mutex_init(&batch.worker[i].lock, NULL);
+  /* the jobs of a worker that didn't start are stolen by the others */
+  for (i = 1; i < batch.worker_len; i++)
+    batch.worker[i].started =
+      pthread_create(&batch.worker[i].thread, NULL, run_worker,
+                     &batch.worker[i]) == 0;
+  run_worker(&batch.worker[0]);
+  for (i = 1; i < batch.worker_len; i++)
+    if (batch.worker[i].started)
+      pthread_join(batch.worker[i].thread, NULL);
+  for (i = 0; i < batch.worker_len; i++)
+    pthread_mutex_destroy(&batch.worker[i].lock);
+  pthread_mutex_destroy(&batch.lock);
+#else
+  run_worker(&batch.worker[0]);
+#endif
+
+  if (batch.failed)
+    ret = ERR_JOB;
 free:
-  free_top(&top);
-close:
-  close_file(file);
-exit:
+  for (i = 0; i < batch.len; i++)
+    mem_free(batch.job[i].argv);
+  mem_free(batch.job);
+  mem_free(batch.worker);
+  mem_free(text);
+  return ret;
+}
+
+int
+main(int argc, char ** argv) {
+  struct args args;
+  int ret;
+
+  if ((ret = parse_args(&args, argc, argv)) != 0) {
+    if (argc > 0)
+      error_arg(argv[0]);
+  } else if (args.batch != NULL) {
+    ret = run_batch(args.batch, args.jobs);
+  } else {
+    ret = run(&args, NULL, 0);
+  }
+
   if (ret)
-    fprintf(stderr, "Error: %s\n", err_to_str(ret));
+    fprintf(stderr, "Error: %s\n", ea_strerror(ret));
   return ret;
 }
+
+#endif